@@ -27,11 +27,16 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <grp.h>
 #include <libgen.h>
 #include <limits.h>
+#include <netdb.h>
+#include <poll.h>
 #include <pwd.h>
 #include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -42,12 +47,32 @@
 #include <unistd.h>
 #include <zlib.h>
 
+#ifdef USE_ISAL
+#include <isa-l/igzip_lib.h>
+#endif
+
+#ifdef USE_LZ4
+#include <lz4.h>
+#endif
+
+#ifdef USE_ZSTD
+#include <zdict.h>
+#include <zstd.h>
+#endif
+
+#include <linux/fs.h>
+
+#include <sys/ioctl.h>
 #include <sys/ipc.h>
+#include <sys/mman.h>
 #include <sys/shm.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/types.h>
 
 #include "hardware.h"
+#include "hash.h"
 #include "warnings.h"
 
 //==========================================================
@@ -61,6 +86,13 @@ typedef enum {
 	TYPE_SEC_STAGE, TYPE_DAT_STAGE,
 } as_type;
 
+// Codecs a segment file may be compressed with. Deflate is always available -
+// lz4 and zstd only if built with USE_LZ4 and USE_ZSTD.
+
+typedef enum {
+	CODEC_STORE, CODEC_DEFLATE, CODEC_LZ4, CODEC_ZSTD, N_CODECS
+} as_codec;
+
 // Information about a segment.
 
 typedef struct as_segment_s {
@@ -77,8 +109,25 @@ typedef struct as_segment_s {
 	char* nsnm;
 	as_type type;
 	uLong crc32;
+	uint32_t target;
+	time_t atime;
+	time_t ctime;
 } as_segment_t;
 
+// A shared memory segment, as found by discovery.
+
+typedef struct as_shm_s {
+	key_t key;
+	int shmid;
+	uid_t uid;
+	gid_t gid;
+	unsigned int mode;
+	shmatt_t natt;
+	size_t segsz;
+	time_t atime;
+	time_t ctime;
+} as_shm_t;
+
 // Information about a segment file.
 
 typedef struct as_file_s {
@@ -89,19 +138,145 @@ typedef struct as_file_s {
 	size_t filsz;
 	size_t segsz;
 	bool compress;
+	as_codec codec;
+	bool cas;
 	uint32_t stage;
 	uint32_t inst;
 	uint32_t nsid;
 	char* nsnm;
 	as_type type;
+	bool planned;
+	uint32_t base_ver;
+	uint32_t n_arenas;
+	bool pack;
+	size_t offset;
+	uint32_t target;
 } as_file_t;
 
+// Types of file I/O.
+
+typedef enum {
+	IO_OP_WRITE, IO_OP_READ, IO_OP_VERIFY, IO_OP_COMPARE, IO_OP_PRECOPY,
+	IO_OP_FINALIZE, IO_OP_STREAM
+} as_io_op;
+
+// A range of a segment which doesn't match its segment file.
+
+typedef struct as_range_s {
+	size_t start;
+	size_t end;
+} as_range_t;
+
+// A segment file recorded in a backup's manifest.
+
+typedef struct as_manifest_entry_s {
+	key_t key;
+	size_t segsz;
+	size_t filsz;
+	bool compress;
+	bool cas;
+	as_codec codec;
+	uint32_t dict_id;
+	bool has_digest;
+	as_digest_t digest;
+	bool has_crc32;
+	uLong crc32;
+	uid_t uid;
+	gid_t gid;
+	unsigned int mode;
+	uint32_t target;
+} as_manifest_entry_t;
+
+// Manifest of the segment files backed up for a namespace.
+
+typedef struct as_manifest_s {
+	uint32_t version;
+	uint32_t inst;
+	uint32_t nsid;
+	char* nsnm;
+	uint32_t base_ver;
+	uint32_t n_pri_arenas;
+	uint32_t n_sec_arenas;
+	time_t created;
+	char* targets;
+	as_manifest_entry_t* entries;
+	uint32_t n_entries;
+} as_manifest_t;
+
+// A line of a backup or restore journal - a segment attached (restore only),
+// or a chunk of I/O completed.
+
+typedef struct as_journal_entry_s {
+	key_t key;
+	bool done;
+	uint32_t chunk;
+	int shmid;
+	size_t filsz;
+	uLong crc32;
+	as_digest_t digest;
+	time_t atime;
+	time_t ctime;
+	time_t time;
+} as_journal_entry_t;
+
+// Journal of a namespace's backup or restore, from which it can be resumed.
+// Its records carry real crc32s only if crc32 is set.
+
+typedef struct as_journal_s {
+	int fd;
+	bool crc32;
+	as_journal_entry_t* entries;
+	uint32_t n_entries;
+	uint32_t n_done;
+} as_journal_t;
+
+// Maximum number of mirror directories to write copies of segment files to.
+enum {
+	MAX_MIRRORS = 3
+};
+
+// Longest ETag an object store may return for an uploaded part.
+enum {
+	S3_ETAG_LEN = 128
+};
+
+// A part of a segment uploaded to (or downloaded from) an object store - its
+// ETag, to complete the upload with, and its crc32.
+
+typedef struct as_s3_part_s {
+	char etag[S3_ETAG_LEN + 1];
+	uLong crc32;
+} as_s3_part_t;
+
+// A dictionary trained for a codec, named by its id. Segment files compressed
+// with it need it to be decompressed.
+
+typedef struct as_dict_s {
+	uint32_t id;
+	void* buf;
+	size_t size;
+#ifdef USE_ZSTD
+	ZSTD_CDict* cdict;
+	ZSTD_DDict* ddict;
+#endif
+} as_dict_t;
+
+#ifdef USE_ZSTD
+// A thread's zstd contexts, made on first use and reused for every chunk the
+// thread compresses or decompresses. Freed when the thread exits.
+
+typedef struct as_zstd_ctx_s {
+	ZSTD_CCtx* cctx;
+	ZSTD_DCtx* dctx;
+} as_zstd_ctx_t;
+#endif
+
 // Information about a file I/O.
 
 typedef struct as_io_s {
 	key_t key;
 	int fd;
-	bool write;
+	as_io_op op;
 	void* memptr;
 	size_t filsz;
 	size_t segsz;
@@ -111,6 +286,31 @@ typedef struct as_io_s {
 	uid_t uid;
 	gid_t gid;
 	mode_t mode;
+	uint32_t n_chunks;
+	bool failed;
+	as_range_t* ranges;
+	uint32_t n_ranges;
+	as_digest_t digest;
+	const as_manifest_entry_t* base;
+	bool reused;
+	bool cas;
+	as_codec codec;
+	const as_dict_t* dict;
+	uint32_t dict_id;
+	as_digest_t* chunk_digests;
+	uint64_t stored_sz;
+	uint64_t rewritten_sz;
+	bool* chunks_done;
+	uint32_t n_chunks_done;
+	time_t atime;
+	time_t ctime;
+	as_type type;
+	uint64_t usec;
+	size_t offset;
+	uint32_t target;
+	int mirror_fds[MAX_MIRRORS];
+	char* upload_id;
+	as_s3_part_t* parts;
 } as_io_t;
 
 // Information about a compressed file.
@@ -122,6 +322,320 @@ typedef struct as_cmp_s {
 	uLong crc32;
 } __attribute__((packed)) as_cmp_t;
 
+// Follows the header of a chunked compressed file. The segment is split into
+// chunks of chunk_sz bytes, each compressed on its own and preceded by its
+// (uint32_t) length in the file. A chunk whose length is that of the chunk
+// itself is stored as it is.
+
+typedef struct as_cmp_ext_s {
+	uint32_t codec;
+	uint32_t chunk_sz;
+} __attribute__((packed)) as_cmp_ext_t;
+
+// A compressed file being read ahead - a thread reads the next block of it into
+// one buffer, while the block in the other is inflated.
+
+typedef struct as_readahead_s {
+	int fd;
+	size_t size;
+	uint8_t* bufs[2];
+	ssize_t lens[2];
+	bool full[2];
+	uint32_t next;
+	bool stop;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t thread;
+} as_readahead_t;
+
+// A piece of a legacy (single gzip stream) compressed file, inflated by one
+// of several threads. The first piece of a round starts where the last round
+// stopped, and is inflated straight into the segment. Each other piece starts
+// at the first deflate block found in its region of the file, and is inflated
+// into memory - at first with "markers" for bytes of the unknown window before
+// it, until the window it makes for itself is clean. Every piece stops at the
+// first block boundary at or after the start of the next piece's region. A
+// stored block's header is all zero bits, so if a piece starts with one, it may
+// really start anywhere from there up to the stored block's length.
+
+typedef struct as_spec_part_s {
+	const uint8_t* in;
+	size_t in_size;
+	bool known;
+	uint64_t search_bit;
+	uint64_t search_end;
+	uint64_t stop_bit;
+	const uint8_t* dict;
+	size_t dict_len;
+	bool found;
+	bool final;
+	bool full;
+	uint64_t start_bit;
+	uint64_t stored_bit;
+	uint64_t end_bit;
+	uint16_t* head;
+	size_t n_head;
+	size_t head_cap;
+	int64_t last_marker;
+	uint8_t* body;
+	size_t n_body;
+	size_t body_cap;
+	uint8_t* dest;
+	uLong crc;
+} as_spec_part_t;
+
+// A deflate decoder's state - the bits it's reading, and the Huffman codes of
+// the block it's in. A table entry is a symbol and its code length (4 bits),
+// indexed by the next (up to) 15 bits of input.
+
+typedef struct as_inflater_s {
+	const uint8_t* in;
+	size_t in_size;
+	uint64_t pos;
+	bool final;
+	uint32_t type;
+	uint32_t stored_len;
+	uint32_t lit_bits;
+	uint32_t dist_bits;
+	uint32_t pre_bits;
+	uint16_t lit[1 << 15];
+	uint16_t dist[1 << 15];
+	uint16_t pre[1 << 7];
+} as_inflater_t;
+
+// What compressing samples of a segment with a codec yielded.
+
+typedef struct as_sample_s {
+	uint64_t in_bytes;
+	uint64_t out_bytes;
+	double secs;
+} as_sample_t;
+
+// Header of a chunk store recipe file. Followed by the digests of the
+// segment's chunks, which name the chunk files in the chunk store. A pre-copy
+// state file has the same layout, with the digests of what was pre-copied.
+
+typedef struct as_cas_s {
+	uint32_t magic;
+	uint32_t version;
+	size_t segsz;
+	uint32_t chunk_size;
+	uint32_t n_chunks;
+	uint32_t compress;
+} __attribute__((packed)) as_cas_t;
+
+// Header of a pack file - all of a namespace's segments in one file, named
+// after its base segment key. Followed by the extent table, then by the
+// segments, each at a PACK_ALIGN-aligned offset.
+
+typedef struct as_pack_hdr_s {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t n_extents;
+	uint32_t reserved;
+} __attribute__((packed)) as_pack_hdr_t;
+
+// An entry of a pack file's extent table.
+
+typedef struct as_pack_extent_s {
+	key_t key;
+	uid_t uid;
+	gid_t gid;
+	uint32_t mode;
+	size_t offset;
+	size_t segsz;
+} __attribute__((packed)) as_pack_extent_t;
+
+// An open pack file - or pack in a raw container, starting at base.
+
+typedef struct as_pack_s {
+	int fd;
+	as_pack_extent_t* extents;
+	uint32_t n_extents;
+	size_t base;
+	size_t size;
+} as_pack_t;
+
+// Header of a raw container's superblock. It's followed by a table locating
+// the pack of each namespace backed up to the container.
+
+typedef struct as_raw_hdr_s {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t n_packs;
+	uint32_t reserved;
+} __attribute__((packed)) as_raw_hdr_t;
+
+// An entry of a raw container's pack table.
+
+typedef struct as_raw_pack_s {
+	key_t key;
+	uint32_t reserved;
+	size_t offset;
+	size_t size;
+} __attribute__((packed)) as_raw_pack_t;
+
+// An open raw container - a block device or preallocated file.
+
+typedef struct as_raw_s {
+	int fd;
+	size_t size;
+	uint8_t* super;
+	bool reset;
+} as_raw_t;
+
+// Header of a backup stream. It's followed by frames - for each namespace, a
+// namespace frame listing its segments, then data frames holding the chunks of
+// those segments, in any order, then a namespace end frame - and finally an
+// end frame. A transfer to another node spreads the stream over several
+// connections, each starting with the header and a connect frame.
+
+typedef struct as_stream_hdr_s {
+	uint32_t magic;
+	uint32_t version;
+} __attribute__((packed)) as_stream_hdr_t;
+
+// Header of a frame in a backup stream, followed by len bytes of payload. A
+// data frame holds size bytes of segment key at offset - deflated if flagged,
+// and with the crc32 of the undeflated bytes if flagged. A namespace frame
+// holds its name, then size entries listing its segments. A namespace end
+// frame gives the number of data frames sent for the namespace, in size. A
+// connect frame gives the connection's index in offset, and the number of
+// connections in size, and holds the transfer's shared token. An ack frame,
+// sent back by the receiver of a transfer, gives its status in flags.
+
+typedef struct as_frame_s {
+	uint32_t magic;
+	uint32_t type;
+	key_t key;
+	uint32_t flags;
+	uint64_t offset;
+	uint64_t size;
+	uint64_t len;
+	uint32_t crc;
+	uint32_t reserved;
+} __attribute__((packed)) as_frame_t;
+
+// An entry of a namespace frame's list of segments.
+
+typedef struct as_stream_entry_s {
+	key_t key;
+	uid_t uid;
+	gid_t gid;
+	uint32_t mode;
+	uint64_t segsz;
+} __attribute__((packed)) as_stream_entry_t;
+
+// A segment being restored (or verified) from a backup stream.
+
+typedef struct as_stream_seg_s {
+	as_stream_entry_t entry;
+	int shmid;
+	uint8_t* memptr;
+	size_t received;
+} as_stream_seg_t;
+
+// The namespace being restored (or verified) from a backup stream, shared by
+// the connections it arrives over.
+
+typedef struct as_stream_state_s {
+	key_t key;
+	char* nsnm;
+	as_stream_seg_t* segs;
+	uint32_t n_segs;
+	bool failed;
+	uint64_t n_frames;
+	uint32_t n_in_flight;
+	uint32_t n_live;
+	uint32_t n_namespaces;
+	bool ended;
+	bool success;
+} as_stream_state_t;
+
+// An object store backup - the bucket and prefix its objects are under, the
+// endpoint serving it, and the credentials to sign requests with.
+
+typedef struct as_s3_s {
+	char* bucket;
+	char* prefix;
+	char* host;
+	char* port;
+	const char* region;
+	const char* access_key;
+	const char* secret_key;
+	const char* token;
+} as_s3_t;
+
+// Size of the buffer for reading an object store's responses.
+enum {
+	S3_READ_BUF = 16384
+};
+
+// A connection to an object store, and what's been read from it but not yet
+// consumed.
+
+typedef struct as_http_s {
+	int fd;
+	uint8_t buf[S3_READ_BUF];
+	size_t pos;
+	size_t len;
+} as_http_t;
+
+// Response to an object store request - its status, the headers we need, and
+// its body, unless that was read into the caller's buffer.
+
+typedef struct as_s3_resp_s {
+	int status;
+	uint64_t content_length;
+	char etag[S3_ETAG_LEN + 1];
+	uid_t uid;
+	gid_t gid;
+	mode_t mode;
+	char* body;
+	size_t body_len;
+} as_s3_resp_t;
+
+// Classes of segments, by what they hold - as planned.
+
+typedef enum {
+	CLASS_PRI, CLASS_SEC, CLASS_DAT, N_CLASSES
+} as_class;
+
+// A dry-run plan, accumulated over the namespaces being analyzed. The
+// compressed size of each class of segments is estimated (from samples) when
+// compressing, or when a deadline may choose to compress.
+
+typedef struct as_plan_s {
+	uint64_t bytes[N_CLASSES];
+	uint64_t cmp_bytes[N_CLASSES];
+	uint64_t sampled_bytes[N_CLASSES];
+	uint64_t sampled_out[N_CLASSES];
+	double codec_secs[N_CLASSES];
+	double cmp_secs[N_CLASSES];
+	uint64_t file_bytes;
+	uint64_t max_segsz;
+	uint32_t n_segments;
+	as_file_t probe;
+	uint64_t codec_bytes[N_CODECS];
+	as_file_t codec_probes[N_CODECS];
+	uint32_t n_cmp_files;
+} as_plan_t;
+
+// A backup against a deadline - what's been measured, and which classes of
+// segments are being compressed.
+
+typedef struct as_deadline_s {
+	double start;
+	double write_bw;
+	bool measured;
+	double scale;
+	double ns_start;
+	double predicted;
+	uint64_t bytes_left;
+	uint64_t ns_bytes;
+	bool compress[N_CLASSES];
+} as_deadline_t;
+
 //==========================================================
 // Globals.
 //
@@ -135,6 +649,20 @@ static const char g_all_rights[] = "All rights reserved.";
 
 static const char* FILE_EXTENSION = ".dat";
 static const char* FILE_EXTENSION_CMP = ".dat.gz";
+static const char* FILE_EXTENSION_CHUNKED = ".dat.cz";
+static const char* FILE_EXTENSION_CAS = ".cas";
+static const char* CHUNK_EXTENSION_CMP = ".z";
+static const char* MANIFEST_EXTENSION = ".manifest";
+static const char* DICT_EXTENSION = ".zdict";
+static const char* PRECOPY_EXTENSION = ".precopy";
+static const char* S3_SCHEME = "s3://";
+static const char* S3_DEFAULT_REGION = "us-east-1";
+static const char* S3_DEFAULT_PORT = "80";
+static const char* S3_AWS_DOMAIN = ".amazonaws.com";
+static const char* JOURNAL_EXTENSION = ".journal";
+static const char* PACK_EXTENSION = ".pack";
+static const char* TEMP_EXTENSION = ".tmp";
+static const char* PROC_SYSVIPC_SHM = "/proc/sysvipc/shm";
 
 static const key_t AS_XMEM_KEY_TYPE_MASK = (key_t)0xFF000000;
 static const key_t AS_XMEM_PRI_KEY = (key_t)0xAE000000;
@@ -152,6 +680,29 @@ static const unsigned int MODE_MASK = 0x1ff;
 
 static const int SHMGET_FLAGS_CREATE_ONLY = IPC_CREAT | IPC_EXCL | 0666;
 
+// Deflate's length and distance codes - base values and extra bits - and the
+// order in which a dynamic block lists its code length code's lengths.
+
+static const uint16_t DEFLATE_LEN_BASE[] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59,
+	67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t DEFLATE_LEN_EXTRA[] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4,
+	5, 5, 5, 5, 0
+};
+static const uint16_t DEFLATE_DIST_BASE[] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513,
+	769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const uint8_t DEFLATE_DIST_EXTRA[] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10,
+	11, 11, 12, 12, 13, 13
+};
+static const uint8_t DEFLATE_PRECODE_ORDER[] = {
+	16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
 // Instead of #defines: Advantage? Use the symbol table, so easier debugging.
 
 // For string formatting.
@@ -301,3911 +852,17548 @@ enum {
 	CMPHDR_VER = 1
 };
 
-// Compression chunk size.
+// asmt header version of a chunked compressed file.
 enum {
-	CMPCHUNK = 1048576
+	CMPHDR_VER_CHUNKED = 2
 };
 
-// Maximum number of primary stages.
+// Length of the extension of a chunked compressed file's header.
 enum {
-	MAX_PRI_STAGES = 2048
+	CMPEXT_LEN = sizeof(as_cmp_ext_t)
 };
 
-// Maximum number of secondary stages.
+// Compression level for zstd - its fastest regular level.
 enum {
-	MAX_SEC_STAGES = 2048
+	CODEC_ZSTD_LEVEL = 1
 };
 
+// Most a trained dictionary may hold, and the samples of each segment type it's
+// trained on - runs of DICT_SAMPLE bytes, up to DICT_TRAIN in all.
 enum {
-	MAX_DATA_STAGES = 128
+	DICT_SIZE = 64 * 1024,
+	DICT_SAMPLE = 4096,
+	DICT_TRAIN = 2 * 1048576
 };
 
-// General globals.
-
-static char* g_pathdir = NULL;
-static char* g_progname = NULL;
-static char* g_nsnm = NULL;
-static char* g_nsnm_base = NULL;
-static char** g_nsnm_array = NULL;
-static uint32_t g_nsnm_count = 0;
-static uint32_t g_inst = 0; // Default is instance 0.
-static bool g_analyze = false;
-static bool g_backup = false;
-static bool g_compress = false;
-static bool g_crc32 = false;
-static bool g_restore = false;
-static bool g_verbose = false;
-static uint32_t g_max_threads = INV_THREADS; // Default is num_cpus().
-static uLong g_crc32_init;
+// Chunks of a segment type's files compressed to estimate what its dictionary
+// saves.
+enum {
+	DICT_PROBES = 4
+};
 
-// File I/O related globals.
+// Most a zstd frame header takes - enough of a chunk to find the dictionary it
+// names.
+enum {
+	DICT_FRAME_HEADER = 18
+};
 
-static as_io_t* g_ios;
-static bool g_ios_ok;
-static pthread_mutex_t g_io_mutex;
-static uint32_t g_n_ios;
-static uint32_t g_next_io;
-static uint64_t g_total_to_transfer;
-static uint64_t g_total_transferred;
-static uint32_t g_decile_transferred;
-static struct timespec g_io_start_time;
+// Percentage a codec must save, on samples of a segment, for the segment to be
+// compressed at all.
+enum {
+	CODEC_MIN_SAVING = 10
+};
 
-//==========================================================
-// Forward declarations.
-//
+// Percentage more than the smallest output that a faster codec may produce,
+// and still be chosen.
+enum {
+	CODEC_SLACK = 10
+};
 
-static void usage(bool verbose);
-static void print_newline_and_blanks(size_t n_blanks);
-static int init_nsnm_list(void);
-static void exit_nsnm_list(void);
-static bool analyze(void);
-static bool analyze_backup(void);
-static bool check_dir(const char* pathname, bool is_write, bool create);
-static bool list_segments(as_segment_t** segments, uint32_t* n_segments,
-		int* error);
-static bool stat_segment(int shmid, as_segment_t** segment, int* error);
-static int qsort_compare_segments(const void* left, const void* right);
-static bool analyze_backup_candidate(as_segment_t* segments,
-		uint32_t n_segments, uint32_t base_ix);
-static void display_segments(as_segment_t* pbp, as_segment_t* ptp,
-		as_segment_t psps[], uint32_t n_psps, as_segment_t* smp,
-		as_segment_t ssps[], uint32_t n_ssps,
-		as_segment_t data[], uint32_t n_data);
-static bool analyze_backup_sanity(as_segment_t* pbp, as_segment_t* ptp,
-		as_segment_t psps[], uint32_t n_psps, as_segment_t* smp,
-		as_segment_t ssps[], uint32_t n_ssps,
-		as_segment_t data[], uint32_t n_data);
-static bool backup_candidate(as_segment_t* pbp, as_segment_t* ptp,
-		as_segment_t psps[], uint32_t n_psps, as_segment_t* smp,
-		as_segment_t ssps[], uint32_t n_ssps, as_segment_t* data, uint32_t n_data);
-static bool backup_candidate_file(as_segment_t* sp, as_io_t* io, as_io_t ios[],
-		as_segment_t* pbp, as_segment_t* ptp, as_segment_t psps[],
-		uint32_t n_psps, as_segment_t* smp, as_segment_t ssps[],
-		uint32_t n_ssps, as_segment_t* data, uint32_t n_data);
-static bool backup_candidate_check_crc32(as_io_t ios[], as_segment_t* pbp,
-		as_segment_t* ptp, as_segment_t psps[], uint32_t n_psps,
-		as_segment_t* smp, as_segment_t ssps[], uint32_t n_ssps);
-static void backup_candidate_cleanup(as_io_t ios[], as_segment_t* pbp,
-		as_segment_t* ptp, as_segment_t psps[], uint32_t n_psps,
-		as_segment_t* smp, as_segment_t ssps[], uint32_t n_ssps,
-		as_segment_t data[], uint32_t n_data,
-		bool remove_files);
-static bool start_io(as_io_t ios[], uint32_t n_ios);
-static void* run_io(void* args);
-static bool write_file(int fd, const void* buf, size_t segsz, mode_t mode,
-		uid_t uid, gid_t gid, bool compress, uLong* crc);
-static bool pwrite_file(int fd, const void* buf, size_t segsz, mode_t mode,
-		uid_t uid, gid_t gid, uLong* crc);
-static bool zwrite_file(int fd, const void* buf, size_t segsz, mode_t mode,
-		uid_t uid, gid_t gid, uLong* crc);
-static bool read_file(int fd, void* buf, size_t filsz, size_t segsz, int shmid,
-		mode_t mode, uid_t uid, gid_t gid, bool compress, uLong* crc);
-static bool pread_file(int fd, void* buf, size_t segsz, int shmid, mode_t mode,
-		uid_t uid, gid_t gid, uLong* crc);
-static bool zread_file(int fd, void* buf, size_t filsz, size_t segsz, int shmid,
-		mode_t mode, uid_t uid, gid_t gid, uLong* crc);
-static bool analyze_restore(void);
-static bool analyze_restore_candidate(as_file_t* files, uint32_t n_files,
-		uint32_t base_ix);
-static bool analyze_restore_sanity(as_file_t* pbp, as_file_t* ptp,
-		as_file_t psps[], uint32_t n_psps, as_file_t* smp,
-		as_file_t ssps[], uint32_t n_ssps, as_file_t data[], uint32_t n_data);
-static void display_files(as_file_t* pbp, as_file_t* ptp, as_file_t psps[],
-		uint32_t n_psps, as_file_t* smp, as_file_t ssps[], uint32_t n_ssps,
-		as_file_t data[], uint32_t n_data);
-static bool restore_candidate(as_file_t* pbp, as_file_t* ptp, as_file_t psps[],
-		uint32_t n_psps, as_file_t* smp, as_file_t ssps[], uint32_t n_ssps,
-		as_file_t data[], uint32_t n_data);
-static void restore_candidate_cleanup(as_io_t ios[], uint32_t n_ios,
-		bool remove_segments);
-static bool restore_candidate_segment(as_file_t *file, as_io_t *io, as_io_t ios[],
-		uint32_t n_ios, as_file_t *pbp, as_file_t *ptp, as_file_t psps[],
-		uint32_t n_psps, as_file_t *smp, as_file_t ssps[], uint32_t n_ssps,
-		as_file_t data[], uint32_t n_data);
-static bool restore_candidate_check_crc32(as_io_t ios[], uint32_t n_ios);
-static bool validate_file_name(const char* pathname, as_file_t* file);
-static bool list_files(as_file_t** files, uint32_t* n_files, int* error);
-static int qsort_compare_files(const void* left, const void* right);
-static int qsort_compare_segments(const void* left, const void* right);
-static void draw_table(char** table, uint32_t n_rows, uint32_t n_cols);
-static char* strfmt_width(char* string, uint32_t width, uint32_t n_blanks,
-		bool dashes);
-static char* strtime_diff_eta(struct timespec* start, struct timespec* end,
-		uint32_t decile);
-static void gettime_hmst(struct timespec* time, time_t* hours, time_t* minutes,
-		time_t* seconds, time_t* tenths);
+// Runs of bytes, and their length, sampled from a compression chunk to
+// estimate whether it's worth compressing.
+enum {
+	ENTROPY_SAMPLES = 64,
+	ENTROPY_SAMPLE = 128
+};
 
-//==========================================================
-// Aerospike shared memory tool entry point.
-//
+// A chunk is stored without compressing it if its sampled bytes are spread
+// more evenly than 2^7.8 (of 256) equally likely values would be.
+enum {
+	ENTROPY_SPREAD = 223
+};
 
-int
-main(int argc, char* argv[])
-{
-	// Save the basename of the first argument as the program name.
+// Compression chunk size.
+enum {
+	CMPCHUNK = 1048576
+};
 
-	g_progname = basename(argv[0]);
+// Deflate's window - the most a back-reference may reach back.
+enum {
+	DEFLATE_WINDOW = 32768
+};
 
-	// Scan through command line options.
+// Region of a legacy compressed file searched, and inflated, by each thread
+// when several inflate it - and the least a file must hold to be inflated
+// that way.
+enum {
+	SPEC_CHUNK = 4 * 1048576,
+	SPEC_MIN = 2 * SPEC_CHUNK
+};
 
-	int opt;
+// Most threads inflating a legacy compressed file at once.
+enum {
+	SPEC_MAX_THREADS = 16
+};
 
-	while ((opt = getopt(argc, argv, "abchi:n:p:rt:vz")) != -1) {
+// Most a piece of a legacy compressed file inflated into memory may hold - a
+// piece which reaches it stops early, and the rest of the round is dropped.
+enum {
+	SPEC_MAX_OUT = 32 * 1048576
+};
+
+// I/O chunk size - the unit of parallel work within a segment, for the
+// operations which can be split.
+enum {
+	IOCHUNK = 32 * 1048576
+};
+
+// Size of the pieces a segment is written in when it's mirrored.
+enum {
+	MIRRORCHUNK = 1048576
+};
+
+// Granularity of mismatched ranges reported by compare.
+enum {
+	CMPRANGE = 4096
+};
+
+// Maximum number of mismatched ranges listed per segment by compare.
+enum {
+	MAX_RANGES_SHOWN = 16
+};
+
+// Offset of header in chunk store recipe file.
+enum {
+	CASHDR_OFF = 0
+};
+
+// Length of header in chunk store recipe file.
+enum {
+	CASHDR_LEN = sizeof(as_cas_t)
+};
+
+// Chunk store recipe magic number ('ASMC' in ASCII).
+enum {
+	CASHDR_MAG = 0X434D5341
+};
+
+// Chunk store recipe current version.
+enum {
+	CASHDR_VER = 1
+};
+
+// Pre-copy state magic number ('ASMP' in ASCII).
+enum {
+	PRECOPY_MAG = 0X504D5341
+};
+
+// Pack file magic number ('ASMK' in ASCII).
+enum {
+	PACKHDR_MAG = 0X4B4D5341
+};
+
+// Pack file current version.
+enum {
+	PACKHDR_VER = 1
+};
+
+// Alignment of the extents in a pack file.
+enum {
+	PACK_ALIGN = 4096
+};
+
+// Raw container superblock magic number ('ASMR' in ASCII).
+enum {
+	RAWHDR_MAG = 0X524D5341
+};
+
+// Raw container superblock current version.
+enum {
+	RAWHDR_VER = 1
+};
+
+// Size of a raw container's superblock - room to locate a pack for every
+// namespace of every instance.
+enum {
+	RAW_SUPER_LEN = 65536
+};
+
+// Backup stream header magic number ('ASMS' in ASCII).
+enum {
+	STREAMHDR_MAG = 0X534D5341
+};
+
+// Backup stream header current version.
+enum {
+	STREAMHDR_VER = 1
+};
+
+// Backup stream frame magic number ('ASMF' in ASCII), to catch a stream which
+// has lost its framing.
+enum {
+	FRAME_MAG = 0X464D5341
+};
+
+// Types of backup stream frame.
+enum {
+	FRAME_NAMESPACE = 1,
+	FRAME_DATA = 2,
+	FRAME_END = 3,
+	FRAME_NAMESPACE_END = 4,
+	FRAME_CONNECT = 5,
+	FRAME_ACK = 6
+};
+
+// Status of a namespace, acked by the receiver of a transfer.
+enum {
+	ACK_OK = 0,
+	ACK_SKIPPED = 1,
+	ACK_FAILED = 2
+};
+
+// Maximum number of connections a transfer is spread over.
+enum {
+	MAX_CONNS = 16
+};
+
+// Backup stream data frame flags.
+enum {
+	FRAME_DEFLATED = 0x1,
+	FRAME_CRC32 = 0x2
+};
+
+// Most segments a backup stream's namespace frame may list - a sanity limit,
+// so that a corrupt frame can't make us allocate wildly.
+enum {
+	MAX_FRAME_SEGS = 65536
+};
+
+// Longest shared token the connections of a transfer may present.
+enum {
+	MAX_TOKEN_LEN = 256
+};
+
+// Seconds the receiver of a transfer waits for all of the sender's connections,
+// and for each connection's header.
+enum {
+	ACCEPT_TIMEOUT = 600,
+	HEADER_TIMEOUT = 10
+};
+
+// Most parts a multipart upload to an object store may have.
+enum {
+	S3_MAX_PARTS = 10000
+};
+
+// Number of times an object store request is tried, if the store fails it (or
+// the connection does), and how long to wait on the store (or on a transfer's
+// connection, mid-transfer), in seconds.
+enum {
+	S3_MAX_TRIES = 5,
+	S3_TIMEOUT = 60
+};
+
+// Milliseconds to back off for before the first retry of an object store
+// request - doubled for each retry after it.
+enum {
+	S3_BACKOFF_MS = 250
+};
+
+// Longest object store request header, largest response body we'll read (other
+// than segment data), and largest request body hashed into a signature.
+enum {
+	S3_MAX_HEADER = 8192,
+	S3_MAX_BODY = 16 * 1024 * 1024,
+	S3_MAX_SIGNED_BODY = 1024 * 1024
+};
+
+// Number and size of the pages of each segment sampled to estimate its
+// compressed size, when planning a backup.
+enum {
+	PLAN_SAMPLES = 8,
+	PLAN_SAMPLE = 64 * 1024
+};
+
+// Amount written or read to measure a device's throughput, when planning.
+enum {
+	PLAN_PROBE = 16 * 1024 * 1024
+};
+
+// Bound on how far a deadline's predictions are corrected, either way, by how
+// long namespaces really took.
+enum {
+	DEADLINE_SCALE_BOUND = 10
+};
+
+// Current version of manifest.
+enum {
+	MANIFEST_VER = 2
+};
+
+// Current version of journal.
+enum {
+	JOURNAL_VER = 3
+};
+
+// Maximum length of a journal record.
+enum {
+	JOURNAL_RECORD_MAX = 320
+};
+
+// Digest chunk size - a segment's digest is the digest of its chunks' digests.
+// Also the size of chunks in a chunk store.
+enum {
+	DIGEST_CHUNK = 1048576
+};
+
+// Seed for digests.
+enum {
+	DIGEST_SEED = 0
+};
+
+// Long-only command line options.
+enum {
+	OPT_BASE = 256,
+	OPT_CHUNK_STORE,
+	OPT_PRECOPY,
+	OPT_FINALIZE,
+	OPT_RESUME,
+	OPT_PACK,
+	OPT_MIRROR,
+	OPT_RAW,
+	OPT_SEND,
+	OPT_RECEIVE,
+	OPT_ENDPOINT,
+	OPT_DEADLINE,
+	OPT_READ_SIZE,
+	OPT_DIGEST,
+	OPT_FORCE
+};
+
+// Maximum number of primary stages.
+enum {
+	MAX_PRI_STAGES = 2048
+};
+
+// Maximum size, in MiB, of each read of a compressed file on restore.
+enum {
+	MAX_READ_SIZE = 256
+};
+
+// Maximum number of directories to stripe segment files across.
+enum {
+	MAX_TARGETS = 16
+};
+
+// Maximum number of secondary stages.
+enum {
+	MAX_SEC_STAGES = 2048
+};
+
+enum {
+	MAX_DATA_STAGES = 128
+};
+
+// General globals.
+
+static char* g_pathdir = NULL;
+static char* g_pathdir_list = NULL;
+static char** g_pathdirs = NULL;
+static uint32_t g_n_pathdirs = 0;
+static char* g_mirror_list = NULL;
+static char* g_send_addr = NULL;
+static char* g_receive_addr = NULL;
+static const char* g_transfer_token = NULL;
+static char** g_mirrors = NULL;
+static uint32_t g_n_mirrors = 0;
+static char* g_base_pathdir = NULL;
+static char* g_chunk_store = NULL;
+static char* g_progname = NULL;
+static char* g_nsnm = NULL;
+static char* g_nsnm_base = NULL;
+static char** g_nsnm_array = NULL;
+static uint32_t g_nsnm_count = 0;
+static const char* g_inst_list = "0"; // Default is instance 0.
+static uint32_t g_insts = 0;
+static bool g_analyze = false;
+static bool g_backup = false;
+static bool g_compress = false;
+static bool g_digest = false;
+static uint32_t g_deadline = 0;
+static uint32_t g_read_size = 0; // In MiB - default is CMPCHUNK.
+static bool g_crc32 = false;
+static bool g_restore = false;
+static bool g_verify = false;
+static bool g_compare = false;
+static bool g_precopy = false;
+static bool g_finalize = false;
+static bool g_resume = false;
+static bool g_pack = false;
+static bool g_raw = false;
+static bool g_force = false;
+static bool g_stream = false;
+static bool g_s3 = false;
+static char* g_s3_endpoint = NULL;
+static bool g_verbose = false;
+static uint32_t g_max_threads = INV_THREADS; // Default is num_cpus().
+static uLong g_crc32_init;
+
+// File I/O related globals.
+
+static as_io_t* g_ios;
+static bool g_ios_ok;
+static pthread_mutex_t g_io_mutex;
+static uint32_t g_spare_threads;
+static uint32_t g_n_ios;
+static uint32_t g_next_io[MAX_TARGETS];
+static uint32_t g_next_chunk[MAX_TARGETS];
+static uint32_t g_n_failed_ios;
+static uint64_t g_total_to_transfer;
+static uint64_t g_total_transferred;
+static uint32_t g_decile_transferred;
+static struct timespec g_io_start_time;
+static as_journal_t g_journal = { .fd = -1 };
+static as_pack_t g_pack_file = { .fd = -1 };
+static as_raw_t g_raw_dev = { .fd = -1 };
+static as_s3_t g_s3_store = { 0 };
+static as_plan_t g_plan;
+static as_deadline_t g_deadline_state = { .scale = 1.0 };
+static as_dict_t** g_dicts = NULL;
+static uint32_t g_n_dicts = 0;
+#ifdef USE_ZSTD
+static pthread_key_t g_zstd_key;
+static pthread_once_t g_zstd_once = PTHREAD_ONCE_INIT;
+#endif
+
+// Backup stream - stdout for backup, stdin for restore and verify - or the
+// connections of a transfer to (or from) another node. Frames are written
+// whole, one at a time per connection.
+
+static int g_stream_fds[MAX_CONNS];
+static uint32_t g_n_stream_fds = 0;
+static uint32_t g_next_stream_fd = 0;
+static uint64_t g_n_stream_frames = 0;
+static pthread_mutex_t g_stream_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_conn_mutexes[MAX_CONNS];
+static as_stream_state_t g_stream_state;
+static pthread_cond_t g_stream_cond = PTHREAD_COND_INITIALIZER;
+
+// Copies of a backup restored from - the backup itself, then its mirrors.
+
+static bool g_mirror_ok[MAX_MIRRORS];
+static as_manifest_t g_mirror_manifest;
+static uint64_t g_copy_queued[1 + MAX_MIRRORS];
+static uint64_t g_copy_read[1 + MAX_MIRRORS];
+
+//==========================================================
+// Forward declarations.
+//
+
+static void usage(bool verbose);
+static void print_newline_and_blanks(size_t n_blanks);
+static int init_nsnm_list(void);
+static bool init_inst_list(void);
+static bool inst_selected(uint32_t inst);
+static void print_insts(void);
+static void exit_nsnm_list(void);
+static int init_pathdir_list(void);
+static void exit_pathdir_list(void);
+static int split_dir_list(const char* dir_list, char*** dirs,
+		uint32_t* n_dirs);
+static void free_dir_list(char*** dirs, uint32_t* n_dirs);
+static char* real_dir_list(const char* dir_list);
+static bool same_dir_list(const char* dir_list);
+static bool analyze(void);
+static bool analyze_backup(void);
+static bool check_dir(const char* pathname, bool is_write, bool create);
+static bool list_segments(as_segment_t** segments, uint32_t* n_segments,
+		int* error);
+static bool list_shm(as_shm_t** shms, uint32_t* n_shms, int* error);
+static bool read_proc_shm(as_shm_t** shms, uint32_t* n_shms);
+static bool stat_shm(as_shm_t** shms, uint32_t* n_shms, int* error);
+static void add_shm(as_shm_t** shms, uint32_t* n_shms, const as_shm_t* shm);
+static bool stat_segment(const as_shm_t* shm, as_segment_t** segment,
+		int* error);
+static int qsort_compare_segments(const void* left, const void* right);
+static bool analyze_backup_candidate(as_segment_t* segments,
+		uint32_t n_segments, uint32_t base_ix);
+static void display_segments(as_segment_t* pbp, as_segment_t* ptp,
+		as_segment_t psps[], uint32_t n_psps, as_segment_t* smp,
+		as_segment_t ssps[], uint32_t n_ssps,
+		as_segment_t data[], uint32_t n_data);
+static bool analyze_backup_sanity(as_segment_t* pbp, as_segment_t* ptp,
+		as_segment_t psps[], uint32_t n_psps, as_segment_t* smp,
+		as_segment_t ssps[], uint32_t n_ssps,
+		as_segment_t data[], uint32_t n_data);
+static bool backup_candidate(as_segment_t* pbp, as_segment_t* ptp,
+		as_segment_t psps[], uint32_t n_psps, as_segment_t* smp,
+		as_segment_t ssps[], uint32_t n_ssps, as_segment_t* data, uint32_t n_data);
+static void assign_targets(as_segment_t* sps[], uint32_t n_sps);
+static int qsort_compare_segment_sizes(const void* left, const void* right);
+static bool backup_candidate_file(as_segment_t* sp, as_io_t* io, as_io_t ios[],
+		as_segment_t* pbp, as_segment_t* ptp, as_segment_t psps[],
+		uint32_t n_psps, as_segment_t* smp, as_segment_t ssps[],
+		uint32_t n_ssps, as_segment_t* data, uint32_t n_data,
+		const as_manifest_t* manifest);
+static bool backup_candidate_check_crc32(as_io_t ios[], as_segment_t* pbp,
+		as_segment_t* ptp, as_segment_t psps[], uint32_t n_psps,
+		as_segment_t* smp, as_segment_t ssps[], uint32_t n_ssps);
+static void backup_candidate_cleanup(as_io_t ios[], as_segment_t* pbp,
+		as_segment_t* ptp, as_segment_t psps[], uint32_t n_psps,
+		as_segment_t* smp, as_segment_t ssps[], uint32_t n_ssps,
+		as_segment_t data[], uint32_t n_data,
+		bool remove_files);
+static void unlink_segment_file(const as_segment_t* sp, bool compress,
+		bool cas);
+static void unlink_pathdir_file(const char* pathdir, key_t key, bool compress,
+		bool cas);
+static bool backup_file(as_io_t* io);
+static bool create_file(as_io_t* io);
+static bool reuse_file(as_io_t* io);
+static bool digest_segment(const void* buf, size_t segsz, as_digest_t* digest,
+		as_digest_t** chunk_digests);
+static bool read_manifest(const char* pathdir, key_t key,
+		as_manifest_t* manifest);
+static bool write_manifest(as_io_t ios[], uint32_t n_ios, as_segment_t* pbp);
+static bool write_manifest_file(const char* pathdir, const char* targets,
+		as_io_t ios[], uint32_t n_ios, as_segment_t* pbp, time_t created);
+static const as_manifest_entry_t* find_manifest_entry(
+		const as_manifest_t* manifest, key_t key);
+static void free_manifest(as_manifest_t* manifest);
+static bool write_cas_file(as_io_t* io);
+static bool store_chunk(const void* buf, size_t size,
+		const as_digest_t* digest, bool compress, uint64_t* stored_sz);
+static bool same_chunk(const void* buf, size_t size,
+		const as_digest_t* digest, bool compress, const char* pathname);
+static bool read_cas_file(as_io_t* io, uint32_t chunk);
+static bool verify_cas_file(as_io_t* io, uint32_t chunk);
+static bool compare_cas_file(as_io_t* io, uint32_t chunk);
+static bool read_cas_header(int fd, key_t key, size_t segsz, uint32_t magic,
+		as_cas_t* header, as_digest_t** digests);
+static bool load_chunk(const as_digest_t* digest, bool compress, void* buf,
+		size_t size);
+static bool sync_parent_dir(const char* pathname);
+static void chunk_pathname(const as_digest_t* digest, bool compress,
+		char* pathname);
+static const char* file_extension(bool compress, as_codec codec, bool cas);
+static bool precopy_candidate_file(as_io_t* io);
+static bool finalize_candidate_file(as_io_t* io);
+static bool precopy_file(as_io_t* io, uint32_t chunk);
+static bool finalize_file(as_io_t* io, uint32_t chunk);
+static bool pwrite_range(int fd, const void* buf, size_t size, size_t offset);
+static bool write_precopy_state(as_io_t* io);
+static bool read_precopy_state(as_io_t* io);
+static bool finish_precopy(as_io_t ios[], uint32_t n_ios);
+static bool finish_finalize(as_io_t ios[], uint32_t n_ios, as_segment_t* pbp);
+static bool have_journal(key_t key);
+static bool have_precopy(uint32_t inst, uint32_t nsid);
+static bool open_journal(key_t key, bool backup);
+static void close_journal(key_t key, bool remove);
+static void journal_attach(const as_io_t* io);
+static size_t journal_chunk(const as_io_t* io, uint32_t chunk, char* record);
+static void write_journal(const as_io_t* io, const char* record, size_t len);
+static bool resume_io(as_io_t* io, const as_segment_t* sp);
+static bool create_pack(as_io_t ios[], uint32_t n_ios, as_segment_t* pbp);
+static bool finish_pack(as_io_t ios[], uint32_t n_ios);
+static bool have_pack(key_t key, char* pathname);
+static bool open_pack(key_t key);
+static bool read_pack(const char* pathname, size_t base, as_pack_t* pack);
+static void close_pack(void);
+static const as_pack_extent_t* find_pack_extent(key_t key);
+static bool open_raw(void);
+static void close_raw(void);
+static bool container_size(int fd, size_t* size);
+static int open_direct(const char* pathname, int flags);
+static const as_raw_pack_t* find_raw_pack(key_t key);
+static bool add_raw_pack(key_t key, size_t offset, size_t size);
+static bool write_raw_super(void);
+static void list_raw(as_file_t** files, uint32_t* n_files);
+static bool open_stream(void);
+static bool connect_stream(void);
+static bool close_stream(bool complete);
+static bool write_stream_namespace(as_io_t ios[], uint32_t n_ios,
+		const as_segment_t* pbp, uint32_t* status);
+static bool end_stream_namespace(key_t key, uint32_t* status);
+static bool read_stream_ack(key_t key, uint32_t* status);
+static bool write_stream_ack(int fd, key_t key, uint32_t status);
+static bool stream_file(as_io_t* io, uint32_t chunk);
+static bool write_stream(int fd, const void* buf, size_t size);
+static bool read_stream(void);
+static bool accept_stream(void);
+static int accept_connection(int listen_fd, time_t deadline, char* peer,
+		size_t size);
+static bool read_stream_header(int fd, uint32_t* n_conns, uint32_t* conn);
+static void* run_stream(void* args);
+static void read_stream_frames(int fd);
+static bool start_stream_namespace(int fd, const as_frame_t* frame,
+		uint32_t* status);
+static bool read_stream_data(int fd, const as_frame_t* frame, uint8_t* inbuf,
+		uint8_t* scratch, bool* ok);
+static bool finish_stream_namespace(bool complete);
+static bool stream_nsnm_selected(const char* nsnm);
+static bool read_stream_range(int fd, void* buf, size_t size);
+static bool skip_stream(int fd, uint64_t len);
+static bool set_segment_owner(int shmid, mode_t mode, uid_t uid, gid_t gid);
+static bool open_s3(void);
+static void close_s3(void);
+static bool s3_request(const char* method, const char* name,
+		const char* query, const as_io_t* meta, const void* body,
+		size_t body_len, const uLong* body_crc, size_t offset, size_t size,
+		void* buf, as_s3_resp_t* resp);
+static bool s3_try_request(const char* method, const char* name,
+		const char* query, const as_io_t* meta, const void* body,
+		size_t body_len, const uLong* body_crc, size_t offset, size_t size,
+		void* buf, as_s3_resp_t* resp);
+static void s3_crc32_base64(uLong crc, char* out);
+static bool s3_append(char* buf, size_t size, size_t* len, const char* format,
+		...) __attribute__((format(printf, 4, 5)));
+static bool s3_connect(as_http_t* http);
+static bool s3_read_response(as_http_t* http, bool head, size_t size,
+		void* buf, as_s3_resp_t* resp);
+static bool http_read(as_http_t* http, void* buf, size_t size);
+static bool http_read_line(as_http_t* http, char* line, size_t max);
+static ssize_t http_fill(as_http_t* http, void* buf, size_t size);
+static char* s3_encode(const char* in, bool keep_slash, char* out);
+static bool s3_xml_value(const char** cursor, const char* tag, char* value,
+		size_t max);
+static void s3_failed(const char* what, const char* name,
+		const as_s3_resp_t* resp);
+static bool list_s3_names(char*** names, uint32_t* n_names);
+static void free_s3_names(char** names, uint32_t n_names);
+static bool find_s3_objects(const as_segment_t* pbp);
+static bool upload_candidate_file(as_io_t* io);
+static bool upload_file(as_io_t* io, uint32_t chunk);
+static bool finish_s3(as_io_t ios[], uint32_t n_ios, bool success);
+static void abort_s3_uploads(as_io_t ios[], uint32_t n_ios);
+static void delete_s3_object(key_t key);
+static void combine_part_crcs(as_io_t* io);
+static bool list_s3(as_file_t** files, uint32_t* n_files, int* error);
+static bool read_s3_base(key_t key, size_t offset, void* buf, size_t size);
+static bool restore_candidate_s3(as_io_t* io);
+static bool download_file(as_io_t* io, uint32_t chunk);
+static bool compare_candidate(as_segment_t* pbp, as_segment_t* ptp,
+		as_segment_t psps[], uint32_t n_psps, as_segment_t* smp,
+		as_segment_t ssps[], uint32_t n_ssps, as_segment_t data[],
+		uint32_t n_data);
+static bool compare_candidate_file(as_segment_t* sp, as_io_t* io,
+		as_io_t ios[], uint32_t n_ios);
+static void compare_candidate_cleanup(as_io_t ios[], uint32_t n_ios);
+static int qsort_compare_ranges(const void* left, const void* right);
+static bool start_io(as_io_t ios[], uint32_t n_ios);
+static void* run_io(void* args);
+static bool write_file(const int fds[], uint32_t n_fds, const void* buf,
+		size_t segsz, mode_t mode, uid_t uid, gid_t gid, bool compress,
+		as_codec codec, const as_dict_t* dict, uLong* crc);
+static bool pwrite_file(const int fds[], uint32_t n_fds, const void* buf,
+		size_t segsz, mode_t mode, uid_t uid, gid_t gid, uLong* crc);
+#ifndef USE_ISAL
+static bool zwrite_file(const int fds[], uint32_t n_fds, const void* buf,
+		size_t segsz, mode_t mode, uid_t uid, gid_t gid, uLong* crc);
+#else
+static bool iwrite_file(const int fds[], uint32_t n_fds, const void* buf,
+		size_t segsz, mode_t mode, uid_t uid, gid_t gid, uLong* crc);
+#endif
+static bool cwrite_file(const int fds[], uint32_t n_fds, const void* buf,
+		size_t segsz, mode_t mode, uid_t uid, gid_t gid, as_codec codec,
+		const as_dict_t* dict, uLong* crc);
+static bool write_cmp_header(const int fds[], uint32_t n_fds,
+		const as_cmp_t* header, const as_cmp_ext_t* ext);
+static bool write_cmp_data(const int fds[], uint32_t n_fds, const void* buf,
+		size_t size);
+static bool chunk_incompressible(const uint8_t* buf, size_t size);
+static bool set_file_owner(const int fds[], uint32_t n_fds, mode_t mode,
+		uid_t uid, gid_t gid);
+static as_codec choose_codec(const void* buf, size_t segsz);
+static void sample_segment(const uint8_t* buf, size_t segsz,
+		as_sample_t samples[N_CODECS]);
+static as_codec pick_codec(const as_sample_t samples[N_CODECS]);
+static bool codec_available(as_codec codec);
+static const char* codec_name(as_codec codec);
+static as_codec codec_from_name(const char* name);
+static size_t codec_bound(as_codec codec, size_t size);
+static bool codec_compress(as_codec codec, const as_dict_t* dict,
+		const void* in, size_t in_sz, void* out, size_t* out_sz);
+static bool codec_decompress(as_codec codec, const void* in, size_t in_sz,
+		void* out, size_t out_sz);
+static bool codec_train(as_codec codec, const void* samples,
+		const size_t sizes[], uint32_t n_samples, void* dict, size_t* dict_sz);
+static uint32_t codec_dict_id(as_codec codec, const void* in, size_t in_sz);
+#ifdef USE_ZSTD
+static as_zstd_ctx_t* zstd_ctx(void);
+static void zstd_ctx_key(void);
+static void free_zstd_ctx(void* arg);
+#endif
+static void train_dicts(as_io_t ios[], uint32_t n_ios);
+static uint64_t dict_saving(const as_dict_t* dict, const as_io_t ios[],
+		uint32_t n_ios, as_type type, uint64_t total);
+static const as_dict_t* add_dict(void* buf, size_t size, uint32_t id);
+static const as_dict_t* find_dict(uint32_t id);
+static const as_dict_t* read_dict(const char* pathdir, uint32_t id);
+static void load_dicts(void);
+static bool write_dicts(const as_io_t ios[], uint32_t n_ios);
+static bool write_dict(const char* pathdir, const as_dict_t* dict);
+static void free_dicts(void);
+static uint32_t file_dict_id(int fd, size_t segsz, const as_cmp_ext_t* ext);
+static bool read_mirrored_file(as_io_t* io);
+static bool check_mirrored_copy(const as_io_t* io);
+static bool read_file(int fd, size_t offset, void* buf, size_t filsz,
+		size_t segsz, int shmid, mode_t mode, uid_t uid, gid_t gid,
+		bool compress, uLong* crc);
+static bool pread_file(int fd, size_t start, void* buf, size_t segsz,
+		int shmid, mode_t mode, uid_t uid, gid_t gid, uLong* crc);
+static bool zread_file(int fd, void* buf, size_t filsz, size_t segsz, int shmid,
+		mode_t mode, uid_t uid, gid_t gid, uLong* crc);
+#ifdef USE_ISAL
+static bool iread_file(int fd, void* buf, size_t segsz, uLong* crc);
+#endif
+static bool sread_file(int fd, size_t filsz, void* buf, size_t segsz,
+		uLong* crc);
+static bool spec_round(as_spec_part_t parts[], uint32_t n_parts,
+		uint8_t* seg, size_t segsz, size_t* done, uint64_t* bit, bool* final,
+		uLong* crc);
+static void* run_spec_part(void* args);
+static void* run_spec_copy(void* args);
+static bool spec_search(as_spec_part_t* part, as_inflater_t* inf);
+static bool spec_decode(as_spec_part_t* part, as_inflater_t* inf);
+static bool spec_zlib(as_spec_part_t* part, uint64_t bit, const uint8_t* dict,
+		size_t dict_len);
+static bool spec_block(as_spec_part_t* part, as_inflater_t* inf);
+static bool spec_push(as_spec_part_t* part, size_t n);
+static bool spec_header(as_inflater_t* inf, bool search);
+static bool build_code(const uint8_t lens[], uint32_t n, bool precode,
+		uint16_t table[], uint32_t* bits);
+static int32_t decode_symbol(as_inflater_t* inf, const uint16_t table[],
+		uint32_t bits);
+static uint32_t peek_bits(const as_inflater_t* inf, uint32_t n);
+static uint32_t get_bits(as_inflater_t* inf, uint32_t n);
+static size_t skip_gzip_header(const uint8_t* in, size_t in_size);
+static void slide_window(uint8_t* win, const uint8_t* data, size_t len);
+static uint32_t claim_threads(uint32_t max);
+static void release_threads(uint32_t n);
+static bool read_cmp_header(int fd, size_t segsz, as_cmp_t* header,
+		as_cmp_ext_t* ext);
+static bool read_cmp_chunk(int fd, const as_cmp_ext_t* ext, uint8_t* cmp_buf,
+		void* out, size_t size, size_t* offset);
+static bool pread_range(int fd, void* buf, size_t size, size_t offset);
+static bool start_readahead(as_readahead_t* ra, int fd);
+static ssize_t next_readahead(as_readahead_t* ra, uint8_t** buf);
+static void done_readahead(as_readahead_t* ra);
+static void stop_readahead(as_readahead_t* ra);
+static void* run_readahead(void* args);
+static bool cread_file(int fd, const as_cmp_ext_t* ext, void* buf,
+		size_t segsz, uLong* crc);
+static bool cverify_file(int fd, key_t key, const as_cmp_t* header,
+		const as_cmp_ext_t* ext, size_t segsz, uLong* crc);
+static bool ccompare_file(as_io_t* io, const as_cmp_ext_t* ext);
+static bool verify_file(int fd, key_t key, size_t offset, size_t filsz,
+		size_t segsz, bool compress, uLong* crc);
+static bool zverify_file(int fd, key_t key, size_t filsz, size_t segsz,
+		uLong* crc);
+static bool pverify_file(int fd, key_t key, size_t start, size_t segsz,
+		uLong* crc);
+static size_t io_chunk_size(const as_io_t* io, uint32_t chunk);
+static bool compare_file(as_io_t* io, uint32_t chunk);
+static bool zcompare_file(as_io_t* io);
+static bool pcompare_file(as_io_t* io, uint32_t chunk);
+static bool compare_range(as_io_t* io, const uint8_t* file_buf,
+		const uint8_t* seg_buf, size_t size, size_t offset,
+		as_range_t* pending);
+static bool add_range(as_io_t* io, as_range_t* pending, size_t start,
+		size_t end);
+static bool flush_range(as_io_t* io, as_range_t* pending);
+static bool analyze_restore(void);
+static bool analyze_restore_candidate(as_file_t* files, uint32_t n_files,
+		uint32_t base_ix);
+static bool analyze_restore_sanity(as_file_t* pbp, as_file_t* ptp,
+		as_file_t psps[], uint32_t n_psps, as_file_t* smp,
+		as_file_t ssps[], uint32_t n_ssps, as_file_t data[], uint32_t n_data);
+static bool analyze_restore_base_file(as_file_t* pbp, uint32_t n_psps);
+static bool read_base_file(const char* pathname, off_t base, uint8_t* base_ver,
+		uint8_t* n_arenas);
+static void display_files(as_file_t* pbp, as_file_t* ptp, as_file_t psps[],
+		uint32_t n_psps, as_file_t* smp, as_file_t ssps[], uint32_t n_ssps,
+		as_file_t data[], uint32_t n_data);
+static bool restore_candidate(as_file_t* pbp, as_file_t* ptp, as_file_t psps[],
+		uint32_t n_psps, as_file_t* smp, as_file_t ssps[], uint32_t n_ssps,
+		as_file_t data[], uint32_t n_data);
+static void restore_candidate_cleanup(as_io_t ios[], uint32_t n_ios,
+		bool remove_segments);
+static bool restore_candidate_segment(as_file_t *file, as_io_t *io, as_io_t ios[],
+		uint32_t n_ios, as_file_t *pbp, as_file_t *ptp, as_file_t psps[],
+		uint32_t n_psps, as_file_t *smp, as_file_t ssps[], uint32_t n_ssps,
+		as_file_t data[], uint32_t n_data);
+static bool restore_candidate_cas(as_io_t* io);
+static void check_mirrors(key_t key);
+static bool same_manifest(const as_manifest_t* left,
+		const as_manifest_t* right, bool* proven);
+static bool restore_candidate_check_crc32(as_io_t ios[], uint32_t n_ios);
+static bool verify_candidate(as_file_t* pbp, as_file_t* ptp, as_file_t psps[],
+		uint32_t n_psps, as_file_t* smp, as_file_t ssps[], uint32_t n_ssps,
+		as_file_t data[], uint32_t n_data);
+static bool verify_candidate_file(as_file_t* file, as_io_t* io, as_io_t ios[],
+		uint32_t n_ios);
+static bool verify_candidate_crcs(const as_file_t* pbp, as_io_t ios[],
+		uint32_t n_ios);
+static void verify_candidate_cleanup(as_io_t ios[], uint32_t n_ios);
+static bool validate_file_name(const char* pathname, as_file_t* file);
+static bool list_files(as_file_t** files, uint32_t* n_files, int* error);
+static bool list_target_files(uint32_t target, as_file_t** files,
+		uint32_t* n_files, int* error);
+static void list_pack(const char* pathname, key_t key, size_t base,
+		uint32_t target, as_file_t** files, uint32_t* n_files);
+static int qsort_compare_files(const void* left, const void* right);
+static int qsort_compare_segments(const void* left, const void* right);
+static void draw_table(char** table, uint32_t n_rows, uint32_t n_cols);
+static char* strfmt_width(char* string, uint32_t width, uint32_t n_blanks,
+		bool dashes);
+static char* strtime_diff_eta(struct timespec* start, struct timespec* end,
+		uint32_t decile);
+static void gettime_hmst(struct timespec* time, time_t* hours, time_t* minutes,
+		time_t* seconds, time_t* tenths);
+static uint64_t elapsed_usec(const struct timespec* start);
+static const char* type_name(as_type type);
+static bool plan_files(as_file_t** files, uint32_t* n_files);
+static bool plan_namespace(key_t key, as_file_t** files, uint32_t* n_files,
+		bool* any, bool* found);
+static bool have_unplanned_files(key_t key);
+static bool plan_file(const as_manifest_t* manifest,
+		const as_manifest_entry_t* entry, key_t key, as_file_t* file);
+static void free_planned_files(as_file_t** files, uint32_t* n_files);
+static void plan_backup_segments(as_segment_t* pbp, as_segment_t* ptp,
+		as_segment_t psps[], uint32_t n_psps, as_segment_t* smp,
+		as_segment_t ssps[], uint32_t n_ssps, as_segment_t data[],
+		uint32_t n_data);
+static void plan_backup_segment(const as_segment_t* sp);
+static void plan_restore_files(as_file_t* pbp, as_file_t* ptp,
+		as_file_t psps[], uint32_t n_psps, as_file_t* smp, as_file_t ssps[],
+		uint32_t n_ssps, as_file_t data[], uint32_t n_data);
+static void plan_restore_file(const as_file_t* fp);
+static void plan_add_bytes(as_type type, size_t segsz);
+static bool finish_backup_plan(void);
+static bool finish_restore_plan(void);
+static uint64_t plan_print_sizes(void);
+static void plan_print_eta(bool measured, double secs);
+static double plan_write_probe(const char* dir);
+static double plan_read_probe(const as_file_t* fp, double* decode_bw);
+static double plan_inflate_probe(uint8_t* buf, size_t size);
+static uint64_t plan_read_number(const char* pathname);
+static uint64_t plan_read_meminfo(const char* name);
+static double plan_now(void);
+static double plan_decode_probe(const uint8_t* buf, size_t size);
+static as_class segment_class(as_type type);
+static bool compress_segment(as_type type);
+static void deadline_plan(as_segment_t* pbp, as_segment_t* ptp,
+		as_segment_t psps[], uint32_t n_psps, as_segment_t* smp,
+		as_segment_t ssps[], uint32_t n_ssps, as_segment_t data[],
+		uint32_t n_data);
+static void deadline_replan(void);
+static uint32_t deadline_choose(double budget, double* predicted);
+static double deadline_predict(uint32_t mask, uint64_t* written);
+static void deadline_print(uint32_t mask);
+
+//==========================================================
+// Aerospike shared memory tool entry point.
+//
+
+int
+main(int argc, char* argv[])
+{
+	// Save the basename of the first argument as the program name.
+
+	g_progname = basename(argv[0]);
+
+	// Scan through command line options.
+
+	static const struct option long_options[] = {
+		{ "base", required_argument, NULL, OPT_BASE },
+		{ "chunk-store", required_argument, NULL, OPT_CHUNK_STORE },
+		{ "precopy", no_argument, NULL, OPT_PRECOPY },
+		{ "finalize", no_argument, NULL, OPT_FINALIZE },
+		{ "resume", no_argument, NULL, OPT_RESUME },
+		{ "pack", no_argument, NULL, OPT_PACK },
+		{ "mirror", required_argument, NULL, OPT_MIRROR },
+		{ "raw", no_argument, NULL, OPT_RAW },
+		{ "send", required_argument, NULL, OPT_SEND },
+		{ "receive", required_argument, NULL, OPT_RECEIVE },
+		{ "endpoint", required_argument, NULL, OPT_ENDPOINT },
+		{ "deadline", required_argument, NULL, OPT_DEADLINE },
+		{ "read-size", required_argument, NULL, OPT_READ_SIZE },
+		{ "digest", no_argument, NULL, OPT_DIGEST },
+		{ "force", no_argument, NULL, OPT_FORCE },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "abcChi:n:p:rt:vVz", long_options,
+			NULL)) != -1) {
 		switch (opt) {
 
-		case 'a':
-			// Perform analyze operation.
-			g_analyze = true;
-			break;
+		case 'a':
+			// Perform analyze operation.
+			g_analyze = true;
+			break;
+
+		case 'b':
+			// Perform backup operation (or advisory for analyze operation).
+			g_backup = true;
+			break;
+
+		case 'c':
+			// Compare crc32 values.
+			g_crc32 = true;
+			break;
+
+		case 'C':
+			// Perform compare operation (or advisory for analyze operation).
+			g_compare = true;
+			break;
+
+		case 'h':
+			// Provide usage information to user.
+			usage(true);
+			exit(EXIT_SUCCESS);
+			break;
+
+		case 'i':
+			// Filter by instance number(s), or 'all' (default is 0).
+			g_inst_list = optarg;
+			break;
+
+		case 'n':
+			// Filter by namespace name (default is any).
+			g_nsnm = optarg;
+			break;
+
+		case 'p':
+			// Set path directory for segment files (no default).
+			g_pathdir = optarg;
+			break;
+
+		case 'r':
+			// Perform restore operation (or advisory for analyze operation).
+			g_restore = true;
+			break;
+
+		case 't':
+			// Set the maximum number of threads for backup/restore I/Os.
+			// Default is number of CPUs.
+			g_max_threads = (uint32_t)atoi(optarg);
+			break;
+
+		case 'v':
+			// Request verbose output.
+			g_verbose = true;
+			break;
+
+		case 'V':
+			// Perform verify operation (or advisory for analyze operation).
+			g_verify = true;
+			break;
+
+		case 'z':
+			// Request compressed backup.
+			g_compress = true;
+			break;
+
+		case OPT_BASE:
+			// Back up incrementally against a previous backup directory.
+			g_base_pathdir = optarg;
+			break;
+
+		case OPT_CHUNK_STORE:
+			// Use (or back up to) a chunk store.
+			g_chunk_store = optarg;
+			break;
+
+		case OPT_PRECOPY:
+			// Back up live segments, ahead of a later finalize.
+			g_precopy = true;
+			break;
+
+		case OPT_FINALIZE:
+			// Finish a pre-copy backup, after the server has shut down.
+			g_finalize = true;
+			break;
+
+		case OPT_RESUME:
+			// Resume an interrupted backup or restore from its journal.
+			g_resume = true;
+			break;
+
+		case OPT_PACK:
+			// Back up each namespace to a single pack file.
+			g_pack = true;
+			break;
+
+		case OPT_MIRROR:
+			// Also write copies of the backup to these directories.
+			g_mirror_list = optarg;
+			break;
+
+		case OPT_RAW:
+			// The path is a raw container - a block device or file.
+			g_raw = true;
+			break;
+
+		case OPT_SEND:
+			// Back up straight to another node's restore, over TCP.
+			g_send_addr = optarg;
+			break;
+
+		case OPT_RECEIVE:
+			// Restore straight from another node's backup, over TCP.
+			g_receive_addr = optarg;
+			break;
+
+		case OPT_ENDPOINT:
+			// The object store's endpoint, if not the region's S3 one.
+			g_s3_endpoint = optarg;
+			break;
+
+		case OPT_DEADLINE:
+			// Compress only as much as allows the backup to finish within
+			// this many seconds.
+			g_deadline = (uint32_t)atoi(optarg);
+
+			if (g_deadline == 0) {
+				printf("Deadline ('--deadline') must be a number of seconds"
+						" greater than 0.\n\n");
+				usage(false);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case OPT_READ_SIZE:
+			// Size of each read of a compressed file on restore, in MiB.
+			g_read_size = (uint32_t)atoi(optarg);
+
+			if (g_read_size == 0 || g_read_size > MAX_READ_SIZE) {
+				printf("Read size ('--read-size') must be a number of MiB"
+						" from 1 to %d.\n\n", MAX_READ_SIZE);
+				usage(false);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case OPT_DIGEST:
+			// Record segment digests in the manifest, for a later --base.
+			g_digest = true;
+			break;
+
+		case OPT_FORCE:
+			// Back up to a raw container which holds something else.
+			g_force = true;
+			break;
+
+		default:
+			// Unknown command line option.
+			usage(true);
+			exit(EXIT_FAILURE);
+			break;
+		}
+	}
+
+	// If there are arguments past the command line options, bark.
+
+	if (optind < argc) {
+		usage(true);
+		exit(EXIT_FAILURE);
+	}
+
+	// Did user specify exactly one command to perform?
+
+	if ((int)g_backup + (int)g_restore + (int)g_verify + (int)g_compare
+			!= 1) {
+		printf("Must specify exactly one of backup ('-b'), restore ('-r'),"
+				" verify ('-V') or compare ('-C').\n\n");
+		usage(false);
+		exit(EXIT_FAILURE);
+	}
+
+	// A transfer sends a backup stream to a restore on another node, instead
+	// of through a pipe. It takes the place of the directory.
+
+	if ((g_send_addr != NULL && !g_backup)
+			|| (g_receive_addr != NULL && !g_restore)) {
+		printf("Can only specify send ('--send') with backup ('-b'), and"
+				" receive ('--receive') with restore ('-r').\n\n");
+		usage(false);
+		exit(EXIT_FAILURE);
+	}
+
+	if (g_send_addr != NULL || g_receive_addr != NULL) {
+		if (g_pathdir != NULL) {
+			printf("Can't specify pathname of file directory ('-p') with send"
+					" ('--send') or receive ('--receive').\n\n");
+			usage(false);
+			exit(EXIT_FAILURE);
+		}
+
+		g_pathdir = "-";
+
+		// Only a sender with the same shared token is let in.
+
+		g_transfer_token = getenv("ASMT_TRANSFER_TOKEN");
+
+		if (g_transfer_token == NULL || g_transfer_token[0] == '\0'
+				|| strlen(g_transfer_token) > MAX_TOKEN_LEN) {
+			printf("Must set a shared token of up to %d characters in"
+					" ASMT_TRANSFER_TOKEN to send ('--send') or receive"
+					" ('--receive').\n\n", MAX_TOKEN_LEN);
+			usage(false);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	// User must specify the path of the directory containing (or to contain)
+	// Aerospike database segment files.
+
+	if (g_pathdir == NULL) {
+		printf("Must specify pathname of file directory (use '-p').\n\n");
+		usage(false);
+		exit(EXIT_FAILURE);
+	}
+
+	// The directory may be a comma-separated list of directories, to stripe
+	// the segment files across. The first also holds each namespace's base
+	// segment file, manifest and journal.
+
+	int n_pathdirs = init_pathdir_list();
+
+	if (n_pathdirs < 1 || n_pathdirs > MAX_TARGETS) {
+		printf("Must specify from 1 to %d non-empty directories"
+				" (use '-p').\n\n", MAX_TARGETS);
+		usage(false);
+		exit(EXIT_FAILURE);
+	}
+
+	// A directory of '-' is a stream - backed up to stdout, restored or
+	// verified from stdin.
+
+	g_stream = g_n_pathdirs == 1 && strcmp(g_pathdir, "-") == 0;
+
+	// A directory of s3://<bucket>[/<prefix>] is an object store.
+
+	g_s3 = strncmp(g_pathdir_list, S3_SCHEME, strlen(S3_SCHEME)) == 0;
+
+	// An incremental backup is still a backup.
+
+	if (g_base_pathdir != NULL && !g_backup) {
+		printf("Can only specify base directory ('--base') with backup"
+				" ('-b').\n\n");
+		usage(false);
+		exit(EXIT_FAILURE);
+	}
+
+	// Digests are recorded in the manifest, for a later incremental backup.
+	// An incremental backup needs them, and records them so that it can be
+	// the base of the next one.
+
+	if (g_digest && (!g_backup || g_pack || g_raw)) {
+		printf("Can only specify digest ('--digest') with backup ('-b'), and"
+				" not with pack ('--pack') or raw ('--raw').\n\n");
+		usage(false);
+		exit(EXIT_FAILURE);
+	}
+
+	if (g_base_pathdir != NULL) {
+		g_digest = true;
+	}
+
+	// Only a raw backup overwrites something which isn't a backup.
+
+	if (g_force && (!g_backup || !g_raw)) {
+		printf("Can only specify force ('--force') with backup ('-b') to raw"
+				" ('--raw').\n\n");
+		usage(false);
+		exit(EXIT_FAILURE);
+	}
+
+	// Pre-copy and finalize are two halves of one backup.
+
+	if ((g_precopy || g_finalize) && !g_backup) {
+		printf("Can only specify pre-copy ('--precopy') or finalize"
+				" ('--finalize') with backup ('-b').\n\n");
+		usage(false);
+		exit(EXIT_FAILURE);
+	}
+
+	if (g_precopy && g_finalize) {
+		printf("Can't specify both pre-copy ('--precopy') and finalize"
+				" ('--finalize').\n\n");
+		usage(false);
+		exit(EXIT_FAILURE);
+	}
+
+	// A pre-copy is patched in place by finalize, so its segment files must
+	// be plain files.
+
+	if ((g_precopy || g_finalize) && (g_compress || g_crc32
+			|| g_base_pathdir != NULL || g_chunk_store != NULL)) {
+		printf("Can't specify compress ('-z'), crc32 ('-c'), base directory"
+				" ('--base') or chunk store ('--chunk-store') with pre-copy"
+				" ('--precopy') or finalize ('--finalize').\n\n");
+		usage(false);
+		exit(EXIT_FAILURE);
+	}
+
+	// Only backups and restores are journaled. A pre-copy is finished by
+	// finalize, which may simply be run again.
+
+	if (g_resume && ((!g_backup && !g_restore) || g_precopy || g_finalize)) {
+		printf("Can only specify resume ('--resume') with backup ('-b') or"
+				" restore ('-r'), and not with pre-copy ('--precopy') or"
+				" finalize ('--finalize').\n\n");
+		usage(false);
+		exit(EXIT_FAILURE);
+	}
+
+	// A pack is laid out up front, so its segments must be written as they
+	// are, and is only synced once it's complete.
+
+	if (g_pack && !g_backup) {
+		printf("Can only specify pack ('--pack') with backup ('-b').\n\n");
+		usage(false);
+		exit(EXIT_FAILURE);
+	}
+
+	if (g_pack && (g_compress || g_base_pathdir != NULL
+			|| g_chunk_store != NULL || g_precopy || g_finalize || g_resume)) {
+		printf("Can't specify compress ('-z'), base directory ('--base'),"
+				" chunk store ('--chunk-store'), pre-copy ('--precopy'),"
+				" finalize ('--finalize') or resume ('--resume') with pack"
+				" ('--pack').\n\n");
+		usage(false);
+		exit(EXIT_FAILURE);
+	}
+
+	// Features which work on a backup in place, or on a single file, need a
+	// single directory.
+
+	if (g_n_pathdirs > 1 && (g_base_pathdir != NULL || g_precopy || g_finalize
+			|| g_pack)) {
+		printf("Can't specify base directory ('--base'), pre-copy"
+				" ('--precopy'), finalize ('--finalize') or pack ('--pack')"
+				" with more than one directory ('-p').\n\n");
+		usage(false);
+		exit(EXIT_FAILURE);
+	}
+
+	// A stream is written (or read) in a single pass, through a pipe.
+
+	if (g_stream && (g_compare || g_base_pathdir != NULL
+			|| g_chunk_store != NULL || g_precopy || g_finalize || g_resume
+			|| g_pack || g_raw || g_mirror_list != NULL)) {
+		printf("Can't specify compare ('-C'), base directory ('--base'),"
+				" chunk store ('--chunk-store'), pre-copy ('--precopy'),"
+				" finalize ('--finalize'), resume ('--resume'), pack"
+				" ('--pack'), raw ('--raw') or mirror ('--mirror') with a"
+				" stream ('-p -').\n\n");
+		usage(false);
+		exit(EXIT_FAILURE);
+	}
+
+	if (g_stream && g_analyze && !g_backup) {
+		printf("Can't analyze a restore or verify from a stream"
+				" ('-p -').\n\n");
+		usage(false);
+		exit(EXIT_FAILURE);
+	}
+
+	// A raw container holds a pack per namespace, written in place with direct
+	// I/O - so the same restrictions apply as to a pack, and more.
+
+	if (g_raw && (g_compress || g_base_pathdir != NULL
+			|| g_chunk_store != NULL || g_precopy || g_finalize || g_resume
+			|| g_mirror_list != NULL || g_n_pathdirs > 1)) {
+		printf("Can't specify compress ('-z'), base directory ('--base'),"
+				" chunk store ('--chunk-store'), pre-copy ('--precopy'),"
+				" finalize ('--finalize'), resume ('--resume'), mirror"
+				" ('--mirror') or more than one directory ('-p') with raw"
+				" ('--raw').\n\n");
+		usage(false);
+		exit(EXIT_FAILURE);
+	}
+
+	if (g_raw && g_backup) {
+		g_pack = true;
+	}
+
+	// An object store backup is one object per segment, uploaded in parts -
+	// only backed up and restored.
+
+	if (g_s3_endpoint != NULL && !g_s3) {
+		printf("Can only specify endpoint ('--endpoint') with an object"
+				" store ('-p s3://<bucket>').\n\n");
+		usage(false);
+		exit(EXIT_FAILURE);
+	}
+
+	// Only plain HTTP is spoken - the endpoint must be given, so that data
+	// and credentials don't go to AWS in cleartext by default.
+
+	if (g_s3 && g_s3_endpoint == NULL) {
+		printf("Must specify the object store's endpoint ('--endpoint')"
+				" with an object store\n('-p s3://<bucket>').\n\n");
+		usage(false);
+		exit(EXIT_FAILURE);
+	}
+
+	if (g_s3 && (g_verify || g_compare || g_compress
+			|| g_base_pathdir != NULL || g_chunk_store != NULL || g_precopy
+			|| g_finalize || g_resume || g_pack || g_raw
+			|| g_mirror_list != NULL || g_n_pathdirs > 1)) {
+		printf("Can't specify verify ('-V'), compare ('-C'), compress ('-z'),"
+				" base directory ('--base'), chunk store ('--chunk-store'),"
+				" pre-copy ('--precopy'), finalize ('--finalize'), resume"
+				" ('--resume'), pack ('--pack'), raw ('--raw'), mirror"
+				" ('--mirror') or more than one directory ('-p') with an"
+				" object store ('-p s3://<bucket>').\n\n");
+		usage(false);
+		exit(EXIT_FAILURE);
+	}
+
+	// The read size only applies to reading compressed files, on restore.
+
+	if (g_read_size != 0 && !g_restore) {
+		printf("Can only specify read size ('--read-size') with restore"
+				" ('-r').\n\n");
+		usage(false);
+		exit(EXIT_FAILURE);
+	}
+
+	// A deadline chooses whether to compress, file by file, so its backup
+	// is a directory of files.
+
+	if (g_deadline != 0 && (!g_backup || g_compress || g_base_pathdir != NULL
+			|| g_chunk_store != NULL || g_precopy || g_finalize || g_resume
+			|| g_pack || g_raw || g_stream || g_s3)) {
+		printf("Can only specify deadline ('--deadline') with backup ('-b'),"
+				" and not with compress ('-z'), base directory ('--base'),"
+				" chunk store ('--chunk-store'), pre-copy ('--precopy'),"
+				" finalize ('--finalize'), resume ('--resume'), pack"
+				" ('--pack'), raw ('--raw'), a stream ('-p -') or an object"
+				" store ('-p s3://<bucket>').\n\n");
+		usage(false);
+		exit(EXIT_FAILURE);
+	}
+
+	// Mirrors are written from the same pass over the segments as the
+	// backup itself - each is a complete, single-directory copy of it.
+
+	if (g_mirror_list != NULL) {
+		int n_mirrors = split_dir_list(g_mirror_list, &g_mirrors,
+				&g_n_mirrors);
+
+		if (n_mirrors < 1 || n_mirrors > MAX_MIRRORS) {
+			printf("Must specify from 1 to %d non-empty mirror directories"
+					" (use \'--mirror\').\n\n", MAX_MIRRORS);
+			usage(false);
+			exit(EXIT_FAILURE);
+		}
+
+		if (!g_backup && !g_restore) {
+			printf("Can only specify mirror (\'--mirror\') with backup"
+					" (\'-b\') or restore (\'-r\').\n\n");
+			usage(false);
+			exit(EXIT_FAILURE);
+		}
+
+		if (g_n_pathdirs > 1 || g_base_pathdir != NULL
+				|| g_chunk_store != NULL || g_precopy || g_finalize
+				|| g_pack) {
+			printf("Can't specify more than one directory (\'-p\'), base"
+					" directory (\'--base\'), chunk store (\'--chunk-store\'),"
+					" pre-copy (\'--precopy\'), finalize (\'--finalize\') or"
+					" pack (\'--pack\') with mirror (\'--mirror\').\n\n");
+			usage(false);
+			exit(EXIT_FAILURE);
+		}
+
+		// A mirrored backup isn't journaled, so can't be resumed. A restore
+		// from mirrors can.
+
+		if (g_backup && g_resume) {
+			printf("Can't specify resume (\'--resume\') with a mirrored"
+					" backup.\n\n");
+			usage(false);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	// Don't need to specify compress with restore or verify.
+
+	if ((g_restore || g_verify || g_compare) && g_compress) {
+		printf("Unnecessary to specify compress ('-z') with restore ('-r'),"
+				" verify ('-V') or compare ('-C').\n\n");
+	}
+
+	// Can't specify an instance number outside the valid range.
+	// Note: Instance can be 0.
+
+	if (!init_inst_list()) {
+		printf("Instance must be from %d..%d, a comma-separated list of"
+				" them, or 'all' (use '-i').\n\n", MIN_INST, MAX_INST);
+		usage(false);
+		exit(EXIT_FAILURE);
+	}
+
+	// Determine maximum number of threads--use num_cpus() if not specified.
+
+	if (g_max_threads == INV_THREADS) {
+		g_max_threads = num_cpus();
+	}
+	else if (g_max_threads < MIN_THREADS || g_max_threads > MAX_THREADS) {
+		printf("Max threads must be in the range %d..%d (use '-t').\n\n",
+				MIN_THREADS, MAX_THREADS);
+		usage(false);
+		exit(EXIT_FAILURE);
+	}
+
+	// Determine the read size - one compression chunk if not specified.
+
+	if (g_read_size == 0) {
+		g_read_size = CMPCHUNK / 1048576;
+	}
+
+	// A backup stream goes to stdout, so everything else which would go there
+	// goes to stderr instead. A write to a closed pipe fails the backup,
+	// rather than killing us.
+
+	if (g_stream && g_backup && !g_analyze && g_send_addr != NULL) {
+		signal(SIGPIPE, SIG_IGN);
+	}
+	else if (g_stream && g_backup && !g_analyze) {
+		if (isatty(STDOUT_FILENO)) {
+			printf("Won't write a backup stream to a terminal - redirect"
+					" stdout.\n\n");
+			exit(EXIT_FAILURE);
+		}
+
+		fflush(stdout);
+		g_stream_fds[0] = dup(STDOUT_FILENO);
+
+		if (g_stream_fds[0] < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+			printf("Could not set up backup stream on stdout.\n");
+			exit(EXIT_FAILURE);
+		}
+
+		g_n_stream_fds = 1;
+		signal(SIGPIPE, SIG_IGN);
+	}
+	else if ((g_stream && !g_backup && g_receive_addr != NULL) || g_s3) {
+		signal(SIGPIPE, SIG_IGN);
+	}
+	else if (g_stream && !g_backup) {
+		if (isatty(STDIN_FILENO)) {
+			printf("Won't read a backup stream from a terminal - redirect"
+					" stdin.\n\n");
+			exit(EXIT_FAILURE);
+		}
+
+		g_stream_fds[0] = STDIN_FILENO;
+		g_n_stream_fds = 1;
+	}
+
+	// If we haven't printed usage (and verbose), print copyright info.
+
+	if (g_verbose) {
+		printf("%s, %s", g_fullname, g_version);
+		printf("\n");
+		printf("%s  %s\n", g_copyright, g_all_rights);
+		printf("\n");
+	}
+
+	// Print command as issued.
+
+	if (g_verbose) {
+		printf("%s", g_progname);
+		for (int i = 1; i < argc; i++) {
+			printf(" %s", argv[i]);
+		}
+		printf("\n");
+	}
+
+	// Decide which operation to perform.
+
+	if (g_verbose) {
+		printf("\n");
+		if (g_analyze) {
+			printf("Performing analyze operation");
+			if (g_backup) {
+				printf(" with backup option");
+			}
+			else if (g_verify) {
+				printf(" with verify option");
+			}
+			else if (g_compare) {
+				printf(" with compare option");
+			}
+			else {
+				printf(" with restore option");
+			}
+			printf(".\n");
+		}
+		else if (g_backup) {
+			printf("Performing %s%sbackup operation",
+					g_resume ? "resumed " : "",
+					g_base_pathdir != NULL ? "incremental " :
+					g_precopy ? "pre-copy " :
+					g_finalize ? "finalizing " :
+					g_raw ? "raw " :
+					g_stream ? "streamed " :
+					g_s3 ? "object store " :
+					g_pack ? "packed " : "");
+			if (g_deadline != 0) {
+				printf(" within %u seconds", g_deadline);
+			}
+			if (g_crc32 && !g_compress) {
+				printf(" with crc32 checking");
+			}
+			else if (g_compress && !g_crc32) {
+				printf(" with compression");
+			}
+			else if (g_compress && g_crc32) {
+				printf(" with compression and crc32 checking");
+			}
+			printf(".\n");
+		}
+		else if (g_verify) {
+			printf("Performing verify operation.\n");
+		}
+		else if (g_compare) {
+			printf("Performing compare operation.\n");
+		}
+		else {
+			printf("Performing %srestore operation",
+					g_resume ? "resumed " : "");
+			if (g_crc32) {
+				printf(" with crc32 checking");
+			}
+			printf(".\n");
+		}
+	}
+
+	// Each thread restoring a compressed file reads it ahead into two buffers
+	// of the read size - shrink it if they'd take more than the available
+	// memory.
+
+	uint64_t mem_available = g_restore ?
+			plan_read_meminfo("MemAvailable:") : 0;
+	uint64_t read_bufs = 2 * (uint64_t)g_read_size * 1048576 * g_max_threads;
+
+	if (mem_available != 0 && read_bufs > mem_available) {
+		uint32_t read_size = (uint32_t)(mem_available
+				/ (2 * (uint64_t)1048576 * g_max_threads));
+
+		g_read_size = read_size == 0 ? 1 : read_size;
+
+		if (g_verbose) {
+			printf("Read size reduced to %u MiB, to fit %u threads' buffers"
+					" in available memory.\n", g_read_size, g_max_threads);
+		}
+	}
+
+	// Initialize the CRC32 initialization constant.
+
+	g_crc32_init = g_crc32 ? crc32(0L, Z_NULL, 0) : 0;
+
+	// Get the list of namespace names over which to operate.
+
+	int ret = init_nsnm_list();
+
+	if (ret < 0) {
+		printf("Failed to extract namespace names from list.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// Operate over each namespace name provided (if any). A stream can only be
+	// read once, so every namespace is restored (or verified) from it in a
+	// single pass.
+
+	bool success;
+
+	if (g_stream && g_backup && !g_analyze && !open_stream()) {
+		success = false;
+	}
+	else if (g_stream && !g_backup) {
+		success = read_stream();
+	}
+	else if (g_nsnm_count == 0) {
+		// No namespace name provided.
+		success = analyze();
+	}
+	else {
+		// List of namespace names provided.
+		success = true;
+		uint32_t count = 0;
+
+		for (uint32_t i = 0; i < g_nsnm_count; i++) {
+			g_nsnm = g_nsnm_array[i];
+
+			if (strcmp(g_nsnm, "") == 0) {
+				continue;
+			}
+
+			count++;
+
+			if (!analyze()) {
+				success = false;
+			}
+		}
+
+		if (success && count != g_nsnm_count) {
+			printf("\nInvalid namespace name(s) provided.\n");
+		}
+	}
+
+	if (g_stream && g_backup && !g_analyze && g_n_stream_fds != 0
+			&& !close_stream(success)) {
+		success = false;
+	}
+
+	exit_nsnm_list();
+	exit_pathdir_list();
+	free_dir_list(&g_mirrors, &g_n_mirrors);
+	close_raw();
+	close_s3();
+
+	exit(success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+//==========================================================
+// Local helpers.
+//
+
+// Print usage information.
+
+static void
+usage(bool verbose)
+{
+	printf("%s, %s", g_fullname, g_version);
+	printf("\n");
+	printf("%s  %s\n", g_copyright, g_all_rights);
+	printf("\n");
+
+	char first_str[MAX_BUFFER];
+
+	sprintf(first_str, "usage: %s", g_progname);
+
+	size_t first_len = strlen(first_str);
+
+	printf("%s", first_str);
+
+	printf(" [-a]");
+	printf(" [-b]");
+	printf(" [-c]");
+	printf(" [-C]");
+	printf(" [-h]");
+	printf(" [-i <instance>]");
+	printf(" [-n <name>[,<name>...]]");
+
+	print_newline_and_blanks(first_len);
+
+	printf(" -p <pathdir>[,<pathdir>...]");
+	printf(" [-r]");
+	printf(" [-t <threads>]");
+	printf(" [-v]");
+	printf(" [-V]");
+	printf(" [-z]");
+
+	print_newline_and_blanks(first_len);
+
+	printf(" [--base <pathdir>]");
+	printf(" [--chunk-store <pathdir>]");
+	printf(" [--precopy]");
+
+	print_newline_and_blanks(first_len);
+
+	printf(" [--finalize]");
+	printf(" [--resume]");
+	printf(" [--pack]");
+
+	print_newline_and_blanks(first_len);
+
+	printf(" [--mirror <pathdir>[,<pathdir>...]]");
+	printf(" [--raw]");
+
+	print_newline_and_blanks(first_len);
+
+	printf(" [--send <host>:<port>]");
+	printf(" [--receive [<addr>:]<port>]");
+
+	print_newline_and_blanks(first_len);
+
+	printf(" [--endpoint <host>[:<port>]]");
+	printf(" [--deadline <seconds>]");
+
+	print_newline_and_blanks(first_len);
+
+	printf(" [--read-size <MiB>]");
+	printf(" [--digest]");
+	printf(" [--force]");
+
+	printf("\n\n");
+
+	printf("-a analyze (advisory - goes with '-b' or '-r')\n");
+	printf("-b backup (operation or advisory with '-a')\n");
+	printf("-c compare crc32 values of segments and segment files\n");
+	printf("-C compare segments with existing segment files (operation or"
+			" advisory\n   with '-a')\n");
+	printf("-h help\n");
+	printf("-i filter by instance - a comma-separated list, or 'all' (default"
+			" is\n   instance 0)\n");
+	printf("-n filter by namespace name (default is all namespaces)\n");
+	printf("-p path of directory (mandatory) - a comma-separated list stripes"
+			" the backup,\n   '-' backs up to stdout, or restores or"
+			" verifies from stdin, and\n   's3://<bucket>[/<prefix>]' backs up"
+			" to, or restores from, an object store\n");
+	printf("-r restore (operation or advisory with '-a')\n");
+	printf("-t maximum number of threads for I/O (default is #CPUs,"
+			" in this case %u)\n", num_cpus());
+	printf("-v verbose output\n");
+	printf("-V verify backup files (operation or advisory with '-a')\n");
+	printf("-z compress files on backup\n");
+	printf("--base back up incrementally - reuse unchanged segment files from"
+			" the\n   previous backup in <pathdir>\n");
+	printf("--chunk-store store segments as chunks in the chunk store in"
+			" <pathdir>,\n   shared between backups\n");
+	printf("--precopy back up segments while the server is running, to be"
+			" finished\n   with '--finalize'\n");
+	printf("--finalize finish a '--precopy' backup after the server has shut"
+			" down -\n   rewrite only what changed\n");
+	printf("--resume resume an interrupted backup or restore from its journal\n");
+	printf("--pack back up each namespace to a single pack file\n");
+	printf("--mirror back up to, or restore from, copies of the backup in each"
+			" <pathdir>,\n   too\n");
+	printf("--raw <pathdir> is a block device or preallocated file - back up"
+			" each namespace\n   to a pack in it, with direct I/O\n");
+	printf("--send back up straight to a '--receive' restore on another node,"
+			" over TCP,\n   in place of '-p' - with the token in"
+			" ASMT_TRANSFER_TOKEN\n");
+	printf("--receive restore straight from a '--send' backup on another node,"
+			" listening\n   on [<addr>:]<port>, in place of '-p' - only from a"
+			" sender with the same\n   ASMT_TRANSFER_TOKEN\n");
+	printf("--endpoint the object store's endpoint (required with s3://) -"
+			" spoken to over\n   plain HTTP\n");
+	printf("--deadline back up within <seconds> - compress only as much as"
+			" there's time for\n");
+	printf("--read-size read compressed files on restore <MiB> at a time"
+			" (default is 1)\n");
+	printf("--digest record segment digests in the manifest, so that the backup"
+			" can be the\n   '--base' of a later one (implied by '--base')\n");
+	printf("--force back up to a '--raw' device which holds something other"
+			" than a backup\n");
+
+	printf("\n");
+
+	printf("Notes:\n");
+
+	printf("\n");
+
+	printf("1. The '-c' option has a significant performance cost.\n");
+	printf("2. However, this is reduced when combined with the '-z' option.\n");
+	printf("3. Should be run in verbose mode ('-v') if possible.\n");
+	printf("4. A comma-separated list of namespace names may be provided.\n");
+	printf("5. Every backup but a '--pack' writes a manifest, which '--base'"
+			" relies on.\n");
+	printf("6. Restoring a backup made with '--chunk-store' needs the same"
+			" option.\n");
+	printf("7. A '--precopy' backup can't be restored until it's been"
+			" finalized.\n");
+	printf("8. An interrupted backup or restore keeps what it completed, for"
+			" '--resume'.\n");
+	printf("9. Analyzing a backup ('-ba -v') times writing a 16 MiB file to"
+			" each directory.\n");
+
+	if (!verbose) {
+		return;
+	}
+
+	printf("\n");
+
+	printf("Possible primary option combinations:\n");
+
+	printf("\n");
+
+	printf("-b     Perform backup operation ('-p' required).\n");
+	printf("-r     Perform restore operation ('-p' required).\n");
+	printf("-ba    Analyze backup operation ('-p' required).\n");
+	printf("-ra    Analyze restore operation ('-p' required).\n");
+	printf("-V     Perform verify operation ('-p' required).\n");
+	printf("-Va    Analyze verify operation ('-p' required).\n");
+	printf("-C     Perform compare operation ('-p' required).\n");
+	printf("-Ca    Analyze compare operation ('-p' required).\n");
+
+	printf("\n");
+
+	printf("Examples:\n");
+
+	printf("\n");
+
+	char buffer[MAX_BUFFER];
+
+	sprintf(buffer, "%s -b -p /home/aerospike/backups", g_progname);
+	printf("%s\n", buffer);
+
+	printf("\n");
+
+	printf("    Backs up all Aerospike database segments with instance 0\n");
+	printf("    (all namespaces) to the directory /home/aerospike/backups.\n");
+
+	printf("\n");
+
+	sprintf(buffer, "%s -b -p /home/aerospike/backups -zc", g_progname);
+	printf("%s\n", buffer);
+
+	printf("\n");
+
+	printf("    Backs up all Aerospike database segments with instance 0\n");
+	printf("    (all namespaces) to the directory /home/aerospike/backups.\n");
+	printf("    Requests that file compression be applied and crc32 checks\n");
+	printf("    be made on all backups.\n");
+
+	printf("\n");
+
+	sprintf(buffer, "%s -ba -i2 -p /home/aerospike/backups -v", g_progname);
+	printf("%s\n", buffer);
+
+	printf("\n");
+
+	printf("    Analyzes whether any Aerospike database segments with\n");
+	printf("    instance 2 (all namespaces) can be backed up to the directory\n");
+	printf("    /home/aerospike/backups. Requests verbose output.\n");
+
+	printf("\n");
+
+	sprintf(buffer, "%s -b -i all -p /home/aerospike/backups", g_progname);
+	printf("%s\n", buffer);
+
+	printf("\n");
+
+	printf("    Backs up all Aerospike database segments of every instance on\n");
+	printf("    the host (all namespaces) to the directory\n");
+	printf("    /home/aerospike/backups, in one run.\n");
+
+	printf("\n");
+
+	sprintf(buffer, "%s -b -p /home/aerospike/backups/tue"
+			" --base /home/aerospike/backups/mon", g_progname);
+	printf("%s\n", buffer);
+
+	printf("\n");
+
+	printf("    Backs up all Aerospike database segments with instance 0\n");
+	printf("    (all namespaces) to the directory /home/aerospike/backups/tue.\n");
+	printf("    Segments which haven't changed since the backup in the\n");
+	printf("    directory /home/aerospike/backups/mon are hard linked (or\n");
+	printf("    cloned) from there instead of being written again.\n");
+
+	printf("\n");
+
+	sprintf(buffer, "%s -b -p /home/aerospike/backups/tue"
+			" --chunk-store /home/aerospike/chunks", g_progname);
+	printf("%s\n", buffer);
+
+	printf("\n");
+
+	printf("    Backs up all Aerospike database segments with instance 0\n");
+	printf("    (all namespaces) to the directory /home/aerospike/backups/tue,\n");
+	printf("    storing each segment as 1 MiB chunks in the chunk store\n");
+	printf("    /home/aerospike/chunks. Chunks already in the chunk store\n");
+	printf("    (e.g., from earlier backups) aren't written again.\n");
+
+	printf("\n");
+
+	sprintf(buffer, "%s -b -p /home/aerospike/backups --precopy", g_progname);
+	printf("%s\n", buffer);
+	sprintf(buffer, "%s -b -p /home/aerospike/backups --finalize", g_progname);
+	printf("%s\n", buffer);
+
+	printf("\n");
+
+	printf("    Backs up all Aerospike database segments with instance 0\n");
+	printf("    (all namespaces) to the directory /home/aerospike/backups in\n");
+	printf("    two passes. The first copies the segments while the server is\n");
+	printf("    still running. The second, after the server has shut down,\n");
+	printf("    rewrites only what changed in the meantime.\n");
+
+	printf("\n");
+
+	sprintf(buffer, "%s -b -p /home/aerospike/backups --pack", g_progname);
+	printf("%s\n", buffer);
+
+	printf("\n");
+
+	printf("    Backs up all Aerospike database segments with instance 0\n");
+	printf("    (all namespaces) to the directory /home/aerospike/backups,\n");
+	printf("    one pack file per namespace instead of one file per segment.\n");
+
+	printf("\n");
+
+	sprintf(buffer, "%s -b -p /mnt/ssd0/backups,/mnt/ssd1/backups",
+			g_progname);
+	printf("%s\n", buffer);
+
+	printf("\n");
+
+	printf("    Backs up all Aerospike database segments with instance 0\n");
+	printf("    (all namespaces), striped across two directories on separate\n");
+	printf("    devices. Restore with the same '-p'.\n");
+
+	printf("\n");
+
+	sprintf(buffer, "%s -b -p /mnt/ssd0/backups --mirror /mnt/ssd1/backups -z",
+			g_progname);
+	printf("%s\n", buffer);
+
+	printf("\n");
+
+	printf("    Backs up all Aerospike database segments with instance 0\n");
+	printf("    (all namespaces), compressed, to two directories on separate\n");
+	printf("    devices, each segment read and compressed only once.\n");
+
+	printf("\n");
+
+	sprintf(buffer, "%s -r -p /mnt/ssd0/backups --mirror /mnt/ssd1/backups",
+			g_progname);
+	printf("%s\n", buffer);
+
+	printf("\n");
+
+	printf("    Restores all Aerospike database segments with instance 0\n");
+	printf("    (all namespaces), reading from both copies of the backup.\n");
+
+	printf("\n");
+
+	sprintf(buffer, "%s -b -p - -z | ssh backup-host 'cat > index.asmt'",
+			g_progname);
+	printf("%s\n", buffer);
+
+	printf("\n");
+
+	printf("    Backs up all Aerospike database segments with instance 0\n");
+	printf("    (all namespaces) as a compressed stream on stdout, here\n");
+	printf("    piped to another host. Restore it with '-r -p -'.\n");
+
+	printf("\n");
+
+	sprintf(buffer, "%s -b -z -c --send node2:7000 -t 8", g_progname);
+	printf("%s\n", buffer);
+
+	printf("\n");
+
+	printf("    Backs up all Aerospike database segments with instance 0\n");
+	printf("    (all namespaces) straight to node2, over 8 connections, where\n");
+	printf("    '-r --receive 7000' restores them as they arrive. Both\n");
+	printf("    must have the same token in ASMT_TRANSFER_TOKEN.\n");
+
+	printf("\n");
+
+	sprintf(buffer, "%s -b -c -p s3://backups/node1 --endpoint minio:9000",
+			g_progname);
+	printf("%s\n", buffer);
+
+	printf("\n");
+
+	printf("    Backs up all Aerospike database segments with instance 0\n");
+	printf("    (all namespaces) to the bucket 'backups' of the object store\n");
+	printf("    at minio:9000, as objects under 'node1/'. Credentials come\n");
+	printf("    from AWS_ACCESS_KEY_ID and AWS_SECRET_ACCESS_KEY.\n");
+
+	printf("\n");
+
+	sprintf(buffer, "%s -b -p /path/to/backup --deadline 300", g_progname);
+	printf("%s\n", buffer);
+
+	printf("\n");
+
+	printf("    Backs up all Aerospike database segments with instance 0\n");
+	printf("    (all namespaces) to /path/to/backup within 5 minutes,\n");
+	printf("    compressing whichever segments there's time to compress.\n");
+
+	printf("\n");
+
+	sprintf(buffer, "%s -b -p /dev/nvme1n1 --raw", g_progname);
+	printf("%s\n", buffer);
+
+	printf("\n");
+
+	printf("    Backs up all Aerospike database segments with instance 0\n");
+	printf("    (all namespaces) straight to the block device /dev/nvme1n1,\n");
+	printf("    with direct I/O - one pack per namespace.\n");
+
+	printf("\n");
+
+	sprintf(buffer, "%s -r -i3 -n bar -p /home/aerospike/backups -cv -t 128",
+			g_progname);
+	printf("%s\n", buffer);
+
+	printf("\n");
+
+	printf("    Restores all Aerospike database segment files with instance 3\n");
+	printf("    (namespace \'bar\') from the directory /home/aerospike/backups.\n");
+	printf("    Requests that crc32 checks be made on all restorations.\n");
+	printf("    Requests verbose output. Uses no more than 128 threads\n");
+	printf("    for file I/O. Any compressed files will be decompressed.\n");
+
+	printf("\n");
+
+	sprintf(buffer, "%s -V -p /home/aerospike/backups -v -t 16", g_progname);
+	printf("%s\n", buffer);
+
+	printf("\n");
+
+	printf("    Verifies all Aerospike database segment files with instance 0\n");
+	printf("    (all namespaces) in the directory /home/aerospike/backups.\n");
+	printf("    Reads and decompresses every file, checking headers, sizes\n");
+	printf("    and checksums. Nothing is written to shared memory. Uses no\n");
+	printf("    more than 16 threads for file I/O.\n");
+
+	printf("\n");
+
+	sprintf(buffer, "%s -C -p /home/aerospike/backups -v", g_progname);
+	printf("%s\n", buffer);
+
+	printf("\n");
+
+	printf("    Compares all unattached Aerospike database segments with\n");
+	printf("    instance 0 (all namespaces) with the segment files in the\n");
+	printf("    directory /home/aerospike/backups, e.g., after a backup and\n");
+	printf("    before a reboot. Reports mismatched ranges. Nothing is\n");
+	printf("    written.\n");
+
+	printf("\n");
+}
+
+// Print a newline followed by a number of blanks.
+
+static void
+print_newline_and_blanks(size_t n_blanks)
+{
+	char buffer[MAX_BUFFER];
+
+	memset(buffer, ' ', n_blanks);
+	buffer[n_blanks] = '\0';
+	printf("\n%s", buffer);
+}
+
+static int
+init_nsnm_list(void)
+{
+	assert(g_nsnm_base == NULL);
+	assert(g_nsnm_array == NULL);
+	assert(g_nsnm_count == 0);
+
+	if (g_nsnm == NULL) {
+		return 0;
+	}
+
+	char* list = strdup(g_nsnm);
+
+	if (list == NULL) {
+		return 0;
+	}
+
+	// Save the original namespace name list.
+
+	g_nsnm_base = g_nsnm;
+
+	// Extract namespace names from the list.
+
+	char* tmp_list = list;
+
+	while (tmp_list != NULL) {
+
+		// Find next element in list.
+
+		char* tmp_elmt = strchr(tmp_list, ',');
+
+		if (tmp_elmt != NULL) {
+			*tmp_elmt = '\0';
+		}
+
+		// Add element to array.
+
+		g_nsnm_count++;
+
+		char** new_array = (char**)realloc(g_nsnm_array,
+				g_nsnm_count * sizeof(char*));
+		assert(new_array != NULL);
+		g_nsnm_array = new_array;
+
+		g_nsnm_array[g_nsnm_count - 1] = strdup(tmp_list);
+
+		// Go to next element (if any).
+
+		tmp_list = tmp_elmt == NULL ? NULL : ++tmp_elmt;
+	}
+
+	free(list);
+	g_nsnm = NULL;
+
+	return (int)g_nsnm_count;
+}
+
+static void
+exit_nsnm_list(void)
+{
+	if (g_nsnm_array == NULL) {
+		return;
+	}
+
+	for (uint32_t i = 0; i < g_nsnm_count; i++) {
+		assert(g_nsnm_array[i] != NULL);
+		free(g_nsnm_array[i]);
+		g_nsnm_array[i] = NULL;
+	}
+
+	free(g_nsnm_array);
+
+	g_nsnm_array = NULL;
+	g_nsnm = g_nsnm_base;
+	g_nsnm_base = NULL;
+}
+
+// Turn the instance list - 'all', or a comma-separated list of instance
+// numbers - into the set of instances to operate on. Returns false if any
+// instance is invalid.
+
+static bool
+init_inst_list(void)
+{
+	if (strcmp(g_inst_list, "all") == 0) {
+		g_insts = (1u << (MAX_INST + 1)) - 1;
+		return true;
+	}
+
+	const char* tmp_list = g_inst_list;
+
+	while (true) {
+		char* end;
+		unsigned long inst = strtoul(tmp_list, &end, 10);
+
+		if (*tmp_list < '0' || *tmp_list > '9' || inst > MAX_INST
+				|| (*end != ',' && *end != '\0')) {
+			return false;
+		}
+
+		g_insts |= 1u << inst;
+
+		if (*end == '\0') {
+			return true;
+		}
+
+		tmp_list = end + 1;
+	}
+}
+
+static bool
+inst_selected(uint32_t inst)
+{
+	return inst <= MAX_INST && (g_insts & (1u << inst)) != 0;
+}
+
+// Print the instance filter, for messages that follow "Did not find ...".
+
+static void
+print_insts(void)
+{
+	if (strcmp(g_inst_list, "all") == 0) {
+		printf(", any instance");
+	}
+	else {
+		printf(", instance%s %s", strchr(g_inst_list, ',') != NULL ? "s" : "",
+				g_inst_list);
+	}
+}
+
+// Split the directory path into the list of directories to stripe segment
+// files across. Returns the number of directories, or -1 if any is empty.
+
+static int
+init_pathdir_list(void)
+{
+	assert(g_pathdir_list == NULL);
+	assert(g_pathdirs == NULL);
+	assert(g_n_pathdirs == 0);
+
+	// Save the original directory list.
+
+	g_pathdir_list = g_pathdir;
+
+	int n_pathdirs = split_dir_list(g_pathdir_list, &g_pathdirs,
+			&g_n_pathdirs);
+
+	if (g_n_pathdirs != 0) {
+		g_pathdir = g_pathdirs[0];
+	}
+
+	return n_pathdirs;
+}
+
+static void
+exit_pathdir_list(void)
+{
+	if (g_pathdirs == NULL) {
+		return;
+	}
+
+	free_dir_list(&g_pathdirs, &g_n_pathdirs);
+
+	g_pathdir = g_pathdir_list;
+	g_pathdir_list = NULL;
+}
+
+// Split a comma-separated list of directories into an array of them. Returns
+// the number of directories, or -1 if any is empty.
+
+static int
+split_dir_list(const char* dir_list, char*** dirs, uint32_t* n_dirs)
+{
+	char* list = strdup(dir_list);
+
+	if (list == NULL) {
+		return -1;
+	}
+
+	// Extract directories from the list.
+
+	bool empty = false;
+	char* tmp_list = list;
+
+	while (tmp_list != NULL) {
+
+		// Find next element in list.
+
+		char* tmp_elmt = strchr(tmp_list, ',');
+
+		if (tmp_elmt != NULL) {
+			*tmp_elmt = '\0';
+		}
+
+		if (*tmp_list == '\0') {
+			empty = true;
+		}
+
+		// Add element to array.
+
+		(*n_dirs)++;
+
+		char** new_array = (char**)realloc(*dirs, *n_dirs * sizeof(char*));
+		assert(new_array != NULL);
+		*dirs = new_array;
+
+		(*dirs)[*n_dirs - 1] = strdup(tmp_list);
+
+		// Go to next element (if any).
+
+		tmp_list = tmp_elmt == NULL ? NULL : ++tmp_elmt;
+	}
+
+	free(list);
+
+	return empty ? -1 : (int)*n_dirs;
+}
+
+// Free an array of directories from split_dir_list().
+
+static void
+free_dir_list(char*** dirs, uint32_t* n_dirs)
+{
+	for (uint32_t i = 0; i < *n_dirs; i++) {
+		assert((*dirs)[i] != NULL);
+		free((*dirs)[i]);
+		(*dirs)[i] = NULL;
+	}
+
+	free(*dirs);
+
+	*dirs = NULL;
+	*n_dirs = 0;
+}
+
+// Resolve each directory of a comma-separated list to its absolute path, so
+// that the list doesn't depend on how it was typed, nor on where from. A
+// directory which can't be resolved is kept as it is. Returns the list, to be
+// freed by the caller, or NULL.
+
+static char*
+real_dir_list(const char* dir_list)
+{
+	char** dirs = NULL;
+	uint32_t n_dirs = 0;
+
+	if (split_dir_list(dir_list, &dirs, &n_dirs) < 0) {
+		free_dir_list(&dirs, &n_dirs);
+		return strdup(dir_list);
+	}
+
+	char* list = (char*)malloc(n_dirs * (PATH_MAX + 1));
+	size_t len = 0;
+
+	for (uint32_t i = 0; list != NULL && i < n_dirs; i++) {
+		char real[PATH_MAX + 1];
+		const char* dir = realpath(dirs[i], real) != NULL ? real : dirs[i];
+
+		len += (size_t)sprintf(list + len, "%s%s", i == 0 ? "" : ",", dir);
+	}
+
+	free_dir_list(&dirs, &n_dirs);
+
+	return list;
+}
+
+// Check whether a comma-separated list of directories names the same
+// directories as the '-p' list, in the same order - however either was typed.
+
+static bool
+same_dir_list(const char* dir_list)
+{
+	char** dirs = NULL;
+	uint32_t n_dirs = 0;
+	bool same = split_dir_list(dir_list, &dirs, &n_dirs) >= 0
+			&& n_dirs == g_n_pathdirs;
+
+	for (uint32_t i = 0; same && i < n_dirs; i++) {
+		struct stat statbuf;
+		struct stat pathdir_statbuf;
+
+		same = stat(dirs[i], &statbuf) == 0
+				&& stat(g_pathdirs[i], &pathdir_statbuf) == 0
+				&& statbuf.st_dev == pathdir_statbuf.st_dev
+				&& statbuf.st_ino == pathdir_statbuf.st_ino;
+	}
+
+	free_dir_list(&dirs, &n_dirs);
+
+	return same;
+}
+
+// Analyze (and perform?) which operations (backup/restore) can be performed.
+// Note: Compare shares backup's discovery of segments, verify shares
+// restore's discovery of segment files.
+
+static bool
+analyze(void)
+{
+	return g_backup || g_compare ? analyze_backup() : analyze_restore();
+}
+
+// Analyze whether backup operations can be performed (and perform?).
+
+static bool
+analyze_backup(void)
+{
+	as_segment_t* segments;
+	int error;
+
+	memset(&g_plan, 0, sizeof(g_plan));
+
+	// First, see if we can access the backup directories for writing.
+	// Do not create if only analyzing. Compare only reads. A raw container
+	// must already exist.
+
+	if (g_raw && !open_raw()) {
+		return false;
+	}
+
+	if (g_s3 && !open_s3()) {
+		return false;
+	}
+
+	for (uint32_t t = 0; !g_raw && !g_stream && !g_s3 && t < g_n_pathdirs;
+			t++) {
+		const char* pathdir = g_pathdirs[t];
+
+		if (g_compare) {
+			if (!check_dir(pathdir, false, false)) {
+				if (g_verbose) {
+					printf("Cannot read from directory \'%s\'", pathdir);
+					printf(": either it does not exist"
+							" or we don't have read permission.\n");
+				}
+
+				return false;
+			}
+		}
+		else if (!check_dir(pathdir, true, !g_analyze)) {
+			if (g_verbose) {
+				printf("Cannot write to directory \'%s\'", pathdir);
+				if (g_analyze) {
+					printf(": either it does not exist,"
+							" we don't have write permission,"
+							" or we're running with \'-a\'.\n");
+				} else {
+					printf(": either it does not exist"
+							" or we don't have write permission.\n");
+				}
+			}
+
+			return false;
+		}
+	}
+
+	// Compare loads the dictionaries zstd compressed segment files may need.
+
+	if (g_compare && !g_raw && !g_s3 && codec_available(CODEC_ZSTD)) {
+		load_dicts();
+	}
+
+	// Likewise the chunk store (if any).
+
+	if (g_chunk_store != NULL && !check_dir(g_chunk_store, !g_compare,
+			!g_compare && !g_analyze)) {
+		if (g_verbose) {
+			printf("Cannot %s chunk store directory \'%s\'.\n",
+					g_compare ? "read from" : "write to", g_chunk_store);
+		}
+
+		return false;
+	}
+
+	// And the mirror directories (if any).
+
+	for (uint32_t m = 0; m < g_n_mirrors; m++) {
+		if (!check_dir(g_mirrors[m], true, !g_analyze)) {
+			if (g_verbose) {
+				printf("Cannot write to mirror directory \'%s\'.\n",
+						g_mirrors[m]);
+			}
+
+			return false;
+		}
+	}
+
+	// Get the list of segments that passed the instance / namespace filter.
+
+	uint32_t n_segments;
+
+	if (!list_segments(&segments, &n_segments, &error) || n_segments == 0) {
+		// Note: n_segments and error are valid even if list_segments() returned false.
+
+		if (g_verbose) {
+			printf("\nDid not find any suitable Aerospike database segments");
+			print_insts();
+
+			if (g_nsnm != NULL) {
+				printf(", namespace \'%s\'", g_nsnm);
+			}
+
+			if (error != 0) {
+				char errbuff[MAX_BUFFER];
+				char *errout = strerror_r(errno, errbuff, MAX_BUFFER);
+
+				printf(": error was %d: %s", error, errout);
+			}
+
+			printf(".\n");
+		}
+
+		return false;
+	}
+
+	// Against a deadline, the time that's left is shared out by size, over
+	// the namespaces to be backed up.
+
+	if (g_deadline != 0 && !g_analyze) {
+		if (g_deadline_state.start == 0.0) {
+			g_deadline_state.start = plan_now();
+		}
+
+		g_deadline_state.bytes_left = 0;
+
+		for (uint32_t i = 0; i < n_segments; i++) {
+			for (uint32_t j = 0; j < n_segments; j++) {
+				if (segments[j].type == TYPE_BASE
+						&& segments[j].inst == segments[i].inst
+						&& segments[j].nsid == segments[i].nsid) {
+					g_deadline_state.bytes_left += segments[i].segsz;
+					break;
+				}
+			}
+		}
+	}
+
+	// Look for segments that can be backed up:
+	//
+	// Must have one base and treex segment and and one or more primary stage
+	// segments. May have one meta segment and one or more secondary stage
+	// segments. Will handle multiple namespaces if requested and no failures.
+
+	bool candidates = false;
+
+	for (uint32_t i = 0; i < n_segments; i++) {
+		as_segment_t* segment = &segments[i];
+
+		if (segment->type == TYPE_BASE) {
+			candidates = true;
+
+			if (!analyze_backup_candidate(segments, n_segments, i)) {
+				for (uint32_t j = 0; j < n_segments; j++) {
+					as_segment_t* sp = &segments[j];
+
+					if (sp->nsnm != NULL) {
+						free(sp->nsnm);
+						sp->nsnm = NULL;
+					}
+				}
+
+				free(segments);
+				segments = NULL;
+
+				return false;
+			}
+		}
+	}
+
+	if (!candidates) {
+		if (g_verbose) {
+			printf("\nDid not find any %sAerospike database segments",
+					g_precopy ? "" : "unattached ");
+			print_insts();
+
+			if (g_nsnm != NULL) {
+				printf(", namespace \'%s\'", g_nsnm);
+			}
+
+			printf(".\n");
+		}
+	}
+
+	// When analyzing, follow the commands with the plan.
+
+	bool success = true;
+
+	if (g_analyze && g_verbose && candidates && !g_compare) {
+		success = finish_backup_plan();
+	}
+
+	for (uint32_t j = 0; j < n_segments; j++) {
+		as_segment_t* sp = &segments[j];
+
+		if (sp->nsnm != NULL) {
+			free(sp->nsnm);
+			sp->nsnm = NULL;
+		}
+	}
+	free(segments);
+	segments = NULL;
+
+	return success;
+}
+
+// Add a namespace's segments to the dry-run plan.
+
+static void
+plan_backup_segments(as_segment_t* pbp, as_segment_t* ptp,
+		as_segment_t psps[], uint32_t n_psps, as_segment_t* smp,
+		as_segment_t ssps[], uint32_t n_ssps, as_segment_t data[],
+		uint32_t n_data)
+{
+	plan_backup_segment(pbp);
+	plan_backup_segment(ptp);
+
+	for (uint32_t i = 0; i < n_psps; i++) {
+		plan_backup_segment(&psps[i]);
+	}
+
+	if (smp != NULL) {
+		plan_backup_segment(smp);
+	}
+
+	for (uint32_t i = 0; i < n_ssps; i++) {
+		plan_backup_segment(&ssps[i]);
+	}
+
+	for (uint32_t i = 0; i < n_data; i++) {
+		plan_backup_segment(&data[i]);
+	}
+}
+
+// Add a segment to the plan. When compressing - or if a deadline may choose
+// to - sample it, as backup does to choose its codec, to estimate its
+// compressed size and the throughput of compression.
+
+static void
+plan_backup_segment(const as_segment_t* sp)
+{
+	plan_add_bytes(sp->type, sp->segsz);
+
+	as_class class = segment_class(sp->type);
+
+	// Base and meta segment files are never compressed.
+
+	if ((!g_compress && g_deadline == 0) || sp->type == TYPE_BASE
+			|| sp->type == TYPE_META) {
+		g_plan.cmp_bytes[class] += sp->segsz;
+		g_plan.file_bytes += sp->segsz;
+		return;
+	}
+
+	uint8_t* memptr = (uint8_t*)shmat(sp->shmid, NULL, SHM_RDONLY);
+
+	if (memptr == (uint8_t*)-1) {
+		// Can't sample, so assume the worst.
+
+		g_plan.cmp_bytes[class] += sp->segsz;
+		g_plan.file_bytes += sp->segsz;
+		return;
+	}
+
+	as_sample_t samples[N_CODECS];
+
+	sample_segment(memptr, sp->segsz, samples);
+	shmdt(memptr);
+
+	const as_sample_t* sample = &samples[pick_codec(samples)];
+	uint64_t estimate = sample->in_bytes == 0 ? 0 :
+			(uint64_t)((double)sp->segsz * (double)sample->out_bytes /
+					(double)sample->in_bytes);
+
+	// Backup samples the segment just the same, then compresses it with the
+	// codec picked - or doesn't, if it's to be stored.
+
+	double secs = sample->in_bytes == 0 ? 0.0 :
+			(double)sp->segsz * sample->secs / (double)sample->in_bytes;
+
+	for (uint32_t c = 0; c < N_CODECS; c++) {
+		secs += samples[c].secs;
+	}
+
+	g_plan.codec_secs[class] += sample->secs;
+	g_plan.cmp_secs[class] += secs;
+	g_plan.sampled_bytes[class] += sample->in_bytes;
+	g_plan.sampled_out[class] += sample->out_bytes;
+	g_plan.cmp_bytes[class] += estimate;
+	g_plan.file_bytes += g_compress ? estimate : sp->segsz;
+}
+
+// Add a namespace's segment files to the dry-run plan. The largest file is
+// remembered, to measure read throughput with.
+
+static void
+plan_restore_files(as_file_t* pbp, as_file_t* ptp, as_file_t psps[],
+		uint32_t n_psps, as_file_t* smp, as_file_t ssps[], uint32_t n_ssps,
+		as_file_t data[], uint32_t n_data)
+{
+	plan_restore_file(pbp);
+	plan_restore_file(ptp);
+
+	for (uint32_t i = 0; i < n_psps; i++) {
+		plan_restore_file(&psps[i]);
+	}
+
+	if (smp != NULL) {
+		plan_restore_file(smp);
+	}
+
+	for (uint32_t i = 0; i < n_ssps; i++) {
+		plan_restore_file(&ssps[i]);
+	}
+
+	for (uint32_t i = 0; i < n_data; i++) {
+		plan_restore_file(&data[i]);
+	}
+}
+
+static void
+plan_restore_file(const as_file_t* fp)
+{
+	plan_add_bytes(fp->type, fp->segsz);
+
+	g_plan.file_bytes += fp->filsz;
+
+	if (fp->segsz > g_plan.max_segsz) {
+		g_plan.max_segsz = fp->segsz;
+	}
+
+	if (fp->filsz > g_plan.probe.filsz) {
+		g_plan.probe = *fp;
+		g_plan.probe.nsnm = NULL;
+	}
+
+	// Each codec's decompression is timed on its largest file - a chunk
+	// store's chunks are read one at a time, so aren't.
+
+	if (fp->compress && !fp->cas && fp->codec < N_CODECS) {
+		as_file_t* probe = &g_plan.codec_probes[fp->codec];
+
+		g_plan.codec_bytes[fp->codec] += fp->segsz;
+		g_plan.n_cmp_files++;
+
+		if (fp->filsz > probe->filsz) {
+			*probe = *fp;
+			probe->nsnm = NULL;
+		}
+	}
+}
+
+static void
+plan_add_bytes(as_type type, size_t segsz)
+{
+	g_plan.bytes[segment_class(type)] += segsz;
+	g_plan.n_segments++;
+}
+
+// Print the plan for a backup - sizes, whether it fits in each directory and
+// how long it's likely to take. Returns false if it can't fit.
+
+static bool
+finish_backup_plan(void)
+{
+	bool success = true;
+
+	(void)plan_print_sizes();
+
+	uint64_t sampled_bytes = 0;
+	uint64_t sampled_out = 0;
+	double codec_secs = 0.0;
+	double cmp_secs = 0.0;
+
+	for (uint32_t c = 0; c < N_CLASSES; c++) {
+		sampled_bytes += g_plan.sampled_bytes[c];
+		sampled_out += g_plan.sampled_out[c];
+		codec_secs += g_plan.codec_secs[c];
+		cmp_secs += g_plan.cmp_secs[c];
+	}
+
+	if (g_compress) {
+		printf("    backup size      %lu bytes (estimated, %.2f of %lu bytes"
+				" sampled)\n", g_plan.file_bytes, sampled_bytes == 0 ?
+				1.0 : (double)sampled_out / (double)sampled_bytes,
+				sampled_bytes);
+	}
+
+	// Incremental backups write at most this much.
+
+	bool upper_bound = g_base_pathdir != NULL || g_chunk_store != NULL
+			|| g_finalize || g_deadline != 0;
+
+	// Each directory holds its share of a striped backup - and each mirror a
+	// copy of it. The slowest of them sets the pace.
+
+	double write_secs = 0.0;
+	double write_bw = 0.0;
+	bool measured = !g_stream && !g_s3;
+
+	for (uint32_t t = 0; measured && t < g_n_pathdirs + g_n_mirrors; t++) {
+		const char* dir = t < g_n_pathdirs ?
+				g_pathdirs[t] : g_mirrors[t - g_n_pathdirs];
+		uint64_t need = t < g_n_pathdirs ?
+				g_plan.file_bytes / g_n_pathdirs : g_plan.file_bytes;
+		uint64_t space = 0;
+
+		if (g_raw) {
+			space = g_raw_dev.size;
+		}
+		else {
+			struct statvfs vfs;
+
+			if (statvfs(dir, &vfs) == 0) {
+				space = (uint64_t)vfs.f_bavail * vfs.f_frsize;
+			}
+		}
+
+		bool fits = space >= need;
+
+		printf("    space            \'%s\': %lu bytes free, need %s%lu - %s\n",
+				dir, space,
+				upper_bound ? "at most " : "", need,
+				fits ? "ok" : upper_bound ? "may not fit" : "does not fit");
+
+		if (!fits && !upper_bound) {
+			success = false;
+		}
+
+		// Don't scribble on a raw device to time it.
+
+		double bw = g_raw ? 0.0 : plan_write_probe(dir);
+
+		if (bw <= 0.0) {
+			measured = false;
+			break;
+		}
+
+		printf("    write            \'%s\': %.1f MiB/s\n", dir,
+				bw / (1024 * 1024));
+
+		if (t < g_n_pathdirs && (t == 0 || bw * g_n_pathdirs < write_bw)) {
+			write_bw = bw * g_n_pathdirs;
+		}
+
+		if ((double)need / bw > write_secs) {
+			write_secs = (double)need / bw;
+		}
+	}
+
+	double compress_secs = 0.0;
+
+	if ((g_compress || g_deadline != 0) && codec_secs > 0.0) {
+		double bw = (double)sampled_bytes / codec_secs;
+
+		printf("    compression      %.1f MiB/s per thread, %u thread%s\n",
+				bw / (1024 * 1024), g_max_threads,
+				g_max_threads == 1 ? "" : "s");
+
+		if (g_compress) {
+			compress_secs = cmp_secs / g_max_threads;
+		}
+	}
+
+	// Against a deadline, the whole backup is planned as one.
+
+	if (g_deadline != 0) {
+		double predicted;
+
+		g_deadline_state.write_bw = measured ? write_bw : 0.0;
+
+		uint32_t mask = deadline_choose((double)g_deadline, &predicted);
+
+		printf("    deadline         %us: compress ", g_deadline);
+		deadline_print(mask);
+		printf("- %s\n", !measured ? "not measured" :
+				predicted <= (double)g_deadline ? "ok" : "will overrun");
+
+		plan_print_eta(measured, predicted);
+
+		return success;
+	}
+
+	plan_print_eta(measured || g_compress, write_secs > compress_secs ?
+			write_secs : compress_secs);
+
+	return success;
+}
+
+// Print the plan for a restore - sizes, whether shared memory can hold the
+// segments and how long it's likely to take. Returns false if the kernel's
+// limits won't allow the segments to be created.
+
+static bool
+finish_restore_plan(void)
+{
+	bool success = true;
+	uint64_t total = plan_print_sizes();
+	uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+
+	printf("    backup size      %lu bytes\n", g_plan.file_bytes);
+
+	// The largest segment must be allowed, and all of them must fit in what
+	// shared memory is left.
+
+	uint64_t shmmax = plan_read_number("/proc/sys/kernel/shmmax");
+
+	if (shmmax != 0) {
+		bool fits = g_plan.max_segsz <= shmmax;
+
+		printf("    shmmax           %lu bytes, largest segment %lu - %s\n",
+				shmmax, g_plan.max_segsz, fits ? "ok" : "too small");
+
+		success = success && fits;
+	}
+
+	uint64_t shmall = plan_read_number("/proc/sys/kernel/shmall");
+	struct shm_info info;
+
+	if (shmall != 0 && shmctl(0, SHM_INFO, (struct shmid_ds*)&info) >= 0) {
+		uint64_t used = (uint64_t)info.shm_tot * page;
+		uint64_t limit = shmall > UINT64_MAX / page ?
+				UINT64_MAX : shmall * page;
+		uint64_t left = used < limit ? limit - used : 0;
+		bool fits = total <= left;
+
+		printf("    shmall           %lu bytes left, need %lu - %s\n", left,
+				total, fits ? "ok" : "too small");
+
+		success = success && fits;
+	}
+
+	// Memory the segments will occupy - swapped out if it isn't there - plus
+	// the two read ahead buffers of each thread restoring a compressed file.
+
+	uint32_t n_readers = g_plan.n_cmp_files < g_max_threads ?
+			g_plan.n_cmp_files : g_max_threads;
+	uint64_t read_bufs = 2 * (uint64_t)g_read_size * 1048576 * n_readers;
+
+	if (read_bufs != 0) {
+		printf("    read buffers     %lu bytes, %u MiB x 2 x %u thread%s\n",
+				read_bufs, g_read_size, n_readers, n_readers == 1 ? "" : "s");
+	}
+
+	uint64_t available = plan_read_meminfo("MemAvailable:");
+	uint64_t need = total + read_bufs;
+
+	if (available != 0) {
+		printf("    memory           %lu bytes available, need %lu - %s\n",
+				available, need, need <= available ? "ok" : "will swap");
+	}
+
+	// Time reading the largest file, and decompressing the largest file of
+	// each codec - only the segments compressed with it take its time.
+
+	bool probe = !g_stream && !g_s3;
+	double read_bw = probe ? plan_read_probe(&g_plan.probe, NULL) : 0.0;
+	double secs = 0.0;
+
+	if (read_bw > 0.0) {
+		printf("    read             %.1f MiB/s\n", read_bw / (1024 * 1024));
+		secs = (double)g_plan.file_bytes / g_n_pathdirs / read_bw;
+	}
+
+	double decode_secs = 0.0;
+
+	for (uint32_t c = 0; probe && c < N_CODECS; c++) {
+		double decode_bw = 0.0;
+
+		if (g_plan.codec_bytes[c] == 0
+				|| plan_read_probe(&g_plan.codec_probes[c], &decode_bw) <= 0.0
+				|| decode_bw <= 0.0) {
+			continue;
+		}
+
+		printf("    decompression    %s %.1f MiB/s per thread, %u thread%s\n",
+				codec_name((as_codec)c), decode_bw / (1024 * 1024),
+				g_max_threads, g_max_threads == 1 ? "" : "s");
+
+		decode_secs += (double)g_plan.codec_bytes[c]
+				/ (decode_bw * g_max_threads);
+	}
+
+	if (decode_secs > secs) {
+		secs = decode_secs;
+	}
+
+	plan_print_eta(read_bw > 0.0, secs);
+
+	return success;
+}
+
+// Print the sizes in the plan, by type. Returns the total.
+
+static uint64_t
+plan_print_sizes(void)
+{
+	uint64_t total = g_plan.bytes[CLASS_PRI] + g_plan.bytes[CLASS_SEC]
+			+ g_plan.bytes[CLASS_DAT];
+
+	printf("\nPlan:\n");
+	printf("    primary index    %lu bytes\n", g_plan.bytes[CLASS_PRI]);
+	printf("    secondary index  %lu bytes\n", g_plan.bytes[CLASS_SEC]);
+	printf("    data             %lu bytes\n", g_plan.bytes[CLASS_DAT]);
+	printf("    total            %lu bytes in %u segments\n", total,
+			g_plan.n_segments);
+
+	return total;
+}
+
+static void
+plan_print_eta(bool measured, double secs)
+{
+	if (!measured) {
+		printf("    estimated time   not measured\n");
+		return;
+	}
+
+	struct timespec start = { 0, 0 };
+	struct timespec end = {
+		.tv_sec = (time_t)secs,
+		.tv_nsec = (long)((secs - (double)(time_t)secs) * 1e9)
+	};
+
+	char* time_str = strtime_diff_eta(&start, &end, 0);
+
+	printf("    estimated time   %s\n", time_str);
+	free(time_str);
+}
+
+// Time writing (and syncing) PLAN_PROBE bytes to a scratch file in a
+// directory. Returns bytes per second, or 0 if it can't be measured.
+
+static double
+plan_write_probe(const char* dir)
+{
+	char pathname[PATH_MAX + 1];
+
+	snprintf(pathname, sizeof(pathname), "%s/.asmt-probe%s", dir,
+			TEMP_EXTENSION);
+
+	uint8_t* buf = (uint8_t*)malloc(PLAN_PROBE);
+	int fd = buf == NULL ? -1 :
+			open(pathname, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+
+	if (fd < 0) {
+		if (g_verbose) {
+			char errbuff[MAX_BUFFER];
+			char* errout = buf == NULL ? "out of memory" :
+					strerror_r(errno, errbuff, MAX_BUFFER);
+
+			printf("Could not time writing to '%s': %s.\n", dir, errout);
+		}
+
+		free(buf);
+		return 0.0;
+	}
+
+	// Incompressible, in case the file system compresses.
+
+	for (size_t i = 0; i < PLAN_PROBE; i++) {
+		buf[i] = (uint8_t)(rand() >> 7);
+	}
+
+	double start = plan_now();
+	bool success = write(fd, buf, PLAN_PROBE) == PLAN_PROBE
+			&& fdatasync(fd) == 0;
+	double secs = plan_now() - start;
+
+	if (!success && g_verbose) {
+		char errbuff[MAX_BUFFER];
+		char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
+
+		printf("Could not time writing to '%s': %s.\n", dir, errout);
+	}
+
+	close(fd);
+	unlink(pathname);
+	free(buf);
+
+	return success && secs > 0.0 ? (double)PLAN_PROBE / secs : 0.0;
+}
+
+// Time reading (up to) PLAN_PROBE bytes of a segment file, dropped from the
+// page cache first. If asked to, and it's compressed, time decompressing what
+// was read, too - as its header says, a gzip stream or chunks in a codec.
+// Returns bytes per second, or 0 if it can't be measured.
+
+static double
+plan_read_probe(const as_file_t* fp, double* decode_bw)
+{
+	char pathname[PATH_MAX + 1];
+
+	if (fp->filsz == 0) {
+		return 0.0;
+	}
+
+	if (g_raw) {
+		strcpy(pathname, g_pathdir);
+	}
+	else {
+		sprintf(pathname, "%s/%08x%s", g_pathdirs[fp->target], fp->key,
+				fp->pack ? PACK_EXTENSION :
+						file_extension(fp->compress, fp->codec, fp->cas));
+	}
+
+	size_t size = fp->filsz < PLAN_PROBE ? fp->filsz : PLAN_PROBE;
+	uint8_t* buf = (uint8_t*)malloc(size);
+	int fd = buf == NULL ? -1 : open(pathname, O_RDONLY);
+
+	if (fd < 0) {
+		free(buf);
+		return 0.0;
+	}
+
+	off_t offset = (off_t)fp->offset;
+
+	posix_fadvise(fd, offset, (off_t)size, POSIX_FADV_DONTNEED);
+
+	double start = plan_now();
+	ssize_t rc = pread(fd, buf, size, offset);
+	double secs = plan_now() - start;
+
+	close(fd);
+
+	if (rc != (ssize_t)size || secs <= 0.0) {
+		free(buf);
+		return 0.0;
+	}
+
+	// A compressed file starts with its header.
+
+	if (decode_bw != NULL && fp->compress && !fp->cas
+			&& size > sizeof(as_cmp_t)) {
+		*decode_bw = ((const as_cmp_t*)buf)->version == CMPHDR_VER_CHUNKED ?
+				plan_decode_probe(buf, size) :
+				plan_inflate_probe(buf + sizeof(as_cmp_t),
+						size - sizeof(as_cmp_t));
+	}
+
+	free(buf);
+
+	return (double)size / secs;
+}
+
+// Time inflating a gzip'd buffer, possibly cut short. Returns inflated bytes
+// per second, or 0 if it can't be measured.
+
+static double
+plan_inflate_probe(uint8_t* buf, size_t size)
+{
+	uint8_t* out = (uint8_t*)malloc(PLAN_PROBE);
+
+#ifdef USE_ISAL
+	// Built with ISA-L, restore inflates with igzip - so time that.
+
+	struct inflate_state state;
+
+	if (out == NULL) {
+		return 0.0;
+	}
+
+	isal_inflate_init(&state);
+
+	state.crc_flag = ISAL_GZIP;
+	state.next_in = buf;
+	state.avail_in = (uint32_t)size;
+
+	uint64_t inflated = 0;
+	double start = plan_now();
+	int rc;
+
+	do {
+		state.next_out = out;
+		state.avail_out = PLAN_PROBE;
+		rc = isal_inflate(&state);
+		inflated += PLAN_PROBE - state.avail_out;
+	} while (rc == ISAL_DECOMP_OK && state.avail_out == 0
+			&& state.block_state != ISAL_BLOCK_FINISH);
+
+	double secs = plan_now() - start;
+
+	free(out);
+
+	return secs > 0.0 && inflated != 0 ? (double)inflated / secs : 0.0;
+#else
+	z_stream infstream = { .zalloc = Z_NULL, .zfree = Z_NULL,
+			.opaque = Z_NULL };
+
+	if (out == NULL || inflateInit2(&infstream, 15 + 32) != Z_OK) {
+		free(out);
+		return 0.0;
+	}
+
+	infstream.next_in = buf;
+	infstream.avail_in = (uInt)size;
+
+	uint64_t inflated = 0;
+	double start = plan_now();
+	int rc = Z_OK;
+
+	while (rc == Z_OK) {
+		infstream.next_out = out;
+		infstream.avail_out = PLAN_PROBE;
+		rc = inflate(&infstream, Z_NO_FLUSH);
+		inflated += PLAN_PROBE - infstream.avail_out;
+	}
+
+	double secs = plan_now() - start;
+
+	inflateEnd(&infstream);
+	free(out);
+
+	return secs > 0.0 && inflated != 0 ? (double)inflated / secs : 0.0;
+#endif
+}
+
+// Time decompressing the chunks of a chunked compressed file wholly within a
+// buffer read from its start. Returns decompressed bytes per second, or 0 if
+// it can't be measured.
+
+static double
+plan_decode_probe(const uint8_t* buf, size_t size)
+{
+	if (size < CMPHDR_LEN + CMPEXT_LEN) {
+		return 0.0;
+	}
+
+	const as_cmp_t* header = (const as_cmp_t*)buf;
+	as_cmp_ext_t ext;
+
+	memcpy(&ext, buf + CMPHDR_LEN, CMPEXT_LEN);
+
+	if (ext.codec >= N_CODECS || !codec_available((as_codec)ext.codec)
+			|| ext.chunk_sz == 0 || ext.chunk_sz > IOCHUNK) {
+		return 0.0;
+	}
+
+	uint8_t* out = (uint8_t*)malloc(ext.chunk_sz);
+
+	if (out == NULL) {
+		return 0.0;
+	}
+
+	size_t offset = CMPHDR_LEN + CMPEXT_LEN;
+	uint64_t decoded = 0;
+	double start = plan_now();
+
+	while (decoded < header->segsz && offset + sizeof(uint32_t) <= size) {
+		uint32_t len;
+		size_t chunk = header->segsz - decoded < ext.chunk_sz ?
+				header->segsz - decoded : ext.chunk_sz;
+
+		memcpy(&len, buf + offset, sizeof(len));
+		offset += sizeof(len);
+
+		if (len > chunk || offset + len > size) {
+			break;
+		}
+
+		if (len == chunk) {
+			memcpy(out, buf + offset, chunk);
+		}
+		else if (!codec_decompress((as_codec)ext.codec, buf + offset, len,
+				out, chunk)) {
+			break;
+		}
+
+		offset += len;
+		decoded += chunk;
+	}
+
+	double secs = plan_now() - start;
+
+	free(out);
+
+	return secs > 0.0 && decoded != 0 ? (double)decoded / secs : 0.0;
+}
+
+// Read a number from a /proc file. Returns 0 if it can't be read.
+
+static uint64_t
+plan_read_number(const char* pathname)
+{
+	FILE* file = fopen(pathname, "r");
+	unsigned long long value = 0;
+
+	if (file != NULL) {
+		if (fscanf(file, "%llu", &value) != 1) {
+			value = 0;
+		}
+
+		fclose(file);
+	}
+
+	return (uint64_t)value;
+}
+
+// Read a value (in kB) from /proc/meminfo, in bytes. Returns 0 if it can't be
+// read.
+
+static uint64_t
+plan_read_meminfo(const char* name)
+{
+	FILE* file = fopen("/proc/meminfo", "r");
+	char line[MAX_BUFFER];
+	unsigned long long value = 0;
+
+	while (file != NULL && fgets(line, sizeof(line), file) != NULL) {
+		if (strncmp(line, name, strlen(name)) == 0) {
+			value = strtoull(line + strlen(name), NULL, 10) * 1024;
+			break;
+		}
+	}
+
+	if (file != NULL) {
+		fclose(file);
+	}
+
+	return (uint64_t)value;
+}
+
+static double
+plan_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+static as_class
+segment_class(as_type type)
+{
+	switch (type) {
+		case TYPE_BASE:
+		case TYPE_TREEX:
+		case TYPE_PRI_STAGE:
+			return CLASS_PRI;
+		case TYPE_META:
+		case TYPE_SEC_STAGE:
+			return CLASS_SEC;
+		case TYPE_DAT_STAGE:
+		default:
+			return CLASS_DAT;
+	}
+}
+
+// Whether to compress a segment's file. Base and meta segment files are never
+// compressed, nor chunked - they must be readable as they are. Against a
+// deadline, it depends on the segment's class.
+
+static bool
+compress_segment(as_type type)
+{
+	if (type == TYPE_BASE || type == TYPE_META) {
+		return false;
+	}
+
+	return g_deadline != 0 ?
+			g_deadline_state.compress[segment_class(type)] : g_compress;
+}
+
+// Against a deadline, choose which classes of a namespace's segments to
+// compress - writing as little as possible, while still predicted to finish
+// in the namespace's share of the time that's left. Devices are measured once,
+// the codec on samples of each namespace's segments.
+
+static void
+deadline_plan(as_segment_t* pbp, as_segment_t* ptp, as_segment_t psps[],
+		uint32_t n_psps, as_segment_t* smp, as_segment_t ssps[],
+		uint32_t n_ssps, as_segment_t data[], uint32_t n_data)
+{
+	as_deadline_t* dl = &g_deadline_state;
+
+	memset(&g_plan, 0, sizeof(g_plan));
+	plan_backup_segments(pbp, ptp, psps, n_psps, smp, ssps, n_ssps, data,
+			n_data);
+
+	// The slowest directory sets the pace, each taking its share.
+
+	if (!dl->measured) {
+		dl->measured = true;
+		dl->write_bw = 0.0;
+
+		for (uint32_t t = 0; t < g_n_pathdirs; t++) {
+			double bw = plan_write_probe(g_pathdirs[t]) * g_n_pathdirs;
+
+			if (t == 0 || bw < dl->write_bw) {
+				dl->write_bw = bw;
+			}
+		}
+	}
+
+	dl->ns_bytes = g_plan.bytes[CLASS_PRI] + g_plan.bytes[CLASS_SEC]
+			+ g_plan.bytes[CLASS_DAT];
+
+	double left = (double)g_deadline - (plan_now() - dl->start);
+	double budget = dl->bytes_left <= dl->ns_bytes ? left :
+			left * (double)dl->ns_bytes / (double)dl->bytes_left;
+	uint32_t mask = deadline_choose(budget, &dl->predicted);
+
+	for (uint32_t c = 0; c < N_CLASSES; c++) {
+		dl->compress[c] = (mask & (1u << c)) != 0;
+	}
+
+	if (g_verbose) {
+		printf("Deadline for namespace \'%s\': compressing ", pbp->nsnm);
+		deadline_print(mask);
+		printf("- predicted %.1fs of %.1fs left.\n", dl->predicted,
+				budget > 0.0 ? budget : 0.0);
+	}
+
+	dl->ns_start = plan_now();
+}
+
+// After a namespace, correct the predictions by how long it really took, and
+// take its bytes off what's left.
+
+static void
+deadline_replan(void)
+{
+	as_deadline_t* dl = &g_deadline_state;
+	double actual = plan_now() - dl->ns_start;
+
+	if (dl->predicted > 0.0 && actual > 0.0) {
+		dl->scale *= actual / dl->predicted;
+
+		if (dl->scale < 1.0 / DEADLINE_SCALE_BOUND) {
+			dl->scale = 1.0 / DEADLINE_SCALE_BOUND;
+		}
+		else if (dl->scale > DEADLINE_SCALE_BOUND) {
+			dl->scale = DEADLINE_SCALE_BOUND;
+		}
+	}
+
+	dl->bytes_left = dl->bytes_left > dl->ns_bytes ?
+			dl->bytes_left - dl->ns_bytes : 0;
+}
+
+// Try every combination of classes to compress. Returns the one which writes
+// the fewest bytes within the budget - or, if none fits, the fastest.
+
+static uint32_t
+deadline_choose(double budget, double* predicted)
+{
+	uint32_t best = 0;
+	uint64_t best_written = UINT64_MAX;
+	double best_secs = 0.0;
+	bool best_fits = false;
+
+	for (uint32_t mask = 0; mask < (1u << N_CLASSES); mask++) {
+		uint64_t written;
+		double secs = deadline_predict(mask, &written);
+		bool fits = secs <= budget;
+
+		if (mask == 0 || (fits && (!best_fits || written < best_written))
+				|| (!fits && !best_fits && secs < best_secs)) {
+			best = mask;
+			best_written = written;
+			best_secs = secs;
+			best_fits = fits;
+		}
+	}
+
+	*predicted = best_secs;
+
+	return best;
+}
+
+// Print which classes of segments are to be compressed.
+
+static void
+deadline_print(uint32_t mask)
+{
+	static const char* const names[N_CLASSES] = {
+		"primary index", "secondary index", "data"
+	};
+
+	if (mask == 0) {
+		printf("nothing ");
+		return;
+	}
+
+	const char* sep = "";
+
+	for (uint32_t c = 0; c < N_CLASSES; c++) {
+		if ((mask & (1u << c)) != 0) {
+			printf("%s%s", sep, names[c]);
+			sep = ", ";
+		}
+	}
+
+	printf(" ");
+}
+
+// Predict how long a namespace takes to back up, compressing the given classes
+// of segments - the slower of writing and compressing, on all threads.
+
+static double
+deadline_predict(uint32_t mask, uint64_t* written)
+{
+	const as_deadline_t* dl = &g_deadline_state;
+	double compress_secs = 0.0;
+
+	*written = 0;
+
+	for (uint32_t c = 0; c < N_CLASSES; c++) {
+		if ((mask & (1u << c)) == 0 || g_plan.sampled_bytes[c] == 0) {
+			*written += g_plan.bytes[c];
+			continue;
+		}
+
+		*written += g_plan.cmp_bytes[c];
+		compress_secs += g_plan.cmp_secs[c] / g_max_threads;
+	}
+
+	// Unmeasured devices - just write as little as possible.
+
+	double write_secs = dl->write_bw > 0.0 ?
+			(double)*written / dl->write_bw : 0.0;
+
+	return dl->scale * (write_secs > compress_secs ?
+			write_secs : compress_secs);
+}
+
+// Check whether a directory exists and is accessible by us.
+// Note: If create is set, we will try to create the directory.
+// Note: We check permissions based on the write parameter,
+// Note: If we create the directory, we do not unwind after failure.
+
+static bool
+check_dir(const char* pathname, bool is_write, bool create)
+{
+	struct stat statbuf;
+
+	// Does the directory exit?
+
+	if (stat(pathname, &statbuf) != 0) {
+		// If not and we've been asked (create is true), can we create it?
+
+		if (create) {
+			if (mkdir(pathname, DEFAULT_MODE_DIR) != 0) {
+				return false;
+			}
+			if (g_verbose) {
+				printf("\nCreated backup directory \'%s\'.\n", pathname);
+			}
+		}
+		else {
+			return false;
+		}
+
+		// We created it. Try again to get status.
+
+		if (stat(pathname, &statbuf) != 0) {
+			return false;
+		}
+	}
+
+	// Is it a directory? (Will be if we just created it!)
+
+	if (!S_ISDIR(statbuf.st_mode)) {
+		return false;
+	}
+
+	// Can we access it? Standard UNIX rules.
+
+	uint32_t my_uid = getuid();
+	uint32_t my_gid = getgid();
+
+	if (is_write) {
+		if (my_uid == 0 || my_gid == 0
+				|| (statbuf.st_uid == my_uid && (statbuf.st_mode & S_IWUSR))
+				|| (statbuf.st_gid == my_gid && (statbuf.st_mode & S_IWGRP))
+				|| (statbuf.st_mode & S_IWOTH)) {
+			return true;
+		}
+	}
+	else {
+		if (my_uid == 0 || my_gid == 0
+				|| (statbuf.st_uid == my_uid && (statbuf.st_mode & S_IRUSR))
+				|| (statbuf.st_gid == my_gid && (statbuf.st_mode & S_IRGRP))
+				|| (statbuf.st_mode & S_IROTH)) {
+			return true;
+		}
+	}
+
+	// Can't access.
+
+	return false;
+}
+
+// Get information about all Aerospike database segments.
+// Note: *n_segments and *error are valid even if list_segments() returns false.
+
+static bool
+list_segments(as_segment_t** segments, uint32_t* n_segments, int* error)
+{
+	// Start with no segments.
+
+	*n_segments = 0;
+	*error = 0;
+
+	// Get info on all shared memory segments..
+
+	as_shm_t* shms;
+	uint32_t n_shms;
+
+	if (!list_shm(&shms, &n_shms, error)) {
+		return false;
+	}
+
+	*segments = NULL; // Table is initially empty.
+
+	// Try each segment. Some may be Aerospike database segments.
+
+	for (uint32_t ix = 0; ix < n_shms; ix++) {
+		as_segment_t* segment;
+
+		// Get information about segment.
+
+		if (!stat_segment(&shms[ix], &segment, error)) {
+			continue;
+		}
+
+		// Check whether the segment is attached. A pre-copy backs up segments
+		// which are still in use.
+
+		if (segment->natt != 0 && !g_precopy) {
+			if (segment->nsnm != NULL) {
+				free(segment->nsnm);
+				segment->nsnm = NULL;
+			}
+
+			free(segment);
+			segment = NULL;
+			continue;
+		}
+
+		// Check whether the instance is a match (if specified).
+
+		if (!inst_selected(segment->inst)) {
+			if (segment->nsnm != NULL) {
+				free(segment->nsnm);
+				segment->nsnm = NULL;
+			}
+
+			free(segment);
+			segment = NULL;
+			continue;
+		}
+
+		// Check whether the namespace name is a match.
+
+		if (segment->type == TYPE_BASE && g_nsnm != NULL) {
+			if (segment->nsnm == NULL) {
+				free(segment);
+				segment = NULL;
+				continue;
+			}
+			else if (strcmp(segment->nsnm, g_nsnm) != 0) {
+				free(segment->nsnm);
+				segment->nsnm = NULL;
+				free(segment);
+				segment = NULL;
+				continue;
+			}
+		}
+
+		// Found a valid, unattached Aerospike database segment; append it to table.
+
+		(*n_segments)++;
+
+		*segments = realloc(*segments,
+				(uint32_t)*n_segments * sizeof(as_segment_t));
+		assert(*segments != NULL);
+
+		memcpy(*segments + *n_segments - 1, segment, sizeof(as_segment_t));
+
+		free(segment);
+		segment = NULL;
+		// Do not free segment->nsnm: It is still in use!
+	}
+
+	free(shms);
+
+	return true;
+}
+
+// Get the catalog of all shared memory segments in one pass - from
+// /proc/sysvipc/shm if possible, otherwise by probing every shmid with
+// SHM_STAT.
+// Note: *n_shms and *error are valid even if list_shm() returns false.
+
+static bool
+list_shm(as_shm_t** shms, uint32_t* n_shms, int* error)
+{
+	*shms = NULL;
+	*n_shms = 0;
+	*error = 0;
+
+	if (read_proc_shm(shms, n_shms)) {
+		return true;
+	}
+
+	return stat_shm(shms, n_shms, error);
+}
+
+// Read the catalog of shared memory segments from /proc/sysvipc/shm. The
+// columns are found by name in the header line. Returns false if the file
+// can't be read or parsed, in which case the catalog is left empty.
+
+static bool
+read_proc_shm(as_shm_t** shms, uint32_t* n_shms)
+{
+	FILE* file = fopen(PROC_SYSVIPC_SHM, "r");
+
+	if (file == NULL) {
+		return false;
+	}
+
+	// Find the columns we need in the header.
+
+	static const char* const names[] = {
+		"key", "shmid", "perms", "size", "nattch", "uid", "gid", "atime",
+		"ctime"
+	};
+
+	enum { N_COLUMNS = sizeof(names) / sizeof(names[0]) };
+
+	int columns[N_COLUMNS];
+	char line[MAX_BUFFER];
+	bool success = fgets(line, sizeof(line), file) != NULL;
+
+	for (uint32_t c = 0; c < N_COLUMNS; c++) {
+		columns[c] = -1;
+	}
+
+	char* save;
+	int n_fields = 0;
+
+	for (char* field = success ? strtok_r(line, " \t\n", &save) : NULL;
+			field != NULL; field = strtok_r(NULL, " \t\n", &save)) {
+		for (uint32_t c = 0; c < N_COLUMNS; c++) {
+			if (strcmp(field, names[c]) == 0) {
+				columns[c] = n_fields;
+			}
+		}
+
+		n_fields++;
+	}
+
+	for (uint32_t c = 0; c < N_COLUMNS; c++) {
+		if (columns[c] < 0) {
+			success = false;
+		}
+	}
+
+	// One segment per line.
+
+	while (success && fgets(line, sizeof(line), file) != NULL) {
+		char* values[N_COLUMNS] = { NULL };
+		int n = 0;
+
+		for (char* field = strtok_r(line, " \t\n", &save); field != NULL;
+				field = strtok_r(NULL, " \t\n", &save), n++) {
+			for (uint32_t c = 0; c < N_COLUMNS; c++) {
+				if (columns[c] == n) {
+					values[c] = field;
+				}
+			}
+		}
+
+		if (n < n_fields) {
+			success = false;
+			break;
+		}
+
+		as_shm_t shm = {
+			.key = (key_t)strtol(values[0], NULL, 10),
+			.shmid = (int)strtol(values[1], NULL, 10),
+			.mode = (unsigned int)strtoul(values[2], NULL, 8),
+			.segsz = (size_t)strtoull(values[3], NULL, 10),
+			.natt = (shmatt_t)strtoul(values[4], NULL, 10),
+			.uid = (uid_t)strtoul(values[5], NULL, 10),
+			.gid = (gid_t)strtoul(values[6], NULL, 10),
+			.atime = (time_t)strtoll(values[7], NULL, 10),
+			.ctime = (time_t)strtoll(values[8], NULL, 10)
+		};
+
+		add_shm(shms, n_shms, &shm);
+	}
+
+	fclose(file);
+
+	if (!success) {
+		free(*shms);
+		*shms = NULL;
+		*n_shms = 0;
+	}
+
+	return success;
+}
+
+// Build the catalog of shared memory segments by probing each shmid in the
+// kernel's range with SHM_STAT - one system call per slot.
+
+static bool
+stat_shm(as_shm_t** shms, uint32_t* n_shms, int* error)
+{
+	struct shmid_ds dummy; // Dummy, needed by shmctl(3).
+
+	int rc = shmctl(0, SHM_INFO, &dummy);
+
+	if (rc < 0) {
+		*error = errno;
+		return false;
+	}
+
+	int max_shmid = rc; // Range of shmids: (0..max_shmid) (inclusive).
+
+	// Try each shmid in the range. Some may correspond to segments.
+
+	for (int ix = 0; ix <= max_shmid; ix++) {
+		struct shmid_ds ds;
+
+		rc = shmctl(ix, SHM_STAT, &ds);
+
+		if (rc == -1) {
+			continue;
+		}
+
+		as_shm_t shm = {
+			.key = ds.shm_perm.__key,
+			.shmid = rc,
+			.uid = ds.shm_perm.uid,
+			.gid = ds.shm_perm.gid,
+			.mode = ds.shm_perm.mode,
+			.natt = ds.shm_nattch,
+			.segsz = ds.shm_segsz,
+			.atime = ds.shm_atime,
+			.ctime = ds.shm_ctime
+		};
+
+		add_shm(shms, n_shms, &shm);
+	}
+
+	return true;
+}
+
+// Append a segment to the catalog, growing it in powers of two.
+
+static void
+add_shm(as_shm_t** shms, uint32_t* n_shms, const as_shm_t* shm)
+{
+	if ((*n_shms & (*n_shms - 1)) == 0) {
+		uint32_t capacity = *n_shms == 0 ? 16 : *n_shms * 2;
+
+		*shms = realloc(*shms, capacity * sizeof(as_shm_t));
+		assert(*shms != NULL);
+	}
+
+	(*shms)[(*n_shms)++] = *shm;
+}
+
+// Get information about a single shared memory segment from the catalog.
+// Validates whether a segment is an Aerospike database segment.
+
+static bool
+stat_segment(const as_shm_t* shm, as_segment_t** segment, int* error)
+{
+	// Extract key from the catalog entry.
+
+	key_t key = shm->key;
+
+	// Check if this is an Aerospike primary, secondary, or data key.
+
+	bool primary = false;
+	bool secondary = false;
+
+	switch(key & AS_XMEM_KEY_TYPE_MASK) {
+		case AS_XMEM_PRI_KEY:
+			primary = true;
+			break;
+		case AS_XMEM_SEC_KEY:
+			secondary = true;
+			break;
+		case AS_XMEM_DAT_KEY:
+			break;
+		default:
+			*error = EINVAL;
+			return false;
+			break;
+	}
+
+	// Found a valid Aerospike database segment; create segment entry.
+
+	*segment = malloc(sizeof(as_segment_t));
+	assert(*segment != NULL);
+
+	as_segment_t* sp = *segment;
+
+	// Populate segment info.
+
+	sp->key = key;
+	sp->shmid = shm->shmid;
+	sp->uid = shm->uid;
+	sp->gid = shm->gid;
+	sp->mode = shm->mode;
+	sp->natt = shm->natt;
+	sp->segsz = shm->segsz;
+
+	// Note when the segment was last attached or changed, as the catalog had
+	// it before attaching it below - a resumed backup checks that it wasn't
+	// since the interrupted one.
+
+	sp->atime = shm->atime;
+	sp->ctime = shm->ctime;
+
+	// Extract the key base from the key.
+
+	key = key & ~AS_XMEM_KEY_TYPE_MASK;
+
+	// Determine instance from key base.
+
+	sp->inst = (uint32_t)key >> AS_XMEM_INSTANCE_KEY_SHIFT;
+
+	if (sp->inst > MAX_INST) {
+		// Note: instance can be zero.
+		free(*segment);
+		*segment = NULL;
+		*error = ENOENT;
+		return false;
+	}
+
+	// Determine namespace ID from key base.
+
+	key = key & ~(0xf << AS_XMEM_INSTANCE_KEY_SHIFT);
+
+	sp->nsid = (uint32_t)(key & (0xff << AS_XMEM_NS_KEY_SHIFT))
+			>> AS_XMEM_NS_KEY_SHIFT;
+
+	if (sp->nsid < MIN_NSID || sp->nsid > MAX_NSID) {
+		free(*segment);
+		*segment = NULL;
+		*error = ENOENT;
+		return false;
+	}
+
+	// Extract segment type from key base.
+
+	key = key & ~(0xff << AS_XMEM_NS_KEY_SHIFT);
+
+	if (key >= AS_XMEM_ARENA_KEY) {
+		if (primary) {
+			sp->type = TYPE_PRI_STAGE;
+		}
+		else if (secondary) {
+			sp->type = TYPE_SEC_STAGE;
+		}
+		else {
+			sp->type = TYPE_DAT_STAGE;
+		}
+	}
+	else if (key == AS_XMEM_TREEX_KEY) {
+		if (primary) {
+			sp->type = TYPE_TREEX;
+		}
+		else if (!secondary) {
+			sp->type = TYPE_DAT_STAGE;
+		}
+	}
+	else {
+		if (primary) {
+			sp->type = TYPE_BASE ;
+		}
+		else if (secondary) {
+			sp->type = TYPE_META ;
+		}
+		else {
+			sp->type = TYPE_DAT_STAGE;
+		}
+	}
+
+	// Extract stage number from key.
+
+	if (sp->type == TYPE_PRI_STAGE ||
+		sp->type == TYPE_SEC_STAGE) {
+		if ((uint32_t)key < MIN_ARENA || (uint32_t)key > MAX_ARENA) {
+			free(*segment);
+			*segment = NULL;
+			*error = ENOENT;
+			return false;
+		}
+
+		sp->stage = (uint32_t)key;
+	}
+	else if (sp->type == TYPE_DAT_STAGE) {
+		sp->stage = (uint32_t)key;
+	}
+	else {
+		sp->stage = 0;
+	}
+
+	// Get namespace from base segment.
+
+	if (sp->type == TYPE_BASE) {
+		void* memptr = shmat(sp->shmid, NULL, SHM_RDONLY);
+
+		if (memptr == (void*)-1) {
+			*error = errno;
+			free(*segment);
+			*segment = NULL;
+			return false;
+		}
+
+		char nsnm[NAMESPACE_LEN + 1];
+
+		memcpy(nsnm, memptr + NAMESPACE_OFF, NAMESPACE_LEN);
+		nsnm[NAMESPACE_LEN] = '\0';
+		shmdt(memptr);
+		sp->nsnm = strdup(nsnm);
+	}
+	else {
+		sp->nsnm = NULL;
+	}
+
+	// If g_crc32 option is selected, compute crc32.
+
+	if (g_crc32) {
+		void* memptr = shmat(sp->shmid, NULL, SHM_RDONLY);
+
+		if (memptr == (void*)-1) {
+			*error = errno;
+
+			if (sp->nsnm != NULL) {
+				free(sp->nsnm);
+			
+			sp->nsnm = NULL;
+			}
+
+			free(*segment);
+			*segment = NULL;
+			return false;
+		}
+
+		sp->crc32 = crc32(g_crc32_init, memptr, (uInt)sp->segsz);
+		shmdt(memptr);
+	}
+	else {
+		sp->crc32 = g_crc32_init;
+	}
+
+	*error = 0;
+	return true;
+}
+
+// Determine whether a candidate base segment can be backed up.
+
+static bool
+analyze_backup_candidate(as_segment_t* segments, uint32_t n_segments,
+		uint32_t base_ix)
+{
+	// Shortcut for primary base segment.
+
+	as_segment_t* pbp = &segments[base_ix];
+
+	assert(pbp->type == TYPE_BASE);
+	assert(pbp->nsnm != NULL);
+
+	// Shortcuts for instance and namespace values.
+
+	uint32_t inst = pbp->inst;
+	uint32_t nsid = pbp->nsid;
+	char* nsnm = pbp->nsnm;
+
+	// Find the primary treex segment.
+
+	as_segment_t* ptp = NULL;
+	uint32_t n_ptps = 0;
+
+	for (uint32_t ix = 0; ix < n_segments; ix++) {
+		as_segment_t* sp = &segments[ix];
+
+		if (sp->type == TYPE_TREEX && sp->nsid == nsid && sp->inst == inst) {
+			ptp = sp;
+			ptp->nsnm = strdup(nsnm);
+			n_ptps++;
+		}
+	}
+
+	if (n_ptps != 1) {
+		if (g_verbose) {
+			printf("Missing treex segment for instance %u"
+					", namespace \'%s\' (nsid %d).\n", inst, nsnm, nsid);
+		}
+
+		// TODO: if (n_ptps > 1) will leak ptp->nsnm.
+
+		return false;
+	}
+
+	// Find the primary stage segments.
+
+	as_segment_t psps[MAX_PRI_STAGES] = { 0 };
+	uint32_t n_psps = 0;
+
+	for (uint32_t ix = 0; ix < n_segments; ix++) {
+		as_segment_t* sp = &segments[ix];
+
+		if (sp->type == TYPE_PRI_STAGE && sp->nsid == nsid
+				&& sp->inst == inst) {
+			psps[n_psps] = *sp;
+			psps[n_psps].nsnm = strdup(nsnm);
+			n_psps++;
+		}
+	}
+
+	if (n_psps < 1) {
+		if (g_verbose) {
+			printf("Missing primary stage segment(s) for instance %u"
+					", namespace \'%s\' (nsid %d).\n", inst, nsnm, nsid);
+		}
+
+		if (ptp != NULL && ptp->nsnm != NULL) {
+			free(ptp->nsnm);
+			ptp->nsnm = NULL;
+		}
+
+		return false;
+	}
+
+	// Sort the primary stage segments by key.
+
+	if (n_psps > 1) {
+		qsort((void*)psps, (size_t)n_psps, sizeof(as_segment_t),
+				qsort_compare_segments);
+	}
+
+	// Check that all primary stages are present.
+
+	for (uint32_t ix = 0; ix < n_psps; ix++) {
+		bool found = false;
+
+		for (uint32_t jx = 0; jx < n_psps; jx++) {
+			as_segment_t* jp = &psps[jx];
+
+			if (jp->stage == ix + (uint32_t)AS_XMEM_ARENA_KEY) {
+				found = true;
+				break;
+			}
+		}
+
+		if (!found) {
+			if (g_verbose) {
+				printf("Missing primary stage segment %03x for instance %u"
+						", namespace \'%s\' (nsid %d).\n",
+						ix + (uint32_t)AS_XMEM_ARENA_KEY, inst, nsnm, nsid);
+			}
+
+			if (ptp != NULL && ptp->nsnm != NULL) {
+				free(ptp->nsnm);
+				ptp->nsnm = NULL;
+			}
+
+			for (uint32_t jx = 0; jx < n_psps; jx++) {
+				if (psps[jx].nsnm != NULL) {
+					free(psps[jx].nsnm);
+					psps[jx].nsnm = NULL;
+				}
+			}
+
+			return false;
+		}
+	}
+
+	// Find the meta segment (if any).
+
+	as_segment_t* smp = NULL;
+	uint32_t n_smps = 0;
+
+	for (uint32_t ix = 0; ix < n_segments; ix++) {
+		as_segment_t* sp = &segments[ix];
+
+		if (sp->type == TYPE_META && sp->nsid == nsid && sp->inst == inst) {
+			smp = sp;
+			smp->nsnm = strdup(nsnm);
+			n_smps++;
+		}
+	}
+
+	if (n_smps > 1) {
+		if (g_verbose) {
+			printf("Too many meta segments for instance %u"
+					", namespace \'%s\' (nsid %d).\n", inst, nsnm, nsid);
+		}
+
+		if (ptp != NULL && ptp->nsnm != NULL) {
+			free(ptp->nsnm);
+			ptp->nsnm = NULL;
+		}
+
+		for (uint32_t jx= 0; jx < n_psps; jx++) {
+			if (psps[jx].nsnm != NULL) {
+				free(psps[jx].nsnm);
+				psps[jx].nsnm = NULL;
+			}
+		}
+
+		// TODO: If (n_smps > 1) will leak smp->nsnm.
+
+		return false;
+	}
+
+	as_segment_t ssps[MAX_SEC_STAGES] = { 0 };
+	uint32_t n_ssps = 0;
+
+	// Found a meta segment?
+
+	if (n_smps == 1) {
+
+		// Find the secondary stage segments.
+
+		for (uint32_t ix = 0; ix < n_segments; ix++) {
+			as_segment_t* sp = &segments[ix];
+
+			if (sp->type == TYPE_SEC_STAGE && sp->nsid == nsid
+					&& sp->inst == inst) {
+
+				ssps[n_ssps] = *sp;
+				ssps[n_ssps].nsnm = strdup(nsnm);
+				n_ssps++;
+			}
+		}
+
+		if (n_ssps < 1) {
+			if (g_verbose) {
+				printf("No secondary stage segments for instance %u"
+						", namespace \'%s\' (nsid %d).\n", inst, nsnm, nsid);
+			}
+
+			if (ptp != NULL && ptp->nsnm != NULL) {
+				free(ptp->nsnm);
+				ptp->nsnm = NULL;
+			}
+
+			for (uint32_t jx= 0; jx < n_psps; jx++) {
+				if (psps[jx].nsnm != NULL) {
+					free(psps[jx].nsnm);
+					psps[jx].nsnm = NULL;
+				}
+			}
+
+			if (n_ssps > 0) {
+				if (smp != NULL && smp->nsnm != NULL) {
+					free(smp->nsnm);
+					smp->nsnm = NULL;
+				}
+			}
+
+
+					return false;
+		}
+
+		// Sort the secondary stage segments by key.
+
+		if (n_ssps > 1) {
+			qsort((void*)ssps, (size_t)n_ssps, sizeof(as_segment_t),
+					qsort_compare_segments);
+		}
+
+		// Check that all secondary stages are present.
+
+		for (uint32_t ix = 0; ix < n_ssps; ix++) {
+			bool found = false;
+
+			for (uint32_t jx = 0; jx < n_ssps; jx++) {
+				as_segment_t* jp = &ssps[jx];
+
+				if (jp->stage == ix + (uint32_t)AS_XMEM_ARENA_KEY) {
+					found = true;
+				}
+			}
+
+			if (!found) {
+				if (g_verbose) {
+					printf(
+							"Missing secondary stage segment %03x for instance %u"
+									", namespace \'%s\' (nsid %d).\n",
+							ix + (uint32_t)AS_XMEM_ARENA_KEY, inst, nsnm,
+							nsid);
+				}
+
+				if (ptp != NULL && ptp->nsnm != NULL) {
+					free(ptp->nsnm);
+					ptp->nsnm = NULL;
+				}
+
+				for (uint32_t jx= 0; jx < n_psps; jx++) {
+					if (psps[jx].nsnm != NULL) {
+						free(psps[jx].nsnm);
+						psps[jx].nsnm = NULL;
+					}
+				}
+
+				if (smp != NULL && smp->nsnm != NULL) {
+					free(smp->nsnm);
+					smp->nsnm = NULL;
+				}
+
+				for (uint32_t jx= 0; jx < n_ssps; jx++) {
+					if (ssps[jx].nsnm != NULL) {
+						free(ssps[jx].nsnm);
+						ssps[jx].nsnm = NULL;
+					}
+				}
+
+				return false;
+			}
+		}
+	}
+
+	// Find the data segments, if any.
+
+	as_segment_t data[MAX_DATA_STAGES] = { 0 };
+	uint32_t n_data = 0;
+
+	for (uint32_t ix = 0; ix < n_segments; ix++) {
+		as_segment_t* sp = &segments[ix];
+
+		if (sp->type == TYPE_DAT_STAGE && sp->nsid == nsid
+				&& sp->inst == inst) {
+			data[n_data] = *sp;
+			data[n_data].nsnm = strdup(nsnm);
+			n_data++;
+		}
+	}
+
+	// Sort the data segments (if any).
+
+	if (n_data > 1) {
+		qsort((void*)data, (size_t)n_data, sizeof(as_segment_t),
+				qsort_compare_segments);
+	}
+
+	// If verbose, display a list of segments to be backed up.
+
+	if (g_verbose) {
+		printf("\n");
+		display_segments(pbp, ptp, psps, n_psps, smp, ssps, n_ssps, data, n_data);
+		printf("\n");
+	}
+
+	// Sanity-check backup candidate,
+
+	if (!analyze_backup_sanity(pbp, ptp, psps, n_psps, smp, ssps, n_ssps, data, n_data)) {
+		if (g_verbose) {
+			printf("Failed %s sanity check for instance %u"
+					", namespace \'%s\' (nsid %d).\n",
+					g_compare ? "compare" : "backup", inst, nsnm, nsid);
+		}
+
+		if (ptp != NULL && ptp->nsnm != NULL) {
+			free(ptp->nsnm);
+			ptp->nsnm = NULL;
+		}
+
+		for (uint32_t jx= 0; jx < n_psps; jx++) {\
+			if (psps[jx].nsnm != NULL) {
+				free(psps[jx].nsnm);
+				psps[jx].nsnm = NULL;
+			}
+		}
+
+		if (smp != NULL && smp->nsnm != NULL) {
+			free(smp->nsnm);
+			smp->nsnm = NULL;
+		}
+
+		for (uint32_t jx= 0; jx < n_ssps; jx++) {
+			if (ssps[jx].nsnm != NULL) {
+				free(ssps[jx].nsnm);
+				ssps[jx].nsnm = NULL;
+			}
+		}
+
+		for (uint32_t jx = 0; jx < n_data; jx++) {
+			if (data[jx].nsnm != NULL) {
+				free(data[jx].nsnm);
+				data[jx].nsnm = NULL;
+			}
+		}
+
+		return false;
+	}
+
+	// Determine whether to merely analyze or actually backup.
+
+	if (g_analyze) {
+		if (g_verbose && !g_compare) {
+			plan_backup_segments(pbp, ptp, psps, n_psps, smp, ssps, n_ssps,
+					data, n_data);
+		}
+
+		if (g_verbose) {
+			// Print command to backup (or compare) these segments.
+
+			printf("%s %s", g_progname, g_compare ? "-C" : "-b");
+			printf(" -i %u", inst);
+			printf(" -n %s", nsnm);
+			if (g_send_addr != NULL) {
+				printf(" --send %s", g_send_addr);
+			}
+			else {
+				printf(" -p %s", g_pathdir_list);
+			}
+			if (g_s3_endpoint != NULL) {
+				printf(" --endpoint %s", g_s3_endpoint);
+			}
+			if (g_compress && !g_compare) {
+				printf(" -z");
+			}
+			if (g_deadline != 0) {
+				printf(" --deadline %u", g_deadline);
+			}
+			if (g_crc32) {
+				printf(" -c");
+			}
+			if (g_base_pathdir != NULL) {
+				printf(" --base %s", g_base_pathdir);
+			}
+			else if (g_digest) {
+				printf(" --digest");
+			}
+			if (g_chunk_store != NULL) {
+				printf(" --chunk-store %s", g_chunk_store);
+			}
+			if (g_precopy) {
+				printf(" --precopy");
+			}
+			if (g_finalize) {
+				printf(" --finalize");
+			}
+			if (g_resume) {
+				printf(" --resume");
+			}
+			if (g_mirror_list != NULL) {
+				printf(" --mirror %s", g_mirror_list);
+			}
+			if (g_raw) {
+				printf(" --raw");
+				if (g_force) {
+					printf(" --force");
+				}
+			}
+			else if (g_pack) {
+				printf(" --pack");
+			}
+			printf("\n");
+		}
+
+		if (ptp->nsnm != NULL) {
+			free(ptp->nsnm);
+			ptp->nsnm = NULL;
+		}
+
+		for (uint32_t jx= 0; jx < n_psps; jx++) {
+			if (psps[jx].nsnm != NULL) {
+				free(psps[jx].nsnm);
+				psps[jx].nsnm = NULL;
+			}
+		}
+
+		if (smp != NULL && smp->nsnm != NULL) {
+			free(smp->nsnm);
+			smp->nsnm = NULL;
+		}
+
+		for (uint32_t jx= 0; jx < n_ssps; jx++) {
+			if (ssps[jx].nsnm != NULL) {
+				free(ssps[jx].nsnm);
+				ssps[jx].nsnm = NULL;
+			}
+		}
+
+		for (uint32_t jx = 0; jx < n_data; jx++) {
+			if (data[jx].nsnm != NULL) {
+				free(data[jx].nsnm);
+				data[jx].nsnm = NULL;
+			}
+		}
+
+		return true;
+	}
+
+	// Actually perform backup (or compare)...
+
+	if (g_deadline != 0) {
+		deadline_plan(pbp, ptp, psps, n_psps, smp, ssps, n_ssps, data, n_data);
+	}
+
+	bool success = g_compare ?
+			compare_candidate(pbp, ptp, psps, n_psps, smp, ssps, n_ssps,
+					data, n_data) :
+			backup_candidate(pbp, ptp, psps, n_psps, smp, ssps, n_ssps,
+					data, n_data);
+
+	if (g_deadline != 0) {
+		deadline_replan();
+	}
+
+	if (ptp != NULL && ptp->nsnm != NULL) {
+		free(ptp->nsnm);
+		ptp->nsnm = NULL;
+	}
+
+	for (uint32_t jx = 0; jx < n_psps; jx++) {
+		if (psps[jx].nsnm != NULL) {
+			free(psps[jx].nsnm);
+			psps[jx].nsnm = NULL;
+		}
+	}
+
+	if (n_ssps > 0) {
+		if (smp != NULL && smp->nsnm != NULL) {
+			free(smp->nsnm);
+			smp->nsnm = NULL;
+		}
+
+		for (uint32_t jx = 0; jx < n_ssps; jx++) {
+			if (ssps[jx].nsnm != NULL) {
+				free(ssps[jx].nsnm);
+				ssps[jx].nsnm = NULL;
+			}
+		}
+	}
+
+	if (n_data > 0) {
+		for (uint32_t jx = 0; jx < n_data; jx++) {
+			if (data[jx].nsnm != NULL) {
+				free(data[jx].nsnm);
+				data[jx].nsnm = NULL;
+			}
+		}
+	}
+
+	return success;
+}
+
+// qsort(3) comparison routine for shared memory segments.
+
+static int
+qsort_compare_segments(const void* left, const void* right)
+{
+	return (int)((uint32_t)((as_segment_t*)left)->key
+			- (uint32_t)((as_segment_t*)right)->key);
+}
+
+// Display a table of all segments to be backed up.
+
+static void
+display_segments(as_segment_t* pbp, as_segment_t* ptp,
+		as_segment_t psps[], uint32_t n_psps, as_segment_t* smp,
+		as_segment_t ssps[], uint32_t n_ssps,
+		as_segment_t data[], uint32_t n_data)
+{
+	(void)data;
+
+	uint32_t n_rows = 1 + 2 + n_psps + (n_ssps > 0 ? (1 + n_ssps) : 0) + n_data;
+	char* table[n_rows][g_crc32 ? 13 : 12];
+
+	// Fill in table header.
+
+	table[0][0] = strdup("key");
+	table[0][1] = strdup("shmid");
+	table[0][2] = strdup("user");
+	table[0][3] = strdup("group");
+	table[0][4] = strdup("mode");
+	table[0][5] = strdup("natt");
+	table[0][6] = strdup("segsz");
+	table[0][7] = strdup("inst");
+	table[0][8] = strdup("nsid");
+	table[0][9] = strdup("name");
+	table[0][10] = strdup("type");
+	table[0][11] = strdup("stage");
+	if (g_crc32) {
+		table[0][12] = strdup("crc32");
+	}
+
+	char buffer[MAX_BUFFER];
+
+	// Fill in table body.
+
+	for (uint32_t i = 1; i < n_rows; i++) {
+		as_segment_t* segment;
+
+		if (i == 1) {
+			segment = pbp;
+		}
+		else if (i == 2) {
+			segment = ptp;
+		}
+		else if (i == 3 && smp != NULL) {
+			segment = smp;
+		}
+		else if (i <= 3 + n_psps - (uint32_t)(smp == NULL)) {
+			segment = &psps[i - (4 - (uint32_t)(smp == NULL))];
+		}
+		else if (i <= 3 + n_psps + n_ssps - (uint32_t)(smp == NULL)) {
+			segment = &ssps[i - (4 + n_psps - (uint32_t)(smp == NULL))];
+		}
+		else {
+			segment = &data[i - (4 + n_psps + n_ssps - (uint32_t)(smp == NULL))];
+		}
+
+		sprintf(buffer, "0x%08x", segment->key);
+		table[i][0] = strdup(buffer);
+
+		sprintf(buffer, "%d", segment->shmid);
+		table[i][1] = strdup(buffer);
+
+		struct passwd* pw;
+
+		if ((pw = getpwuid(segment->uid)) == NULL) {
+			sprintf(buffer, "%d", segment->uid);
+		}
+		else {
+			sprintf(buffer, "%s", pw->pw_name);
+		}
+		table[i][2] = strdup(buffer);
+
+		struct group* gr;
+
+		if ((gr = getgrgid(segment->gid)) == NULL) {
+			sprintf(buffer, "%d", segment->gid);
+		}
+		else {
+			sprintf(buffer, "%s", gr->gr_name);
+		}
+		table[i][3] = strdup(buffer);
+
+		sprintf(buffer, "0%o", segment->mode);
+		table[i][4] = strdup(buffer);
+
+		// If segment is attached, print special notation.
+
+		if (segment->natt == 0) {
+			sprintf(buffer, "%lu", segment->natt);
+		}
+		else {
+			sprintf(buffer, "%lu*", segment->natt);
+		}
+		table[i][5] = strdup(buffer);
+
+		sprintf(buffer, "%lu", segment->segsz);
+		table[i][6] = strdup(buffer);
+
+		sprintf(buffer, "%u", segment->inst);
+		table[i][7] = strdup(buffer);
+
+		sprintf(buffer, "%u", segment->nsid);
+		table[i][8] = strdup(buffer);
+
+		sprintf(buffer, "%s", segment->nsnm == NULL ? "-" : segment->nsnm);
+
+		table[i][9] = strdup(buffer);
+
+		switch (segment->type) {
+		case TYPE_BASE:
+			sprintf(buffer, "pi-base");
+			break;
+		case TYPE_TREEX:
+			sprintf(buffer, "pi-treex");
+			break;
+		case TYPE_META:
+			sprintf(buffer, "si-meta");
+			break;
+		case TYPE_PRI_STAGE:
+			sprintf(buffer, "pi-stage");
+			break;
+		case TYPE_SEC_STAGE:
+			sprintf(buffer, "si-stage");
+			break;
+		case TYPE_DAT_STAGE:
+			sprintf(buffer, "data-stage");
+			break;
+		default:
+			printf("unknown segment type is %d.\n", segment->type);
+			assert(false);
+		}
+		table[i][10] = strdup(buffer);
+
+		if (segment->type == TYPE_PRI_STAGE
+				|| segment->type == TYPE_SEC_STAGE
+				|| segment->type == TYPE_DAT_STAGE) {
+			sprintf(buffer, "0x%03x", segment->stage);
+		}
+		else {
+			sprintf(buffer, "-");
+		}
+		table[i][11] = strdup(buffer);
+
+		if (g_crc32) {
+			sprintf(buffer, "0x%08lx", segment->crc32);
+			table[i][12] = strdup(buffer);
+		}
+	}
+
+	// Draw the table. Frees all allocated elements.
+
+	draw_table(&table[0][0], n_rows, g_crc32 ? 13 : 12);
+}
+
+// Perform a final sanity check on this backup candidate.
+
+static bool
+analyze_backup_sanity(as_segment_t* pbp, as_segment_t* ptp,
+		as_segment_t psps[], uint32_t n_psps, as_segment_t* smp,
+		as_segment_t ssps[], uint32_t n_ssps,
+		as_segment_t data[], uint32_t n_data)
+{
+	(void)ptp;
+	(void)psps;
+	(void)ssps;
+	(void)data;
+	(void)n_data;
+
+	// Extract primary stage count from the base segment.
+
+	if (pbp->segsz < N_ARENAS_PRI_OFF + N_ARENAS_LEN) {
+		if (g_verbose) {
+			printf("Base segment %08x is too small.\n", pbp->key);
+		}
+
+		return false;
+	}
+
+	void* memptr = shmat(pbp->shmid, NULL, SHM_RDONLY);
+
+	if (memptr == (void*)-1) {
+		if (g_verbose) {
+			printf("Could not access base segment %08x.\n", pbp->key);
+		}
+
+		return false;
+	}
+
+	// Check the base segment version number.
+
+	uint32_t base_ver = *(uint32_t*)(memptr + BASEVER_OFF);
+
+	if (base_ver < BASEVER_MIN || base_ver > BASEVER_MAX) {
+		if (g_verbose) {
+			printf("Invalid version number in base segment %08x:"
+					" expecting version in range %u to %u"
+					", found version %u.\n", pbp->key, BASEVER_MIN, BASEVER_MAX,
+					base_ver);
+		}
+
+		return false;
+	}
+
+	// Check the base segment shutdown status. Segments being pre-copied are
+	// still in use, so won't have been shut down yet.
+
+	uint32_t base_shut = *(uint32_t*)(memptr + BASESHUT_OFF);
+
+	if (base_shut != 1 && !g_precopy) {
+		if (g_verbose) {
+			printf("Shutdown status in base segment %08x:"
+					" expecting status 1"
+					", found status %u.\n", pbp->key, base_shut);
+		}
+
+		return false;
+	}
+
+	// Actually read the number of stages from the base segment.
+
+	uint32_t n_pri_arenas = *(uint32_t*)(memptr + N_ARENAS_PRI_OFF);
+
+	shmdt(memptr);
+
+	// Check that we have the full complement of primary stages to back up.
+
+	if (n_pri_arenas != n_psps) {
+		if (g_verbose) {
+			printf("Wrong number of primary arena stages"
+					": expecting %u, found %u.\n", n_pri_arenas, n_psps);
+		}
+
+		return false;
+	}
+
+	// Check sanity of the meta segment (if any).
+
+	if (n_ssps > 0) {
+
+		// Check the size of the meta segment.
+
+		if (smp->segsz < N_ARENAS_SEC_OFF + N_ARENAS_LEN) {
+			if (g_verbose) {
+				printf("Meta segment %08x is too small.\n", smp->key);
+			}
+
+			return false;
+		}
+
+		memptr = shmat(smp->shmid, NULL, SHM_RDONLY);
+
+		if (memptr == (void*)-1) {
+			if (g_verbose) {
+				printf("Could not access meta segment %08x.\n", smp->key);
+			}
+
+			return false;
+		}
+
+		// Actually read the number of stages from the base segment.
+
+		uint32_t n_sec_arenas = *(uint32_t*)(memptr + N_ARENAS_SEC_OFF);
+
+		shmdt(memptr);
+
+		// Check that we have the full complement of secondary stages to back up.
+
+		if (n_sec_arenas != n_ssps) {
+			if (g_verbose) {
+				printf("Wrong number of secondary arena stages"
+						": expecting %u, found %u.\n", n_sec_arenas, n_ssps);
+			}
+
+			return false;
+		}
+	}
+
+	// Compare needs the files which backup would refuse to overwrite.
+
+	if (g_compare) {
+		return true;
+	}
+
+	// Finalize needs the files of a complete pre-copy. The base segment's
+	// pre-copy state is written last, so its presence means the pre-copy
+	// completed.
+
+	if (g_finalize) {
+		char pathname[PATH_MAX + 1];
+
+		sprintf(pathname, "%s/%08x%s", g_pathdir, pbp->key, PRECOPY_EXTENSION);
+
+		if (access(pathname, F_OK) < 0) {
+			if (g_verbose) {
+				printf("Found no complete pre-copy of instance %u"
+						", namespace \'%s\' (nsid %u) in \'%s\'.\n", pbp->inst,
+						pbp->nsnm, pbp->nsid, g_pathdir);
+			}
+
+			return false;
+		}
+
+		return true;
+	}
+
+	// A resumed backup carries on with the files it left behind.
+
+	if (g_resume && have_journal(pbp->key)) {
+		return true;
+	}
+
+	// A stream has no files to find. An object store's objects are listed.
+
+	if (g_stream) {
+		return true;
+	}
+
+	if (g_s3) {
+		return !find_s3_objects(pbp);
+	}
+
+	// Check that the destinations (mirrors included) have no files for this
+	// namespace and instance.
+
+	bool found = false;
+
+	for (uint32_t t = 0; t < g_n_pathdirs + g_n_mirrors; t++) {
+		const char* pathdir = t < g_n_pathdirs ?
+				g_pathdirs[t] : g_mirrors[t - g_n_pathdirs];
+
+		DIR* dir = opendir(pathdir);
+
+		if (dir == NULL) {
+			continue;
+		}
+
+		struct dirent* dirent;
+		as_file_t aerospike_file;
+
+		while ((dirent = readdir(dir)) != NULL) {
+			// Skip "." and ".." entries.
+
+			if (strcmp(dirent->d_name, ".") == 0
+					|| strcmp(dirent->d_name, "..") == 0) {
+				continue;
+			}
+
+			// Validate the file name.
+
+			if (!validate_file_name(dirent->d_name, &aerospike_file)) {
+				continue;
+			}
+
+			// Check whether the file is for this namespace and instance.
+
+			if (aerospike_file.inst == pbp->inst
+					&& aerospike_file.nsid == pbp->nsid) {
+				found = true;
+
+				if (g_verbose) {
+					printf("Found existing Aerospike file \'%s/%s\' with"
+							" instance %u, namespace \'%s\' (nsid %u)"
+							": cannot back up associated segment.\n",
+							pathdir, dirent->d_name, pbp->inst, pbp->nsnm,
+							pbp->nsid);
+				}
+
+				continue;
+			}
+		}
+
+		closedir(dir);
+	}
+
+	return !found;
+}
+
+// Actually back up identified segments.
+
+static bool
+backup_candidate(as_segment_t* pbp, as_segment_t* ptp,
+		as_segment_t psps[], uint32_t n_psps, as_segment_t* smp,
+		as_segment_t ssps[], uint32_t n_ssps,
+		as_segment_t data[], uint32_t n_data)
+{
+	// Create list of file I/O requests.
+	// Note: Assumes that ulimit (number of open files) is big enough, unless
+	// packing.
+
+	uint32_t n_files = 1 + 1 + n_psps;
+
+	if (n_ssps > 0) {
+		n_files += 1 + n_ssps;
+	}
+
+	if (n_data > 0) {
+		n_files += n_data;
+	}
+
+	// Stripe the segment files across the backup directories.
+
+	as_segment_t* sps[n_files];
+	uint32_t n_sps = 0;
+
+	sps[n_sps++] = pbp;
+	sps[n_sps++] = ptp;
+
+	for (uint32_t i = 0; i < n_psps; i++) {
+		sps[n_sps++] = &psps[i];
+	}
+
+	if (n_ssps > 0) {
+		sps[n_sps++] = smp;
+
+		for (uint32_t i = 0; i < n_ssps; i++) {
+			sps[n_sps++] = &ssps[i];
+		}
+	}
+
+	for (uint32_t i = 0; i < n_data; i++) {
+		sps[n_sps++] = &data[i];
+	}
+
+	assign_targets(sps, n_sps);
+
+	// For an incremental backup, get the base backup's manifest. Without one,
+	// every segment is written.
+
+	as_manifest_t manifest = { 0 };
+
+	if (g_base_pathdir != NULL) {
+		if (!read_manifest(g_base_pathdir, pbp->key, &manifest)) {
+			if (g_verbose) {
+				printf("No manifest for base segment %08x in base directory"
+						" \'%s\': backing up all segments.\n", pbp->key,
+						g_base_pathdir);
+			}
+		}
+		else if (manifest.inst != pbp->inst || manifest.nsid != pbp->nsid
+				|| pbp->nsnm == NULL || strcmp(manifest.nsnm, pbp->nsnm) != 0) {
+			if (g_verbose) {
+				printf("Manifest for base segment %08x in base directory"
+						" \'%s\' is for another namespace"
+						": backing up all segments.\n", pbp->key,
+						g_base_pathdir);
+			}
+
+			free_manifest(&manifest);
+		}
+	}
+
+	// Journal the backup, so that it can be resumed if interrupted. A pack is
+	// only synced once it's complete, so there's nothing to resume. Nor is a
+	// mirrored backup resumed - its copies would have to be checked too - nor
+	// a stream, which can't be rewound, nor an object store backup, which has
+	// nowhere to keep a journal.
+
+	if (!g_pack && !g_stream && !g_s3 && g_n_mirrors == 0
+			&& !open_journal(pbp->key, true)) {
+		free_manifest(&manifest);
+		return false;
+	}
+
+	as_io_t ios[n_files];
+	uint32_t n_ios = 0;
+
+	if (!backup_candidate_file(pbp, &ios[n_ios++], ios, pbp, ptp, psps, n_psps,
+			smp, ssps, n_ssps, data, n_data, &manifest)) {
+		free_manifest(&manifest);
+		close_journal(pbp->key, false);
+		return false;
+	}
+
+	if (!backup_candidate_file(ptp, &ios[n_ios++], ios, pbp, ptp, psps, n_psps,
+			smp, ssps, n_ssps, data, n_data, &manifest)) {
+		free_manifest(&manifest);
+		close_journal(pbp->key, false);
+		return false;
+	}
+
+	for (uint32_t i = 0; i < n_psps; i++) {
+		if (!backup_candidate_file(&psps[i], &ios[n_ios++], ios, pbp, ptp, psps,
+				n_psps, smp, ssps, n_ssps, data, n_data, &manifest)) {
+			free_manifest(&manifest);
+			close_journal(pbp->key, false);
+			return false;
+		}
+	}
+
+	if (n_ssps > 0) {
+		if (!backup_candidate_file(smp, &ios[n_ios++], ios, pbp, ptp, psps,
+				n_psps, smp, ssps, n_ssps, data, n_data, &manifest)) {
+			free_manifest(&manifest);
+			close_journal(pbp->key, false);
+			return false;
+		}
+
+		for (uint32_t i = 0; i < n_ssps; i++) {
+			if (!backup_candidate_file(&ssps[i], &ios[n_ios++], ios, pbp, ptp,
+					psps, n_psps, smp, ssps, n_ssps, data, n_data, &manifest)) {
+				free_manifest(&manifest);
+				close_journal(pbp->key, false);
+				return false;
+			}
+		}
+	}
+
+	if (n_data > 0) {
+		for (uint32_t i = 0; i < n_data; i++) {
+			if (!backup_candidate_file(&data[i], &ios[n_ios++], ios, pbp, ptp,
+					psps, n_psps, smp, ssps, n_ssps, data, n_data, &manifest)) {
+				free_manifest(&manifest);
+				close_journal(pbp->key, false);
+				return false;
+			}
+		}
+	}
+
+	assert(n_files == n_ios);
+
+	// Lay out and create the pack, now that all the segments are known.
+
+	if (g_pack && !create_pack(ios, n_ios, pbp)) {
+		// Clean up all intermediate operations.
+
+		backup_candidate_cleanup(ios, pbp, ptp, psps, n_psps, smp, ssps,
+				n_ssps, data, n_data, true);
+
+		free_manifest(&manifest);
+		close_journal(pbp->key, false);
+		return false;
+	}
+
+	// A stream lists the namespace's segments ahead of their data. The
+	// receiver of a transfer may skip the namespace, as filtered out.
+
+	uint32_t status = ACK_OK;
+
+	if (g_stream && (!write_stream_namespace(ios, n_ios, pbp, &status)
+			|| status != ACK_OK)) {
+		backup_candidate_cleanup(ios, pbp, ptp, psps, n_psps, smp, ssps,
+				n_ssps, data, n_data, true);
+
+		free_manifest(&manifest);
+
+		if (status == ACK_SKIPPED && g_verbose) {
+			printf("\nReceiver skipped instance %u, namespace \'%s\' (nsid"
+					" %u).\n", pbp->inst,
+					pbp->nsnm == NULL ? "<null>" : pbp->nsnm, pbp->nsid);
+		}
+
+		return status == ACK_SKIPPED;
+	}
+
+	// Train the dictionaries the segment files are compressed with - only
+	// zstd uses them, and only in segment files.
+
+	if (codec_available(CODEC_ZSTD) && !g_pack && !g_stream && !g_s3) {
+		train_dicts(ios, n_ios);
+	}
+
+	// Hand the file I/O requests in for processing.
+
+	bool success = start_io(&ios[0], n_ios);
+
+	// Mark the end of the namespace's data in a stream. The receiver of a
+	// transfer acks whether it restored the namespace.
+
+	if (g_stream && (!end_stream_namespace(pbp->key, &status)
+			|| status != ACK_OK)) {
+		success = false;
+	}
+
+	// Complete the multipart uploads to an object store (or abort them).
+
+	if (g_s3) {
+		success = finish_s3(ios, n_ios, success);
+	}
+
+	// I/O requests were processed. Now post-process. A stream's chunks are
+	// checked by their own crc32s, when it's read.
+
+	if (success && g_crc32 && !g_stream) {
+		if (!backup_candidate_check_crc32(ios, pbp, ptp, psps, n_psps, smp,
+				ssps, n_ssps)) {
+			if (g_verbose) {
+				printf("crc32 mismatch.\n\n");
+			}
+
+			success = false;
+		}
+	}
+
+	// Record what was backed up, for later incremental backups. A pre-copy
+	// records its state instead, and isn't a backup until it's finalized. A
+	// pack's extent table takes the place of the manifest, and a stream's
+	// namespace frame. An object store's objects are listed instead. The
+	// dictionaries the segment files need are kept beside them.
+
+	if (g_stream || g_s3) {
+		// Nothing more to record.
+	}
+	else if (g_precopy) {
+		success = success && finish_precopy(ios, n_ios);
+	}
+	else if (g_pack) {
+		success = success && finish_pack(ios, n_ios);
+	}
+	else if (g_finalize) {
+		success = success && finish_finalize(ios, n_ios, pbp);
+	}
+	else if (success && (!write_dicts(ios, n_ios)
+			|| !write_manifest(ios, n_ios, pbp))) {
+		success = false;
+	}
+
+	free_dicts();
+
+	// Notify user of success or failure.
+
+	if (g_verbose) {
+		printf("%s", success ?
+				(g_precopy ? "\nSuccessfully pre-copied" :
+						"\nSuccessfully backed up") :
+				(g_precopy ? "\nFailed to pre-copy" : "\nFailed to back up"));
+		printf(" %u Aerospike database segments", n_files);
+		printf(" for instance %u, namespace \'%s\' (nsid %u).\n", pbp->inst,
+				pbp->nsnm == NULL ? "<null>" : pbp->nsnm, pbp->nsid);
+
+		if (success && g_base_pathdir != NULL) {
+			uint32_t n_reused = 0;
+			uint64_t reused_sz = 0;
+
+			for (uint32_t i = 0; i < n_ios; i++) {
+				if (ios[i].reused) {
+					n_reused++;
+					reused_sz += ios[i].segsz;
+				}
+			}
+
+			printf("Reused %u unchanged segment files (%lu of %lu bytes)"
+					" from base directory \'%s\'.\n", n_reused, reused_sz,
+					g_total_to_transfer, g_base_pathdir);
+		}
+
+		if (success && g_chunk_store != NULL) {
+			uint64_t stored_sz = 0;
+
+			for (uint32_t i = 0; i < n_ios; i++) {
+				stored_sz += ios[i].stored_sz;
+			}
+
+			printf("Stored %lu of %lu bytes as new chunks in chunk store"
+					" \'%s\'.\n", stored_sz, g_total_to_transfer,
+					g_chunk_store);
+		}
+
+		if (success && g_n_mirrors != 0) {
+			printf("Wrote copies to mirror directories \'%s\'.\n",
+					g_mirror_list);
+		}
+
+		if (success && g_precopy) {
+			printf("Finalize with \'--finalize\' after the server has shut"
+					" down.\n");
+		}
+
+		if (success && g_finalize) {
+			uint64_t rewritten_sz = 0;
+
+			for (uint32_t i = 0; i < n_ios; i++) {
+				rewritten_sz += ios[i].rewritten_sz;
+			}
+
+			printf("Rewrote %lu of %lu bytes changed since the pre-copy.\n",
+					rewritten_sz, g_total_to_transfer);
+		}
+	}
+
+	free_manifest(&manifest);
+
+	// Free any chunk digests still held.
+
+	for (uint32_t i = 0; i < n_ios; i++) {
+		free(ios[i].chunk_digests);
+		ios[i].chunk_digests = NULL;
+
+		free(ios[i].chunks_done);
+		ios[i].chunks_done = NULL;
+
+		free(ios[i].parts);
+		ios[i].parts = NULL;
+	}
+
+	// Clean up all intermediate operations. A failed finalize leaves the
+	// pre-copy in place, to be finalized again.
+
+	backup_candidate_cleanup(ios, pbp, ptp, psps, n_psps, smp, ssps, n_ssps,
+			data, n_data, !success && !g_finalize);
+
+	close_journal(pbp->key, success);
+
+	return success;
+}
+
+// Assign each segment a backup directory to be written to, balancing the bytes
+// written to each - largest segment first, each to the directory with the
+// fewest bytes so far. The base and meta segments stay in the first directory,
+// with the manifest and journal, so that restore can find them.
+
+static void
+assign_targets(as_segment_t* sps[], uint32_t n_sps)
+{
+	uint64_t target_sz[MAX_TARGETS] = { 0 };
+	as_segment_t* sorted[n_sps];
+	uint32_t n_sorted = 0;
+
+	for (uint32_t i = 0; i < n_sps; i++) {
+		if (sps[i]->type == TYPE_BASE || sps[i]->type == TYPE_META) {
+			sps[i]->target = 0;
+			target_sz[0] += sps[i]->segsz;
+		}
+		else {
+			sorted[n_sorted++] = sps[i];
+		}
+	}
+
+	qsort((void*)sorted, (size_t)n_sorted, sizeof(as_segment_t*),
+			qsort_compare_segment_sizes);
+
+	for (uint32_t i = 0; i < n_sorted; i++) {
+		uint32_t target = 0;
+
+		for (uint32_t t = 1; t < g_n_pathdirs; t++) {
+			if (target_sz[t] < target_sz[target]) {
+				target = t;
+			}
+		}
+
+		sorted[i]->target = target;
+		target_sz[target] += sorted[i]->segsz;
+	}
+}
+
+// qsort(3) comparison routine for segments by size - largest first, then by
+// key, so that the same segments are always laid out the same way.
+
+static int
+qsort_compare_segment_sizes(const void* left, const void* right)
+{
+	const as_segment_t* l = *(as_segment_t* const*)left;
+	const as_segment_t* r = *(as_segment_t* const*)right;
+
+	if (l->segsz != r->segsz) {
+		return l->segsz > r->segsz ? -1 : 1;
+	}
+
+	return (uint32_t)l->key < (uint32_t)r->key ? -1 : 1;
+}
+
+static bool
+backup_candidate_file(as_segment_t* sp, as_io_t* io, as_io_t ios[],
+		as_segment_t* pbp, as_segment_t* ptp, as_segment_t psps[],
+		uint32_t n_psps, as_segment_t* smp, as_segment_t ssps[],
+		uint32_t n_ssps, as_segment_t data[], uint32_t n_data,
+		const as_manifest_t* manifest)
+{
+	// Attach to the segment (for reading).
+
+	void* memptr = shmat(sp->shmid, NULL, SHM_RDONLY);
+
+	if (memptr == (void*)-1) {
+		char errbuff[MAX_BUFFER];
+		char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
+
+		printf("Could not attach segment %08x"
+				": error was %d: %s.\n", sp->key,
+		errno, errout);
+
+		// Clean up all intermediate operations.
+
+		backup_candidate_cleanup(ios, pbp, ptp, psps, n_psps, smp, ssps, n_ssps,
+		data, n_data, true);
+
+		return false;
+	}
+
+	// Create an I/O request for the segment.
+
+	io->key = sp->key;
+	io->op = IO_OP_WRITE;
+	io->memptr = memptr;
+	io->shmid = sp->shmid;
+	io->type = sp->type;
+	io->usec = 0;
+	io->filsz = 0;
+	io->segsz = sp->segsz;
+	io->mode = sp->mode;
+	io->uid = sp->uid;
+	io->gid = sp->gid;
+	io->crc32 = g_crc32_init;
+	io->n_chunks = 1;
+	io->failed = false;
+	io->chunks_done = NULL;
+	io->n_chunks_done = 0;
+	io->ranges = NULL;
+	io->n_ranges = 0;
+	io->base = NULL;
+	io->reused = false;
+	memset(&io->digest, 0, sizeof(as_digest_t));
+	io->chunk_digests = NULL;
+	io->stored_sz = 0;
+	io->rewritten_sz = 0;
+	io->offset = 0;
+	io->target = sp->target;
+
+	// Note when the segment was last attached (by us, just now) and changed,
+	// for the journal (if any) - a resumed backup checks that it hasn't been
+	// since.
+
+	struct shmid_ds ds;
+
+	if (g_journal.fd >= 0 && shmctl(sp->shmid, IPC_STAT, &ds) == 0) {
+		io->atime = ds.shm_atime;
+		io->ctime = ds.shm_ctime;
+	}
+	else {
+		io->atime = io->ctime = 0;
+	}
+
+	// Base and meta segment files are never compressed, nor chunked - they
+	// must be readable as they are.
+
+	io->compress = compress_segment(sp->type);
+	io->cas = sp->type != TYPE_BASE && sp->type != TYPE_META
+			&& g_chunk_store != NULL;
+	io->codec = CODEC_DEFLATE;
+
+	// If the base backup has a file for the segment, creation is deferred
+	// until we know whether the segment has changed.
+
+	io->fd = -1;
+
+	for (uint32_t m = 0; m < MAX_MIRRORS; m++) {
+		io->mirror_fds[m] = -1;
+	}
+
+	io->upload_id = NULL;
+	io->parts = NULL;
+	io->dict = NULL;
+	io->dict_id = 0;
+
+	// When resuming, skip a segment the interrupted backup completed. Any
+	// other file it left behind is written again.
+
+	if (g_resume && g_journal.n_entries != 0) {
+		if (resume_io(io, sp)) {
+			return true;
+		}
+
+		unlink_pathdir_file(g_pathdirs[io->target], io->key, io->compress,
+				io->cas);
+	}
+
+	// Pre-copy and finalize work on plain files in place, in chunks.
+
+	if (g_precopy || g_finalize) {
+		bool ok = g_precopy ?
+				precopy_candidate_file(io) : finalize_candidate_file(io);
+
+		if (!ok) {
+			// Clean up all intermediate operations.
+
+			backup_candidate_cleanup(ios, pbp, ptp, psps, n_psps, smp, ssps,
+					n_ssps, data, n_data, g_precopy);
+		}
+
+		return ok;
+	}
+
+	// A pack is created once all the segments are known.
+
+	if (g_pack) {
+		return true;
+	}
+
+	// A segment goes to a stream in chunks, each its own data frame.
+
+	if (g_stream) {
+		io->op = IO_OP_STREAM;
+		io->n_chunks = (uint32_t)((io->segsz + IOCHUNK - 1) / IOCHUNK);
+		return true;
+	}
+
+	// A segment goes to an object store in parts, uploaded in parallel.
+
+	if (g_s3) {
+		if (!upload_candidate_file(io)) {
+			// Clean up all intermediate operations.
+
+			abort_s3_uploads(ios, (uint32_t)(io - ios) + 1);
+			backup_candidate_cleanup(ios, pbp, ptp, psps, n_psps, smp, ssps,
+					n_ssps, data, n_data, true);
+
+			return false;
+		}
+
+		return true;
+	}
+
+	// A compressed segment may have been stored plain in the base backup, if
+	// no codec shrank it.
+
+	const as_manifest_entry_t* entry = find_manifest_entry(manifest, sp->key);
+
+	if (entry != NULL && entry->has_digest && entry->segsz == sp->segsz
+			&& (entry->compress == io->compress || io->compress)
+			&& entry->cas == io->cas) {
+		io->base = entry;
+		return true;
+	}
+
+	// A compressed file's name depends on the codec picked for it, so it's
+	// created once the segment has been sampled.
+
+	if (io->compress && !io->cas) {
+		return true;
+	}
+
+	// Open (create) the segment file.
+
+	if (!create_file(io)) {
+		// Clean up all intermediate operations.
+
+		backup_candidate_cleanup(ios, pbp, ptp, psps, n_psps, smp, ssps, n_ssps,
+			data, n_data, true);
+
+		return false;
+	}
+
+	return true;
+}
+
+static bool
+backup_candidate_check_crc32(as_io_t ios[], as_segment_t* pbp,
+		as_segment_t* ptp, as_segment_t psps[], uint32_t n_psps,
+		as_segment_t* smp, as_segment_t ssps[], uint32_t n_ssps)
+{
+	if (pbp->crc32 != ios[0].crc32) {
+		return false;
+	}
+
+	if (ptp->crc32 != ios[1].crc32) {
+		return false;
+	}
+
+	for (uint32_t ix = 0; ix < n_psps; ix++) {
+		if (psps[ix].crc32 != ios[2 + ix].crc32) {
+			return false;
+		}
+	}
+
+	if (n_ssps > 0) {
+		if (smp->crc32 != ios[2 + n_psps].crc32) {
+			return false;
+		}
+
+		for (uint32_t ix = 0; ix < n_ssps; ix++) {
+			if (ssps[ix].crc32 != ios[2 + n_psps + 1 + ix].crc32) {
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+// Cleanup from backup_candidate().
+// If remove is set, all files created should be removed.
+
+static void
+backup_candidate_cleanup(as_io_t ios[], as_segment_t* pbp,
+		as_segment_t* ptp, as_segment_t psps[], uint32_t n_psps,
+		as_segment_t* smp, as_segment_t ssps[], uint32_t n_ssps,
+		as_segment_t data[], uint32_t n_data,
+		bool remove_files)
+{
+	(void)data;
+	(void)n_data;
+
+	uint32_t n_objects = 2 + n_psps;
+
+	if (n_ssps > 0) {
+		n_objects += 1 + n_ssps;
+	}
+
+	// Detach all (possibly) attached segments.
+
+	for (uint32_t ix = 0; ix < n_objects; ix++) {
+		shmdt(ios[ix].memptr);
+	}
+
+	// Close all (possibly) opened files. A pack's is shared by all.
+
+	for (uint32_t ix = 0; ix < n_objects; ix++) {
+		if (ios[ix].fd != g_pack_file.fd) {
+			close(ios[ix].fd);
+		}
+
+		for (uint32_t m = 0; m < g_n_mirrors; m++) {
+			if (ios[ix].mirror_fds[m] >= 0) {
+				close(ios[ix].mirror_fds[m]);
+			}
+		}
+	}
+
+	close_pack();
+
+	// Remove all created files (only on failure case). Once any were
+	// journaled as complete, they're kept for a resume.
+
+	if (!remove_files || g_journal.n_done != 0) {
+		return;
+	}
+
+	// A pack in a raw container is dropped simply by not being added to the
+	// superblock. A stream just lacks its end frame.
+
+	if (g_raw || g_stream) {
+		return;
+	}
+
+	if (g_pack) {
+		char pathname[PATH_MAX + 1];
+
+		sprintf(pathname, "%s/%08x%s", g_pathdir, pbp->key, PACK_EXTENSION);
+		unlink(pathname);
+		return;
+	}
+
+	unlink_segment_file(pbp, false, false);
+	unlink_segment_file(ptp, compress_segment(ptp->type),
+			g_chunk_store != NULL);
+
+	for (uint32_t ix = 0; ix < n_psps; ix++) {
+		unlink_segment_file(&psps[ix], compress_segment(psps[ix].type),
+				g_chunk_store != NULL);
+	}
+
+	if (n_ssps > 0) {
+		unlink_segment_file(smp, false, false);
+
+		for (uint32_t ix = 0; ix < n_ssps; ix++) {
+			unlink_segment_file(&ssps[ix], compress_segment(ssps[ix].type),
+					g_chunk_store != NULL);
+		}
+	}
+}
+
+// Remove a segment's file, and its copies in the mirror directories - or its
+// object, in an object store.
+
+static void
+unlink_segment_file(const as_segment_t* sp, bool compress, bool cas)
+{
+	if (g_s3) {
+		delete_s3_object(sp->key);
+		return;
+	}
+
+	unlink_pathdir_file(g_pathdirs[sp->target], sp->key, compress, cas);
+
+	for (uint32_t m = 0; m < g_n_mirrors; m++) {
+		unlink_pathdir_file(g_mirrors[m], sp->key, compress, cas);
+	}
+}
+
+// Remove a segment's file from a directory. A compressed segment's file may
+// be plain, deflated or chunked, depending on the codec picked for it.
+
+static void
+unlink_pathdir_file(const char* pathdir, key_t key, bool compress, bool cas)
+{
+	char pathname[PATH_MAX + 1];
+
+	sprintf(pathname, "%s/%08x%s", pathdir, key,
+			file_extension(false, CODEC_STORE, cas));
+	unlink(pathname);
+
+	if (compress && !cas) {
+		sprintf(pathname, "%s/%08x%s", pathdir, key, FILE_EXTENSION_CMP);
+		unlink(pathname);
+
+		sprintf(pathname, "%s/%08x%s", pathdir, key, FILE_EXTENSION_CHUNKED);
+		unlink(pathname);
+	}
+}
+
+// Back up a segment to its segment file. If the base backup has a file with
+// the same digest, reuse it instead of writing the segment again.
+
+static bool
+backup_file(as_io_t* io)
+{
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	// A segment is written in place in its pack. There's no manifest, so no
+	// digest, and the pack is synced once it's complete. A raw container is
+	// written with direct I/O, in whole blocks - the segment is mapped in
+	// whole pages.
+
+	if (g_pack) {
+		size_t size = g_raw ?
+				(io->segsz + PACK_ALIGN - 1) / PACK_ALIGN * PACK_ALIGN :
+				io->segsz;
+		bool success = pwrite_range(io->fd, io->memptr, size, io->offset);
+
+		if (success && g_crc32) {
+			io->crc32 = crc32_z(io->crc32, io->memptr, io->segsz);
+		}
+
+		io->filsz = io->segsz;
+		io->usec = elapsed_usec(&start);
+
+		return success;
+	}
+
+	// Digest the segment, for the manifest and to find out whether it has
+	// changed since the base backup - only if asked to, as it means reading
+	// the whole segment once more. The chunk store needs the chunk digests.
+
+	if ((g_digest || io->cas) && !digest_segment(io->memptr, io->segsz,
+			&io->digest, io->cas ? &io->chunk_digests : NULL)) {
+		return false;
+	}
+
+	bool reuse = io->base != NULL
+			&& hash_digest_equal(&io->digest, &io->base->digest)
+			&& reuse_file(io);
+
+	// Each compressed segment written gets the codec which suits it. One which
+	// no codec shrinks is stored as it is, in a plain file.
+
+	if (!reuse && io->compress && !io->cas) {
+		io->codec = choose_codec(io->memptr, io->segsz);
+		io->compress = io->codec != CODEC_STORE;
+	}
+
+	bool success;
+
+	if (reuse) {
+		io->reused = true;
+		io->compress = io->base->compress;
+		io->codec = io->base->codec;
+		io->dict_id = io->base->dict_id;
+
+		// The file holds exactly what's in the segment.
+
+		if (g_crc32) {
+			io->crc32 = crc32_z(io->crc32, io->memptr, io->segsz);
+		}
+
+		success = true;
+	}
+	else if (io->fd < 0 && !create_file(io)) {
+		success = false;
+	}
+	else {
+		// Segment changed (or file couldn't be reused) - write it, and its
+		// copies in the mirror directories.
+
+		int fds[1 + MAX_MIRRORS];
+
+		fds[0] = io->fd;
+
+		for (uint32_t m = 0; m < g_n_mirrors; m++) {
+			fds[1 + m] = io->mirror_fds[m];
+		}
+
+		success = io->cas ?
+				write_cas_file(io) :
+				write_file(fds, 1 + g_n_mirrors, io->memptr, io->segsz,
+						io->mode, io->uid, io->gid, io->compress, io->codec,
+						io->dict, &io->crc32);
+
+		// Only zstd compresses with the dictionary.
+
+		if (io->compress && io->codec == CODEC_ZSTD && io->dict != NULL) {
+			io->dict_id = io->dict->id;
+		}
+
+		for (uint32_t i = 0; i <= g_n_mirrors; i++) {
+			(void)fsync(fds[i]);
+		}
+	}
+
+	free(io->chunk_digests);
+	io->chunk_digests = NULL;
+
+	if (success && !io->reused) {
+		struct stat statbuf;
+
+		if (fstat(io->fd, &statbuf) < 0) {
+			return false;
+		}
+
+		io->filsz = (size_t)statbuf.st_size;
+	}
+
+	io->usec = elapsed_usec(&start);
+
+	return success;
+}
+
+// Create the segment file for an I/O request - and its copy in each mirror
+// directory.
+
+static bool
+create_file(as_io_t* io)
+{
+	for (uint32_t m = 0; m <= g_n_mirrors; m++) {
+		const char* pathdir = m == 0 ?
+				g_pathdirs[io->target] : g_mirrors[m - 1];
+		int* fd = m == 0 ? &io->fd : &io->mirror_fds[m - 1];
+
+		// Construct the filename for the segment file.
+
+		char pathname[PATH_MAX + 1];
+
+		sprintf(pathname, "%s/%08x%s", pathdir, io->key,
+				file_extension(io->compress, io->codec, io->cas));
+
+		// Open (create) the segment file.
+
+		int rc = open(pathname, O_CREAT | O_RDWR | O_EXCL, DEFAULT_MODE);
+
+		if (rc < 0) {
+			char errbuff[MAX_BUFFER];
+			char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
+
+			if (g_verbose) {
+				printf("Could not create segment file \'%s\'"
+						": error was %d: %s.\n", pathname, errno, errout);
+			}
+
+			return false;
+		}
+
+		*fd = rc;
+
+		if (!io->compress && !io->cas) {
+			// Allocate storage space for the data to be written to the file.
+
+			rc = posix_fallocate(*fd, 0, (off_t)io->segsz);
+
+			if (rc < 0) {
+				char errbuff[MAX_BUFFER];
+				char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
+
+				if (g_verbose) {
+					printf("Could not allocate storage for segment file"
+							" \'%s\': error was %d: %s.\n", pathname, errno,
+							errout);
+				}
+
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+// Reuse the base backup's segment file for an unchanged segment. Prefer a hard
+// link, else a copy-on-write clone (reflink). Returns false if neither works,
+// in which case the segment must be written.
+
+static bool
+reuse_file(as_io_t* io)
+{
+	assert(g_base_pathdir != NULL);
+
+	const char* extension = file_extension(io->base->compress,
+			io->base->codec, io->base->cas);
+
+	char base_pathname[PATH_MAX + 1];
+	char pathname[PATH_MAX + 1];
+
+	sprintf(base_pathname, "%s/%08x%s", g_base_pathdir, io->key, extension);
+	sprintf(pathname, "%s/%08x%s", g_pathdirs[io->target], io->key,
+			extension);
+
+	// The base file must still be the one the manifest describes.
+
+	struct stat statbuf;
+
+	if (stat(base_pathname, &statbuf) < 0
+			|| (size_t)statbuf.st_size != io->base->filsz) {
+		if (g_verbose) {
+			printf("Base segment file \'%s\' is missing or changed size"
+					": writing segment %08x.\n", base_pathname, io->key);
+		}
+
+		return false;
+	}
+
+	// A hard link shares ownership and mode with the base file, so only use
+	// one if these are already right.
+
+	if (statbuf.st_uid == io->uid && statbuf.st_gid == io->gid
+			&& (statbuf.st_mode & MODE_MASK) == (io->mode & MODE_MASK)
+			&& link(base_pathname, pathname) == 0) {
+		io->filsz = (size_t)statbuf.st_size;
+		return true;
+	}
+
+	// Otherwise (e.g., across file systems) try a clone.
+
+	int src_fd = open(base_pathname, O_RDONLY);
+
+	if (src_fd < 0) {
+		return false;
+	}
+
+	int fd = open(pathname, O_CREAT | O_WRONLY | O_EXCL, DEFAULT_MODE);
+
+	if (fd < 0) {
+		close(src_fd);
+		return false;
+	}
+
+	bool success = ioctl(fd, FICLONE, src_fd) == 0
+			&& fchown(fd, io->uid, io->gid) == 0
+			&& fchmod(fd, io->mode) == 0;
+
+	close(src_fd);
+
+	if (!success) {
+		close(fd);
+		unlink(pathname);
+		return false;
+	}
+
+	io->fd = fd;
+	io->filsz = (size_t)statbuf.st_size;
+
+	return true;
+}
+
+// Set up the pre-copy of a live segment - create its (plain) segment file, and
+// room for the digests of its chunks.
+
+static bool
+precopy_candidate_file(as_io_t* io)
+{
+	io->op = IO_OP_PRECOPY;
+	io->compress = false;
+	io->cas = false;
+	io->n_chunks = (uint32_t)((io->segsz + IOCHUNK - 1) / IOCHUNK);
+
+	size_t n_digests = (io->segsz + DIGEST_CHUNK - 1) / DIGEST_CHUNK;
+
+	io->chunk_digests = (as_digest_t*)malloc(n_digests * sizeof(as_digest_t));
+
+	if (io->chunk_digests == NULL) {
+		if (g_verbose) {
+			printf("Could not allocate memory for chunk digests.\n");
+		}
+
+		return false;
+	}
+
+	if (!create_file(io)) {
+		return false;
+	}
+
+	// Set file ownership and mode now - finalize patches the file in place.
+
+	if (fchown(io->fd, io->uid, io->gid) == -1
+			|| fchmod(io->fd, io->mode) == -1) {
+		char errbuff[MAX_BUFFER];
+		char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
+
+		if (g_verbose) {
+			printf("Unable to set uid, gid or mode for file"
+					": error was %d: %s\n", errno, errout);
+		}
+
+		return false;
+	}
+
+	return true;
+}
+
+// Set up the finalize of a segment. If it was pre-copied, reopen its segment
+// file to rewrite the chunks which changed since. Otherwise (e.g., an arena
+// stage added since the pre-copy) back it up from scratch.
+
+static bool
+finalize_candidate_file(as_io_t* io)
+{
+	io->compress = false;
+	io->cas = false;
+
+	char pathname[PATH_MAX + 1];
+
+	sprintf(pathname, "%s/%08x%s", g_pathdir, io->key, FILE_EXTENSION);
+
+	if (read_precopy_state(io)) {
+		int fd = open(pathname, O_RDWR);
+		struct stat statbuf;
+
+		if (fd >= 0 && fstat(fd, &statbuf) == 0
+				&& (size_t)statbuf.st_size == io->segsz) {
+			io->op = IO_OP_FINALIZE;
+			io->fd = fd;
+			io->n_chunks = (uint32_t)((io->segsz + IOCHUNK - 1) / IOCHUNK);
+			return true;
+		}
+
+		if (fd >= 0) {
+			close(fd);
+		}
+
+		free(io->chunk_digests);
+		io->chunk_digests = NULL;
+	}
+
+	if (g_verbose) {
+		printf("No usable pre-copy of segment %08x: backing it up in full.\n",
+				io->key);
+	}
+
+	unlink(pathname);
+
+	return create_file(io);
+}
+
+// Pre-copy a chunk (of size IOCHUNK) of a live segment. The segment may change
+// under us, so each DIGEST_CHUNK is copied before it's digested and written -
+// the digest always describes what's in the file.
+
+static bool
+precopy_file(as_io_t* io, uint32_t chunk)
+{
+	size_t start = (size_t)chunk * IOCHUNK;
+	size_t end = start + io_chunk_size(io, chunk);
+
+	uint8_t* buf = (uint8_t*)malloc(DIGEST_CHUNK);
+
+	if (buf == NULL) {
+		if (g_verbose) {
+			printf("Could not allocate memory to pre-copy segment %08x.\n",
+					io->key);
+		}
+
+		return false;
+	}
+
+	for (size_t offset = start; offset < end; offset += DIGEST_CHUNK) {
+		size_t size = end - offset < DIGEST_CHUNK ? end - offset : DIGEST_CHUNK;
+
+		memcpy(buf, (const uint8_t*)io->memptr + offset, size);
+		hash_digest(buf, size, DIGEST_SEED,
+				&io->chunk_digests[offset / DIGEST_CHUNK]);
+
+		if (!pwrite_range(io->fd, buf, size, offset)) {
+			if (g_verbose) {
+				printf("Could not write segment file %08x.\n", io->key);
+			}
+
+			free(buf);
+			buf = NULL;
+			return false;
+		}
+	}
+
+	free(buf);
+	buf = NULL;
+
+	return true;
+}
+
+// Finalize a chunk (of size IOCHUNK) of a pre-copied segment - rewrite each
+// DIGEST_CHUNK whose digest no longer matches the pre-copy.
+
+static bool
+finalize_file(as_io_t* io, uint32_t chunk)
+{
+	size_t start = (size_t)chunk * IOCHUNK;
+	size_t end = start + io_chunk_size(io, chunk);
+	const uint8_t* seg_buf = (const uint8_t*)io->memptr;
+	uint64_t rewritten_sz = 0;
+	struct timespec begin;
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+
+	for (size_t offset = start; offset < end; offset += DIGEST_CHUNK) {
+		size_t size = end - offset < DIGEST_CHUNK ? end - offset : DIGEST_CHUNK;
+		as_digest_t* precopy_digest = &io->chunk_digests[offset / DIGEST_CHUNK];
+		as_digest_t digest;
+
+		hash_digest(seg_buf + offset, size, DIGEST_SEED, &digest);
+
+		if (hash_digest_equal(&digest, precopy_digest)) {
+			continue;
+		}
+
+		if (!pwrite_range(io->fd, seg_buf + offset, size, offset)) {
+			if (g_verbose) {
+				printf("Could not write segment file %08x.\n", io->key);
+			}
+
+			return false;
+		}
+
+		*precopy_digest = digest;
+		rewritten_sz += size;
+	}
+
+	uint64_t usec = elapsed_usec(&begin);
+
+	pthread_mutex_lock(&g_io_mutex);
+	io->rewritten_sz += rewritten_sz;
+	io->usec += usec;
+	pthread_mutex_unlock(&g_io_mutex);
+
+	return true;
+}
+
+// Write a buffer to a file at an offset, retrying partial writes.
+
+static bool
+pwrite_range(int fd, const void* buf, size_t size, size_t offset)
+{
+	size_t done = 0;
+
+	while (done < size) {
+		ssize_t result = pwrite(fd, (const uint8_t*)buf + done, size - done,
+				(off_t)(offset + done));
+
+		if (result <= 0) {
+			return false;
+		}
+
+		done += (size_t)result;
+	}
+
+	return true;
+}
+
+// Write a segment's pre-copy state - the digests of its pre-copied chunks. The
+// state is written to a temporary file and renamed, so it's only ever found
+// complete.
+
+static bool
+write_precopy_state(as_io_t* io)
+{
+	char pathname[PATH_MAX + 1];
+	char temp_pathname[PATH_MAX + 1];
+
+	sprintf(pathname, "%s/%08x%s", g_pathdir, io->key, PRECOPY_EXTENSION);
+	sprintf(temp_pathname, "%s/%08x%s%s", g_pathdir, io->key,
+			PRECOPY_EXTENSION, TEMP_EXTENSION);
+
+	int fd = open(temp_pathname, O_CREAT | O_WRONLY | O_TRUNC, DEFAULT_MODE);
+
+	if (fd < 0) {
+		char errbuff[MAX_BUFFER];
+		char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
+
+		if (g_verbose) {
+			printf("Could not create pre-copy state \'%s\'"
+					": error was %d: %s.\n", temp_pathname, errno, errout);
+		}
+
+		return false;
+	}
+
+	uint32_t n_chunks = (uint32_t)((io->segsz + DIGEST_CHUNK - 1)
+			/ DIGEST_CHUNK);
+
+	as_cas_t header;
+
+	header.magic = PRECOPY_MAG;
+	header.version = CASHDR_VER;
+	header.segsz = io->segsz;
+	header.chunk_size = DIGEST_CHUNK;
+	header.n_chunks = n_chunks;
+	header.compress = 0;
+
+	bool success = pwrite_range(fd, &header, CASHDR_LEN, CASHDR_OFF)
+			&& pwrite_range(fd, io->chunk_digests,
+					n_chunks * sizeof(as_digest_t), CASHDR_LEN)
+			&& fdatasync(fd) == 0;
+
+	close(fd);
+
+	if (success && rename(temp_pathname, pathname) < 0) {
+		success = false;
+	}
+
+	if (!success) {
+		if (g_verbose) {
+			printf("Could not write pre-copy state \'%s\'.\n", pathname);
+		}
+
+		unlink(temp_pathname);
+	}
+
+	return success;
+}
+
+// Read a segment's pre-copy state (if any) into its I/O request.
+
+static bool
+read_precopy_state(as_io_t* io)
+{
+	char pathname[PATH_MAX + 1];
+
+	sprintf(pathname, "%s/%08x%s", g_pathdir, io->key, PRECOPY_EXTENSION);
+
+	int fd = open(pathname, O_RDONLY);
+
+	if (fd < 0) {
+		return false;
+	}
+
+	as_cas_t header;
+
+	bool success = read_cas_header(fd, io->key, io->segsz, PRECOPY_MAG,
+			&header, &io->chunk_digests);
+
+	close(fd);
+
+	return success;
+}
+
+// Make a pre-copy durable, then record the state of each segment. The base
+// segment's state goes last, marking the pre-copy complete.
+
+static bool
+finish_precopy(as_io_t ios[], uint32_t n_ios)
+{
+	for (uint32_t i = 0; i < n_ios; i++) {
+		as_io_t* io = &ios[n_ios - 1 - i];
+
+		if (fdatasync(io->fd) < 0) {
+			if (g_verbose) {
+				printf("Could not sync segment file %08x.\n", io->key);
+			}
+
+			return false;
+		}
+
+		if (!write_precopy_state(io)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Make a finalized backup durable and write its manifest. Then drop the
+// pre-copy state - the base segment's last - along with the files of any
+// segments which have gone since the pre-copy.
+
+static bool
+finish_finalize(as_io_t ios[], uint32_t n_ios, as_segment_t* pbp)
+{
+	for (uint32_t i = 0; i < n_ios; i++) {
+		as_io_t* io = &ios[i];
+
+		if (io->op != IO_OP_FINALIZE) {
+			continue;
+		}
+
+		if (fdatasync(io->fd) < 0) {
+			if (g_verbose) {
+				printf("Could not sync segment file %08x.\n", io->key);
+			}
+
+			return false;
+		}
+
+		// The chunk digests now describe the segment, as does the file.
+
+		size_t n_chunks = (io->segsz + DIGEST_CHUNK - 1) / DIGEST_CHUNK;
+
+		hash_digest(io->chunk_digests, n_chunks * sizeof(as_digest_t),
+				DIGEST_SEED, &io->digest);
+		io->filsz = io->segsz;
+	}
+
+	if (!write_manifest(ios, n_ios, pbp)) {
+		return false;
+	}
+
+	char pathname[PATH_MAX + 1];
+	DIR* dir = opendir(g_pathdir);
+
+	if (dir != NULL) {
+		struct dirent* dirent;
+
+		while ((dirent = readdir(dir)) != NULL) {
+			// Find pre-copy state for this namespace and instance.
+
+			char* dot_ptr = strchr(dirent->d_name, '.');
+
+			if (dot_ptr == NULL || strcmp(dot_ptr, PRECOPY_EXTENSION) != 0
+					|| dot_ptr - dirent->d_name != 8) {
+				continue;
+			}
+
+			as_file_t file;
+
+			sprintf(pathname, "%.8s%s", dirent->d_name, FILE_EXTENSION);
+
+			if (!validate_file_name(pathname, &file)
+					|| file.inst != pbp->inst || file.nsid != pbp->nsid) {
+				continue;
+			}
+
+			bool found = false;
+
+			for (uint32_t i = 0; i < n_ios; i++) {
+				if (ios[i].key == file.key) {
+					found = true;
+					break;
+				}
+			}
+
+			if (found) {
+				continue;
+			}
+
+			// The segment has gone - so must its file.
+
+			if (g_verbose) {
+				printf("Removing segment file %08x: segment has gone since"
+						" the pre-copy.\n", file.key);
+			}
+
+			sprintf(pathname, "%s/%08x%s", g_pathdir, file.key,
+					FILE_EXTENSION);
+			unlink(pathname);
+
+			sprintf(pathname, "%s/%08x%s", g_pathdir, file.key,
+					PRECOPY_EXTENSION);
+			unlink(pathname);
+		}
+
+		closedir(dir);
+	}
+
+	for (uint32_t i = 0; i < n_ios; i++) {
+		sprintf(pathname, "%s/%08x%s", g_pathdir, ios[n_ios - 1 - i].key,
+				PRECOPY_EXTENSION);
+		unlink(pathname);
+	}
+
+	return true;
+}
+
+// Check whether a namespace's backup or restore left a journal behind.
+
+static bool
+have_journal(key_t key)
+{
+	char pathname[PATH_MAX + 1];
+
+	sprintf(pathname, "%s/%08x%s", g_pathdir, key, JOURNAL_EXTENSION);
+
+	return access(pathname, F_OK) == 0;
+}
+
+// Check whether a namespace has pre-copy state in the backup directory - left
+// by a pre-copy, until a finalize completes and drops it.
+
+static bool
+have_precopy(uint32_t inst, uint32_t nsid)
+{
+	DIR* dir = opendir(g_pathdir);
+
+	if (dir == NULL) {
+		return false;
+	}
+
+	bool found = false;
+	struct dirent* dirent;
+
+	while (!found && (dirent = readdir(dir)) != NULL) {
+		char* dot_ptr = strchr(dirent->d_name, '.');
+
+		if (dot_ptr == NULL || strcmp(dot_ptr, PRECOPY_EXTENSION) != 0
+				|| dot_ptr - dirent->d_name != 8) {
+			continue;
+		}
+
+		char pathname[PATH_MAX + 1];
+		as_file_t file;
+
+		sprintf(pathname, "%.8s%s", dirent->d_name, FILE_EXTENSION);
+
+		found = validate_file_name(pathname, &file) && file.inst == inst
+				&& file.nsid == nsid;
+	}
+
+	closedir(dir);
+
+	return found;
+}
+
+// Open the journal of a namespace's backup or restore, named after its base
+// segment key. When resuming, first read what the interrupted run completed.
+// The journal's header says whether its records carry crc32s - a run with '-c'
+// can't resume from one without.
+
+static bool
+open_journal(key_t key, bool backup)
+{
+	const char* operation = backup ? "backup" : "restore";
+	char pathname[PATH_MAX + 1];
+
+	sprintf(pathname, "%s/%08x%s", g_pathdir, key, JOURNAL_EXTENSION);
+
+	g_journal.fd = -1;
+	g_journal.crc32 = false;
+	g_journal.entries = NULL;
+	g_journal.n_entries = 0;
+	g_journal.n_done = 0;
+
+	FILE* file = g_resume ? fopen(pathname, "r") : NULL;
+
+	if (g_resume && file == NULL) {
+		if (g_verbose) {
+			printf("No journal \'%s\' to resume from: starting from"
+					" scratch.\n", pathname);
+		}
+	}
+
+	if (file != NULL) {
+		uint32_t max_entries = 0;
+		bool same_operation = false;
+		char line[MAX_BUFFER];
+
+		while (fgets(line, sizeof(line), file) != NULL) {
+			as_journal_entry_t entry;
+			char value[MAX_BUFFER];
+			unsigned int entry_key;
+			long entry_atime;
+			long entry_ctime;
+			long entry_time;
+
+			memset(&entry, 0, sizeof(as_journal_entry_t));
+
+			if (sscanf(line, "operation=%1023s", value) == 1) {
+				same_operation = strcmp(value, operation) == 0;
+				continue;
+			}
+
+			unsigned int crc32;
+
+			if (sscanf(line, "crc32=%u", &crc32) == 1) {
+				g_journal.crc32 = crc32 != 0;
+				continue;
+			}
+
+			if (sscanf(line, "attach key=%x shmid=%d time=%ld", &entry_key,
+					&entry.shmid, &entry_time) == 3) {
+				entry.done = false;
+			}
+			else if (sscanf(line, "done key=%x chunk=%u shmid=%d filsz=%lu"
+					" crc32=%lx digest=%1023s atime=%ld ctime=%ld time=%ld",
+					&entry_key, &entry.chunk, &entry.shmid, &entry.filsz,
+					&entry.crc32, value, &entry_atime, &entry_ctime,
+					&entry_time) == 9
+					&& hash_digest_from_hex(value, &entry.digest)) {
+				entry.done = true;
+				entry.atime = (time_t)entry_atime;
+				entry.ctime = (time_t)entry_ctime;
+			}
+			else {
+				// Other lines - including one cut short by the interruption.
+				continue;
+			}
+
+			entry.key = (key_t)entry_key;
+			entry.time = (time_t)entry_time;
+
+			if (g_journal.n_entries == max_entries) {
+				max_entries = max_entries == 0 ? 64 : max_entries * 2;
+
+				as_journal_entry_t* entries = realloc(g_journal.entries,
+						max_entries * sizeof(as_journal_entry_t));
+
+				if (entries == NULL) {
+					same_operation = false;
+					break;
+				}
+
+				g_journal.entries = entries;
+			}
+
+			g_journal.entries[g_journal.n_entries++] = entry;
+
+			if (entry.done) {
+				g_journal.n_done++;
+			}
+		}
+
+		fclose(file);
+
+		if (!same_operation) {
+			if (g_verbose) {
+				printf("Journal \'%s\' is not for a %s.\n", pathname,
+						operation);
+			}
+
+			free(g_journal.entries);
+			g_journal.entries = NULL;
+			g_journal.n_entries = 0;
+			g_journal.n_done = 0;
+			return false;
+		}
+
+		// A journal written without '-c' has crc32s of 0, never computed.
+
+		if (g_crc32 && !g_journal.crc32 && g_journal.n_done != 0) {
+			if (g_verbose) {
+				printf("Journal '%s' was written without crc32 ('-c'):"
+						" resume without '-c', or remove the journal and"
+						" start from scratch.\n", pathname);
+			}
+
+			free(g_journal.entries);
+			g_journal.entries = NULL;
+			g_journal.n_entries = 0;
+			g_journal.n_done = 0;
+			return false;
+		}
+	}
+
+	// Append to what was read, or start afresh.
+
+	int flags = O_CREAT | O_WRONLY | O_APPEND;
+
+	if (g_journal.n_entries == 0) {
+		flags |= O_TRUNC;
+	}
+
+	g_journal.fd = open(pathname, flags, DEFAULT_MODE);
+
+	if (g_journal.fd < 0) {
+		char errbuff[MAX_BUFFER];
+		char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
+
+		if (g_verbose) {
+			printf("Could not open journal \'%s\': error was %d: %s.\n",
+					pathname, errno, errout);
+		}
+
+		free(g_journal.entries);
+		g_journal.entries = NULL;
+		g_journal.n_entries = 0;
+		g_journal.n_done = 0;
+		return false;
+	}
+
+	// Records appended without '-c' carry no crc32s - nor, from here on, does
+	// the journal. The last crc32 line read counts.
+
+	if (g_journal.n_entries == 0) {
+		dprintf(g_journal.fd, "version=%u\noperation=%s\ncrc32=%d\n",
+				JOURNAL_VER, operation, g_crc32 ? 1 : 0);
+	}
+	else if (g_journal.crc32 && !g_crc32) {
+		dprintf(g_journal.fd, "crc32=0\n");
+	}
+
+	g_journal.crc32 = g_crc32;
+
+	return true;
+}
+
+// Close the journal of a namespace's backup or restore, if one was opened. It's
+// kept only if the run didn't complete and there's something to resume.
+
+static void
+close_journal(key_t key, bool complete)
+{
+	if (g_journal.fd < 0) {
+		return;
+	}
+
+	close(g_journal.fd);
+	g_journal.fd = -1;
+
+	if (complete || g_journal.n_done == 0) {
+		char pathname[PATH_MAX + 1];
+
+		sprintf(pathname, "%s/%08x%s", g_pathdir, key, JOURNAL_EXTENSION);
+		unlink(pathname);
+	}
+	else if (g_verbose) {
+		printf("Completed work was kept: finish with \'--resume\'.\n");
+	}
+
+	free(g_journal.entries);
+	g_journal.entries = NULL;
+	g_journal.n_entries = 0;
+	g_journal.n_done = 0;
+}
+
+// Journal the attachment of a segment being restored. A segment attached by
+// anyone else later has been tampered with.
+
+static void
+journal_attach(const as_io_t* io)
+{
+	if (g_journal.fd < 0) {
+		return;
+	}
+
+	dprintf(g_journal.fd, "attach key=%08x shmid=%d time=%ld\n", io->key,
+			io->shmid, (long)time(NULL));
+}
+
+// Format the journal record of a completed chunk of a backup or restore, into
+// record (of JOURNAL_RECORD_MAX bytes). Called under the I/O mutex - the record
+// is written by write_journal() outside it. Returns the record's length, 0 if
+// there's nothing to journal.
+
+static size_t
+journal_chunk(const as_io_t* io, uint32_t chunk, char* record)
+{
+	if (g_journal.fd < 0
+			|| (io->op != IO_OP_WRITE && io->op != IO_OP_READ)) {
+		return 0;
+	}
+
+	char hex[DIGEST_HEX_LEN + 1];
+
+	hash_digest_to_hex(&io->digest, hex);
+
+	int len = snprintf(record, JOURNAL_RECORD_MAX, "done key=%08x chunk=%u"
+			" shmid=%d filsz=%lu crc32=%lx digest=%s atime=%ld ctime=%ld"
+			" time=%ld\n", io->key, chunk, io->shmid, io->filsz, io->crc32,
+			hex, (long)io->atime, (long)io->ctime, (long)time(NULL));
+
+	if (len <= 0 || len >= JOURNAL_RECORD_MAX) {
+		return 0;
+	}
+
+	g_journal.n_done++;
+
+	return (size_t)len;
+}
+
+// Write a journal record. A backup's data has been synced to its file by now -
+// the record is synced too, so that a resume after a crash doesn't redo it. The
+// journal is opened for appending, so a record is written whole, whichever
+// thread writes it.
+
+static void
+write_journal(const as_io_t* io, const char* record, size_t len)
+{
+	if (write(g_journal.fd, record, len) != (ssize_t)len
+			|| fdatasync(g_journal.fd) < 0) {
+		if (g_verbose) {
+			printf("Could not sync journal after segment %08x.\n", io->key);
+		}
+	}
+}
+
+// Apply the journal of an interrupted backup or restore to an I/O request -
+// mark the chunks it completed, provided that what they produced is still
+// intact. A backup passes the segment being backed up. Returns true if the
+// whole request was completed.
+
+static bool
+resume_io(as_io_t* io, const as_segment_t* sp)
+{
+	time_t latest = 0;
+	const as_journal_entry_t* last_done = NULL;
+
+	for (uint32_t i = 0; i < g_journal.n_entries; i++) {
+		const as_journal_entry_t* entry = &g_journal.entries[i];
+
+		if (entry->key != io->key) {
+			continue;
+		}
+
+		if (entry->time > latest) {
+			latest = entry->time;
+		}
+
+		if (entry->done) {
+			last_done = entry;
+		}
+	}
+
+	if (last_done == NULL) {
+		return false;
+	}
+
+	bool compress = io->compress;
+
+	if (g_backup) {
+		// A backed up segment mustn't have changed since - e.g., by a warm
+		// restart of the server, which keeps shmids. It can't have, unless
+		// someone attached it (or changed its permissions) since - so it must
+		// still have the attach and change times journaled with it, those of
+		// the interrupted backup's own attach. Its detach time says nothing,
+		// as the interrupted backup's own detach is later than its journal.
+
+		if (sp->natt != 0 || sp->atime != last_done->atime
+				|| sp->ctime != last_done->ctime) {
+			if (g_verbose) {
+				printf("Segment %08x was attached since the interrupted"
+						" backup: backing it up again.\n", io->key);
+			}
+
+			return false;
+		}
+
+		// A backed up segment's file must still be there, at full size. A
+		// compressed segment's may have been deflated, chunked, or stored
+		// plain.
+
+		const char* extensions[] = {
+			file_extension(io->compress, CODEC_DEFLATE, io->cas),
+			FILE_EXTENSION_CHUNKED, FILE_EXTENSION
+		};
+		uint32_t n_extensions = io->compress && !io->cas ? 3 : 1;
+		char pathname[PATH_MAX + 1];
+		struct stat statbuf;
+		uint32_t e;
+
+		for (e = 0; e < n_extensions; e++) {
+			sprintf(pathname, "%s/%08x%s", g_pathdirs[io->target], io->key,
+					extensions[e]);
+
+			if (stat(pathname, &statbuf) == 0) {
+				break;
+			}
+		}
+
+		if (e == n_extensions) {
+			return false;
+		}
+
+		compress = io->compress && strcmp(extensions[e], FILE_EXTENSION) != 0;
+		io->filsz = (size_t)statbuf.st_size;
+
+		// The manifest names the codec the file was compressed with, and the
+		// dictionary (if any).
+
+		if (compress && !io->cas) {
+			as_cmp_t header;
+			as_cmp_ext_t ext;
+			int fd = open(pathname, O_RDONLY);
+
+			if (fd < 0) {
+				return false;
+			}
+
+			bool ok = read_cmp_header(fd, io->segsz, &header, &ext);
+
+			if (ok && header.version == CMPHDR_VER_CHUNKED) {
+				io->dict_id = file_dict_id(fd, io->segsz, &ext);
+			}
+
+			close(fd);
+
+			if (!ok) {
+				return false;
+			}
+
+			io->codec = (as_codec)ext.codec;
+		}
+	}
+	else {
+		// A restored segment mustn't have been attached by anyone else since.
+
+		struct shmid_ds ds;
+
+		if (shmctl(io->shmid, IPC_STAT, &ds) < 0 || ds.shm_nattch != 0
+				|| ds.shm_atime > latest) {
+			return false;
+		}
+	}
+
+	io->chunks_done = (bool*)calloc(io->n_chunks, sizeof(bool));
+
+	if (io->chunks_done == NULL) {
+		return false;
+	}
+
+	uint32_t n_chunks_done = 0;
+
+	for (uint32_t i = 0; i < g_journal.n_entries; i++) {
+		const as_journal_entry_t* entry = &g_journal.entries[i];
+
+		if (entry->key != io->key || !entry->done
+				|| entry->shmid != io->shmid || entry->chunk >= io->n_chunks
+				|| io->chunks_done[entry->chunk]
+				|| (g_backup && entry->filsz != io->filsz)) {
+			continue;
+		}
+
+		io->chunks_done[entry->chunk] = true;
+		n_chunks_done++;
+
+		if (io->n_chunks == 1) {
+			io->filsz = entry->filsz;
+			io->crc32 = entry->crc32;
+			io->digest = entry->digest;
+		}
+	}
+
+	io->n_chunks_done = n_chunks_done;
+
+	if (g_verbose && n_chunks_done != 0) {
+		printf("Resuming segment %08x: %u of %u chunks already done.\n",
+				io->key, n_chunks_done, io->n_chunks);
+	}
+
+	if (n_chunks_done != io->n_chunks) {
+		return false;
+	}
+
+	io->compress = compress;
+
+	return true;
+}
+
+// Lay out a namespace's pack - the header and extent table, then each segment
+// at an aligned offset - and create it, preallocated to its full size. All the
+// I/O requests share its file descriptor. In a raw container, the pack follows
+// the last one there, and is written with direct I/O.
+
+static bool
+create_pack(as_io_t ios[], uint32_t n_ios, as_segment_t* pbp)
+{
+	size_t base = 0;
+
+	if (g_raw) {
+		// The first pack of the run starts the container afresh.
+
+		if (g_raw_dev.reset) {
+			as_raw_hdr_t* header = (as_raw_hdr_t*)g_raw_dev.super;
+
+			memset(g_raw_dev.super, 0, RAW_SUPER_LEN);
+			header->magic = RAWHDR_MAG;
+			header->version = RAWHDR_VER;
+			header->n_packs = 0;
+
+			if (!write_raw_super()) {
+				return false;
+			}
+
+			g_raw_dev.reset = false;
+		}
+
+		const as_raw_hdr_t* header = (const as_raw_hdr_t*)g_raw_dev.super;
+		const as_raw_pack_t* packs =
+				(const as_raw_pack_t*)(g_raw_dev.super + sizeof(as_raw_hdr_t));
+
+		base = RAW_SUPER_LEN;
+
+		for (uint32_t i = 0; i < header->n_packs; i++) {
+			size_t end = packs[i].offset + packs[i].size;
+
+			if (end > base) {
+				base = end;
+			}
+		}
+	}
+
+	size_t offset = base + sizeof(as_pack_hdr_t)
+			+ n_ios * sizeof(as_pack_extent_t);
+
+	offset = (offset + PACK_ALIGN - 1) / PACK_ALIGN * PACK_ALIGN;
+
+	for (uint32_t i = 0; i < n_ios; i++) {
+		ios[i].offset = offset;
+		offset += (ios[i].segsz + PACK_ALIGN - 1) / PACK_ALIGN * PACK_ALIGN;
+	}
+
+	g_pack_file.base = base;
+	g_pack_file.size = offset - base;
+
+	char pathname[PATH_MAX + 1];
+
+	if (g_raw) {
+		strcpy(pathname, g_pathdir);
+	}
+	else {
+		sprintf(pathname, "%s/%08x%s", g_pathdir, pbp->key, PACK_EXTENSION);
+	}
+
+	int fd = g_raw ? open_direct(pathname, O_RDWR) :
+			open(pathname, O_CREAT | O_RDWR | O_EXCL, DEFAULT_MODE);
+
+	if (fd < 0) {
+		char errbuff[MAX_BUFFER];
+		char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
+
+		if (g_verbose) {
+			printf("Could not create pack file '%s'"
+					": error was %d: %s.\n", pathname, errno, errout);
+		}
+
+		return false;
+	}
+
+	g_pack_file.fd = fd;
+
+	// A block device can't grow - the pack must fit.
+
+	struct stat statbuf;
+
+	if (g_raw && fstat(fd, &statbuf) == 0 && S_ISBLK(statbuf.st_mode)) {
+		if (offset > g_raw_dev.size) {
+			if (g_verbose) {
+				printf("Raw container '%s' is too small: namespace needs"
+						" %lu bytes, %lu bytes left.\n", pathname,
+						offset - base,
+						g_raw_dev.size > base ? g_raw_dev.size - base : 0);
+			}
+
+			return false;
+		}
+	}
+	else {
+		int rc = posix_fallocate(fd, (off_t)base, (off_t)(offset - base));
+
+		if (rc != 0) {
+			char errbuff[MAX_BUFFER];
+			char* errout = strerror_r(rc, errbuff, MAX_BUFFER);
+
+			if (g_verbose) {
+				printf("Could not allocate storage for pack file '%s'"
+						": error was %d: %s.\n", pathname, rc, errout);
+			}
+
+			return false;
+		}
+	}
+
+	for (uint32_t i = 0; i < n_ios; i++) {
+		ios[i].fd = fd;
+	}
+
+	return true;
+}
+
+// Finish a namespace's pack, once all its segments are written - write the
+// header and extent table, sync it (just the once), and give it the base
+// segment's ownership and mode. A pack in a raw container is added to its
+// superblock instead. The extent table is padded to whole blocks, for direct
+// I/O.
+
+static bool
+finish_pack(as_io_t ios[], uint32_t n_ios)
+{
+	size_t size = sizeof(as_pack_hdr_t) + n_ios * sizeof(as_pack_extent_t);
+
+	size = (size + PACK_ALIGN - 1) / PACK_ALIGN * PACK_ALIGN;
+
+	uint8_t* buf;
+
+	if (posix_memalign((void**)&buf, PACK_ALIGN, size) != 0) {
+		if (g_verbose) {
+			printf("Could not allocate memory for pack extent table.\n");
+		}
+
+		return false;
+	}
+
+	memset(buf, 0, size);
+
+	as_pack_hdr_t* header = (as_pack_hdr_t*)buf;
+	as_pack_extent_t* extents = (as_pack_extent_t*)(buf + sizeof(as_pack_hdr_t));
+
+	header->magic = PACKHDR_MAG;
+	header->version = PACKHDR_VER;
+	header->n_extents = n_ios;
+
+	for (uint32_t i = 0; i < n_ios; i++) {
+		extents[i].key = ios[i].key;
+		extents[i].uid = ios[i].uid;
+		extents[i].gid = ios[i].gid;
+		extents[i].mode = ios[i].mode & MODE_MASK;
+		extents[i].offset = ios[i].offset;
+		extents[i].segsz = ios[i].segsz;
+	}
+
+	int fd = g_pack_file.fd;
+	bool success = pwrite_range(fd, buf, size, g_pack_file.base)
+			&& fsync(fd) == 0;
+
+	free(buf);
+	buf = NULL;
+
+	if (!success) {
+		if (g_verbose) {
+			printf("Could not write pack file %08x.\n", ios[0].key);
+		}
+
+		return false;
+	}
+
+	if (g_raw) {
+		return add_raw_pack(ios[0].key, g_pack_file.base, g_pack_file.size);
+	}
+
+	if (fchown(fd, ios[0].uid, ios[0].gid) == -1
+			|| fchmod(fd, ios[0].mode & MODE_MASK) == -1) {
+		char errbuff[MAX_BUFFER];
+		char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
+
+		if (g_verbose) {
+			printf("Unable to set uid, gid or mode for pack file %08x"
+					": error was %d: %s\n", ios[0].key, errno, errout);
+		}
+
+		return false;
+	}
+
+	return true;
+}
+
+// Check whether a namespace was backed up to a pack, in any of the backup
+// directories - or in the raw container.
+
+static bool
+have_pack(key_t key, char* pathname)
+{
+	if (g_raw) {
+		strcpy(pathname, g_pathdir);
+		return find_raw_pack(key) != NULL;
+	}
+
+	for (uint32_t t = 0; t < g_n_pathdirs; t++) {
+		sprintf(pathname, "%s/%08x%s", g_pathdirs[t], key, PACK_EXTENSION);
+
+		if (access(pathname, F_OK) == 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Open a namespace's pack, to read its segments. A restore from a raw
+// container reads them with direct I/O.
+
+static bool
+open_pack(key_t key)
+{
+	char pathname[PATH_MAX + 1];
+	size_t base = 0;
+
+	if (!have_pack(key, pathname)) {
+		sprintf(pathname, "%s/%08x%s", g_pathdir, key, PACK_EXTENSION);
+	}
+
+	if (g_raw) {
+		const as_raw_pack_t* raw_pack = find_raw_pack(key);
+
+		if (raw_pack == NULL) {
+			if (g_verbose) {
+				printf("Found no pack for base segment %08x in raw container"
+						" '%s'.\n", key, pathname);
+			}
+
+			return false;
+		}
+
+		base = raw_pack->offset;
+	}
+
+	if (!read_pack(pathname, base, &g_pack_file)) {
+		return false;
+	}
+
+	if (g_raw && g_restore) {
+		int fd = open_direct(pathname, O_RDONLY);
+
+		if (fd < 0) {
+			if (g_verbose) {
+				printf("Could not open raw container '%s' for direct"
+						" I/O.\n", pathname);
+			}
+
+			close_pack();
+			return false;
+		}
+
+		close(g_pack_file.fd);
+		g_pack_file.fd = fd;
+	}
+
+	return true;
+}
+
+// Open a pack - at an offset, in a raw container - and read its extent table.
+// Every extent must lie within the pack file or container, so a truncated pack
+// is rejected up front.
+
+static bool
+read_pack(const char* pathname, size_t base, as_pack_t* pack)
+{
+	int fd = open(pathname, O_RDONLY);
+
+	if (fd < 0) {
+		char errbuff[MAX_BUFFER];
+		char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
+
+		if (g_verbose) {
+			printf("Could not open pack file '%s'"
+					": error was %d: %s.\n", pathname, errno, errout);
+		}
+
+		return false;
+	}
+
+	as_pack_hdr_t header;
+	size_t file_size;
+
+	if (pread(fd, (void*)&header, sizeof(header), (off_t)base)
+					!= sizeof(header)
+			|| !container_size(fd, &file_size)
+			|| header.magic != PACKHDR_MAG
+			|| header.version != PACKHDR_VER
+			|| header.n_extents == 0
+			|| base + sizeof(header)
+					+ header.n_extents * sizeof(as_pack_extent_t)
+					> file_size) {
+		if (g_verbose) {
+			printf("Invalid pack file '%s'.\n", pathname);
+		}
+
+		close(fd);
+		return false;
+	}
+
+	size_t size = header.n_extents * sizeof(as_pack_extent_t);
+	as_pack_extent_t* extents = (as_pack_extent_t*)malloc(size);
+
+	if (extents == NULL
+			|| pread(fd, (void*)extents, size, (off_t)(base + sizeof(header)))
+					!= (ssize_t)size) {
+		if (g_verbose) {
+			printf("Could not read extent table of pack file '%s'.\n",
+					pathname);
+		}
+
+		free(extents);
+		close(fd);
+		return false;
+	}
+
+	for (uint32_t i = 0; i < header.n_extents; i++) {
+		if (extents[i].offset < base
+				|| extents[i].offset + extents[i].segsz > file_size) {
+			if (g_verbose) {
+				printf("Pack file '%s' is truncated: segment %08x is"
+						" missing.\n", pathname, extents[i].key);
+			}
+
+			free(extents);
+			close(fd);
+			return false;
+		}
+	}
+
+	pack->fd = fd;
+	pack->extents = extents;
+	pack->n_extents = header.n_extents;
+	pack->base = base;
+	pack->size = 0;
+
+	return true;
+}
+
+// Close the open pack (if any).
+
+static void
+close_pack(void)
+{
+	if (g_pack_file.fd >= 0) {
+		close(g_pack_file.fd);
+		g_pack_file.fd = -1;
+	}
+
+	free(g_pack_file.extents);
+	g_pack_file.extents = NULL;
+	g_pack_file.n_extents = 0;
+	g_pack_file.base = 0;
+	g_pack_file.size = 0;
+}
+
+// Find a segment's extent in the open pack (if any).
+
+static const as_pack_extent_t*
+find_pack_extent(key_t key)
+{
+	for (uint32_t i = 0; i < g_pack_file.n_extents; i++) {
+		if (g_pack_file.extents[i].key == key) {
+			return &g_pack_file.extents[i];
+		}
+	}
+
+	return NULL;
+}
+
+// Open the raw container named by the directory path - a block device or
+// preallocated file - and get its superblock. A backup starts the container
+// afresh, but only once its first pack is created - so a backup which fails
+// before then leaves the previous one intact. It won't overwrite anything but
+// a backup (or a blank device), unless forced. Restore, verify and compare
+// need a valid superblock.
+
+static bool
+open_raw(void)
+{
+	if (g_raw_dev.fd >= 0) {
+		return true;
+	}
+
+	int fd = open_direct(g_pathdir, g_backup ? O_RDWR : O_RDONLY);
+
+	if (fd < 0) {
+		char errbuff[MAX_BUFFER];
+		char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
+
+		if (g_verbose) {
+			printf("Could not open raw container \'%s\': error was %d: %s.\n",
+					g_pathdir, errno, errout);
+		}
+
+		return false;
+	}
+
+	size_t size;
+
+	if (!container_size(fd, &size) || size <= RAW_SUPER_LEN) {
+		if (g_verbose) {
+			printf("Raw container \'%s\' is too small: must be larger than"
+					" %d bytes.\n", g_pathdir, RAW_SUPER_LEN);
+		}
+
+		close(fd);
+		return false;
+	}
+
+	uint8_t* super;
+
+	if (posix_memalign((void**)&super, PACK_ALIGN, RAW_SUPER_LEN) != 0) {
+		if (g_verbose) {
+			printf("Could not allocate memory for raw container"
+					" superblock.\n");
+		}
+
+		close(fd);
+		return false;
+	}
+
+	g_raw_dev.fd = fd;
+	g_raw_dev.size = size;
+	g_raw_dev.super = super;
+
+	g_raw_dev.reset = false;
+
+	as_raw_hdr_t* header = (as_raw_hdr_t*)super;
+
+	if (pread(fd, (void*)super, RAW_SUPER_LEN, 0) != RAW_SUPER_LEN) {
+		if (g_verbose) {
+			printf("Could not read superblock of raw container \'%s\'.\n",
+					g_pathdir);
+		}
+
+		close_raw();
+		return false;
+	}
+
+	if (g_backup) {
+		bool blank = true;
+
+		for (uint32_t i = 0; blank && i < RAW_SUPER_LEN; i++) {
+			blank = super[i] == 0;
+		}
+
+		if (!blank && header->magic != RAWHDR_MAG && !g_force) {
+			if (g_verbose) {
+				printf("Raw container \'%s\' holds something other than a"
+						" backup: use \'--force\' to overwrite it.\n",
+						g_pathdir);
+			}
+
+			close_raw();
+			return false;
+		}
+
+		// Analyzing a backup leaves the container as it is.
+
+		g_raw_dev.reset = !g_analyze;
+
+		return true;
+	}
+
+	if (header->magic != RAWHDR_MAG || header->version != RAWHDR_VER
+			|| header->n_packs > (RAW_SUPER_LEN - sizeof(as_raw_hdr_t))
+					/ sizeof(as_raw_pack_t)) {
+		if (g_verbose) {
+			printf("Invalid superblock in raw container \'%s\'.\n",
+					g_pathdir);
+		}
+
+		close_raw();
+		return false;
+	}
+
+	return true;
+}
+
+// Close the raw container (if open).
+
+static void
+close_raw(void)
+{
+	if (g_raw_dev.fd >= 0) {
+		close(g_raw_dev.fd);
+		g_raw_dev.fd = -1;
+	}
+
+	free(g_raw_dev.super);
+	g_raw_dev.super = NULL;
+	g_raw_dev.size = 0;
+}
+
+// Get the size of a file - or of a block device, which has no size of its own.
+
+static bool
+container_size(int fd, size_t* size)
+{
+	struct stat statbuf;
+
+	if (fstat(fd, &statbuf) < 0) {
+		return false;
+	}
+
+	if (!S_ISBLK(statbuf.st_mode)) {
+		*size = (size_t)statbuf.st_size;
+		return true;
+	}
+
+	uint64_t dev_size;
+
+	if (ioctl(fd, BLKGETSIZE64, &dev_size) < 0) {
+		return false;
+	}
+
+	*size = (size_t)dev_size;
+
+	return true;
+}
+
+// Open a file for direct I/O, bypassing the page cache. Some file systems
+// (e.g., tmpfs) don't support it, so fall back to buffered I/O there.
+
+static int
+open_direct(const char* pathname, int flags)
+{
+	int fd = open(pathname, flags | O_DIRECT);
+
+	if (fd < 0 && errno == EINVAL) {
+		fd = open(pathname, flags);
+	}
+
+	return fd;
+}
+
+// Find a namespace's pack in the raw container's superblock (if any).
+
+static const as_raw_pack_t*
+find_raw_pack(key_t key)
+{
+	if (g_raw_dev.super == NULL) {
+		return NULL;
+	}
+
+	const as_raw_hdr_t* header = (const as_raw_hdr_t*)g_raw_dev.super;
+	const as_raw_pack_t* packs =
+			(const as_raw_pack_t*)(g_raw_dev.super + sizeof(as_raw_hdr_t));
+
+	for (uint32_t i = 0; i < header->n_packs; i++) {
+		if (packs[i].key == key) {
+			return &packs[i];
+		}
+	}
+
+	return NULL;
+}
+
+// Add a namespace's pack to the raw container's superblock, once the pack is
+// complete.
+
+static bool
+add_raw_pack(key_t key, size_t offset, size_t size)
+{
+	as_raw_hdr_t* header = (as_raw_hdr_t*)g_raw_dev.super;
+	as_raw_pack_t* packs =
+			(as_raw_pack_t*)(g_raw_dev.super + sizeof(as_raw_hdr_t));
+
+	if (header->n_packs >= (RAW_SUPER_LEN - sizeof(as_raw_hdr_t))
+			/ sizeof(as_raw_pack_t)) {
+		if (g_verbose) {
+			printf("No room for pack %08x in superblock of raw container"
+					" \'%s\'.\n", key, g_pathdir);
+		}
+
+		return false;
+	}
+
+	as_raw_pack_t* pack = &packs[header->n_packs++];
+
+	pack->key = key;
+	pack->reserved = 0;
+	pack->offset = offset;
+	pack->size = size;
+
+	return write_raw_super();
+}
+
+// Write (and sync) the raw container's superblock.
+
+static bool
+write_raw_super(void)
+{
+	if (!pwrite_range(g_raw_dev.fd, g_raw_dev.super, RAW_SUPER_LEN, 0)
+			|| fsync(g_raw_dev.fd) != 0) {
+		if (g_verbose) {
+			printf("Could not write superblock of raw container \'%s\'.\n",
+					g_pathdir);
+		}
+
+		return false;
+	}
+
+	return true;
+}
+
+// Start a backup stream - on stdout, with its header, or over connections to
+// the receiving node, each with the header and a connect frame.
+
+static bool
+open_stream(void)
+{
+	for (uint32_t c = 0; c < MAX_CONNS; c++) {
+		pthread_mutex_init(&g_conn_mutexes[c], NULL);
+	}
+
+	if (g_send_addr != NULL && !connect_stream()) {
+		return false;
+	}
+
+	as_stream_hdr_t header = { .magic = STREAMHDR_MAG,
+			.version = STREAMHDR_VER };
+
+	for (uint32_t c = 0; c < g_n_stream_fds; c++) {
+		as_frame_t frame = { .magic = FRAME_MAG, .type = FRAME_CONNECT,
+				.offset = c, .size = g_n_stream_fds };
+
+		if (g_send_addr != NULL) {
+			frame.len = strlen(g_transfer_token);
+		}
+
+		if (!write_stream(g_stream_fds[c], &header, sizeof(header))
+				|| (g_send_addr != NULL && (!write_stream(g_stream_fds[c],
+						&frame, sizeof(frame))
+						|| !write_stream(g_stream_fds[c], g_transfer_token,
+								frame.len)))) {
+			if (g_verbose) {
+				printf("Could not write backup stream header.\n");
+			}
+
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Connect to the receiving node of a transfer, given as <host>:<port> - over
+// as many connections as I/O threads, up to MAX_CONNS.
+
+static bool
+connect_stream(void)
+{
+	char host[MAX_BUFFER];
+	const char* port = strrchr(g_send_addr, ':');
+
+	if (port == NULL || port == g_send_addr || port[1] == '\0'
+			|| (size_t)(port - g_send_addr) >= sizeof(host)) {
+		if (g_verbose) {
+			printf("Invalid address \'%s\' to send to: expecting"
+					" <host>:<port>.\n", g_send_addr);
+		}
+
+		return false;
+	}
+
+	memcpy(host, g_send_addr, (size_t)(port - g_send_addr));
+	host[port - g_send_addr] = '\0';
+	port++;
+
+	struct addrinfo hints = { .ai_family = AF_UNSPEC,
+			.ai_socktype = SOCK_STREAM };
+	struct addrinfo* addrs;
+	int rc = getaddrinfo(host, port, &hints, &addrs);
+
+	if (rc != 0) {
+		if (g_verbose) {
+			printf("Could not resolve \'%s\': %s.\n", g_send_addr,
+					gai_strerror(rc));
+		}
+
+		return false;
+	}
+
+	uint32_t n_conns = g_max_threads < MAX_CONNS ? g_max_threads : MAX_CONNS;
+
+	for (uint32_t c = 0; c < n_conns; c++) {
+		int fd = -1;
+
+		for (struct addrinfo* addr = addrs; addr != NULL;
+				addr = addr->ai_next) {
+			fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+
+			if (fd < 0) {
+				continue;
+			}
+
+			if (connect(fd, addr->ai_addr, addr->ai_addrlen) == 0) {
+				break;
+			}
+
+			close(fd);
+			fd = -1;
+		}
+
+		if (fd < 0) {
+			char errbuff[MAX_BUFFER];
+			char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
+
+			if (g_verbose) {
+				printf("Could not connect to \'%s\': error was %d: %s.\n",
+						g_send_addr, errno, errout);
+			}
+
+			freeaddrinfo(addrs);
+			return false;
+		}
+
+		g_stream_fds[g_n_stream_fds++] = fd;
+	}
+
+	freeaddrinfo(addrs);
+
+	if (g_verbose) {
+		printf("Connected to \'%s\' over %u connections.\n", g_send_addr,
+				g_n_stream_fds);
+	}
+
+	return true;
+}
+
+// Finish a backup stream. Only a complete one gets an end frame, so that an
+// incomplete one is recognized as such when it's read.
+
+static bool
+close_stream(bool complete)
+{
+	as_frame_t frame = { .magic = FRAME_MAG, .type = FRAME_END };
+	bool success = !complete
+			|| write_stream(g_stream_fds[0], &frame, sizeof(frame));
+
+	for (uint32_t c = 0; c < g_n_stream_fds; c++) {
+		if (close(g_stream_fds[c]) < 0) {
+			success = false;
+		}
+	}
+
+	g_n_stream_fds = 0;
+
+	if (!success && g_verbose) {
+		printf("Could not finish backup stream.\n");
+	}
+
+	return success;
+}
+
+// Write a namespace frame to the backup stream - the namespace's name and the
+// segments of it to follow. The receiver of a transfer acks whether it wants
+// them.
+
+static bool
+write_stream_namespace(as_io_t ios[], uint32_t n_ios, const as_segment_t* pbp,
+		uint32_t* status)
+{
+	size_t len = NAMESPACE_LEN + n_ios * sizeof(as_stream_entry_t);
+	uint8_t* buf = (uint8_t*)calloc(1, len);
+
+	if (buf == NULL) {
+		if (g_verbose) {
+			printf("Could not allocate memory for namespace frame.\n");
+		}
+
+		return false;
+	}
+
+	if (pbp->nsnm != NULL) {
+		strncpy((char*)buf, pbp->nsnm, NAMESPACE_LEN);
+	}
+
+	as_stream_entry_t* entries = (as_stream_entry_t*)(buf + NAMESPACE_LEN);
+
+	for (uint32_t i = 0; i < n_ios; i++) {
+		entries[i].key = ios[i].key;
+		entries[i].uid = ios[i].uid;
+		entries[i].gid = ios[i].gid;
+		entries[i].mode = ios[i].mode & MODE_MASK;
+		entries[i].segsz = ios[i].segsz;
+	}
+
+	as_frame_t frame = { .magic = FRAME_MAG, .type = FRAME_NAMESPACE,
+			.key = pbp->key, .size = n_ios, .len = len };
+
+	bool success = write_stream(g_stream_fds[0], &frame, sizeof(frame))
+			&& write_stream(g_stream_fds[0], buf, len);
+
+	free(buf);
+	buf = NULL;
+
+	if (!success) {
+		if (g_verbose) {
+			printf("Could not write namespace frame for base segment %08x to"
+					" backup stream.\n", pbp->key);
+		}
+
+		return false;
+	}
+
+	g_n_stream_frames = 0;
+	*status = ACK_OK;
+
+	return g_send_addr == NULL || read_stream_ack(pbp->key, status);
+}
+
+// Write a namespace end frame to the backup stream, once all the namespace's
+// data frames are written. The receiver of a transfer acks whether it restored
+// the namespace.
+
+static bool
+end_stream_namespace(key_t key, uint32_t* status)
+{
+	as_frame_t frame = { .magic = FRAME_MAG, .type = FRAME_NAMESPACE_END,
+			.key = key, .size = g_n_stream_frames };
+
+	if (!write_stream(g_stream_fds[0], &frame, sizeof(frame))) {
+		if (g_verbose) {
+			printf("Could not write namespace end frame for base segment %08x"
+					" to backup stream.\n", key);
+		}
+
+		return false;
+	}
+
+	*status = ACK_OK;
+
+	return g_send_addr == NULL || read_stream_ack(key, status);
+}
+
+// Read the receiver's ack of a namespace (or namespace end) frame.
+
+static bool
+read_stream_ack(key_t key, uint32_t* status)
+{
+	as_frame_t frame;
+
+	if (!read_stream_range(g_stream_fds[0], &frame, sizeof(frame))
+			|| frame.magic != FRAME_MAG || frame.type != FRAME_ACK
+			|| frame.key != key) {
+		if (g_verbose) {
+			printf("Lost connection to \'%s\' awaiting ack for base segment"
+					" %08x.\n", g_send_addr, key);
+		}
+
+		return false;
+	}
+
+	*status = frame.flags;
+
+	if (*status == ACK_FAILED && g_verbose) {
+		printf("\nReceiver could not restore namespace of base segment"
+				" %08x.\n", key);
+	}
+
+	return true;
+}
+
+// Write an ack of a namespace (or namespace end) frame back to the sender of
+// a transfer.
+
+static bool
+write_stream_ack(int fd, key_t key, uint32_t status)
+{
+	as_frame_t frame = { .magic = FRAME_MAG, .type = FRAME_ACK, .key = key,
+			.flags = status };
+
+	return write_stream(fd, &frame, sizeof(frame));
+}
+
+// Write a chunk of a segment to the backup stream, as a data frame - deflated
+// (if that makes it smaller) and with its crc32, if requested. Chunks are
+// prepared in parallel, then written whole as they're ready, to the next free
+// connection.
+
+static bool
+stream_file(as_io_t* io, uint32_t chunk)
+{
+	size_t offset = (size_t)chunk * IOCHUNK;
+	size_t size = io_chunk_size(io, chunk);
+	const uint8_t* data = (const uint8_t*)io->memptr + offset;
+
+	as_frame_t frame = { .magic = FRAME_MAG, .type = FRAME_DATA,
+			.key = io->key, .offset = offset, .size = size, .len = size };
+
+	if (g_crc32) {
+		frame.flags |= FRAME_CRC32;
+		frame.crc = (uint32_t)crc32_z(crc32(0L, Z_NULL, 0), data, size);
+	}
+
+	const void* payload = data;
+	uint8_t* buf = NULL;
+
+	if (io->compress) {
+		uLongf len = compressBound((uLong)size);
+
+		buf = (uint8_t*)malloc(len);
+
+		if (buf == NULL || compress2(buf, &len, data, (uLong)size,
+				Z_BEST_SPEED) != Z_OK) {
+			if (g_verbose) {
+				printf("Could not compress segment %08x for backup stream.\n",
+						io->key);
+			}
+
+			free(buf);
+			return false;
+		}
+
+		if (len < size) {
+			frame.flags |= FRAME_DEFLATED;
+			frame.len = len;
+			payload = buf;
+		}
+	}
+
+	// Take the first free connection, starting from the next in turn - or wait
+	// for that one.
+
+	pthread_mutex_lock(&g_stream_mutex);
+
+	uint32_t c = g_next_stream_fd++ % g_n_stream_fds;
+
+	g_n_stream_frames++;
+
+	pthread_mutex_unlock(&g_stream_mutex);
+
+	uint32_t i = 0;
+
+	while (i < g_n_stream_fds
+			&& pthread_mutex_trylock(&g_conn_mutexes[c]) != 0) {
+		c = (c + 1) % g_n_stream_fds;
+		i++;
+	}
+
+	if (i == g_n_stream_fds) {
+		pthread_mutex_lock(&g_conn_mutexes[c]);
+	}
+
+	bool success = write_stream(g_stream_fds[c], &frame, sizeof(frame))
+			&& write_stream(g_stream_fds[c], payload, frame.len);
+
+	pthread_mutex_unlock(&g_conn_mutexes[c]);
+
+	free(buf);
+	buf = NULL;
+
+	if (!success) {
+		if (g_verbose) {
+			printf("Could not write segment %08x to backup stream.\n",
+					io->key);
+		}
+
+		return false;
+	}
+
+	pthread_mutex_lock(&g_stream_mutex);
+	io->filsz += sizeof(frame) + frame.len;
+	pthread_mutex_unlock(&g_stream_mutex);
+
+	return true;
+}
+
+// Write to a backup stream, which may be a pipe or socket - so write(2), not
+// pwrite(2).
+
+static bool
+write_stream(int fd, const void* buf, size_t size)
+{
+	size_t done = 0;
+
+	while (done < size) {
+		ssize_t result = write(fd, (const uint8_t*)buf + done, size - done);
+
+		if (result < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (result <= 0) {
+			return false;
+		}
+
+		done += (size_t)result;
+	}
+
+	return true;
+}
+
+// Restore (or verify) the namespaces in a backup stream - on stdin, or over
+// the connections of a transfer, each read by its own thread - in a single
+// pass. Each namespace's segments are created as soon as its namespace frame
+// arrives, then filled in as its data frames do. Namespaces which don't pass
+// the filter are skipped. A namespace which fails doesn't stop the others.
+
+static bool
+read_stream(void)
+{
+	if (g_receive_addr != NULL) {
+		if (!accept_stream()) {
+			return false;
+		}
+	}
+	else if (!read_stream_header(g_stream_fds[0], NULL, NULL)) {
+		return false;
+	}
+
+	memset(&g_stream_state, 0, sizeof(g_stream_state));
+	g_stream_state.success = true;
+	g_stream_state.n_live = g_n_stream_fds;
+
+	if (g_n_stream_fds == 1) {
+		read_stream_frames(g_stream_fds[0]);
+	}
+	else {
+		pthread_t threads[g_n_stream_fds];
+		uint32_t n_threads = 0;
+
+		for (uint32_t c = 0; c < g_n_stream_fds; c++) {
+			if (pthread_create(&threads[n_threads], NULL, run_stream,
+					(void*)(uintptr_t)g_stream_fds[c]) != 0) {
+				// Closing the connection stops the sender, and the namespace
+				// in progress is failed.
+
+				pthread_mutex_lock(&g_stream_mutex);
+				g_stream_state.n_live--;
+				g_stream_state.success = false;
+				pthread_mutex_unlock(&g_stream_mutex);
+
+				shutdown(g_stream_fds[c], SHUT_RDWR);
+				continue;
+			}
+
+			n_threads++;
+		}
+
+		for (uint32_t t = 0; t < n_threads; t++) {
+			pthread_join(threads[t], NULL);
+		}
+	}
+
+	// Every connection's been read to its end. The stream should have ended
+	// properly.
+
+	if (!g_stream_state.ended) {
+		if (g_verbose) {
+			printf("Backup stream ended early.\n");
+		}
+
+		pthread_mutex_lock(&g_stream_mutex);
+
+		if (g_stream_state.segs != NULL) {
+			finish_stream_namespace(false);
+		}
+
+		g_stream_state.success = false;
+
+		pthread_mutex_unlock(&g_stream_mutex);
+	}
+
+	free(g_stream_state.nsnm);
+	g_stream_state.nsnm = NULL;
+
+	if (g_receive_addr != NULL) {
+		for (uint32_t c = 0; c < g_n_stream_fds; c++) {
+			close(g_stream_fds[c]);
+		}
+
+		g_n_stream_fds = 0;
+	}
+
+	if (g_stream_state.success && g_stream_state.n_namespaces == 0
+			&& g_verbose) {
+		printf("\nDid not find any Aerospike database segments in the backup"
+				" stream");
+		print_insts();
+		if (g_nsnm_count != 0) {
+			printf(", namespace \'%s\'", g_nsnm_base);
+		}
+		printf(".\n");
+	}
+
+	return g_stream_state.success;
+}
+
+// Wait for the sending node of a transfer to connect, on the [<addr>:]<port>
+// given - and then for the rest of its connections. A connection which doesn't
+// present the shared token in time, or whose index is already taken, is turned
+// away, and we carry on waiting - but not beyond ACCEPT_TIMEOUT. A connection
+// which stalls once the transfer is under way times out after S3_TIMEOUT.
+
+static bool
+accept_stream(void)
+{
+	char host[MAX_BUFFER];
+	const char* port = strrchr(g_receive_addr, ':');
+
+	if (port != NULL && (port == g_receive_addr
+			|| (size_t)(port - g_receive_addr) >= sizeof(host))) {
+		if (g_verbose) {
+			printf("Invalid address '%s' to receive on: expecting"
+					" [<addr>:]<port>.\n", g_receive_addr);
+		}
+
+		return false;
+	}
+
+	if (port != NULL) {
+		memcpy(host, g_receive_addr, (size_t)(port - g_receive_addr));
+		host[port - g_receive_addr] = '\0';
+		port++;
+	}
+	else {
+		port = g_receive_addr;
+	}
+
+	struct addrinfo hints = { .ai_family = AF_UNSPEC,
+			.ai_socktype = SOCK_STREAM, .ai_flags = AI_PASSIVE };
+	struct addrinfo* addrs;
+	int rc = getaddrinfo(port != g_receive_addr ? host : NULL, port, &hints,
+			&addrs);
+
+	if (rc != 0) {
+		if (g_verbose) {
+			printf("Invalid address '%s' to receive on: %s.\n",
+					g_receive_addr, gai_strerror(rc));
+		}
+
+		return false;
+	}
+
+	int listen_fd = -1;
+
+	for (struct addrinfo* addr = addrs; addr != NULL; addr = addr->ai_next) {
+		listen_fd = socket(addr->ai_family, addr->ai_socktype,
+				addr->ai_protocol);
+
+		if (listen_fd < 0) {
+			continue;
+		}
+
+		int on = 1;
+
+		(void)setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+		if (bind(listen_fd, addr->ai_addr, addr->ai_addrlen) == 0
+				&& listen(listen_fd, MAX_CONNS) == 0) {
+			break;
+		}
+
+		close(listen_fd);
+		listen_fd = -1;
+	}
+
+	freeaddrinfo(addrs);
+
+	if (listen_fd < 0) {
+		char errbuff[MAX_BUFFER];
+		char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
+
+		if (g_verbose) {
+			printf("Could not listen on '%s': error was %d: %s.\n",
+					g_receive_addr, errno, errout);
+		}
+
+		return false;
+	}
+
+	if (g_verbose) {
+		printf("Waiting for connections on '%s'.\n", g_receive_addr);
+	}
+
+	// The first connection says how many there are.
+
+	time_t deadline = time(NULL) + ACCEPT_TIMEOUT;
+	uint32_t n_conns = 1;
+	bool connected[MAX_CONNS] = { false };
+
+	while (g_n_stream_fds < n_conns) {
+		char peer[NI_MAXHOST];
+		int fd = accept_connection(listen_fd, deadline, peer, sizeof(peer));
+
+		if (fd < 0) {
+			break;
+		}
+
+		// Don't let a connection which never sends its header hold us up.
+
+		struct timeval timeout = { .tv_sec = HEADER_TIMEOUT };
+
+		(void)setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+				sizeof(timeout));
+
+		uint32_t conn_n_conns;
+		uint32_t conn;
+
+		if (!read_stream_header(fd, &conn_n_conns, &conn)
+				|| (g_n_stream_fds != 0 && conn_n_conns != n_conns)
+				|| connected[conn]) {
+			if (g_verbose) {
+				printf("Rejected connection from '%s'.\n", peer);
+			}
+
+			close(fd);
+			continue;
+		}
+
+		// Nor one which stalls mid-transfer.
+
+		timeout.tv_sec = S3_TIMEOUT;
+
+		(void)setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+				sizeof(timeout));
+
+		connected[conn] = true;
+		g_stream_fds[g_n_stream_fds++] = fd;
+		n_conns = conn_n_conns;
+	}
+
+	close(listen_fd);
+
+	if (g_n_stream_fds != n_conns) {
+		for (uint32_t c = 0; c < g_n_stream_fds; c++) {
+			close(g_stream_fds[c]);
+		}
+
+		g_n_stream_fds = 0;
+
+		return false;
+	}
+
+	if (g_verbose) {
+		printf("Receiving over %u connections.\n", n_conns);
+	}
+
+	return true;
+}
+
+// Accept a connection on a listening socket, waiting no later than deadline.
+// Returns the connection's fd, with the peer's address in peer, or -1.
+
+static int
+accept_connection(int listen_fd, time_t deadline, char* peer, size_t size)
+{
+	struct pollfd pfd = { .fd = listen_fd, .events = POLLIN };
+	int rc;
+
+	do {
+		time_t now = time(NULL);
+
+		rc = now >= deadline ?
+				0 : poll(&pfd, 1, (int)(deadline - now) * 1000);
+	} while (rc < 0 && errno == EINTR);
+
+	if (rc == 0) {
+		if (g_verbose) {
+			printf("Timed out waiting for connections after %d seconds.\n",
+					ACCEPT_TIMEOUT);
+		}
+
+		return -1;
+	}
+
+	struct sockaddr_storage addr;
+	socklen_t addr_len = sizeof(addr);
+	int fd = rc < 0 ? -1 : accept(listen_fd, (struct sockaddr*)&addr,
+			&addr_len);
+
+	if (fd < 0) {
+		char errbuff[MAX_BUFFER];
+		char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
+
+		if (g_verbose) {
+			printf("Could not accept connection: error was %d: %s.\n",
+					errno, errout);
+		}
+
+		return -1;
+	}
+
+	if (getnameinfo((struct sockaddr*)&addr, addr_len, peer, (socklen_t)size,
+			NULL, 0, NI_NUMERICHOST) != 0) {
+		strcpy(peer, "unknown");
+	}
+
+	return fd;
+}
+
+// Read a backup stream's header - and, for a connection of a transfer, its
+// connect frame, giving the number of connections and this one's index.
+
+static bool
+read_stream_header(int fd, uint32_t* n_conns, uint32_t* conn)
+{
+	as_stream_hdr_t header;
+
+	if (!read_stream_range(fd, &header, sizeof(header))
+			|| header.magic != STREAMHDR_MAG
+			|| header.version != STREAMHDR_VER) {
+		if (g_verbose) {
+			printf("Invalid backup stream header.\n");
+		}
+
+		return false;
+	}
+
+	if (n_conns == NULL) {
+		return true;
+	}
+
+	as_frame_t frame;
+
+	if (!read_stream_range(fd, &frame, sizeof(frame))
+			|| frame.magic != FRAME_MAG || frame.type != FRAME_CONNECT
+			|| frame.size == 0 || frame.size > MAX_CONNS
+			|| frame.offset >= frame.size || frame.len > MAX_TOKEN_LEN) {
+		if (g_verbose) {
+			printf("Invalid backup stream connect frame.\n");
+		}
+
+		return false;
+	}
+
+	// The token must match ours. Every byte is compared, however early they
+	// differ, so that the time taken doesn't give it away.
+
+	char token[MAX_TOKEN_LEN] = { 0 };
+	size_t len = strlen(g_transfer_token);
+
+	if (!read_stream_range(fd, token, (size_t)frame.len)) {
+		if (g_verbose) {
+			printf("Invalid backup stream connect frame.\n");
+		}
+
+		return false;
+	}
+
+	uint8_t diff = frame.len != len;
+
+	for (size_t i = 0; i < len; i++) {
+		diff |= (uint8_t)(token[i] ^ g_transfer_token[i]);
+	}
+
+	if (diff != 0) {
+		if (g_verbose) {
+			printf("Connection presented the wrong transfer token.\n");
+		}
+
+		return false;
+	}
+
+	*n_conns = (uint32_t)frame.size;
+	*conn = (uint32_t)frame.offset;
+
+	return true;
+}
+
+// Read one of the connections of a transfer.
+
+static void*
+run_stream(void* args)
+{
+	read_stream_frames((int)(uintptr_t)args);
+
+	return NULL;
+}
+
+// Read frames from a backup stream (or one of its connections) until its end.
+// Any failure is recorded in the shared state.
+
+static void
+read_stream_frames(int fd)
+{
+	uint8_t* inbuf = (uint8_t*)malloc(compressBound(IOCHUNK));
+	uint8_t* scratch = g_verify ? (uint8_t*)malloc(IOCHUNK) : NULL;
+	bool done = inbuf == NULL || (g_verify && scratch == NULL);
+
+	if (done) {
+		if (g_verbose) {
+			printf("Could not allocate memory for backup stream.\n");
+		}
+
+		pthread_mutex_lock(&g_stream_mutex);
+		g_stream_state.success = false;
+		pthread_mutex_unlock(&g_stream_mutex);
+	}
+
+	while (!done) {
+		as_frame_t frame;
+
+		// A connection ends after the stream's end frame (or early, which is
+		// caught once all the connections have ended).
+
+		if (!read_stream_range(fd, &frame, sizeof(frame))) {
+			break;
+		}
+
+		if (frame.magic != FRAME_MAG) {
+			if (g_verbose) {
+				printf("Backup stream is corrupt.\n");
+			}
+
+			pthread_mutex_lock(&g_stream_mutex);
+			g_stream_state.success = false;
+			pthread_mutex_unlock(&g_stream_mutex);
+			break;
+		}
+
+		switch (frame.type) {
+		case FRAME_NAMESPACE:
+			pthread_mutex_lock(&g_stream_mutex);
+
+			// The previous namespace never ended - its backup failed.
+
+			if (g_stream_state.segs != NULL) {
+				finish_stream_namespace(false);
+				g_stream_state.success = false;
+			}
+
+			pthread_mutex_unlock(&g_stream_mutex);
+
+			uint32_t status;
+
+			if (!start_stream_namespace(fd, &frame, &status)) {
+				pthread_mutex_lock(&g_stream_mutex);
+				g_stream_state.success = false;
+				pthread_mutex_unlock(&g_stream_mutex);
+
+				done = true;
+				break;
+			}
+
+			if (g_receive_addr != NULL
+					&& !write_stream_ack(fd, frame.key, status)) {
+				done = true;
+			}
+			break;
+
+		case FRAME_DATA:
+			pthread_mutex_lock(&g_stream_mutex);
+
+			// Data for a namespace which was skipped (or failed) is read
+			// past.
+
+			bool wanted = g_stream_state.segs != NULL
+					&& !g_stream_state.failed;
+
+			if (wanted) {
+				g_stream_state.n_in_flight++;
+			}
+
+			pthread_mutex_unlock(&g_stream_mutex);
+
+			bool ok = true;
+			bool read = wanted ?
+					read_stream_data(fd, &frame, inbuf, scratch, &ok) :
+					skip_stream(fd, frame.len);
+
+			pthread_mutex_lock(&g_stream_mutex);
+
+			if (wanted) {
+				g_stream_state.n_in_flight--;
+			}
+
+			if (!read || !ok) {
+				g_stream_state.failed = true;
+			}
+
+			if (!read) {
+				g_stream_state.success = false;
+				done = true;
+			}
+
+			g_stream_state.n_frames++;
+
+			pthread_cond_broadcast(&g_stream_cond);
+			pthread_mutex_unlock(&g_stream_mutex);
+			break;
+
+		case FRAME_NAMESPACE_END:
+			pthread_mutex_lock(&g_stream_mutex);
+
+			// Wait for the namespace's data frames still on their way over the
+			// other connections - unless one of them is lost.
+
+			while (g_stream_state.n_frames < frame.size
+					&& g_stream_state.n_live == g_n_stream_fds) {
+				pthread_cond_wait(&g_stream_cond, &g_stream_mutex);
+			}
+
+			if (frame.key != g_stream_state.key
+					|| g_stream_state.n_frames != frame.size) {
+				g_stream_state.failed = true;
+			}
+
+			if (g_stream_state.segs != NULL) {
+				finish_stream_namespace(!g_stream_state.failed);
+			}
+
+			bool failed = g_stream_state.failed;
+
+			if (failed) {
+				g_stream_state.success = false;
+			}
+
+			pthread_mutex_unlock(&g_stream_mutex);
+
+			if (g_receive_addr != NULL && !write_stream_ack(fd, frame.key,
+					failed ? ACK_FAILED : ACK_OK)) {
+				done = true;
+			}
+			break;
+
+		case FRAME_END:
+			pthread_mutex_lock(&g_stream_mutex);
+
+			if (g_stream_state.segs != NULL) {
+				finish_stream_namespace(false);
+				g_stream_state.success = false;
+			}
+
+			g_stream_state.ended = true;
+
+			pthread_mutex_unlock(&g_stream_mutex);
+
+			done = true;
+			break;
+
+		default:
+			if (g_verbose) {
+				printf("Backup stream has invalid frame type %u.\n",
+						frame.type);
+			}
+
+			pthread_mutex_lock(&g_stream_mutex);
+			g_stream_state.success = false;
+			pthread_mutex_unlock(&g_stream_mutex);
+
+			done = true;
+			break;
+		}
+	}
+
+	free(inbuf);
+	free(scratch);
+
+	pthread_mutex_lock(&g_stream_mutex);
+	g_stream_state.n_live--;
+	pthread_cond_broadcast(&g_stream_cond);
+	pthread_mutex_unlock(&g_stream_mutex);
+}
+
+// Start on a namespace in a backup stream, given its namespace frame - create
+// (or, verifying, just list) its segments, if it passes the filter. Returns
+// false if the stream is corrupt, else the status to ack.
+
+static bool
+start_stream_namespace(int fd, const as_frame_t* frame, uint32_t* status)
+{
+	char name[PATH_MAX + 1];
+	as_file_t base_file;
+
+	sprintf(name, "%08x%s", frame->key, FILE_EXTENSION);
+
+	if (frame->size == 0 || frame->size > MAX_FRAME_SEGS
+			|| frame->len != NAMESPACE_LEN
+					+ frame->size * sizeof(as_stream_entry_t)
+			|| !validate_file_name(name, &base_file)
+			|| base_file.type != TYPE_BASE) {
+		if (g_verbose) {
+			printf("Backup stream has invalid namespace frame.\n");
+		}
+
+		return false;
+	}
+
+	uint32_t n_entries = (uint32_t)frame->size;
+	as_stream_seg_t* segs =
+			(as_stream_seg_t*)calloc(n_entries, sizeof(as_stream_seg_t));
+	char nsnm[NAMESPACE_LEN + 1];
+
+	if (segs == NULL || !read_stream_range(fd, nsnm, NAMESPACE_LEN)) {
+		if (g_verbose) {
+			printf("Could not read namespace frame from backup stream.\n");
+		}
+
+		free(segs);
+		return false;
+	}
+
+	nsnm[NAMESPACE_LEN] = '\0';
+
+	for (uint32_t i = 0; i < n_entries; i++) {
+		as_stream_seg_t* seg = &segs[i];
+		as_file_t valid_file;
+
+		seg->shmid = -1;
+		seg->memptr = NULL;
+
+		if (!read_stream_range(fd, &seg->entry, sizeof(as_stream_entry_t))) {
+			free(segs);
+			return false;
+		}
+
+		// Every segment listed must belong to the namespace.
+
+		sprintf(name, "%08x%s", seg->entry.key, FILE_EXTENSION);
+
+		if (!validate_file_name(name, &valid_file)
+				|| valid_file.inst != base_file.inst
+				|| valid_file.nsid != base_file.nsid) {
+			if (g_verbose) {
+				printf("Backup stream lists segment %08x under base segment"
+						" %08x.\n", seg->entry.key, frame->key);
+			}
+
+			free(segs);
+			return false;
+		}
+	}
+
+	pthread_mutex_lock(&g_stream_mutex);
+
+	g_stream_state.key = frame->key;
+	free(g_stream_state.nsnm);
+	g_stream_state.nsnm = strdup(nsnm);
+	g_stream_state.segs = NULL;
+	g_stream_state.n_segs = 0;
+	g_stream_state.failed = false;
+	g_stream_state.n_frames = 0;
+
+	pthread_mutex_unlock(&g_stream_mutex);
+
+	// Check whether the namespace passes the filter.
+
+	if (!inst_selected(base_file.inst) || !stream_nsnm_selected(nsnm)) {
+		free(segs);
+		*status = ACK_SKIPPED;
+		return true;
+	}
+
+	// Verifying, the segments are only checked, not created. Segments not yet
+	// created when one can't be have no shmid, so aren't removed.
+
+	bool ok = true;
+
+	for (uint32_t i = 0; !g_verify && i < n_entries; i++) {
+		as_stream_seg_t* seg = &segs[i];
+
+		seg->shmid = shmget(seg->entry.key, (size_t)seg->entry.segsz,
+				SHMGET_FLAGS_CREATE_ONLY);
+
+		if (seg->shmid < 0) {
+			char errbuff[MAX_BUFFER];
+			char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
+
+			if (g_verbose) {
+				printf("Could not create segment with key %08x"
+						": error was %d: %s.\n", seg->entry.key, errno,
+						errout);
+			}
+
+			ok = false;
+			break;
+		}
+
+		seg->memptr = (uint8_t*)shmat(seg->shmid, NULL, 0);
+
+		if (seg->memptr == (void*)-1) {
+			char errbuff[MAX_BUFFER];
+			char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
+
+			if (g_verbose) {
+				printf("Could not attach segment %08x"
+						": error was %d: %s.\n", seg->entry.key, errno,
+						errout);
+			}
+
+			seg->memptr = NULL;
+			ok = false;
+			break;
+		}
+	}
+
+	pthread_mutex_lock(&g_stream_mutex);
+
+	g_stream_state.segs = segs;
+	g_stream_state.n_segs = n_entries;
+	g_stream_state.n_namespaces++;
+
+	if (!ok) {
+		finish_stream_namespace(false);
+		g_stream_state.success = false;
+	}
+
+	pthread_mutex_unlock(&g_stream_mutex);
+
+	*status = ok ? ACK_OK : ACK_FAILED;
+
+	return true;
+}
+
+// Read a data frame from a backup stream into its segment (or, verifying,
+// into scratch), inflating it and checking its crc32 as flagged. Returns false
+// if the stream is corrupt, or sets ok false if the data is bad.
+
+static bool
+read_stream_data(int fd, const as_frame_t* frame, uint8_t* inbuf,
+		uint8_t* scratch, bool* ok)
+{
+	*ok = true;
+
+	as_stream_seg_t* seg = NULL;
+
+	for (uint32_t i = 0; i < g_stream_state.n_segs; i++) {
+		if (g_stream_state.segs[i].entry.key == frame->key) {
+			seg = &g_stream_state.segs[i];
+			break;
+		}
+	}
+
+	bool deflated = (frame->flags & FRAME_DEFLATED) != 0;
+
+	if (seg == NULL || frame->size == 0 || frame->size > IOCHUNK
+			|| frame->offset + frame->size > seg->entry.segsz
+			|| (deflated ? frame->len > compressBound(IOCHUNK) :
+					frame->len != frame->size)) {
+		if (g_verbose) {
+			printf("Backup stream has invalid data frame for segment %08x.\n",
+					frame->key);
+		}
+
+		return false;
+	}
+
+	uint8_t* dest = g_verify ? scratch : seg->memptr + frame->offset;
+
+	if (!read_stream_range(fd, deflated ? inbuf : dest, (size_t)frame->len)) {
+		if (g_verbose) {
+			printf("Backup stream is truncated.\n");
+		}
+
+		return false;
+	}
+
+	if (deflated) {
+		uLongf size = (uLongf)frame->size;
+
+		if (uncompress(dest, &size, inbuf, (uLong)frame->len) != Z_OK
+				|| size != frame->size) {
+			if (g_verbose) {
+				printf("Could not inflate segment %08x at offset %lu from"
+						" backup stream.\n", frame->key, frame->offset);
+			}
+
+			*ok = false;
+			return true;
+		}
+	}
+
+	if ((frame->flags & FRAME_CRC32) != 0 && (uint32_t)crc32_z(
+			crc32(0L, Z_NULL, 0), dest, (size_t)frame->size) != frame->crc) {
+		if (g_verbose) {
+			printf("crc32 mismatch in segment %08x at offset %lu in backup"
+					" stream.\n", frame->key, frame->offset);
+		}
+
+		*ok = false;
+		return true;
+	}
+
+	pthread_mutex_lock(&g_stream_mutex);
+	seg->received += (size_t)frame->size;
+	pthread_mutex_unlock(&g_stream_mutex);
+
+	return true;
+}
+
+// Finish the namespace being restored (or verified) from a backup stream -
+// complete if every byte of every segment arrived. Its segments are detached
+// and given their ownership, or removed if it's incomplete. Called with the
+// stream mutex held, once no data frames are being read into the segments.
+
+static bool
+finish_stream_namespace(bool complete)
+{
+	while (g_stream_state.n_in_flight != 0) {
+		pthread_cond_wait(&g_stream_cond, &g_stream_mutex);
+	}
+
+	as_stream_seg_t* segs = g_stream_state.segs;
+	uint32_t n_segs = g_stream_state.n_segs;
+	bool success = complete;
+
+	for (uint32_t i = 0; success && i < n_segs; i++) {
+		if (segs[i].received != segs[i].entry.segsz) {
+			if (g_verbose) {
+				printf("Backup stream is missing data for segment %08x.\n",
+						segs[i].entry.key);
+			}
+
+			success = false;
+		}
+	}
+
+	for (uint32_t i = 0; i < n_segs; i++) {
+		as_stream_seg_t* seg = &segs[i];
+
+		if (seg->memptr != NULL) {
+			shmdt(seg->memptr);
+			seg->memptr = NULL;
+		}
+
+		if (seg->shmid >= 0 && success && !set_segment_owner(seg->shmid,
+				seg->entry.mode, seg->entry.uid, seg->entry.gid)) {
+			success = false;
+		}
+	}
+
+	// Remove all created segments (only on failure case).
+
+	for (uint32_t i = 0; !success && i < n_segs; i++) {
+		if (segs[i].shmid >= 0) {
+			shmctl(segs[i].shmid, IPC_RMID, NULL);
+		}
+	}
+
+	if (g_verbose) {
+		char name[PATH_MAX + 1];
+		as_file_t base_file = { 0 };
+
+		sprintf(name, "%08x%s", g_stream_state.key, FILE_EXTENSION);
+		validate_file_name(name, &base_file);
+
+		printf("%s %u Aerospike database segments from backup stream for"
+				" instance %u, namespace \'%s\' (nsid %u).\n",
+				success ?
+						(g_verify ? "Successfully verified" :
+								"Successfully restored") :
+						(g_verify ? "Failed to verify" : "Failed to restore"),
+				n_segs, base_file.inst,
+				g_stream_state.nsnm == NULL ? "<null>" : g_stream_state.nsnm,
+				base_file.nsid);
+	}
+
+	free(segs);
+	g_stream_state.segs = NULL;
+	g_stream_state.n_segs = 0;
+	g_stream_state.failed = !success;
+
+	return success;
+}
+
+// Check whether a namespace in a backup stream passes the namespace filter.
+
+static bool
+stream_nsnm_selected(const char* nsnm)
+{
+	if (g_nsnm_count == 0) {
+		return true;
+	}
+
+	for (uint32_t i = 0; i < g_nsnm_count; i++) {
+		if (strcmp(g_nsnm_array[i], nsnm) == 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Read from a backup stream, which may be a pipe or socket - so read(2), not
+// pread(2).
+
+static bool
+read_stream_range(int fd, void* buf, size_t size)
+{
+	size_t done = 0;
+
+	while (done < size) {
+		ssize_t result = read(fd, (uint8_t*)buf + done, size - done);
+
+		if (result < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (result <= 0) {
+			return false;
+		}
+
+		done += (size_t)result;
+	}
+
+	return true;
+}
+
+// Read past a frame's payload in a backup stream.
+
+static bool
+skip_stream(int fd, uint64_t len)
+{
+	uint8_t buf[MAX_BUFFER];
+
+	while (len != 0) {
+		size_t size = len < sizeof(buf) ? (size_t)len : sizeof(buf);
+
+		if (!read_stream_range(fd, buf, size)) {
+			return false;
+		}
+
+		len -= size;
+	}
+
+	return true;
+}
+
+// Give a restored segment its ownership and mode.
+
+static bool
+set_segment_owner(int shmid, mode_t mode, uid_t uid, gid_t gid)
+{
+	struct shmid_ds shmid_ds = { .shm_perm.uid = uid, .shm_perm.gid = gid,
+			.shm_perm.mode = (short unsigned)(mode & MODE_MASK), };
+
+	if (shmctl(shmid, IPC_SET, &shmid_ds) == -1) {
+		char errbuff[MAX_BUFFER];
+		char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
+
+		if (g_verbose) {
+			printf("Unable to set uid, gid, or mode for shared memory segment"
+					": error was %d: %s\n", errno, errout);
+		}
+
+		return false;
+	}
+
+	return true;
+}
+
+// Set up access to the object store given as s3://<bucket>[/<prefix>] - its
+// endpoint, region and credentials. The credentials are taken from the
+// environment, as for other S3 tools. Only plain HTTP is spoken, so AWS's own
+// endpoints are refused - they'd get data and credentials in cleartext.
+
+static bool
+open_s3(void)
+{
+	if (g_s3_store.bucket != NULL) {
+		return true;
+	}
+
+	// Seed the jitter of retry backoffs, so that processes retrying against
+	// the same store don't all back off on the same schedule.
+
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	srandom((unsigned int)(now.tv_sec ^ now.tv_nsec ^ (getpid() << 16)));
+
+	const char* path = g_pathdir + strlen(S3_SCHEME);
+	const char* slash = strchr(path, '/');
+
+	g_s3_store.bucket = slash == NULL ?
+			strdup(path) : strndup(path, (size_t)(slash - path));
+	g_s3_store.prefix = strdup(slash == NULL ? "" : slash + 1);
+
+	if (g_s3_store.bucket == NULL || g_s3_store.prefix == NULL) {
+		if (g_verbose) {
+			printf("Could not allocate memory for object store.\n");
+		}
+
+		return false;
+	}
+
+	// Objects are named <prefix>/<key>.dat - drop any trailing slashes.
+
+	size_t len = strlen(g_s3_store.prefix);
+
+	while (len != 0 && g_s3_store.prefix[len - 1] == '/') {
+		g_s3_store.prefix[--len] = '\0';
+	}
+
+	if (g_s3_store.bucket[0] == '\0') {
+		if (g_verbose) {
+			printf("Invalid object store \'%s\': expecting"
+					" s3://<bucket>[/<prefix>].\n", g_pathdir);
+		}
+
+		return false;
+	}
+
+	g_s3_store.region = getenv("AWS_REGION");
+
+	if (g_s3_store.region == NULL) {
+		g_s3_store.region = getenv("AWS_DEFAULT_REGION");
+	}
+
+	if (g_s3_store.region == NULL) {
+		g_s3_store.region = S3_DEFAULT_REGION;
+	}
+
+	g_s3_store.access_key = getenv("AWS_ACCESS_KEY_ID");
+	g_s3_store.secret_key = getenv("AWS_SECRET_ACCESS_KEY");
+	g_s3_store.token = getenv("AWS_SESSION_TOKEN");
+
+	if (g_s3_store.access_key == NULL || g_s3_store.secret_key == NULL) {
+		if (g_verbose) {
+			printf("Must set AWS_ACCESS_KEY_ID and AWS_SECRET_ACCESS_KEY to"
+					" use an object store.\n");
+		}
+
+		return false;
+	}
+
+	char endpoint[MAX_BUFFER];
+
+	snprintf(endpoint, sizeof(endpoint), "%s", g_s3_endpoint);
+
+	char* port = strrchr(endpoint, ':');
+
+	if (port != NULL) {
+		*port++ = '\0';
+	}
+
+	size_t host_len = strlen(endpoint);
+	size_t aws_len = strlen(S3_AWS_DOMAIN);
+
+	if (host_len >= aws_len
+			&& strcasecmp(endpoint + host_len - aws_len, S3_AWS_DOMAIN) == 0) {
+		if (g_verbose) {
+			printf("Won't send to '%s' over plain HTTP: go through a"
+					" TLS-terminating proxy.\n", g_s3_endpoint);
+		}
+
+		return false;
+	}
+
+	g_s3_store.host = strdup(endpoint);
+	g_s3_store.port = strdup(port == NULL ? S3_DEFAULT_PORT : port);
+
+	if (g_s3_store.host == NULL || g_s3_store.port == NULL
+			|| g_s3_store.host[0] == '\0' || g_s3_store.port[0] == '\0') {
+		if (g_verbose) {
+			printf("Invalid object store endpoint \'%s\': expecting"
+					" <host>[:<port>].\n", g_s3_endpoint);
+		}
+
+		return false;
+	}
+
+	return true;
+}
+
+static void
+close_s3(void)
+{
+	free(g_s3_store.bucket);
+	g_s3_store.bucket = NULL;
+
+	free(g_s3_store.prefix);
+	g_s3_store.prefix = NULL;
+
+	free(g_s3_store.host);
+	g_s3_store.host = NULL;
+
+	free(g_s3_store.port);
+	g_s3_store.port = NULL;
+}
+
+// Make a request to the object store, signed with AWS Signature Version 4.
+// The object is named within the prefix - or, if NULL, the request is for the
+// bucket. The query must already be in canonical form. A body with a crc32
+// is sent with it, for the store to check. A ranged get of size bytes at
+// offset is read straight into buf - any other response body is handed back,
+// to be freed by the caller. Transient failures (including 503 SlowDown) are
+// retried, after an exponential backoff with jitter. Returns false if there
+// was no response.
+
+static bool
+s3_request(const char* method, const char* name, const char* query,
+		const as_io_t* meta, const void* body, size_t body_len,
+		const uLong* body_crc, size_t offset, size_t size, void* buf,
+		as_s3_resp_t* resp)
+{
+	for (uint32_t tries = 1; ; tries++) {
+		memset(resp, 0, sizeof(as_s3_resp_t));
+
+		bool success = s3_try_request(method, name, query, meta, body,
+				body_len, body_crc, offset, size, buf, resp);
+
+		if ((success && resp->status < 500) || tries == S3_MAX_TRIES) {
+			return success;
+		}
+
+		// Wait somewhere between half and all of the backoff, so that
+		// parallel requests don't all come back at once.
+
+		uint32_t backoff_ms = (uint32_t)S3_BACKOFF_MS << (tries - 1);
+		uint32_t delay_ms = backoff_ms / 2
+				+ (uint32_t)random() % (backoff_ms / 2 + 1);
+
+		if (g_verbose) {
+			printf("Object store %s request failed (status %d): retrying in"
+					" %u ms.\n", method, resp->status, delay_ms);
+		}
+
+		free(resp->body);
+		resp->body = NULL;
+
+		usleep(delay_ms * 1000);
+	}
+}
+
+static bool
+s3_try_request(const char* method, const char* name, const char* query,
+		const as_io_t* meta, const void* body, size_t body_len,
+		const uLong* body_crc, size_t offset, size_t size, void* buf,
+		as_s3_resp_t* resp)
+{
+	// Path-style addressing - /<bucket>/<prefix>/<name>.
+
+	char uri[PATH_MAX * 3 + 1];
+	char* end = uri;
+
+	end += sprintf(end, "/");
+	end = s3_encode(g_s3_store.bucket, false, end);
+
+	if (name != NULL) {
+		end += sprintf(end, "/");
+
+		if (g_s3_store.prefix[0] != '\0') {
+			end = s3_encode(g_s3_store.prefix, true, end);
+			end += sprintf(end, "/");
+		}
+
+		s3_encode(name, false, end);
+	}
+
+	// Timestamps for the signature.
+
+	time_t now = time(NULL);
+	struct tm tm;
+	char amz_date[32];
+	char date[16];
+
+	gmtime_r(&now, &tm);
+	strftime(amz_date, sizeof(amz_date), "%Y%m%dT%H%M%SZ", &tm);
+	strftime(date, sizeof(date), "%Y%m%d", &tm);
+
+	// Small bodies are hashed into the signature. Segment data isn't - the
+	// store checks it against its crc32 instead.
+
+	char payload_hash[SHA256_HEX_LEN + 1];
+
+	if (body_len > S3_MAX_SIGNED_BODY) {
+		strcpy(payload_hash, "UNSIGNED-PAYLOAD");
+	}
+	else {
+		uint8_t sha[SHA256_LEN];
+
+		hash_sha256(body, body_len, sha);
+		hash_sha256_to_hex(sha, payload_hash);
+	}
+
+	// The headers to sign, in sorted order - as name:value lines, and as
+	// they're sent.
+
+	char host[MAX_BUFFER];
+
+	if (strcmp(g_s3_store.port, S3_DEFAULT_PORT) == 0) {
+		snprintf(host, sizeof(host), "%s", g_s3_store.host);
+	}
+	else {
+		snprintf(host, sizeof(host), "%s:%s", g_s3_store.host,
+				g_s3_store.port);
+	}
+
+	// Each header (and the request they make) must fit, however long the
+	// session token.
+
+	char headers[S3_MAX_HEADER];
+	size_t headers_len = 0;
+	bool fits = s3_append(headers, sizeof(headers), &headers_len,
+			"host:%s\n", host);
+
+	// A multipart upload's parts each carry their crc32, so the store is told
+	// to expect them when it's started.
+
+	if (strcmp(query, "uploads=") == 0) {
+		fits = fits && s3_append(headers, sizeof(headers), &headers_len,
+				"x-amz-checksum-algorithm:CRC32\n");
+	}
+
+	if (body_crc != NULL) {
+		char crc_b64[16];
+
+		s3_crc32_base64(*body_crc, crc_b64);
+		fits = fits && s3_append(headers, sizeof(headers), &headers_len,
+				"x-amz-checksum-crc32:%s\n", crc_b64);
+	}
+
+	fits = fits && s3_append(headers, sizeof(headers), &headers_len,
+			"x-amz-content-sha256:%s\nx-amz-date:%s\n", payload_hash,
+			amz_date);
+
+	if (meta != NULL) {
+		fits = fits && s3_append(headers, sizeof(headers), &headers_len,
+				"x-amz-meta-gid:%u\nx-amz-meta-mode:%o\nx-amz-meta-uid:%u\n",
+				meta->gid, meta->mode & MODE_MASK, meta->uid);
+	}
+
+	if (g_s3_store.token != NULL) {
+		fits = fits && s3_append(headers, sizeof(headers), &headers_len,
+				"x-amz-security-token:%s\n", g_s3_store.token);
+	}
+
+	// All of them are signed.
+
+	char signed_names[MAX_BUFFER];
+	size_t signed_len = 0;
+
+	signed_names[0] = '\0';
+
+	for (const char* line = headers; fits && *line != '\0'; ) {
+		const char* nl = strchr(line, '\n');
+		const char* colon = strchr(line, ':');
+
+		fits = s3_append(signed_names, sizeof(signed_names), &signed_len,
+				"%s%.*s", line == headers ? "" : ";", (int)(colon - line),
+				line);
+		line = nl + 1;
+	}
+
+	if (!fits) {
+		if (g_verbose) {
+			printf("Object store %s request headers are too long.\n",
+					method);
+		}
+
+		return false;
+	}
+
+	// The canonical request, and the string to sign - its hash, scoped to
+	// the date, region and service.
+
+	size_t creq_len = strlen(method) + strlen(uri) + strlen(query)
+			+ strlen(headers) + strlen(signed_names) + strlen(payload_hash)
+			+ 8;
+	char* creq = (char*)malloc(creq_len);
+
+	if (creq == NULL) {
+		if (g_verbose) {
+			printf("Could not allocate memory for object store request.\n");
+		}
+
+		return false;
+	}
+
+	snprintf(creq, creq_len, "%s\n%s\n%s\n%s\n%s\n%s", method, uri, query,
+			headers, signed_names, payload_hash);
+
+	uint8_t sha[SHA256_LEN];
+	char creq_hash[SHA256_HEX_LEN + 1];
+
+	hash_sha256(creq, strlen(creq), sha);
+	hash_sha256_to_hex(sha, creq_hash);
+	free(creq);
+
+	char scope[MAX_BUFFER];
+	char to_sign[MAX_BUFFER * 2];
+
+	snprintf(scope, sizeof(scope), "%s/%s/s3/aws4_request", date,
+			g_s3_store.region);
+	snprintf(to_sign, sizeof(to_sign), "AWS4-HMAC-SHA256\n%s\n%s\n%s",
+			amz_date, scope, creq_hash);
+
+	// The signing key is derived from the secret key, date, region and
+	// service.
+
+	char secret[MAX_BUFFER];
+	uint8_t key[SHA256_LEN];
+
+	snprintf(secret, sizeof(secret), "AWS4%s", g_s3_store.secret_key);
+	hash_hmac_sha256(secret, strlen(secret), date, strlen(date), key);
+	hash_hmac_sha256(key, SHA256_LEN, g_s3_store.region,
+			strlen(g_s3_store.region), key);
+	hash_hmac_sha256(key, SHA256_LEN, "s3", 2, key);
+	hash_hmac_sha256(key, SHA256_LEN, "aws4_request", 12, key);
+	hash_hmac_sha256(key, SHA256_LEN, to_sign, strlen(to_sign), sha);
+
+	char signature[SHA256_HEX_LEN + 1];
+
+	hash_sha256_to_hex(sha, signature);
+
+	// Turn the signed name:value lines into request headers.
+
+	char request[S3_MAX_HEADER * 2];
+	size_t request_len = 0;
+
+	fits = s3_append(request, sizeof(request), &request_len,
+			"%s %s%s%s HTTP/1.1\r\n", method, uri,
+			query[0] != '\0' ? "?" : "", query);
+
+	for (char* line = headers; fits && *line != '\0'; ) {
+		char* nl = strchr(line, '\n');
+		char* colon = strchr(line, ':');
+
+		fits = s3_append(request, sizeof(request), &request_len,
+				"%.*s: %.*s\r\n", (int)(colon - line), line,
+				(int)(nl - colon - 1), colon + 1);
+		line = nl + 1;
+	}
+
+	fits = fits && s3_append(request, sizeof(request), &request_len,
+			"Authorization: AWS4-HMAC-SHA256 Credential=%s/%s,"
+			" SignedHeaders=%s, Signature=%s\r\nContent-Length: %zu\r\n",
+			g_s3_store.access_key, scope, signed_names, signature, body_len);
+
+	if (size != 0) {
+		fits = fits && s3_append(request, sizeof(request), &request_len,
+				"Range: bytes=%zu-%zu\r\n", offset, offset + size - 1);
+	}
+
+	fits = fits && s3_append(request, sizeof(request), &request_len,
+			"Connection: close\r\n\r\n");
+
+	if (!fits) {
+		if (g_verbose) {
+			printf("Object store %s request is too long.\n", method);
+		}
+
+		return false;
+	}
+
+	// Connect, and send the request. Each request has its own connection.
+
+	as_http_t http = { .fd = -1 };
+
+	if (!s3_connect(&http)) {
+		return false;
+	}
+
+	if (!write_stream(http.fd, request, request_len)
+			|| (body_len != 0 && !write_stream(http.fd, body, body_len))) {
+		char errbuff[MAX_BUFFER];
+		char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
+
+		if (g_verbose) {
+			printf("Could not send %s request to object store \'%s\': error"
+					" was %d: %s.\n", method, host, errno, errout);
+		}
+
+		close(http.fd);
+		return false;
+	}
+
+	bool success = s3_read_response(&http, strcmp(method, "HEAD") == 0,
+			size, buf, resp);
+
+	close(http.fd);
+
+	if (!success && g_verbose) {
+		printf("Lost connection to object store \'%s\' during %s request.\n",
+				host, method);
+	}
+
+	return success;
+}
+
+// Append to a request being built in buf (of size bytes), of which len are
+// used. Returns false, leaving buf as it was, if it doesn't fit.
+
+static bool
+s3_append(char* buf, size_t size, size_t* len, const char* format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+
+	int n = vsnprintf(buf + *len, size - *len, format, args);
+
+	va_end(args);
+
+	if (n < 0 || (size_t)n >= size - *len) {
+		buf[*len] = '\0';
+		return false;
+	}
+
+	*len += (size_t)n;
+
+	return true;
+}
+
+// Encode a crc32 as the object store expects it in a checksum - its 4 bytes,
+// big-endian, in base64.
+
+static void
+s3_crc32_base64(uLong crc, char* out)
+{
+	static const char digits[] =
+			"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	uint32_t v = (uint32_t)crc;
+
+	// 32 bits make five full base64 digits and two bits over - padded with
+	// zeros to a sixth, then "==".
+
+	for (uint32_t i = 0; i < 5; i++) {
+		*out++ = digits[(v >> (26 - 6 * i)) & 0x3f];
+	}
+
+	*out++ = digits[(v & 0x3) << 4];
+	strcpy(out, "==");
+}
+
+// Connect to the object store's endpoint.
+
+static bool
+s3_connect(as_http_t* http)
+{
+	struct addrinfo hints = { .ai_family = AF_UNSPEC,
+			.ai_socktype = SOCK_STREAM };
+	struct addrinfo* addrs;
+	int rc = getaddrinfo(g_s3_store.host, g_s3_store.port, &hints, &addrs);
+
+	if (rc != 0) {
+		if (g_verbose) {
+			printf("Could not resolve object store \'%s\': %s.\n",
+					g_s3_store.host, gai_strerror(rc));
+		}
+
+		return false;
+	}
+
+	for (struct addrinfo* addr = addrs; addr != NULL; addr = addr->ai_next) {
+		http->fd = socket(addr->ai_family, addr->ai_socktype,
+				addr->ai_protocol);
+
+		if (http->fd < 0) {
+			continue;
+		}
+
+		if (connect(http->fd, addr->ai_addr, addr->ai_addrlen) == 0) {
+			break;
+		}
+
+		close(http->fd);
+		http->fd = -1;
+	}
+
+	freeaddrinfo(addrs);
+
+	if (http->fd < 0) {
+		char errbuff[MAX_BUFFER];
+		char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
+
+		if (g_verbose) {
+			printf("Could not connect to object store \'%s:%s\': error was"
+					" %d: %s.\n", g_s3_store.host, g_s3_store.port, errno,
+					errout);
+		}
+
+		return false;
+	}
+
+	// Don't wait forever on a store which has stopped responding.
+
+	struct timeval timeout = { .tv_sec = S3_TIMEOUT };
+
+	(void)setsockopt(http->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+			sizeof(timeout));
+	(void)setsockopt(http->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+			sizeof(timeout));
+
+	return true;
+}
+
+// Read the response to an object store request - its status, the headers we
+// need, and its body.
+
+static bool
+s3_read_response(as_http_t* http, bool head, size_t size, void* buf,
+		as_s3_resp_t* resp)
+{
+	char line[S3_MAX_HEADER];
+
+	if (!http_read_line(http, line, sizeof(line))
+			|| sscanf(line, "HTTP/%*d.%*d %d", &resp->status) != 1) {
+		return false;
+	}
+
+	bool chunked = false;
+	bool have_length = false;
+	uint64_t length = 0;
+
+	resp->uid = (uid_t)-1;
+	resp->gid = (gid_t)-1;
+	resp->mode = (mode_t)-1;
+
+	while (true) {
+		if (!http_read_line(http, line, sizeof(line))) {
+			return false;
+		}
+
+		if (line[0] == '\0') {
+			break;
+		}
+
+		char* value = strchr(line, ':');
+
+		if (value == NULL) {
+			continue;
+		}
+
+		*value++ = '\0';
+
+		while (*value == ' ') {
+			value++;
+		}
+
+		if (strcasecmp(line, "Content-Length") == 0) {
+			length = strtoull(value, NULL, 10);
+			have_length = true;
+		}
+		else if (strcasecmp(line, "Transfer-Encoding") == 0) {
+			chunked = strcasecmp(value, "chunked") == 0;
+		}
+		else if (strcasecmp(line, "ETag") == 0) {
+			snprintf(resp->etag, sizeof(resp->etag), "%s", value);
+		}
+		else if (strcasecmp(line, "x-amz-meta-uid") == 0) {
+			resp->uid = (uid_t)strtoul(value, NULL, 10);
+		}
+		else if (strcasecmp(line, "x-amz-meta-gid") == 0) {
+			resp->gid = (gid_t)strtoul(value, NULL, 10);
+		}
+		else if (strcasecmp(line, "x-amz-meta-mode") == 0) {
+			resp->mode = (mode_t)strtoul(value, NULL, 8);
+		}
+	}
+
+	resp->content_length = length;
+
+	if (head || resp->status == 204) {
+		return true;
+	}
+
+	// A ranged get goes straight into the caller's buffer.
+
+	if (buf != NULL && (resp->status == 206 || resp->status == 200)) {
+		if (chunked || length != size) {
+			if (g_verbose) {
+				printf("Object store returned %lu bytes instead of %zu.\n",
+						length, size);
+			}
+
+			return false;
+		}
+
+		return http_read(http, buf, size);
+	}
+
+	// Anything else - listings, upload ids, errors - is small.
+
+	if (have_length && length > S3_MAX_BODY) {
+		return false;
+	}
+
+	size_t max = have_length ? (size_t)length : S3_MAX_BODY;
+
+	resp->body = (char*)malloc(max + 1);
+
+	if (resp->body == NULL) {
+		return false;
+	}
+
+	if (chunked) {
+		while (true) {
+			size_t chunk_len;
+
+			if (!http_read_line(http, line, sizeof(line))
+					|| sscanf(line, "%zx", &chunk_len) != 1
+					|| resp->body_len + chunk_len > max) {
+				return false;
+			}
+
+			if (chunk_len == 0) {
+				break;
+			}
+
+			if (!http_read(http, resp->body + resp->body_len, chunk_len)
+					|| !http_read_line(http, line, sizeof(line))) {
+				return false;
+			}
+
+			resp->body_len += chunk_len;
+		}
+	}
+	else if (have_length) {
+		if (!http_read(http, resp->body, max)) {
+			return false;
+		}
+
+		resp->body_len = max;
+	}
+	else {
+		// No length - the body runs to the end of the connection.
+
+		ssize_t n;
+
+		while (resp->body_len < max && (n = http_fill(http,
+				resp->body + resp->body_len, max - resp->body_len)) > 0) {
+			resp->body_len += (size_t)n;
+		}
+	}
+
+	resp->body[resp->body_len] = '\0';
+
+	return true;
+}
+
+// Read exactly size bytes of a response - first whatever's buffered.
+
+static bool
+http_read(as_http_t* http, void* buf, size_t size)
+{
+	size_t done = 0;
+
+	while (done < size) {
+		ssize_t n = http_fill(http, (uint8_t*)buf + done, size - done);
+
+		if (n <= 0) {
+			return false;
+		}
+
+		done += (size_t)n;
+	}
+
+	return true;
+}
+
+// Read a CRLF-terminated line of a response, without its CRLF.
+
+static bool
+http_read_line(as_http_t* http, char* line, size_t max)
+{
+	size_t len = 0;
+
+	while (true) {
+		if (http->pos == http->len) {
+			ssize_t n = read(http->fd, http->buf, sizeof(http->buf));
+
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+
+			if (n <= 0) {
+				return false;
+			}
+
+			http->pos = 0;
+			http->len = (size_t)n;
+		}
+
+		char c = (char)http->buf[http->pos++];
+
+		if (c == '\n') {
+			break;
+		}
+
+		if (len + 1 == max) {
+			return false;
+		}
+
+		line[len++] = c;
+	}
+
+	if (len != 0 && line[len - 1] == '\r') {
+		len--;
+	}
+
+	line[len] = '\0';
+
+	return true;
+}
+
+// Read up to size bytes of a response - whatever's buffered, else straight
+// from the connection.
+
+static ssize_t
+http_fill(as_http_t* http, void* buf, size_t size)
+{
+	if (http->pos != http->len) {
+		size_t n = http->len - http->pos;
+
+		if (n > size) {
+			n = size;
+		}
+
+		memcpy(buf, http->buf + http->pos, n);
+		http->pos += n;
+
+		return (ssize_t)n;
+	}
+
+	while (true) {
+		ssize_t n = read(http->fd, buf, size);
+
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+
+		return n;
+	}
+}
+
+// URI-encode a string, as the signature requires - all but unreserved
+// characters, and slashes if requested. Returns the end of the output.
+
+static char*
+s3_encode(const char* in, bool keep_slash, char* out)
+{
+	for (; *in != '\0'; in++) {
+		char c = *in;
+
+		if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z')
+				|| (c >= '0' && c <= '9') || c == '-' || c == '_' || c == '.'
+				|| c == '~' || (keep_slash && c == '/')) {
+			*out++ = c;
+		}
+		else {
+			out += sprintf(out, "%%%02X", (uint8_t)c);
+		}
+	}
+
+	*out = '\0';
+
+	return out;
+}
+
+// Find the value of the next <tag> element in an object store response, from
+// *cursor on, and move *cursor past it.
+
+static bool
+s3_xml_value(const char** cursor, const char* tag, char* value, size_t max)
+{
+	char open_tag[MAX_BUFFER];
+	char close_tag[MAX_BUFFER];
+
+	snprintf(open_tag, sizeof(open_tag), "<%s>", tag);
+	snprintf(close_tag, sizeof(close_tag), "</%s>", tag);
+
+	const char* start = strstr(*cursor, open_tag);
+
+	if (start == NULL) {
+		return false;
+	}
+
+	start += strlen(open_tag);
+
+	const char* end = strstr(start, close_tag);
+
+	if (end == NULL || (size_t)(end - start) >= max) {
+		return false;
+	}
+
+	memcpy(value, start, (size_t)(end - start));
+	value[end - start] = '\0';
+	*cursor = end + strlen(close_tag);
+
+	return true;
+}
+
+// Report a failed object store request, with the store's error code, if any.
+
+static void
+s3_failed(const char* what, const char* name, const as_s3_resp_t* resp)
+{
+	if (!g_verbose) {
+		return;
+	}
+
+	char code[MAX_BUFFER] = "";
+	const char* cursor = resp->body;
+
+	if (cursor != NULL) {
+		s3_xml_value(&cursor, "Code", code, sizeof(code));
+	}
+
+	printf("Could not %s \'%s\' in object store \'%s\': status %d%s%s.\n",
+			what, name, g_pathdir, resp->status, code[0] != '\0' ? ", " : "",
+			code);
+}
+
+// List the names (within the prefix) of the objects in the object store,
+// page by page. The list is to be freed by the caller.
+
+static bool
+list_s3_names(char*** names, uint32_t* n_names)
+{
+	*names = NULL;
+	*n_names = 0;
+
+	char prefix[PATH_MAX * 3 + 1];
+	char encoded[PATH_MAX * 3 + 1];
+
+	if (g_s3_store.prefix[0] != '\0') {
+		snprintf(prefix, sizeof(prefix), "%s/", g_s3_store.prefix);
+		s3_encode(prefix, false, encoded);
+	}
+	else {
+		encoded[0] = '\0';
+	}
+
+	size_t prefix_len = strlen(g_s3_store.prefix) == 0 ?
+			0 : strlen(g_s3_store.prefix) + 1;
+	char token[MAX_BUFFER] = "";
+
+	do {
+		char query[MAX_BUFFER * 4];
+		char encoded_token[MAX_BUFFER * 3];
+
+		s3_encode(token, false, encoded_token);
+		snprintf(query, sizeof(query), "%s%s%sdelimiter=%%2F&list-type=2"
+				"&prefix=%s", token[0] != '\0' ? "continuation-token=" : "",
+				encoded_token, token[0] != '\0' ? "&" : "", encoded);
+
+		as_s3_resp_t resp;
+
+		if (!s3_request("GET", NULL, query, NULL, NULL, 0, NULL, 0, 0, NULL,
+				&resp)) {
+			return false;
+		}
+
+		if (resp.status != 200) {
+			s3_failed("list", g_s3_store.prefix, &resp);
+			free(resp.body);
+			return false;
+		}
+
+		const char* cursor = resp.body;
+		char key[PATH_MAX * 3 + 1];
+
+		while (s3_xml_value(&cursor, "Key", key, sizeof(key))) {
+			if (strlen(key) <= prefix_len) {
+				continue;
+			}
+
+			char** new_names = (char**)realloc(*names,
+					(*n_names + 1) * sizeof(char*));
+
+			if (new_names == NULL) {
+				free(resp.body);
+				return false;
+			}
+
+			*names = new_names;
+			(*names)[*n_names] = strdup(key + prefix_len);
+
+			if ((*names)[*n_names] == NULL) {
+				free(resp.body);
+				return false;
+			}
+
+			(*n_names)++;
+		}
+
+		// Carry on from where the page ended, if it's truncated.
+
+		char truncated[MAX_BUFFER] = "";
+
+		cursor = resp.body;
+		s3_xml_value(&cursor, "IsTruncated", truncated, sizeof(truncated));
+		cursor = resp.body;
+
+		if (strcmp(truncated, "true") != 0 || !s3_xml_value(&cursor,
+				"NextContinuationToken", token, sizeof(token))) {
+			token[0] = '\0';
+		}
+
+		free(resp.body);
+	} while (token[0] != '\0');
+
+	return true;
+}
+
+static void
+free_s3_names(char** names, uint32_t n_names)
+{
+	for (uint32_t i = 0; i < n_names; i++) {
+		free(names[i]);
+	}
+
+	free(names);
+}
+
+// Check whether the object store already holds objects for a namespace and
+// instance - a backup won't overwrite them.
+
+static bool
+find_s3_objects(const as_segment_t* pbp)
+{
+	char** names;
+	uint32_t n_names;
+
+	if (!list_s3_names(&names, &n_names)) {
+		return true;
+	}
+
+	bool found = false;
+
+	for (uint32_t i = 0; i < n_names; i++) {
+		as_file_t aerospike_file;
+
+		if (validate_file_name(names[i], &aerospike_file)
+				&& aerospike_file.inst == pbp->inst
+				&& aerospike_file.nsid == pbp->nsid) {
+			found = true;
+
+			if (g_verbose) {
+				printf("Found existing Aerospike object \'%s\' in \'%s\' with"
+						" instance %u, namespace \'%s\' (nsid %u)"
+						": cannot back up associated segment.\n", names[i],
+						g_pathdir, pbp->inst, pbp->nsnm, pbp->nsid);
+			}
+		}
+	}
+
+	free_s3_names(names, n_names);
+
+	return found;
+}
+
+// Prepare an I/O request to upload a segment to the object store - in
+// parallel parts of IOCHUNK bytes, each with its own request. A segment of
+// more than one part is a multipart upload, started here and completed once
+// every part is uploaded.
+
+static bool
+upload_candidate_file(as_io_t* io)
+{
+	io->n_chunks = (uint32_t)((io->segsz + IOCHUNK - 1) / IOCHUNK);
+	io->parts = (as_s3_part_t*)calloc(io->n_chunks, sizeof(as_s3_part_t));
+
+	if (io->parts == NULL) {
+		if (g_verbose) {
+			printf("Could not allocate memory for segment %08x parts.\n",
+					io->key);
+		}
+
+		return false;
+	}
+
+	if (io->n_chunks > S3_MAX_PARTS) {
+		if (g_verbose) {
+			printf("Segment %08x is too big for the object store: %zu bytes"
+					" in more than %u parts.\n", io->key, io->segsz,
+					S3_MAX_PARTS);
+		}
+
+		return false;
+	}
+
+	if (io->n_chunks == 1) {
+		return true;
+	}
+
+	char name[PATH_MAX + 1];
+	as_s3_resp_t resp;
+
+	sprintf(name, "%08x%s", io->key, FILE_EXTENSION);
+
+	if (!s3_request("POST", name, "uploads=", io, NULL, 0, NULL, 0, 0, NULL,
+			&resp)) {
+		return false;
+	}
+
+	const char* cursor = resp.body;
+	char upload_id[MAX_BUFFER];
+
+	if (resp.status != 200 || cursor == NULL
+			|| !s3_xml_value(&cursor, "UploadId", upload_id,
+					sizeof(upload_id))) {
+		s3_failed("start upload of", name, &resp);
+		free(resp.body);
+		return false;
+	}
+
+	free(resp.body);
+	io->upload_id = strdup(upload_id);
+
+	return io->upload_id != NULL;
+}
+
+// Upload a part (of size IOCHUNK) of a segment to the object store - or the
+// whole segment, if it's a single part. Its crc32 is always computed.
+
+static bool
+upload_file(as_io_t* io, uint32_t chunk)
+{
+	size_t offset = (size_t)chunk * IOCHUNK;
+	size_t size = io_chunk_size(io, chunk);
+	const uint8_t* data = (const uint8_t*)io->memptr + offset;
+
+	char name[PATH_MAX + 1];
+	char query[MAX_BUFFER * 4];
+	as_s3_resp_t resp;
+
+	sprintf(name, "%08x%s", io->key, FILE_EXTENSION);
+
+	if (io->upload_id != NULL) {
+		char encoded[MAX_BUFFER * 3];
+
+		s3_encode(io->upload_id, false, encoded);
+		snprintf(query, sizeof(query), "partNumber=%u&uploadId=%s", chunk + 1,
+				encoded);
+	}
+	else {
+		query[0] = '\0';
+	}
+
+	// The store checks the part against its crc32 - which also goes in the
+	// request completing a multipart upload.
+
+	uLong crc = crc32_z(crc32(0L, Z_NULL, 0), data, size);
+
+	if (!s3_request("PUT", name, query, io->upload_id != NULL ? NULL : io,
+			data, size, &crc, 0, 0, NULL, &resp)) {
+		return false;
+	}
+
+	if (resp.status != 200) {
+		s3_failed("upload", name, &resp);
+		free(resp.body);
+		return false;
+	}
+
+	free(resp.body);
+
+	snprintf(io->parts[chunk].etag, sizeof(io->parts[chunk].etag), "%s",
+			resp.etag);
+	io->parts[chunk].crc32 = crc;
+
+	pthread_mutex_lock(&g_io_mutex);
+	io->filsz += size;
+	pthread_mutex_unlock(&g_io_mutex);
+
+	return true;
+}
+
+// Finish uploading a namespace's segments to the object store - complete each
+// multipart upload, or abort them all if the backup failed.
+
+static bool
+finish_s3(as_io_t ios[], uint32_t n_ios, bool success)
+{
+	for (uint32_t i = 0; success && i < n_ios; i++) {
+		as_io_t* io = &ios[i];
+
+		combine_part_crcs(io);
+
+		if (io->upload_id == NULL) {
+			continue;
+		}
+
+		// List the parts, with their ETags and crc32s.
+
+		size_t len = (size_t)io->n_chunks * (S3_ETAG_LEN + 128) + 64;
+		char* body = (char*)malloc(len);
+
+		if (body == NULL) {
+			success = false;
+			break;
+		}
+
+		char* end = body;
+
+		end += sprintf(end, "<CompleteMultipartUpload>");
+
+		for (uint32_t k = 0; k < io->n_chunks; k++) {
+			char crc_b64[16];
+
+			s3_crc32_base64(io->parts[k].crc32, crc_b64);
+			end += sprintf(end, "<Part><PartNumber>%u</PartNumber>"
+					"<ETag>%s</ETag><ChecksumCRC32>%s</ChecksumCRC32></Part>",
+					k + 1, io->parts[k].etag, crc_b64);
+		}
+
+		end += sprintf(end, "</CompleteMultipartUpload>");
+
+		char name[PATH_MAX + 1];
+		char query[MAX_BUFFER * 4];
+		char encoded[MAX_BUFFER * 3];
+		as_s3_resp_t resp;
+
+		sprintf(name, "%08x%s", io->key, FILE_EXTENSION);
+		s3_encode(io->upload_id, false, encoded);
+		snprintf(query, sizeof(query), "uploadId=%s", encoded);
+
+		bool sent = s3_request("POST", name, query, NULL, body,
+				(size_t)(end - body), NULL, 0, 0, NULL, &resp);
+
+		free(body);
+
+		// A completion can fail after the status is sent - the error is in
+		// the body.
+
+		if (!sent || resp.status != 200 || resp.body == NULL
+				|| strstr(resp.body, "<Error>") != NULL) {
+			if (sent) {
+				s3_failed("complete upload of", name, &resp);
+			}
+
+			success = false;
+		}
+		else {
+			free(io->upload_id);
+			io->upload_id = NULL;
+		}
+
+		free(resp.body);
+	}
+
+	abort_s3_uploads(ios, n_ios);
+
+	return success;
+}
+
+// Abort any multipart uploads still in progress, so that the store drops
+// their parts.
+
+static void
+abort_s3_uploads(as_io_t ios[], uint32_t n_ios)
+{
+	for (uint32_t i = 0; i < n_ios; i++) {
+		as_io_t* io = &ios[i];
+
+		if (io->upload_id != NULL) {
+			char name[PATH_MAX + 1];
+			char query[MAX_BUFFER * 4];
+			char encoded[MAX_BUFFER * 3];
+			as_s3_resp_t resp;
+
+			sprintf(name, "%08x%s", io->key, FILE_EXTENSION);
+			s3_encode(io->upload_id, false, encoded);
+			snprintf(query, sizeof(query), "uploadId=%s", encoded);
+
+			if (s3_request("DELETE", name, query, NULL, NULL, 0, NULL, 0, 0,
+					NULL, &resp)) {
+				free(resp.body);
+			}
+
+			free(io->upload_id);
+			io->upload_id = NULL;
+		}
+
+		free(io->parts);
+		io->parts = NULL;
+	}
+}
+
+// Delete a segment's object from the object store.
+
+static void
+delete_s3_object(key_t key)
+{
+	char name[PATH_MAX + 1];
+	as_s3_resp_t resp;
+
+	sprintf(name, "%08x%s", key, FILE_EXTENSION);
+
+	if (s3_request("DELETE", name, "", NULL, NULL, 0, NULL, 0, 0, NULL,
+			&resp)) {
+		free(resp.body);
+	}
+}
+
+// Combine the crc32s of a segment's parts into the segment's crc32.
+
+static void
+combine_part_crcs(as_io_t* io)
+{
+	if (!g_crc32 || io->parts == NULL) {
+		return;
+	}
+
+	io->crc32 = io->parts[0].crc32;
+
+	for (uint32_t k = 1; k < io->n_chunks; k++) {
+		io->crc32 = crc32_combine(io->crc32, io->parts[k].crc32,
+				(z_off_t)io_chunk_size(io, k));
+	}
+}
+
+// Add the objects in the object store to a list of Aerospike database segment
+// files, if they pass the filter - with their sizes and ownership, from their
+// metadata.
+
+static bool
+list_s3(as_file_t** files, uint32_t* n_files, int* error)
+{
+	char** names;
+	uint32_t n_names;
+
+	if (!list_s3_names(&names, &n_names)) {
+		errno = EIO;
+		*error = errno;
+		return false;
+	}
+
+	for (uint32_t i = 0; i < n_names; i++) {
+		const char* name = names[i];
+		as_file_t valid_file;
+
+		if (!validate_file_name(name, &valid_file)
+				|| strcmp(strchr(name, '.'), FILE_EXTENSION) != 0) {
+			continue;
+		}
+
+		// Check whether the instance number is a match.
+
+		if (!inst_selected(valid_file.inst)) {
+			continue;
+		}
+
+		as_s3_resp_t resp;
+
+		if (!s3_request("HEAD", name, "", NULL, NULL, 0, NULL, 0, 0, NULL,
+				&resp)) {
+			continue;
+		}
+
+		if (resp.status != 200) {
+			s3_failed("find", name, &resp);
+			free(resp.body);
+			continue;
+		}
+
+		if (resp.uid == (uid_t)-1 || resp.gid == (gid_t)-1
+				|| resp.mode == (mode_t)-1) {
+			if (g_verbose) {
+				printf("Object \'%s\' in \'%s\' has no ownership metadata.\n",
+						name, g_pathdir);
+			}
+
+			continue;
+		}
+
+		// Extract namespace name from the base segment's object.
+
+		valid_file.nsnm = NULL;
+
+		if (valid_file.type == TYPE_BASE) {
+			char nsnm[NAMESPACE_LEN + 1];
+			as_s3_resp_t ns_resp;
+
+			if (!s3_request("GET", name, "", NULL, NULL, 0, NULL,
+					NAMESPACE_OFF, NAMESPACE_LEN, nsnm, &ns_resp)) {
+				continue;
+			}
+
+			free(ns_resp.body);
+
+			if (ns_resp.status != 206 && ns_resp.status != 200) {
+				continue;
+			}
+
+			nsnm[NAMESPACE_LEN] = '\0';
+
+			// Check whether the namespace name is a match.
+
+			if (g_nsnm != NULL && strcmp(nsnm, g_nsnm) != 0) {
+				continue;
+			}
+
+			valid_file.nsnm = strdup(nsnm);
+		}
+
+		// Found a matching object. Add to list.
+
+		(*n_files)++;
+
+		*files = realloc(*files, (size_t)*n_files * sizeof(as_file_t));
+		assert(*files != NULL);
+
+		as_file_t* file = *files + *n_files - 1;
+
+		file->key = valid_file.key;
+		file->nsnm = valid_file.nsnm;
+		file->uid = resp.uid;
+		file->gid = resp.gid;
+		file->mode = resp.mode;
+		file->filsz = (size_t)resp.content_length;
+		file->segsz = (size_t)resp.content_length;
+		file->compress = false;
+		file->codec = CODEC_STORE;
+		file->cas = false;
+		file->stage = valid_file.stage;
+		file->inst = valid_file.inst;
+		file->nsid = valid_file.nsid;
+		file->type = valid_file.type;
+		file->planned = false;
+		file->pack = false;
+		file->offset = 0;
+		file->target = 0;
+	}
+
+	free_s3_names(names, n_names);
+
+	return true;
+}
+
+// Read a value from a base segment's object in the object store.
+
+static bool
+read_s3_base(key_t key, size_t offset, void* buf, size_t size)
+{
+	char name[PATH_MAX + 1];
+	as_s3_resp_t resp;
+
+	sprintf(name, "%08x%s", key, FILE_EXTENSION);
+
+	if (!s3_request("GET", name, "", NULL, NULL, 0, NULL, offset, size, buf,
+			&resp)) {
+		return false;
+	}
+
+	bool success = resp.status == 206 || resp.status == 200;
+
+	if (!success) {
+		s3_failed("read", name, &resp);
+	}
+
+	free(resp.body);
+
+	return success;
+}
+
+// Prepare an I/O request to download a segment from the object store - in
+// parallel ranged gets of IOCHUNK bytes.
+
+static bool
+restore_candidate_s3(as_io_t* io)
+{
+	io->n_chunks = (uint32_t)((io->segsz + IOCHUNK - 1) / IOCHUNK);
+	io->parts = (as_s3_part_t*)calloc(io->n_chunks, sizeof(as_s3_part_t));
+
+	if (io->parts == NULL) {
+		if (g_verbose) {
+			printf("Could not allocate memory for segment %08x parts.\n",
+					io->key);
+		}
+
+		return false;
+	}
+
+	return true;
+}
+
+// Download a chunk (of size IOCHUNK) of a segment from the object store,
+// straight into the segment. Compute its crc32 if requested.
+
+static bool
+download_file(as_io_t* io, uint32_t chunk)
+{
+	size_t offset = (size_t)chunk * IOCHUNK;
+	size_t size = io_chunk_size(io, chunk);
+	uint8_t* data = (uint8_t*)io->memptr + offset;
+
+	char name[PATH_MAX + 1];
+	as_s3_resp_t resp;
+
+	sprintf(name, "%08x%s", io->key, FILE_EXTENSION);
+
+	if (!s3_request("GET", name, "", NULL, NULL, 0, NULL, offset, size,
+			data, &resp)) {
+		return false;
+	}
+
+	if (resp.status != 206 && resp.status != 200) {
+		s3_failed("download", name, &resp);
+		free(resp.body);
+		return false;
+	}
+
+	free(resp.body);
+
+	if (g_crc32) {
+		io->parts[chunk].crc32 = crc32_z(crc32(0L, Z_NULL, 0), data, size);
+	}
+
+	return true;
+}
+
+// Compute the digest of a segment - the digest of the digests of its
+// DIGEST_CHUNK-sized chunks. The chunk digests are handed back if requested,
+// to be freed by the caller.
+
+static bool
+digest_segment(const void* buf, size_t segsz, as_digest_t* digest,
+		as_digest_t** chunk_digests)
+{
+	size_t n_chunks = (segsz + DIGEST_CHUNK - 1) / DIGEST_CHUNK;
+
+	as_digest_t* digests = malloc(n_chunks * sizeof(as_digest_t));
+
+	if (digests == NULL) {
+		if (g_verbose) {
+			printf("Could not allocate memory to digest segment.\n");
+		}
+
+		return false;
+	}
+
+	const uint8_t* chunk = (const uint8_t*)buf;
+
+	for (size_t i = 0; i < n_chunks; i++) {
+		size_t size = segsz - i * DIGEST_CHUNK;
+
+		if (size > DIGEST_CHUNK) {
+			size = DIGEST_CHUNK;
+		}
+
+		hash_digest(chunk, size, DIGEST_SEED, &digests[i]);
+		chunk += size;
+	}
+
+	hash_digest(digests, n_chunks * sizeof(as_digest_t), DIGEST_SEED, digest);
+
+	if (chunk_digests != NULL) {
+		*chunk_digests = digests;
+	}
+	else {
+		free(digests);
+		digests = NULL;
+	}
+
+	return true;
+}
+
+// Read a namespace's manifest, named after its base segment key, from a backup
+// directory. Entries with unknown fields are tolerated.
+
+static bool
+read_manifest(const char* pathdir, key_t key, as_manifest_t* manifest)
+{
+	char pathname[PATH_MAX + 1];
+
+	sprintf(pathname, "%s/%08x%s", pathdir, key, MANIFEST_EXTENSION);
+
+	FILE* file = fopen(pathname, "r");
+
+	if (file == NULL) {
+		return false;
+	}
+
+	manifest->version = 0;
+	manifest->inst = INV_INST;
+	manifest->nsid = 0;
+	manifest->nsnm = NULL;
+	manifest->base_ver = 0;
+	manifest->n_pri_arenas = 0;
+	manifest->n_sec_arenas = 0;
+	manifest->created = 0;
+	manifest->targets = NULL;
+	manifest->entries = NULL;
+	manifest->n_entries = 0;
+
+	uint32_t max_entries = 0;
+	bool success = true;
+	char line[MAX_BUFFER];
+
+	while (success && fgets(line, sizeof(line), file) != NULL) {
+		line[strcspn(line, "\n")] = '\0';
+
+		if (line[0] == '\0' || line[0] == '#') {
+			continue;
+		}
+
+		if (strncmp(line, "segment ", 8) != 0) {
+			// A key=value line describing the namespace.
+
+			char* value = strchr(line, '=');
+
+			if (value == NULL) {
+				success = false;
+				break;
+			}
+
+			*value++ = '\0';
+
+			if (strcmp(line, "version") == 0) {
+				manifest->version = (uint32_t)strtoul(value, NULL, 10);
+			}
+			else if (strcmp(line, "instance") == 0) {
+				manifest->inst = (uint32_t)strtoul(value, NULL, 10);
+			}
+			else if (strcmp(line, "nsid") == 0) {
+				manifest->nsid = (uint32_t)strtoul(value, NULL, 10);
+			}
+			else if (strcmp(line, "namespace") == 0) {
+				free(manifest->nsnm);
+				manifest->nsnm = strdup(value);
+			}
+			else if (strcmp(line, "base_version") == 0) {
+				manifest->base_ver = (uint32_t)strtoul(value, NULL, 10);
+			}
+			else if (strcmp(line, "n_pri_arenas") == 0) {
+				manifest->n_pri_arenas = (uint32_t)strtoul(value, NULL, 10);
+			}
+			else if (strcmp(line, "n_sec_arenas") == 0) {
+				manifest->n_sec_arenas = (uint32_t)strtoul(value, NULL, 10);
+			}
+			else if (strcmp(line, "created") == 0) {
+				manifest->created = (time_t)strtol(value, NULL, 10);
+			}
+			else if (strcmp(line, "targets") == 0) {
+				free(manifest->targets);
+				manifest->targets = strdup(value);
+			}
+
+			continue;
+		}
+
+		// A segment line - space separated key=value fields.
+
+		if (manifest->n_entries == max_entries) {
+			max_entries = max_entries == 0 ? 64 : max_entries * 2;
+
+			as_manifest_entry_t* entries = realloc(manifest->entries,
+					max_entries * sizeof(as_manifest_entry_t));
+
+			if (entries == NULL) {
+				success = false;
+				break;
+			}
+
+			manifest->entries = entries;
+		}
+
+		as_manifest_entry_t* entry = &manifest->entries[manifest->n_entries];
+		bool have_key = false;
+		char* save_ptr = NULL;
+
+		memset(entry, 0, sizeof(as_manifest_entry_t));
+		entry->codec = CODEC_DEFLATE;
+
+		for (char* field = strtok_r(line + 8, " ", &save_ptr); field != NULL;
+				field = strtok_r(NULL, " ", &save_ptr)) {
+			char* value = strchr(field, '=');
+
+			if (value == NULL) {
+				continue;
+			}
+
+			*value++ = '\0';
+
+			if (strcmp(field, "key") == 0) {
+				entry->key = (key_t)strtoul(value, NULL, 16);
+				have_key = true;
+			}
+			else if (strcmp(field, "segsz") == 0) {
+				entry->segsz = strtoul(value, NULL, 10);
+			}
+			else if (strcmp(field, "filsz") == 0) {
+				entry->filsz = strtoul(value, NULL, 10);
+			}
+			else if (strcmp(field, "file") == 0) {
+				char* dot_ptr = strchr(value, '.');
+
+				entry->compress = dot_ptr != NULL
+						&& (strcmp(dot_ptr, FILE_EXTENSION_CMP) == 0
+								|| strcmp(dot_ptr, FILE_EXTENSION_CHUNKED)
+										== 0);
+				entry->cas = dot_ptr != NULL
+						&& strcmp(dot_ptr, FILE_EXTENSION_CAS) == 0;
+			}
+			else if (strcmp(field, "compress") == 0) {
+				entry->compress = strcmp(value, "1") == 0;
+			}
+			else if (strcmp(field, "codec") == 0) {
+				entry->codec = codec_from_name(value);
+			}
+			else if (strcmp(field, "crc32") == 0) {
+				entry->crc32 = strtoul(value, NULL, 16);
+				entry->has_crc32 = true;
+			}
+			else if (strcmp(field, "dict") == 0) {
+				entry->dict_id = (uint32_t)strtoul(value, NULL, 16);
+			}
+			else if (strcmp(field, "digest") == 0) {
+				entry->has_digest = hash_digest_from_hex(value,
+						&entry->digest);
+			}
+			else if (strcmp(field, "mode") == 0) {
+				entry->mode = (unsigned int)strtoul(value, NULL, 8);
+			}
+			else if (strcmp(field, "uid") == 0) {
+				entry->uid = (uid_t)strtoul(value, NULL, 10);
+			}
+			else if (strcmp(field, "gid") == 0) {
+				entry->gid = (gid_t)strtoul(value, NULL, 10);
+			}
+			else if (strcmp(field, "target") == 0) {
+				entry->target = (uint32_t)strtoul(value, NULL, 10);
+			}
+		}
+
+		if (!have_key) {
+			success = false;
+			break;
+		}
+
+		manifest->n_entries++;
+	}
+
+	fclose(file);
+
+	if (success && (manifest->version < 1 || manifest->version > MANIFEST_VER
+			|| manifest->nsnm == NULL)) {
+		success = false;
+	}
+
+	if (!success) {
+		if (g_verbose) {
+			printf("Invalid manifest \'%s\'.\n", pathname);
+		}
+
+		free_manifest(manifest);
+	}
+
+	return success;
+}
+
+// Write a namespace's manifest, once all its segment files are written - and
+// the same manifest to each mirror directory, whose copy it describes. They
+// share a creation stamp, which tells a mirror of this backup from another.
+
+static bool
+write_manifest(as_io_t ios[], uint32_t n_ios, as_segment_t* pbp)
+{
+	time_t created = time(NULL);
+
+	// The directories are recorded as absolute paths, so that a restore can
+	// tell they're the same, however it names them.
+
+	char* targets = real_dir_list(g_pathdir_list);
+
+	if (targets == NULL || !write_manifest_file(g_pathdir, targets, ios,
+			n_ios, pbp, created)) {
+		free(targets);
+		return false;
+	}
+
+	free(targets);
+
+	for (uint32_t m = 0; m < g_n_mirrors; m++) {
+		targets = real_dir_list(g_mirrors[m]);
+
+		if (targets == NULL || !write_manifest_file(g_mirrors[m], targets,
+				ios, n_ios, pbp, created)) {
+			free(targets);
+			return false;
+		}
+
+		free(targets);
+	}
+
+	return true;
+}
+
+// Write a manifest to a directory. The manifest is written to a temporary
+// file and then renamed, so a manifest is only ever found complete.
+
+static bool
+write_manifest_file(const char* pathdir, const char* targets, as_io_t ios[],
+		uint32_t n_ios, as_segment_t* pbp, time_t created)
+{
+	char pathname[PATH_MAX + 1];
+	char temp_pathname[PATH_MAX + 1];
+
+	sprintf(pathname, "%s/%08x%s", pathdir, pbp->key, MANIFEST_EXTENSION);
+	sprintf(temp_pathname, "%s/%08x%s%s", pathdir, pbp->key,
+			MANIFEST_EXTENSION, TEMP_EXTENSION);
+
+	// Created with the same mode as the segment files it describes - afresh,
+	// as one left behind by an interrupted run keeps its own mode.
+
+	unlink(temp_pathname);
+
+	int fd = open(temp_pathname, O_CREAT | O_WRONLY | O_TRUNC, DEFAULT_MODE);
+	FILE* file = fd < 0 ? NULL : fdopen(fd, "w");
+
+	if (file == NULL) {
+		char errbuff[MAX_BUFFER];
+		char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
+
+		if (g_verbose) {
+			printf("Could not create manifest \'%s\'"
+					": error was %d: %s.\n", temp_pathname, errno, errout);
+		}
+
+		if (fd >= 0) {
+			close(fd);
+			unlink(temp_pathname);
+		}
+
+		return false;
+	}
+
+	fprintf(file, "version=%u\n", MANIFEST_VER);
+	fprintf(file, "instance=%u\n", pbp->inst);
+	fprintf(file, "nsid=%u\n", pbp->nsid);
+	fprintf(file, "namespace=%s\n", pbp->nsnm == NULL ? "" : pbp->nsnm);
+	fprintf(file, "created=%ld\n", (long)created);
+	fprintf(file, "targets=%s\n", targets);
+
+	// What restore checks in the base and meta segments, so that it needn't
+	// open their files to plan.
+
+	for (uint32_t i = 0; i < n_ios; i++) {
+		const uint8_t* memptr = (const uint8_t*)ios[i].memptr;
+
+		if (ios[i].type == TYPE_BASE) {
+			fprintf(file, "base_version=%u\n",
+					*(const uint32_t*)(memptr + BASEVER_OFF));
+			fprintf(file, "n_pri_arenas=%u\n",
+					*(const uint32_t*)(memptr + N_ARENAS_PRI_OFF));
+		}
+		else if (ios[i].type == TYPE_META) {
+			fprintf(file, "n_sec_arenas=%u\n",
+					*(const uint32_t*)(memptr + N_ARENAS_SEC_OFF));
+		}
+	}
+
+	for (uint32_t i = 0; i < n_ios; i++) {
+		const as_io_t* io = &ios[i];
+
+		fprintf(file, "segment key=%08x type=%s segsz=%lu filsz=%lu"
+				" file=%08x%s compress=%d codec=%s mode=%o uid=%u gid=%u",
+				io->key, type_name(io->type), io->segsz, io->filsz, io->key,
+				file_extension(io->compress, io->codec, io->cas),
+				(int)io->compress,
+				io->cas ? (io->compress ? "cas-zlib" : "cas") :
+						(io->compress ? codec_name(io->codec) : "none"),
+				io->mode & MODE_MASK, io->uid, io->gid);
+
+		// Only segments which were digested have a digest to record - a
+		// finalized backup has its pre-copy's chunk digests.
+
+		if (g_digest || io->cas || g_finalize) {
+			char hex[DIGEST_HEX_LEN + 1];
+
+			hash_digest_to_hex(&io->digest, hex);
+			fprintf(file, " digest=%s", hex);
+		}
+
+		if (io->dict_id != 0) {
+			fprintf(file, " dict=%08x", io->dict_id);
+		}
+
+		if (g_crc32) {
+			fprintf(file, " crc32=%08lx", io->crc32);
+		}
+
+		fprintf(file, " target=%u usec=%lu\n", io->target, io->usec);
+	}
+
+	bool success = fflush(file) == 0 && fsync(fileno(file)) == 0;
+
+	if (fclose(file) != 0) {
+		success = false;
+	}
+
+	if (success && rename(temp_pathname, pathname) < 0) {
+		success = false;
+	}
+
+	if (!success) {
+		if (g_verbose) {
+			printf("Could not write manifest \'%s\'.\n", pathname);
+		}
+
+		unlink(temp_pathname);
+	}
+
+	return success;
+}
+
+// Find a segment's entry in a manifest (if any).
+
+static const as_manifest_entry_t*
+find_manifest_entry(const as_manifest_t* manifest, key_t key)
+{
+	for (uint32_t i = 0; i < manifest->n_entries; i++) {
+		if (manifest->entries[i].key == key) {
+			return &manifest->entries[i];
+		}
+	}
+
+	return NULL;
+}
+
+// Free a manifest's contents.
+
+static void
+free_manifest(as_manifest_t* manifest)
+{
+	free(manifest->nsnm);
+	manifest->nsnm = NULL;
+
+	free(manifest->targets);
+	manifest->targets = NULL;
+
+	free(manifest->entries);
+	manifest->entries = NULL;
+	manifest->n_entries = 0;
+}
+
+// Compare identified segments with their existing segment files. Nothing is
+// written, either to the segments or to the files.
+
+static bool
+compare_candidate(as_segment_t* pbp, as_segment_t* ptp,
+		as_segment_t psps[], uint32_t n_psps, as_segment_t* smp,
+		as_segment_t ssps[], uint32_t n_ssps,
+		as_segment_t data[], uint32_t n_data)
+{
+	// Create list of file I/O requests.
+
+	uint32_t n_files = 1 + 1 + n_psps;
+
+	if (n_ssps > 0) {
+		n_files += 1 + n_ssps;
+	}
+
+	if (n_data > 0) {
+		n_files += n_data;
+	}
+
+	// A namespace backed up to a pack is compared with its extents.
+
+	char pathname[PATH_MAX + 1];
+
+	if (have_pack(pbp->key, pathname) && !open_pack(pbp->key)) {
+		return false;
+	}
+
+	as_io_t ios[n_files];
+	uint32_t n_ios = 0;
+
+	if (!compare_candidate_file(pbp, &ios[n_ios], ios, n_ios)) {
+		return false;
+	}
+
+	n_ios++;
+
+	if (!compare_candidate_file(ptp, &ios[n_ios], ios, n_ios)) {
+		return false;
+	}
+
+	n_ios++;
+
+	for (uint32_t i = 0; i < n_psps; i++) {
+		if (!compare_candidate_file(&psps[i], &ios[n_ios], ios, n_ios)) {
+			return false;
+		}
+
+		n_ios++;
+	}
+
+	if (n_ssps > 0) {
+		if (!compare_candidate_file(smp, &ios[n_ios], ios, n_ios)) {
+			return false;
+		}
+
+		n_ios++;
+
+		for (uint32_t i = 0; i < n_ssps; i++) {
+			if (!compare_candidate_file(&ssps[i], &ios[n_ios], ios, n_ios)) {
+				return false;
+			}
+
+			n_ios++;
+		}
+	}
+
+	for (uint32_t i = 0; i < n_data; i++) {
+		if (!compare_candidate_file(&data[i], &ios[n_ios], ios, n_ios)) {
+			return false;
+		}
+
+		n_ios++;
+	}
+
+	assert(n_files == n_ios);
+
+	// Hand the file I/O requests in for processing.
+
+	bool success = start_io(ios, n_ios);
+
+	// Report the mismatched ranges of each segment.
+
+	uint32_t n_mismatched = 0;
+
+	for (uint32_t i = 0; i < n_ios; i++) {
+		as_io_t* io = &ios[i];
+
+		if (io->n_ranges == 0) {
+			continue;
+		}
+
+		n_mismatched++;
+
+		// Chunks were compared in parallel - sort and merge their ranges.
+
+		qsort((void*)io->ranges, (size_t)io->n_ranges, sizeof(as_range_t),
+				qsort_compare_ranges);
+
+		uint32_t n_ranges = 1;
+
+		for (uint32_t j = 1; j < io->n_ranges; j++) {
+			as_range_t* last = &io->ranges[n_ranges - 1];
+
+			if (io->ranges[j].start <= last->end) {
+				if (io->ranges[j].end > last->end) {
+					last->end = io->ranges[j].end;
+				}
+			}
+			else {
+				io->ranges[n_ranges++] = io->ranges[j];
+			}
+		}
+
+		io->n_ranges = n_ranges;
+
+		size_t n_bytes = 0;
+
+		for (uint32_t j = 0; j < io->n_ranges; j++) {
+			n_bytes += io->ranges[j].end - io->ranges[j].start;
+		}
+
+		printf("Segment %08x differs from its segment file in %u range%s"
+				" (%lu bytes):\n", io->key, io->n_ranges,
+				io->n_ranges == 1 ? "" : "s", n_bytes);
+
+		for (uint32_t j = 0; j < io->n_ranges && j < MAX_RANGES_SHOWN; j++) {
+			printf("  0x%012lx-0x%012lx (%lu bytes)\n", io->ranges[j].start,
+					io->ranges[j].end,
+					io->ranges[j].end - io->ranges[j].start);
+		}
+
+		if (io->n_ranges > MAX_RANGES_SHOWN) {
+			printf("  ... and %u more.\n", io->n_ranges - MAX_RANGES_SHOWN);
+		}
+	}
+
+	// Notify user of the outcome.
+
+	if (g_verbose) {
+		if (!success) {
+			printf("\nFailed to compare %u", n_files);
+		}
+		else if (n_mismatched != 0) {
+			printf("\nFound mismatches in %u of %u", n_mismatched, n_files);
+		}
+		else {
+			printf("\nSuccessfully matched %u", n_files);
+		}
+
+		printf(" Aerospike database segments with their segment files");
+		printf(" for instance %u, namespace \'%s\' (nsid %u).\n", pbp->inst,
+				pbp->nsnm == NULL ? "<null>" : pbp->nsnm, pbp->nsid);
+	}
+
+	// Clean up all intermediate operations.
+
+	compare_candidate_cleanup(ios, n_ios);
+
+	return success && n_mismatched == 0;
+}
+
+static bool
+compare_candidate_file(as_segment_t* sp, as_io_t* io, as_io_t ios[],
+		uint32_t n_ios)
+{
+	// Find the segment file. Base and meta segment files are never
+	// compressed.
+
+	char pathname[PATH_MAX + 1];
+	bool compress = false;
+	bool cas = false;
+	uint32_t target = 0;
+
+	// In a pack, the segment's extent stands in for its file.
+
+	const as_pack_extent_t* extent = NULL;
+
+	if (g_pack_file.fd >= 0) {
+		extent = find_pack_extent(sp->key);
+
+		if (extent == NULL) {
+			if (g_verbose) {
+				printf("Could not find segment %08x in pack file.\n",
+						sp->key);
+			}
+
+			// Clean up all intermediate operations.
+
+			compare_candidate_cleanup(ios, n_ios);
+
+			return false;
+		}
+	}
+
+	int fd = extent != NULL ? g_pack_file.fd : -1;
+
+	// Otherwise, the segment file may be in any of the backup directories.
+
+	for (uint32_t t = 0; fd < 0 && t < g_n_pathdirs; t++) {
+		target = t;
+		compress = false;
+		cas = false;
+
+		sprintf(pathname, "%s/%08x%s", g_pathdirs[t], sp->key,
+				FILE_EXTENSION);
+
+		fd = open(pathname, O_RDONLY);
+
+		if (fd < 0 && sp->type != TYPE_BASE && sp->type != TYPE_META) {
+			sprintf(pathname, "%s/%08x%s", g_pathdirs[t], sp->key,
+					FILE_EXTENSION_CMP);
+
+			fd = open(pathname, O_RDONLY);
+			compress = true;
+		}
+
+		if (fd < 0 && sp->type != TYPE_BASE && sp->type != TYPE_META) {
+			sprintf(pathname, "%s/%08x%s", g_pathdirs[t], sp->key,
+					FILE_EXTENSION_CHUNKED);
+
+			fd = open(pathname, O_RDONLY);
+			compress = true;
+		}
+
+		if (fd < 0 && sp->type != TYPE_BASE && sp->type != TYPE_META) {
+			sprintf(pathname, "%s/%08x%s", g_pathdirs[t], sp->key,
+					FILE_EXTENSION_CAS);
+
+			fd = open(pathname, O_RDONLY);
+			compress = false;
+			cas = true;
+		}
+	}
+
+	struct stat statbuf;
+
+	if (fd < 0 || fstat(fd, &statbuf) < 0) {
+		char errbuff[MAX_BUFFER];
+		char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
+
+		if (g_verbose) {
+			printf("Could not open segment file for segment %08x"
+					": error was %d: %s.\n", sp->key, errno, errout);
+		}
+
+		if (fd >= 0 && extent == NULL) {
+			close(fd);
+		}
+
+		// Clean up all intermediate operations.
+
+		compare_candidate_cleanup(ios, n_ios);
+
+		return false;
+	}
+
+	// Attach to the segment (for reading).
+
+	void* memptr = shmat(sp->shmid, NULL, SHM_RDONLY);
+
+	if (memptr == (void*)-1) {
+		char errbuff[MAX_BUFFER];
+		char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
+
+		printf("Could not attach segment %08x"
+				": error was %d: %s.\n", sp->key, errno, errout);
+
+		if (extent == NULL) {
+			close(fd);
+		}
+
+		// Clean up all intermediate operations.
+
+		compare_candidate_cleanup(ios, n_ios);
+
+		return false;
+	}
+
+	// Create an I/O request for the segment. Uncompressed files are compared
+	// in parallel chunks.
+
+	io->key = sp->key;
+	io->fd = fd;
+	io->op = IO_OP_COMPARE;
+	io->memptr = memptr;
+	io->filsz = extent != NULL ? extent->segsz : (size_t)statbuf.st_size;
+	io->offset = extent != NULL ? extent->offset : 0;
+	io->target = target;
+	io->segsz = sp->segsz;
+	io->compress = compress;
+	io->crc32 = g_crc32_init;
+	io->shmid = sp->shmid;
+	io->uid = sp->uid;
+	io->gid = sp->gid;
+	io->mode = sp->mode;
+	io->n_chunks = compress ?
+			1 : (uint32_t)((sp->segsz + IOCHUNK - 1) / IOCHUNK);
+	io->failed = false;
+	io->chunks_done = NULL;
+	io->n_chunks_done = 0;
+	io->atime = io->ctime = 0;
+	io->ranges = NULL;
+	io->n_ranges = 0;
+	io->cas = cas;
+	io->chunk_digests = NULL;
+
+	// A segment in the chunk store is compared by chunk digests, which only
+	// need the chunk store for detail.
+
+	if (cas) {
+		as_cas_t header;
+
+		if (!read_cas_header(fd, sp->key, sp->segsz, CASHDR_MAG, &header,
+				&io->chunk_digests)) {
+			// Clean up all intermediate operations.
+
+			compare_candidate_cleanup(ios, n_ios + 1);
+
+			return false;
+		}
+
+		io->compress = header.compress != 0;
+
+		return true;
+	}
+
+	// An uncompressed file longer than its segment can't match.
+
+	if (!compress && io->filsz > io->segsz) {
+		io->ranges = malloc(sizeof(as_range_t));
+
+		if (io->ranges == NULL) {
+			if (g_verbose) {
+				printf("Could not allocate memory to compare segment %08x.\n",
+						sp->key);
+			}
+
+			// Clean up all intermediate operations.
+
+			compare_candidate_cleanup(ios, n_ios + 1);
+
+			return false;
+		}
+
+		io->ranges[0].start = io->segsz;
+		io->ranges[0].end = io->filsz;
+		io->n_ranges = 1;
+	}
+
+	return true;
+}
+
+// Cleanup from compare_candidate().
+
+static void
+compare_candidate_cleanup(as_io_t ios[], uint32_t n_ios)
+{
+	for (uint32_t i = 0; i < n_ios; i++) {
+		shmdt(ios[i].memptr);
+
+		if (ios[i].fd != g_pack_file.fd) {
+			close(ios[i].fd);
+		}
+
+		free(ios[i].ranges);
+		ios[i].ranges = NULL;
+		ios[i].n_ranges = 0;
+
+		free(ios[i].chunk_digests);
+		ios[i].chunk_digests = NULL;
+	}
+
+	close_pack();
+}
+
+// qsort(3) comparison routine for mismatched ranges.
+
+static int
+qsort_compare_ranges(const void* left, const void* right)
+{
+	size_t l = ((const as_range_t*)left)->start;
+	size_t r = ((const as_range_t*)right)->start;
+
+	return l < r ? -1 : (l > r ? 1 : 0);
+}
+
+// Actually start the I/Os in the list.
+
+static bool
+start_io(as_io_t ios[], uint32_t n_ios)
+{
+	// Each backup directory gets its own pool of threads, so that a slow
+	// device doesn't hold up the others. Number of threads to start for each,
+	// based on g_max_threads and the number of chunks of work for it.
+
+	uint32_t n_chunks[MAX_TARGETS] = { 0 };
+
+	for (uint32_t i = 0; i < n_ios; i++) {
+		assert(ios[i].n_chunks >= 1);
+		assert(ios[i].target < g_n_pathdirs);
+
+		n_chunks[ios[i].target] += ios[i].n_chunks;
+	}
+
+	// Every directory with work needs a thread, even if that's more than
+	// g_max_threads. The rest are dealt out a thread at a time to those which
+	// have more chunks than threads, so that no more than g_max_threads start.
+
+	uint32_t target_threads[MAX_TARGETS] = { 0 };
+	uint32_t n_threads = 0;
+
+	for (uint32_t t = 0; t < g_n_pathdirs; t++) {
+		if (n_chunks[t] != 0) {
+			target_threads[t] = 1;
+			n_threads++;
+		}
+	}
+
+	bool dealt = true;
+
+	while (dealt && n_threads < g_max_threads) {
+		dealt = false;
+
+		for (uint32_t t = 0; t < g_n_pathdirs && n_threads < g_max_threads;
+				t++) {
+			if (target_threads[t] < n_chunks[t]) {
+				target_threads[t]++;
+				n_threads++;
+				dealt = true;
+			}
+		}
+	}
+
+	// Set global file I/O variables.
+
+	g_ios = ios;
+	g_n_ios = n_ios;
+	memset(g_next_io, 0, sizeof(g_next_io));
+	memset(g_next_chunk, 0, sizeof(g_next_chunk));
+	g_n_failed_ios = 0;
+	g_ios_ok = true;
+	g_spare_threads = g_max_threads > n_threads ? g_max_threads - n_threads : 0;
+
+	// How much data will be transferred (total)?
+
+	g_total_to_transfer = 0;
+
+	for (uint32_t i = 0; i < g_n_ios; i++) {
+		g_total_to_transfer += (uint64_t)ios[i].segsz;
+	}
+
+	g_total_transferred = 0;
+	g_decile_transferred = 0;
+
+	// Remember start time.
+
+	int rc = clock_gettime(CLOCK_MONOTONIC, &g_io_start_time);
+
+	if (rc != 0) {
+		if (g_verbose) {
+			printf("Could not determine I/O start time.\n");
+		}
+
+		return false;
+	}
+
+	// Initialize global mutex.
+
+	pthread_mutex_init(&g_io_mutex, NULL);
+
+	// Thread table.
+
+	pthread_t threads[n_threads];
+
+	// Actually start threads.
+
+	uint32_t i = 0;
+
+	for (uint32_t t = 0; rc == 0 && t < g_n_pathdirs; t++) {
+		for (uint32_t k = 0; k < target_threads[t]; k++) {
+			rc = pthread_create(&threads[i], NULL, run_io,
+					(void*)(uintptr_t)t);
+
+			// If creating thread failed, notify successfully created
+			// threads to end and wait.
+
+			if (rc != 0) {
+				pthread_mutex_lock(&g_io_mutex);
+				g_ios_ok = false;
+				pthread_mutex_unlock(&g_io_mutex);
+
+				break;
+			}
+
+			i++;
+		}
+	}
+
+	// Wait for all threads to exit.
+
+	for (uint32_t j = 0; j < i; j++) {
+		pthread_join(threads[j], NULL);
+	}
+
+	struct timespec io_end_time;
+
+	rc = clock_gettime(CLOCK_MONOTONIC, &io_end_time);
+
+	if (rc != 0) {
+		if (g_verbose) {
+			printf("Could not determine I/O end time.\n");
+		}
+	}
+	else {
+		if (g_verbose && g_decile_transferred != 10) {
+			char* time_str = strtime_diff_eta(&g_io_start_time, &io_end_time,
+					g_decile_transferred);
+
+			printf("Total I/O time was %s.\n", time_str);
+			free(time_str);
+			time_str = NULL;
+		}
+	}
+
+	// Return success or failure.
+
+	return g_ios_ok && g_n_failed_ios == 0;
+}
+
+// Process individual file I/O requests by individual threads.
+
+static void*
+run_io(void* args)
+{
+	// Which backup directory's I/O requests this thread processes.
+
+	uint32_t target = (uint32_t)(uintptr_t)args;
+
+	while (true) {
+		// Get the next I/O request (and chunk of it).
+
+		uint32_t next;
+		uint32_t chunk;
+
+		pthread_mutex_lock(&g_io_mutex);
+
+		// Is everything running okay?
+
+		bool ok = g_ios_ok;
+
+		// If so, get next I/O operation.
+
+		if (ok) {
+			while (g_next_io[target] < g_n_ios
+					&& (g_ios[g_next_io[target]].target != target
+							|| g_next_chunk[target]
+									== g_ios[g_next_io[target]].n_chunks)) {
+				g_next_io[target]++;
+				g_next_chunk[target] = 0;
+			}
+
+			next = g_next_io[target];
+			chunk = g_next_chunk[target]++;
+		}
+
+		pthread_mutex_unlock(&g_io_mutex);
+
+		// If there are no more requests or one or more failed, quit.
+
+		if (!ok || next >= g_n_ios) {
+			break;
+		}
+
+		// Extract this I/O request.
+
+		as_io_t* io = &g_ios[next];
+
+		// Chunks completed before a resume are skipped.
+
+		bool skip = io->chunks_done != NULL && io->chunks_done[chunk];
+		bool success;
+
+		if (skip) {
+			success = true;
+		}
+		else {
+			switch (io->op) {
+			case IO_OP_WRITE:
+				success = g_s3 ? upload_file(io, chunk) : backup_file(io);
+				break;
+
+			case IO_OP_READ:
+				if (io->cas) {
+					success = read_cas_file(io, chunk);
+				}
+				else if (g_s3) {
+					success = download_file(io, chunk);
+				}
+				else if (g_n_mirrors != 0) {
+					success = read_mirrored_file(io);
+				}
+				else {
+					success = read_file(io->fd, io->offset, io->memptr,
+							io->filsz, io->segsz, io->shmid, io->mode, io->uid,
+							io->gid, io->compress, &io->crc32);
+				}
+				break;
+
+			case IO_OP_VERIFY:
+				success = io->cas ?
+						verify_cas_file(io, chunk) :
+						verify_file(io->fd, io->key, io->offset, io->filsz,
+								io->segsz, io->compress, &io->crc32);
+				break;
+
+			case IO_OP_COMPARE:
+				success = compare_file(io, chunk);
+				break;
+
+			case IO_OP_PRECOPY:
+				success = precopy_file(io, chunk);
+				break;
+
+			case IO_OP_FINALIZE:
+				success = finalize_file(io, chunk);
+				break;
+
+			case IO_OP_STREAM:
+				success = stream_file(io, chunk);
+				break;
+
+			default:
+				assert(false);
+				success = false;
+				break;
+			}
+		}
+
+		// If this request failed, stop the other threads. Verification and
+		// comparison carry on, so that every bad file gets reported.
+
+		if (!success && io->op != IO_OP_VERIFY && io->op != IO_OP_COMPARE) {
+			pthread_mutex_lock(&g_io_mutex);
+			g_ios_ok = false;
+			pthread_mutex_unlock(&g_io_mutex);
+			break;
+		}
+		else {
+			char record[JOURNAL_RECORD_MAX];
+			size_t record_len = 0;
+
+			pthread_mutex_lock(&g_io_mutex);
+
+			if (!success && !io->failed) {
+				io->failed = true;
+				g_n_failed_ios++;
+			}
+
+			if (success && !skip) {
+				io->n_chunks_done++;
+			}
+
+			// A backup journals skipped chunks again, with the attach time
+			// of this run - which is now the segment's latest.
+
+			if (success && (!skip || io->op == IO_OP_WRITE)) {
+				record_len = journal_chunk(io, chunk, record);
+			}
+
+			g_total_transferred += io_chunk_size(io, chunk);
+
+			// if we've reached a notable decile point, notify the user.
+			// Note: This is the only point at which output is done under
+			// a mutex, so it isn't stepped on by other threads.
+
+			if (g_verbose) {
+				uint32_t decile_transferred = (uint32_t)((g_total_transferred
+						* 10UL) / g_total_to_transfer);
+
+				if (g_decile_transferred != decile_transferred) {
+					g_decile_transferred = decile_transferred;
+
+					if (g_verbose) {
+						printf("Transferred %3d%% of data",
+								g_decile_transferred * 10);
+					}
+
+					struct timespec io_end_time;
+					int rc = clock_gettime(CLOCK_MONOTONIC, &io_end_time);
+
+					if (rc != 0) {
+						if (g_verbose) {
+							printf(".\n");
+						}
+					}
+					else {
+						char* time_str = strtime_diff_eta(&g_io_start_time,
+								&io_end_time, g_decile_transferred);
+
+						if (g_verbose) {
+							printf(" in %s.\n", time_str);
+						}
+
+						free(time_str);
+						time_str = NULL;
+					}
+				}
+			}
+
+			pthread_mutex_unlock(&g_io_mutex);
+
+			if (record_len != 0) {
+				write_journal(io, record, record_len);
+			}
+		}
+	}
+
+	// Out of work - this thread is spare, e.g. to help inflate a large file.
+
+	release_threads(1);
+
+	return NULL;
+}
+
+// Write a complete file (compressed with codec, if requested) - the same file
+// to each of fds, from a single pass over the segment. Deflate makes a gzip
+// stream, any other codec a chunked file. Compute crc32 if requested.
+
+static bool
+write_file(const int fds[], uint32_t n_fds, const void* buf, size_t segsz,
+		mode_t mode, uid_t uid, gid_t gid, bool compress, as_codec codec,
+		const as_dict_t* dict, uLong* crc)
+{
+	if (compress && codec == CODEC_DEFLATE) {
+#ifdef USE_ISAL
+		return iwrite_file(fds, n_fds, buf, segsz, mode, uid, gid, crc);
+#else
+		return zwrite_file(fds, n_fds, buf, segsz, mode, uid, gid, crc);
+#endif
+	}
+	else if (compress) {
+		return cwrite_file(fds, n_fds, buf, segsz, mode, uid, gid, codec, dict,
+				crc);
+	}
+	else {
+		return pwrite_file(fds, n_fds, buf, segsz, mode, uid, gid, crc);
+	}
+}
+
+#ifndef USE_ISAL
+// Write a complete file (compressed). The segment is compressed once, and each
+// compressed chunk written to every file. Retrieve crc32 if requested. Not
+// used if built with USE_ISAL - see iwrite_file().
+
+static bool
+zwrite_file(const int fds[], uint32_t n_fds, const void* buf, size_t segsz,
+		mode_t mode, uid_t uid, gid_t gid, uLong* crc)
+{
+	// Set up and write initial compressed file header.
+
+	as_cmp_t header;
+
+	header.magic = CMPHDR_MAG2;
+	header.version = CMPHDR_VER;
+	header.crc32 = g_crc32_init;
+	header.segsz = segsz;
+
+	if (!write_cmp_header(fds, n_fds, &header, NULL)) {
+		return false;
+	}
+
+	// Allocate buffer for compression intermediate results.
+
+	uint8_t* cmp_buf = (uint8_t*)malloc(CMPCHUNK);
+
+	if (cmp_buf == NULL) {
+		if (g_verbose) {
+			printf("Could not allocate memory to compress file.\n");
+		}
+
+		return false;
+	}
+
+	// Set up the compression.
+
+	z_stream defstream;
+
+	defstream.zalloc = Z_NULL;
+	defstream.zfree = Z_NULL;
+	defstream.opaque = Z_NULL;
+
+	// Use gzip compression; as a side effect, get crc32 for free.
+
+	int windowBits = 15 + 16; // Use max memory and use gzip algorithm.
+	int memLevel = 9; // Use maximum memory level.
+
+	if (deflateInit2(&defstream, Z_BEST_SPEED, Z_DEFLATED, windowBits, memLevel,
+			Z_DEFAULT_STRATEGY) != Z_OK) {
+		if (g_verbose) {
+			printf("Did not initialize compression engine while writing"
+					" segment to file.\n");
+		}
+
+		free(cmp_buf);
+		cmp_buf = NULL;
+		return false;
+	}
+
+	// Whole segment is available in buf. Actually compress the segment, a
+	// chunk at a time.
+
+	const uint8_t* seg = (const uint8_t*)buf;
+	int level = Z_BEST_SPEED;
+	size_t offset = 0;
+	int ret;
+
+	do {
+		size_t size = segsz - offset < CMPCHUNK ? segsz - offset : CMPCHUNK;
+		int flush = offset + size == segsz ? Z_FINISH : Z_NO_FLUSH;
+
+		// A chunk which won't compress is stored in the gzip stream, without
+		// running the compressor over it. Switching level ends the current
+		// deflate block, which must be written out first.
+
+		int chunk_level = chunk_incompressible(seg + offset, size) ?
+				Z_NO_COMPRESSION : Z_BEST_SPEED;
+
+		if (chunk_level != level) {
+			do {
+				defstream.avail_out = (uInt)CMPCHUNK;
+				defstream.next_out = (Bytef*)cmp_buf;
+
+				ret = deflateParams(&defstream, chunk_level,
+						Z_DEFAULT_STRATEGY);
+
+				if ((ret != Z_OK && ret != Z_BUF_ERROR)
+						|| !write_cmp_data(fds, n_fds, cmp_buf,
+								CMPCHUNK - defstream.avail_out)) {
+					if (g_verbose) {
+						printf("Could not compress file.\n");
+					}
+
+					(void)deflateEnd(&defstream);
+					free(cmp_buf);
+					cmp_buf = NULL;
+					return false;
+				}
+			} while (ret == Z_BUF_ERROR);
+
+			level = chunk_level;
+		}
+
+		defstream.avail_in = (uInt)size;
+		defstream.next_in = (Bytef*)(seg + offset);
+
+		do {
+			// Compress into one output buffer at a time.
+
+			defstream.avail_out = (uInt)CMPCHUNK;
+			defstream.next_out = (Bytef*)cmp_buf;
+
+			ret = deflate(&defstream, flush);
+			if (ret == Z_STREAM_ERROR) {
+				if (g_verbose) {
+					printf("Could not compress file.\n");
+				}
+
+				(void)deflateEnd(&defstream);
+				free(cmp_buf);
+				cmp_buf = NULL;
+				return false;
+			}
+
+			// Write this output to the output files.
+
+			if (!write_cmp_data(fds, n_fds, cmp_buf,
+					CMPCHUNK - defstream.avail_out)) {
+				(void)deflateEnd(&defstream);
+				free(cmp_buf);
+				cmp_buf = NULL;
+				return false;
+			}
+		} while (defstream.avail_out == 0);
+
+		offset += size;
+	} while (offset < segsz);
+
+	// Finished compressing. Was it successful?
+
+	if (defstream.avail_in != 0) {
+		if (g_verbose) {
+			printf("Failed to compress file.\n");
+		}
+
+		(void)deflateEnd(&defstream);
+		free(cmp_buf);
+		cmp_buf = NULL;
+		return false;
+	}
+
+	// Shut down compression engine.
+
+	deflateEnd(&defstream);
+
+	// Free intermediate compression buffer.
+
+	free(cmp_buf);
+	cmp_buf = NULL;
+
+	// Ensure compression engine finished happily.
+
+	if (ret != Z_STREAM_END) {
+		if (g_verbose) {
+			printf("Did not finish compressing segment to file.\n");
+		}
+
+		return false;
+	}
+
+	// Should we retrieve crc32?
+
+	*crc = g_crc32 ? defstream.adler : g_crc32_init;
+
+	// Go back and write compressed file header (ALWAYS).
+
+	header.magic = CMPHDR_MAG2;
+	header.version = CMPHDR_VER;
+	header.segsz = segsz;
+	header.crc32 = defstream.adler;
+
+	if (!write_cmp_header(fds, n_fds, &header, NULL)) {
+		return false;
+	}
+
+	// Set file ownership and mode.
+
+	return set_file_owner(fds, n_fds, mode, uid, gid);
+}
+#else
+// Write a complete file (compressed), with ISA-L's igzip instead of zlib. It
+// makes the same kind of gzip stream, so a zlib build of asmt (or gzip) reads
+// it - but deflates several times faster, with the SIMD code ISA-L picks for
+// the CPU at run time. The segment is compressed once, and each compressed
+// chunk written to every file. Retrieve crc32 if requested.
+
+static bool
+iwrite_file(const int fds[], uint32_t n_fds, const void* buf, size_t segsz,
+		mode_t mode, uid_t uid, gid_t gid, uLong* crc)
+{
+	// Set up and write initial compressed file header.
+
+	as_cmp_t header = { .magic = CMPHDR_MAG2, .version = CMPHDR_VER,
+			.segsz = segsz, .crc32 = g_crc32_init };
+
+	if (!write_cmp_header(fds, n_fds, &header, NULL)) {
+		return false;
+	}
+
+	// Allocate buffers for compression intermediate results, and for igzip's
+	// level 1 hash tables.
+
+	uint8_t* cmp_buf = (uint8_t*)malloc(CMPCHUNK);
+	uint8_t* level_buf = (uint8_t*)malloc(ISAL_DEF_LVL1_DEFAULT);
+
+	if (cmp_buf == NULL || level_buf == NULL) {
+		if (g_verbose) {
+			printf("Could not allocate memory to compress file.\n");
+		}
+
+		free(cmp_buf);
+		free(level_buf);
+		return false;
+	}
+
+	// Set up the compression - gzip, at level 1, like zwrite_file().
+
+	struct isal_zstream stream;
+
+	isal_deflate_init(&stream);
+
+	stream.level = 1;
+	stream.level_buf = level_buf;
+	stream.level_buf_size = ISAL_DEF_LVL1_DEFAULT;
+	stream.gzip_flag = IGZIP_GZIP;
+	stream.flush = NO_FLUSH;
+
+	// Whole segment is available in buf, but igzip counts input in 32 bits -
+	// compress the segment a chunk at a time. The crc32 is zlib's, which is
+	// also what goes in the gzip trailer.
+
+	const uint8_t* seg = (const uint8_t*)buf;
+	size_t offset = 0;
+	uLong seg_crc = crc32(0L, Z_NULL, 0);
+	bool success = true;
+
+	do {
+		size_t size = segsz - offset < CMPCHUNK ? segsz - offset : CMPCHUNK;
+
+		seg_crc = crc32_z(seg_crc, seg + offset, size);
+
+		stream.next_in = (uint8_t*)(seg + offset);
+		stream.avail_in = (uint32_t)size;
+		stream.end_of_stream = offset + size == segsz ? 1 : 0;
+
+		do {
+			// Compress into one output buffer at a time, and write it to the
+			// output files. Once all the input is in, igzip finishes the
+			// stream unless it runs out of room to - so it's done when the
+			// output buffer isn't filled.
+
+			stream.next_out = cmp_buf;
+			stream.avail_out = (uint32_t)CMPCHUNK;
+
+			int ret = isal_deflate(&stream);
+
+			if (ret != COMP_OK) {
+				if (g_verbose) {
+					printf("Could not compress file (igzip error %d).\n",
+							ret);
+				}
+
+				success = false;
+				break;
+			}
+
+			if (!write_cmp_data(fds, n_fds, cmp_buf,
+					CMPCHUNK - stream.avail_out)) {
+				success = false;
+				break;
+			}
+		} while (stream.avail_in != 0 || stream.avail_out == 0);
+
+		offset += size;
+	} while (success && offset < segsz);
+
+	free(cmp_buf);
+	cmp_buf = NULL;
+	free(level_buf);
+	level_buf = NULL;
+
+	if (!success) {
+		return false;
+	}
+
+	// Should we retrieve crc32?
+
+	*crc = g_crc32 ? seg_crc : g_crc32_init;
+
+	// Go back and write compressed file header (ALWAYS).
+
+	header.crc32 = seg_crc;
+
+	if (!write_cmp_header(fds, n_fds, &header, NULL)) {
+		return false;
+	}
+
+	// Set file ownership and mode.
+
+	return set_file_owner(fds, n_fds, mode, uid, gid);
+}
+#endif
+
+// Write a complete file (chunked). Each chunk is compressed on its own - with
+// the segment type's dictionary, if it has one - and stored as it is if that
+// doesn't make it smaller - so with CODEC_STORE, the segment is copied as it
+// is. The crc32 in the header is always computed.
+// Retrieve crc32 if requested.
+
+static bool
+cwrite_file(const int fds[], uint32_t n_fds, const void* buf, size_t segsz,
+		mode_t mode, uid_t uid, gid_t gid, as_codec codec,
+		const as_dict_t* dict, uLong* crc)
+{
+	as_cmp_t header = { .magic = CMPHDR_MAG2, .version = CMPHDR_VER_CHUNKED,
+			.segsz = segsz, .crc32 = crc32(0L, Z_NULL, 0) };
+	as_cmp_ext_t ext = { .codec = (uint32_t)codec, .chunk_sz = CMPCHUNK };
+
+	if (!write_cmp_header(fds, n_fds, &header, &ext)) {
+		return false;
+	}
+
+	size_t cmp_cap = codec_bound(codec, CMPCHUNK);
+	uint8_t* cmp_buf = codec == CODEC_STORE ? NULL : (uint8_t*)malloc(cmp_cap);
+
+	if (codec != CODEC_STORE && cmp_buf == NULL) {
+		if (g_verbose) {
+			printf("Could not allocate memory to compress file.\n");
+		}
+
+		return false;
+	}
+
+	const uint8_t* seg = (const uint8_t*)buf;
+
+	for (size_t offset = 0; offset < segsz; offset += CMPCHUNK) {
+		size_t size = segsz - offset < CMPCHUNK ? segsz - offset : CMPCHUNK;
+		const uint8_t* out = seg + offset;
+		size_t len = size;
+
+		header.crc32 = crc32_z(header.crc32, out, size);
+
+		// A chunk which won't compress is stored as it is, without running
+		// the compressor over it.
+
+		if (codec != CODEC_STORE && !chunk_incompressible(out, size)) {
+			size_t cmp_len = cmp_cap;
+
+			if (codec_compress(codec, dict, out, size, cmp_buf, &cmp_len)
+					&& cmp_len < size) {
+				out = cmp_buf;
+				len = cmp_len;
+			}
+		}
+
+		uint32_t len32 = (uint32_t)len;
+
+		for (uint32_t i = 0; i < n_fds; i++) {
+			if (write(fds[i], &len32, sizeof(len32)) != sizeof(len32)
+					|| write(fds[i], out, len) != (ssize_t)len) {
+				if (g_verbose) {
+					printf("Could not write to compressed file.\n");
+				}
+
+				free(cmp_buf);
+				return false;
+			}
+		}
+	}
+
+	free(cmp_buf);
+
+	*crc = g_crc32 ? header.crc32 : g_crc32_init;
+
+	// Go back and write compressed file header, now with its crc32.
+
+	if (!write_cmp_header(fds, n_fds, &header, &ext)) {
+		return false;
+	}
+
+	return set_file_owner(fds, n_fds, mode, uid, gid);
+}
+
+// Write compressed data to each of fds, where they're at.
+
+static bool
+write_cmp_data(const int fds[], uint32_t n_fds, const void* buf, size_t size)
+{
+	for (uint32_t i = 0; i < n_fds; i++) {
+		if (write(fds[i], buf, size) != (ssize_t)size) {
+			if (g_verbose) {
+				printf("Could not write to compressed file.\n");
+			}
+
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Estimate whether a chunk is hopeless to compress, from a histogram of the
+// bytes of ENTROPY_SAMPLES runs spread across it. If the chance of two sampled
+// bytes being equal is barely above that of random bytes, no order-0 coder can
+// shrink it much - the collision entropy, a lower bound on the Shannon
+// entropy, is over log2(ENTROPY_SPREAD) bits per byte. Repeated runs which
+// LZ77 could find may be missed, for the sake of being cheap.
+
+static bool
+chunk_incompressible(const uint8_t* buf, size_t size)
+{
+	uint32_t counts[256] = { 0 };
+	size_t stride = size / ENTROPY_SAMPLES;
+	uint64_t n = 0;
+
+	if (stride < ENTROPY_SAMPLE) {
+		stride = ENTROPY_SAMPLE;
+	}
+
+	for (size_t offset = 0; offset < size; offset += stride) {
+		size_t end = size - offset < ENTROPY_SAMPLE ?
+				size : offset + ENTROPY_SAMPLE;
+
+		for (size_t i = offset; i < end; i++) {
+			counts[buf[i]]++;
+		}
+
+		n += end - offset;
+	}
+
+	// Too small a sample to tell.
+
+	if (n < 256 * 4) {
+		return false;
+	}
+
+	uint64_t collisions = 0;
+
+	for (uint32_t i = 0; i < 256; i++) {
+		collisions += (uint64_t)counts[i] * counts[i];
+	}
+
+	return collisions * ENTROPY_SPREAD < n * n;
+}
+
+// Write the header of a compressed file - and, for a chunked file, its
+// extension - at the start of each of fds.
+
+static bool
+write_cmp_header(const int fds[], uint32_t n_fds, const as_cmp_t* header,
+		const as_cmp_ext_t* ext)
+{
+	for (uint32_t i = 0; i < n_fds; i++) {
+		if (lseek(fds[i], (off_t)CMPHDR_OFF, SEEK_SET) != (off_t)CMPHDR_OFF) {
+			if (g_verbose) {
+				printf("Could not write compressed file header to file.\n");
+			}
+
+			return false;
+		}
+
+		if (write(fds[i], (const void*)header, CMPHDR_LEN)
+				!= (size_t)CMPHDR_LEN || (ext != NULL
+						&& write(fds[i], (const void*)ext, CMPEXT_LEN)
+								!= (size_t)CMPEXT_LEN)) {
+			if (g_verbose) {
+				printf("Could not write compressed file header to file.\n");
+			}
+
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Set the ownership and mode of each of fds.
+
+static bool
+set_file_owner(const int fds[], uint32_t n_fds, mode_t mode, uid_t uid,
+		gid_t gid)
+{
+	for (uint32_t i = 0; i < n_fds; i++) {
+		if (fchown(fds[i], uid, gid) == -1) {
+			char errbuff[MAX_BUFFER];
+			char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
+
+			if (g_verbose) {
+				printf("Unable to set uid or gid for file"
+						": error was %d: %s\n", errno, errout);
+			}
+
+			return false;
+		}
+
+		if (fchmod(fds[i], mode) == -1) {
+			char errbuff[MAX_BUFFER];
+			char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
+
+			if (g_verbose) {
+				printf("Unable to set mode for file"
+						": error was %d: %s\n", errno, errout);
+			}
+
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Choose the codec to compress a segment with, by sampling it.
+
+static as_codec
+choose_codec(const void* buf, size_t segsz)
+{
+	as_sample_t samples[N_CODECS];
+
+	sample_segment((const uint8_t*)buf, segsz, samples);
+
+	return pick_codec(samples);
+}
+
+// Compress PLAN_SAMPLES pages of a segment, spread evenly across it, with each
+// available codec - a small segment is sampled whole. A codec which isn't
+// available, or fails, is recorded as saving nothing.
+
+static void
+sample_segment(const uint8_t* buf, size_t segsz, as_sample_t samples[N_CODECS])
+{
+	size_t stride = segsz / PLAN_SAMPLES;
+
+	if (stride < PLAN_SAMPLE) {
+		stride = PLAN_SAMPLE;
+	}
+
+	memset(samples, 0, N_CODECS * sizeof(as_sample_t));
+
+	size_t cap = 0;
+
+	for (uint32_t c = 0; c < N_CODECS; c++) {
+		size_t bound = codec_bound((as_codec)c, PLAN_SAMPLE);
+
+		if (bound > cap) {
+			cap = bound;
+		}
+	}
+
+	uint8_t* out = (uint8_t*)malloc(cap);
+
+	for (uint32_t c = 0; c < N_CODECS; c++) {
+		as_sample_t* sample = &samples[c];
+		bool measure = out != NULL && c != CODEC_STORE
+				&& codec_available((as_codec)c);
+		double start = plan_now();
+
+		for (uint32_t i = 0; i < PLAN_SAMPLES && (size_t)i * stride < segsz;
+				i++) {
+			size_t offset = (size_t)i * stride;
+			size_t size = segsz - offset;
+
+			if (size > PLAN_SAMPLE) {
+				size = PLAN_SAMPLE;
+			}
+
+			size_t len = cap;
+
+			if (!measure || !codec_compress((as_codec)c, NULL, buf + offset,
+					size, out, &len) || len > size) {
+				len = size;
+			}
+
+			sample->in_bytes += size;
+			sample->out_bytes += len;
+		}
+
+		sample->secs = measure ? plan_now() - start : 0.0;
+	}
+
+	free(out);
+}
+
+// Pick a codec from the samples of a segment. If none saves CODEC_MIN_SAVING,
+// the segment is stored as it is. Otherwise, the fastest codec whose output is
+// within CODEC_SLACK of the smallest is picked.
+
+static as_codec
+pick_codec(const as_sample_t samples[N_CODECS])
+{
+	uint64_t in_bytes = samples[CODEC_STORE].in_bytes;
+	uint64_t smallest = in_bytes;
+
+	for (uint32_t c = 0; c < N_CODECS; c++) {
+		if (samples[c].out_bytes < smallest) {
+			smallest = samples[c].out_bytes;
+		}
+	}
+
+	if (in_bytes == 0 || (in_bytes - smallest) * 100 <
+			in_bytes * CODEC_MIN_SAVING) {
+		return CODEC_STORE;
+	}
+
+	as_codec best = CODEC_STORE;
+
+	for (uint32_t c = 0; c < N_CODECS; c++) {
+		if (c == CODEC_STORE || !codec_available((as_codec)c)
+				|| samples[c].out_bytes * 100 >
+						smallest * (100 + CODEC_SLACK)) {
+			continue;
+		}
+
+		if (best == CODEC_STORE || samples[c].secs < samples[best].secs) {
+			best = (as_codec)c;
+		}
+	}
+
+	return best;
+}
+
+// Whether this build of asmt has a codec.
+
+static bool
+codec_available(as_codec codec)
+{
+	switch (codec) {
+	case CODEC_STORE:
+	case CODEC_DEFLATE:
+		return true;
+#ifdef USE_LZ4
+	case CODEC_LZ4:
+		return true;
+#endif
+#ifdef USE_ZSTD
+	case CODEC_ZSTD:
+		return true;
+#endif
+	default:
+		return false;
+	}
+}
+
+// A codec's name, as in a manifest. Deflate makes a gzip stream.
+
+static const char*
+codec_name(as_codec codec)
+{
+	switch (codec) {
+	case CODEC_STORE:
+		return "store";
+	case CODEC_DEFLATE:
+		return "gzip";
+	case CODEC_LZ4:
+		return "lz4";
+	case CODEC_ZSTD:
+		return "zstd";
+	default:
+		return "unknown";
+	}
+}
+
+// A codec, by its name in a manifest. Defaults to deflate, which is all a
+// manifest of an older backup may name.
+
+static as_codec
+codec_from_name(const char* name)
+{
+	for (uint32_t c = 0; c < N_CODECS; c++) {
+		if (strcmp(name, codec_name((as_codec)c)) == 0) {
+			return (as_codec)c;
+		}
+	}
+
+	return CODEC_DEFLATE;
+}
+
+// The most a codec may compress size bytes to.
+
+static size_t
+codec_bound(as_codec codec, size_t size)
+{
+	switch (codec) {
+	case CODEC_DEFLATE:
+		return compressBound((uLong)size);
+#ifdef USE_LZ4
+	case CODEC_LZ4:
+		return (size_t)LZ4_compressBound((int)size);
+#endif
+#ifdef USE_ZSTD
+	case CODEC_ZSTD:
+		return ZSTD_compressBound(size);
+#endif
+	default:
+		return size;
+	}
+}
+
+// Compress a buffer with a codec - and a dictionary, if given one, which only
+// zstd uses. On entry, *out_sz is the space in out - on success, it's the
+// compressed length.
+
+static bool
+codec_compress(as_codec codec, const as_dict_t* dict, const void* in,
+		size_t in_sz, void* out, size_t* out_sz)
+{
+	switch (codec) {
+	case CODEC_DEFLATE: {
+		uLongf len = (uLongf)*out_sz;
+
+		if (compress2((Bytef*)out, &len, (const Bytef*)in, (uLong)in_sz,
+				Z_BEST_SPEED) != Z_OK) {
+			return false;
+		}
+
+		*out_sz = (size_t)len;
+		return true;
+	}
+#ifdef USE_LZ4
+	case CODEC_LZ4: {
+		int len = LZ4_compress_default((const char*)in, (char*)out, (int)in_sz,
+				(int)*out_sz);
+
+		if (len <= 0) {
+			return false;
+		}
+
+		*out_sz = (size_t)len;
+		return true;
+	}
+#endif
+#ifdef USE_ZSTD
+	case CODEC_ZSTD: {
+		as_zstd_ctx_t* ctx = zstd_ctx();
+
+		if (ctx == NULL) {
+			return false;
+		}
+
+		size_t len = dict != NULL ?
+				ZSTD_compress_usingCDict(ctx->cctx, out, *out_sz, in, in_sz,
+						dict->cdict) :
+				ZSTD_compressCCtx(ctx->cctx, out, *out_sz, in, in_sz,
+						CODEC_ZSTD_LEVEL);
+
+		if (ZSTD_isError(len)) {
+			return false;
+		}
+
+		*out_sz = len;
+		return true;
+	}
+#endif
+	default:
+		(void)dict;
+		return false;
+	}
+}
+
+// Decompress a buffer with a codec - it must decompress to exactly out_sz
+// bytes. A zstd frame names the dictionary (if any) it was compressed with,
+// which must have been loaded.
+
+static bool
+codec_decompress(as_codec codec, const void* in, size_t in_sz, void* out,
+		size_t out_sz)
+{
+	switch (codec) {
+	case CODEC_DEFLATE: {
+		uLongf len = (uLongf)out_sz;
+
+		return uncompress((Bytef*)out, &len, (const Bytef*)in, (uLong)in_sz)
+				== Z_OK && len == out_sz;
+	}
+#ifdef USE_LZ4
+	case CODEC_LZ4:
+		return LZ4_decompress_safe((const char*)in, (char*)out, (int)in_sz,
+				(int)out_sz) == (int)out_sz;
+#endif
+#ifdef USE_ZSTD
+	case CODEC_ZSTD: {
+		as_zstd_ctx_t* ctx = zstd_ctx();
+
+		if (ctx == NULL) {
+			return false;
+		}
+
+		uint32_t id = codec_dict_id(codec, in, in_sz);
+
+		if (id == 0) {
+			return ZSTD_decompressDCtx(ctx->dctx, out, out_sz, in, in_sz)
+					== out_sz;
+		}
+
+		const as_dict_t* dict = find_dict(id);
+
+		if (dict == NULL) {
+			if (g_verbose) {
+				printf("Dictionary %08x%s not found.\n", id, DICT_EXTENSION);
+			}
+
+			return false;
+		}
+
+		return ZSTD_decompress_usingDDict(ctx->dctx, out, out_sz, in, in_sz,
+				dict->ddict) == out_sz;
+	}
+#endif
+	default:
+		return false;
+	}
+}
+
+// Train a dictionary for a codec on n_samples samples, laid end to end. On
+// entry, *dict_sz is the space in dict - on success, it's the dictionary's
+// size. Only zstd uses dictionaries.
+
+static bool
+codec_train(as_codec codec, const void* samples, const size_t sizes[],
+		uint32_t n_samples, void* dict, size_t* dict_sz)
+{
+	switch (codec) {
+#ifdef USE_ZSTD
+	case CODEC_ZSTD: {
+		size_t size = ZDICT_trainFromBuffer(dict, *dict_sz, samples, sizes,
+				n_samples);
+
+		if (ZDICT_isError(size)) {
+			return false;
+		}
+
+		*dict_sz = size;
+		return true;
+	}
+#endif
+	default:
+		(void)samples;
+		(void)sizes;
+		(void)n_samples;
+		(void)dict;
+		(void)dict_sz;
+		return false;
+	}
+}
+
+// The id of the dictionary a compressed buffer needs - 0 if none.
+
+static uint32_t
+codec_dict_id(as_codec codec, const void* in, size_t in_sz)
+{
+	switch (codec) {
+#ifdef USE_ZSTD
+	case CODEC_ZSTD:
+		return ZSTD_getDictID_fromFrame(in, in_sz);
+#endif
+	default:
+		(void)in;
+		(void)in_sz;
+		return 0;
+	}
+}
+
+#ifdef USE_ZSTD
+// The calling thread's zstd contexts - made on its first call. Creating a
+// context per chunk would cost more than compressing many chunks.
+
+static as_zstd_ctx_t*
+zstd_ctx(void)
+{
+	pthread_once(&g_zstd_once, zstd_ctx_key);
+
+	as_zstd_ctx_t* ctx = (as_zstd_ctx_t*)pthread_getspecific(g_zstd_key);
+
+	if (ctx != NULL) {
+		return ctx;
+	}
+
+	ctx = (as_zstd_ctx_t*)malloc(sizeof(as_zstd_ctx_t));
+
+	if (ctx == NULL) {
+		return NULL;
+	}
+
+	ctx->cctx = ZSTD_createCCtx();
+	ctx->dctx = ZSTD_createDCtx();
+
+	if (ctx->cctx == NULL || ctx->dctx == NULL
+			|| pthread_setspecific(g_zstd_key, ctx) != 0) {
+		free_zstd_ctx(ctx);
+		return NULL;
+	}
+
+	return ctx;
+}
+
+// Create the key under which each thread keeps its zstd contexts.
+
+static void
+zstd_ctx_key(void)
+{
+	(void)pthread_key_create(&g_zstd_key, free_zstd_ctx);
+}
+
+// Free a thread's zstd contexts, as it exits.
+
+static void
+free_zstd_ctx(void* arg)
+{
+	as_zstd_ctx_t* ctx = (as_zstd_ctx_t*)arg;
+
+	ZSTD_freeCCtx(ctx->cctx);
+	ZSTD_freeDCtx(ctx->dctx);
+	free(ctx);
+}
+#endif
+
+// Train a zstd dictionary for each type of segment a namespace compresses, on
+// DICT_SAMPLE runs spread evenly across its segments - up to DICT_TRAIN bytes.
+// The chunks of the type's files are then compressed with it, as they share
+// much of their structure - unless it doesn't pay for itself. A type whose
+// samples can't be trained on gets no dictionary.
+
+static void
+train_dicts(as_io_t ios[], uint32_t n_ios)
+{
+	static const as_type types[] = {
+		TYPE_TREEX, TYPE_PRI_STAGE, TYPE_SEC_STAGE, TYPE_DAT_STAGE
+	};
+
+	uint8_t* samples = (uint8_t*)malloc(DICT_TRAIN);
+	size_t* sizes = (size_t*)malloc(DICT_TRAIN / DICT_SAMPLE * sizeof(size_t));
+
+	if (samples == NULL || sizes == NULL) {
+		free(samples);
+		free(sizes);
+		return;
+	}
+
+	for (uint32_t t = 0; t < sizeof(types) / sizeof(types[0]); t++) {
+		uint64_t total = 0;
+
+		for (uint32_t i = 0; i < n_ios; i++) {
+			if (ios[i].type == types[t] && ios[i].compress && !ios[i].cas) {
+				total += ios[i].segsz;
+			}
+		}
+
+		if (total == 0) {
+			continue;
+		}
+
+		// Take the samples at an even stride through the type's segments, as
+		// if they were one.
+
+		uint64_t stride = total / (DICT_TRAIN / DICT_SAMPLE);
+
+		if (stride < DICT_SAMPLE) {
+			stride = DICT_SAMPLE;
+		}
+
+		uint32_t n_samples = 0;
+		size_t len = 0;
+		uint64_t base = 0;
+
+		for (uint32_t i = 0; i < n_ios; i++) {
+			const as_io_t* io = &ios[i];
+
+			if (io->type != types[t] || !io->compress || io->cas) {
+				continue;
+			}
+
+			for (uint64_t pos = (base + stride - 1) / stride * stride;
+					pos < base + io->segsz
+							&& n_samples < DICT_TRAIN / DICT_SAMPLE;
+					pos += stride) {
+				size_t offset = (size_t)(pos - base);
+				size_t size = io->segsz - offset < DICT_SAMPLE ?
+						io->segsz - offset : DICT_SAMPLE;
+
+				memcpy(samples + len, (const uint8_t*)io->memptr + offset,
+						size);
+				sizes[n_samples++] = size;
+				len += size;
+			}
+
+			base += io->segsz;
+		}
+
+		void* buf = malloc(DICT_SIZE);
+		size_t size = DICT_SIZE;
+
+		if (buf == NULL || !codec_train(CODEC_ZSTD, samples, sizes, n_samples,
+				buf, &size)) {
+			if (g_verbose) {
+				printf("Could not train a dictionary for %s segments.\n",
+						type_name(types[t]));
+			}
+
+			free(buf);
+			continue;
+		}
+
+		const as_dict_t* dict = add_dict(buf, size, 0);
+
+		// Use the dictionary only if it's estimated to save more than it takes
+		// up itself.
+
+		if (dict == NULL || dict_saving(dict, ios, n_ios, types[t], total)
+				<= dict->size) {
+			continue;
+		}
+
+		for (uint32_t i = 0; i < n_ios; i++) {
+			if (ios[i].type == types[t] && ios[i].compress && !ios[i].cas) {
+				ios[i].dict = dict;
+			}
+		}
+	}
+
+	free(samples);
+	free(sizes);
+}
+
+// Estimate how much smaller a dictionary makes a type's segment files, from
+// DICT_PROBES of their chunks spread evenly across them.
+
+static uint64_t
+dict_saving(const as_dict_t* dict, const as_io_t ios[], uint32_t n_ios,
+		as_type type, uint64_t total)
+{
+	size_t cap = codec_bound(CODEC_ZSTD, CMPCHUNK);
+	uint8_t* out = (uint8_t*)malloc(cap);
+	uint64_t saving = 0;
+	uint64_t probed = 0;
+
+	for (uint32_t p = 0; out != NULL && p < DICT_PROBES; p++) {
+		uint64_t pos = total * (2 * p + 1) / (2 * DICT_PROBES);
+		uint64_t base = 0;
+
+		for (uint32_t i = 0; i < n_ios; i++) {
+			const as_io_t* io = &ios[i];
+
+			if (io->type != type || !io->compress || io->cas) {
+				continue;
+			}
+
+			if (pos >= base + io->segsz) {
+				base += io->segsz;
+				continue;
+			}
+
+			size_t offset = (size_t)(pos - base) / CMPCHUNK * CMPCHUNK;
+			size_t size = io->segsz - offset < CMPCHUNK ?
+					io->segsz - offset : CMPCHUNK;
+			const uint8_t* chunk = (const uint8_t*)io->memptr + offset;
+			size_t plain_len = cap;
+			size_t dict_len = cap;
+
+			// A chunk which doesn't compress is stored as it is.
+
+			if (!codec_compress(CODEC_ZSTD, NULL, chunk, size, out, &plain_len)
+					|| plain_len > size) {
+				plain_len = size;
+			}
+
+			if (!codec_compress(CODEC_ZSTD, dict, chunk, size, out, &dict_len)
+					|| dict_len > size) {
+				dict_len = size;
+			}
+
+			if (dict_len < plain_len) {
+				saving += plain_len - dict_len;
+			}
+
+			probed += size;
+			break;
+		}
+	}
+
+	free(out);
+
+	return probed == 0 ? 0 : saving * total / probed;
+}
+
+// Add a dictionary, taking ownership of buf. Its id is read from the
+// dictionary itself, and must match id unless that's 0. A dictionary already
+// added is returned instead.
+
+static const as_dict_t*
+add_dict(void* buf, size_t size, uint32_t id)
+{
+	as_dict_t* dict = (as_dict_t*)calloc(1, sizeof(as_dict_t));
+	as_dict_t** dicts = (as_dict_t**)realloc(g_dicts,
+			(g_n_dicts + 1) * sizeof(as_dict_t*));
+
+	if (dicts != NULL) {
+		g_dicts = dicts;
+	}
+
+	if (dict == NULL || dicts == NULL) {
+		free(dict);
+		free(buf);
+		return NULL;
+	}
+
+	dict->buf = buf;
+	dict->size = size;
+
+#ifdef USE_ZSTD
+	dict->id = ZDICT_getDictID(buf, size);
+#else
+	dict->id = id;
+#endif
+
+	if (dict->id == 0 || (id != 0 && dict->id != id)) {
+		if (g_verbose) {
+			printf("Dictionary %08x%s is not valid.\n", id, DICT_EXTENSION);
+		}
+
+		free(dict);
+		free(buf);
+		return NULL;
+	}
+
+	const as_dict_t* found = find_dict(dict->id);
+
+	if (found != NULL) {
+		free(dict);
+		free(buf);
+		return found;
+	}
+
+#ifdef USE_ZSTD
+	dict->cdict = ZSTD_createCDict(buf, size, CODEC_ZSTD_LEVEL);
+	dict->ddict = ZSTD_createDDict(buf, size);
+
+	if (dict->cdict == NULL || dict->ddict == NULL) {
+		ZSTD_freeCDict(dict->cdict);
+		ZSTD_freeDDict(dict->ddict);
+		free(dict);
+		free(buf);
+		return NULL;
+	}
+#endif
+
+	g_dicts[g_n_dicts++] = dict;
+
+	return dict;
+}
+
+// Find a dictionary (if added) by its id.
+
+static const as_dict_t*
+find_dict(uint32_t id)
+{
+	for (uint32_t i = 0; i < g_n_dicts; i++) {
+		if (g_dicts[i]->id == id) {
+			return g_dicts[i];
+		}
+	}
+
+	return NULL;
+}
+
+// Read a dictionary file from a directory, and add it.
+
+static const as_dict_t*
+read_dict(const char* pathdir, uint32_t id)
+{
+	char pathname[PATH_MAX + 1];
+
+	sprintf(pathname, "%s/%08x%s", pathdir, id, DICT_EXTENSION);
+
+	int fd = open(pathname, O_RDONLY);
+
+	if (fd < 0) {
+		return NULL;
+	}
+
+	struct stat statbuf;
+	void* buf = NULL;
+
+	if (fstat(fd, &statbuf) < 0 || statbuf.st_size == 0
+			|| statbuf.st_size > DICT_SIZE
+			|| (buf = malloc((size_t)statbuf.st_size)) == NULL
+			|| !pread_range(fd, buf, (size_t)statbuf.st_size, 0)) {
+		if (g_verbose) {
+			printf("Could not read dictionary '%s'.\n", pathname);
+		}
+
+		free(buf);
+		close(fd);
+		return NULL;
+	}
+
+	close(fd);
+
+	return add_dict(buf, (size_t)statbuf.st_size, id);
+}
+
+// Load the dictionaries in the backup directories and mirror directories, for
+// decompressing the segment files which were compressed with them.
+
+static void
+load_dicts(void)
+{
+	for (uint32_t t = 0; t < g_n_pathdirs + g_n_mirrors; t++) {
+		const char* pathdir = t < g_n_pathdirs ?
+				g_pathdirs[t] : g_mirrors[t - g_n_pathdirs];
+		DIR* dir = opendir(pathdir);
+
+		if (dir == NULL) {
+			continue;
+		}
+
+		struct dirent* dirent;
+
+		while ((dirent = readdir(dir)) != NULL) {
+			char* end_ptr;
+			uint32_t id = (uint32_t)strtoul(dirent->d_name, &end_ptr, 16);
+
+			if (end_ptr != dirent->d_name + 8
+					|| strcmp(end_ptr, DICT_EXTENSION) != 0
+					|| find_dict(id) != NULL) {
+				continue;
+			}
+
+			(void)read_dict(pathdir, id);
+		}
+
+		closedir(dir);
+	}
+}
+
+// Write the dictionaries a namespace's segment files were compressed with to
+// every backup directory and mirror directory - a restore may read from any of
+// them. A file reused from the base backup brings its dictionary with it.
+
+static bool
+write_dicts(const as_io_t ios[], uint32_t n_ios)
+{
+	for (uint32_t i = 0; i < n_ios; i++) {
+		uint32_t id = ios[i].dict_id;
+
+		if (id == 0) {
+			continue;
+		}
+
+		const as_dict_t* dict = find_dict(id);
+
+		// A resumed backup's file may have been compressed with a dictionary
+		// the interrupted backup already wrote.
+
+		if (dict == NULL) {
+			dict = read_dict(g_pathdirs[ios[i].target], id);
+		}
+
+		if (dict == NULL && g_base_pathdir != NULL) {
+			dict = read_dict(g_base_pathdir, id);
+		}
+
+		if (dict == NULL) {
+			if (g_verbose) {
+				printf("Dictionary %08x%s for segment %08x not found.\n", id,
+						DICT_EXTENSION, ios[i].key);
+			}
+
+			return false;
+		}
+
+		for (uint32_t t = 0; t < g_n_pathdirs + g_n_mirrors; t++) {
+			if (!write_dict(t < g_n_pathdirs ?
+					g_pathdirs[t] : g_mirrors[t - g_n_pathdirs], dict)) {
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+// Write a dictionary file to a directory. A dictionary is named by its id, so
+// an existing file with the name already holds it.
+
+static bool
+write_dict(const char* pathdir, const as_dict_t* dict)
+{
+	char pathname[PATH_MAX + 1];
+	char temp_pathname[PATH_MAX + 1];
+
+	sprintf(pathname, "%s/%08x%s", pathdir, dict->id, DICT_EXTENSION);
+
+	if (access(pathname, F_OK) == 0) {
+		return true;
+	}
+
+	sprintf(temp_pathname, "%s/%08x%s%s", pathdir, dict->id, DICT_EXTENSION,
+			TEMP_EXTENSION);
+
+	int fd = open(temp_pathname, O_CREAT | O_WRONLY | O_TRUNC, DEFAULT_MODE);
+
+	if (fd < 0) {
+		if (g_verbose) {
+			printf("Could not create dictionary '%s'.\n", temp_pathname);
+		}
+
+		return false;
+	}
+
+	bool success = write(fd, dict->buf, dict->size) == (ssize_t)dict->size
+			&& fsync(fd) == 0;
+
+	if (close(fd) != 0) {
+		success = false;
+	}
+
+	if (success && rename(temp_pathname, pathname) < 0) {
+		success = false;
+	}
+
+	if (!success) {
+		if (g_verbose) {
+			printf("Could not write dictionary '%s'.\n", pathname);
+		}
+
+		unlink(temp_pathname);
+	}
+
+	return success;
+}
+
+// Free the dictionaries.
+
+static void
+free_dicts(void)
+{
+	for (uint32_t i = 0; i < g_n_dicts; i++) {
+#ifdef USE_ZSTD
+		ZSTD_freeCDict(g_dicts[i]->cdict);
+		ZSTD_freeDDict(g_dicts[i]->ddict);
+#endif
+		free(g_dicts[i]->buf);
+		free(g_dicts[i]);
+	}
+
+	free(g_dicts);
+	g_dicts = NULL;
+	g_n_dicts = 0;
+}
+
+// The id of the dictionary a chunked compressed file was compressed with - 0
+// if none. Every chunk the codec compressed names the same one, so the first
+// is enough.
+
+static uint32_t
+file_dict_id(int fd, size_t segsz, const as_cmp_ext_t* ext)
+{
+	uint8_t frame[DICT_FRAME_HEADER];
+	size_t offset = CMPHDR_LEN + CMPEXT_LEN;
+
+	for (size_t done = 0; done < segsz; done += ext->chunk_sz) {
+		size_t size = segsz - done < ext->chunk_sz ?
+				segsz - done : ext->chunk_sz;
+		uint32_t len;
+
+		if (!pread_range(fd, &len, sizeof(len), offset)) {
+			return 0;
+		}
+
+		offset += sizeof(len);
+
+		if (len < size) {
+			size_t n = len < sizeof(frame) ? len : sizeof(frame);
+
+			return pread_range(fd, frame, n, offset) ?
+					codec_dict_id((as_codec)ext->codec, frame, n) : 0;
+		}
+
+		offset += len;
+	}
+
+	return 0;
+}
+
+// Write a complete file (uncompressed). Compute crc32 if requested.
+
+static bool
+pwrite_file(const int fds[], uint32_t n_fds, const void* buf, size_t segsz,
+		mode_t mode, uid_t uid, gid_t gid, uLong* crc)
+{
+	// Write the segment in one go - or, with mirrors, a piece at a time to
+	// every file, so that each piece is read from the segment just once and
+	// is still in cache for the copies.
+
+	size_t piece = n_fds > 1 ? MIRRORCHUNK : segsz;
+
+	for (size_t offset = 0; offset < segsz; offset += piece) {
+		size_t size = segsz - offset < piece ? segsz - offset : piece;
+
+		for (uint32_t i = 0; i < n_fds; i++) {
+			if (!pwrite_range(fds[i], (const uint8_t*)buf + offset, size,
+					offset)) {
+				return false;
+			}
+		}
+
+		// Should we compute crc32? If so, apply to this piece.
+
+		if (g_crc32) {
+			*crc = crc32_z(*crc, (const uint8_t*)buf + offset, size);
+		}
+	}
+
+	// Set file ownership and mode.
+
+	for (uint32_t i = 0; i < n_fds; i++) {
+		if (fchown(fds[i], uid, gid) == -1) {
+			char errbuff[MAX_BUFFER];
+			char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
+
+			if (g_verbose) {
+				printf("Unable to set uid or gid for file"
+						": error was %d: %s\n", errno, errout);
+			}
+
+			return false;
+		}
+
+		if (fchmod(fds[i], mode) == -1) {
+			char errbuff[MAX_BUFFER];
+			char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
+
+			if (g_verbose) {
+				printf("Unable to set mode for file"
+						": error was %d: %s\n", errno, errout);
+			}
+
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Read a segment from one of the copies of its file - the backup's own, or a
+// mirror's. Each read goes to the copy with the least data queued on it, so
+// the copies' devices share the work. If a read fails, or what it read doesn't
+// match the manifest's crc32 or digest, another copy is tried.
+
+static bool
+read_mirrored_file(as_io_t* io)
+{
+	bool tried[1 + MAX_MIRRORS] = { false };
+
+	while (true) {
+		// Pick the untried copy with the shortest queue.
+
+		int fd = -1;
+		uint32_t copy = 0;
+
+		pthread_mutex_lock(&g_io_mutex);
+
+		for (uint32_t c = 0; c <= g_n_mirrors; c++) {
+			int copy_fd = c == 0 ? io->fd : io->mirror_fds[c - 1];
+
+			if (copy_fd >= 0 && !tried[c]
+					&& (fd < 0 || g_copy_queued[c] < g_copy_queued[copy])) {
+				fd = copy_fd;
+				copy = c;
+			}
+		}
+
+		if (fd >= 0) {
+			g_copy_queued[copy] += io->filsz;
+		}
+
+		pthread_mutex_unlock(&g_io_mutex);
+
+		if (fd < 0) {
+			return false;
+		}
+
+		tried[copy] = true;
+		io->crc32 = g_crc32_init;
+
+		bool success = read_file(fd, copy == 0 ? io->offset : 0, io->memptr,
+				io->filsz, io->segsz, io->shmid, io->mode, io->uid, io->gid,
+				io->compress, &io->crc32);
+		bool intact = success && check_mirrored_copy(io);
+
+		pthread_mutex_lock(&g_io_mutex);
+		g_copy_queued[copy] -= io->filsz;
+
+		if (intact) {
+			g_copy_read[copy] += io->filsz;
+		}
+
+		pthread_mutex_unlock(&g_io_mutex);
+
+		if (intact) {
+			return true;
+		}
+
+		if (g_verbose) {
+			printf("%s segment file %08x from \'%s\': trying another copy.\n",
+					success ? "Bad checksum reading" : "Could not read",
+					io->key, copy == 0 ? g_pathdir : g_mirrors[copy - 1]);
+		}
+	}
+}
+
+// Check a segment just read from one of the copies of its file against the
+// crc32 (or else the digest) its manifest records - a copy may have been
+// silently corrupted. The crc32 is only computed here if '-c' didn't already.
 
-		case 'b':
-			// Perform backup operation (or advisory for analyze operation).
-			g_backup = true;
-			break;
+static bool
+check_mirrored_copy(const as_io_t* io)
+{
+	const as_manifest_entry_t* entry = find_manifest_entry(&g_mirror_manifest,
+			io->key);
+
+	if (entry == NULL || entry->segsz != io->segsz) {
+		return true;
+	}
+
+	if (entry->has_crc32) {
+		uLong crc = io->crc32;
+
+		if (!g_crc32) {
+			const uint8_t* buf = (const uint8_t*)io->memptr;
+
+			crc = crc32(0L, Z_NULL, 0);
+
+			for (size_t offset = 0; offset < io->segsz; offset += CMPCHUNK) {
+				size_t size = io->segsz - offset < CMPCHUNK ?
+						io->segsz - offset : CMPCHUNK;
+
+				crc = crc32(crc, buf + offset, (uInt)size);
+			}
+		}
+
+		return crc == entry->crc32;
+	}
+
+	if (entry->has_digest) {
+		as_digest_t digest;
+
+		return digest_segment(io->memptr, io->segsz, &digest, NULL)
+				&& hash_digest_equal(&digest, &entry->digest);
+	}
+
+	return true;
+}
+
+// Read a complete file (compressed if requested), or an uncompressed segment
+// at an offset in a pack. Compute crc32 if requested.
+
+static bool
+read_file(int fd, size_t offset, void* buf, size_t filsz, size_t segsz,
+		int shmid, mode_t mode, uid_t uid, gid_t gid, bool compress,
+		uLong* crc)
+{
+	if (compress) {
+		return zread_file(fd, buf, filsz, segsz, shmid, mode, uid, gid, crc);
+	}
+	else {
+		return pread_file(fd, offset, buf, segsz, shmid, mode, uid, gid, crc);
+	}
+}
+
+// Read a complete file (compressed). Compute crc32 if requested.
+
+static bool
+zread_file(int fd, void* buf, size_t filsz, size_t segsz, int shmid,
+		mode_t mode, uid_t uid, gid_t gid, uLong* crc)
+{
+	// Read and sanity check compressed file header.
+
+	as_cmp_t header;
+	as_cmp_ext_t ext;
+
+	if (!read_cmp_header(fd, segsz, &header, &ext)) {
+		return false;
+	}
+
+	if (header.version == CMPHDR_VER_CHUNKED) {
+		return cread_file(fd, &ext, buf, segsz, crc)
+				&& set_segment_owner(shmid, mode, uid, gid);
+	}
+
+	// A large legacy file may be inflated by several threads at once, if there
+	// are threads to spare - otherwise (or if that fails), by this one.
+
+	if (filsz >= SPEC_MIN && sread_file(fd, filsz, buf, segsz, crc)) {
+		return set_segment_owner(shmid, mode, uid, gid);
+	}
+
+#ifdef USE_ISAL
+	// Built with ISA-L, igzip inflates the gzip stream instead of zlib.
+
+	return iread_file(fd, buf, segsz, crc)
+			&& set_segment_owner(shmid, mode, uid, gid);
+#else
+	// Set up compression engine.
+
+	z_stream infstream;
+
+	infstream.zalloc = Z_NULL;
+	infstream.zfree = Z_NULL;
+	infstream.opaque = Z_NULL;
+	infstream.avail_in = 0;
+	infstream.next_in = Z_NULL;
+
+	// Specify gzip only.
+
+	int windowBits = 15 + 32; // Use maximum memory and zlib or gzip algorithm.
+	int ret = inflateInit2(&infstream, windowBits);
+
+	if (ret != Z_OK) {
+		if (g_verbose) {
+			printf("Unable to initialize compression engine.\n");
+		}
+
+		return false;
+	}
+
+	// Start reading the file ahead, a block at a time, into one buffer while
+	// the last block is inflated from the other.
+
+	as_readahead_t ra;
+
+	if (!start_readahead(&ra, fd)) {
+		(void)inflateEnd(&infstream);
+		return false;
+	}
+
+	// Decompress file one block at a time.
+
+	size_t have_bytes = 0;
+	void* my_buf = buf;
+
+	do {
+
+		// Wait for the next block of the file.
+
+		uint8_t* cmp_buf;
+		ssize_t bytes_read = next_readahead(&ra, &cmp_buf);
+
+		// The file must not end before the gzip stream does.
+
+		if (bytes_read <= 0) {
+			if (g_verbose) {
+				printf("%s while reading compressed file.\n",
+						bytes_read < 0 ? "Error" : "Unexpected end of file");
+			}
+
+			(void)inflateEnd(&infstream);
+			stop_readahead(&ra);
+			return false;
+		}
+
+		infstream.avail_in = (uInt)bytes_read;
+		infstream.next_in = cmp_buf;
+
+		do {
+			infstream.avail_out = CMPCHUNK;
+			my_buf += have_bytes;
+			infstream.next_out = my_buf;
+
+			ret = inflate(&infstream, Z_SYNC_FLUSH);
+
+			switch (ret) {
+			case Z_ERRNO:
+			case Z_NEED_DICT:
+			case Z_DATA_ERROR:
+			case Z_MEM_ERROR:
+			case Z_STREAM_ERROR:
+
+				if (g_verbose) {
+					printf("Error while decompressing file");
+				}
+
+				switch (ret) {
+
+				case Z_ERRNO:
+					if (g_verbose) {
+						printf(": error reading compressed file");
+					}
+
+					break;
+
+				case Z_STREAM_ERROR:
+					if (g_verbose) {
+						printf(": invalid compression level");
+					}
+
+					break;
+
+				case Z_DATA_ERROR:
+					if (g_verbose) {
+						printf(": invalid or incomplete deflate data");
+					}
+
+					break;
+
+				case Z_MEM_ERROR:
+					if (g_verbose) {
+						printf(": out of memory");
+					}
+
+					break;
+
+				case Z_VERSION_ERROR:
+					if (g_verbose) {
+						printf(": zlib version mismatch");
+					}
+
+					break;
+
+				default:
+					if (g_verbose) {
+						printf(": unknown error (%d)", ret);
+					}
+
+					break;
+				}
+
+				if (g_verbose) {
+					printf(" (%lu bytes into file).\n",
+							infstream.total_in + CMPHDR_LEN);
+				}
+
+				(void)inflateEnd(&infstream);
+				stop_readahead(&ra);
+				return false;
+			}
+
+			have_bytes = CMPCHUNK - infstream.avail_out;
+		} while (infstream.avail_out == 0);
+
+		done_readahead(&ra);
+	} while (ret != Z_STREAM_END);
+
+	(void)inflateEnd(&infstream);
+	stop_readahead(&ra);
+
+	// Retrieve crc32, if requested.
+
+	*crc = g_crc32 ? infstream.adler : g_crc32_init;
+
+	// Set segment ownership
+
+	if (!set_segment_owner(shmid, mode, uid, gid)) {
+		return false;
+	}
+
+	return (ret == Z_STREAM_END || ret == Z_OK) ? true : false;
+#endif
+}
+
+// Read a chunked compressed file, after its header, straight into the segment.
+// Compute crc32 if requested.
+
+static bool
+cread_file(int fd, const as_cmp_ext_t* ext, void* buf, size_t segsz,
+		uLong* crc)
+{
+	uint8_t* cmp_buf = (uint8_t*)malloc(codec_bound(ext->codec,
+			ext->chunk_sz));
+
+	if (cmp_buf == NULL) {
+		if (g_verbose) {
+			printf("Unable to allocate memory for compression engine.\n");
+		}
+
+		return false;
+	}
+
+	size_t file_offset = CMPHDR_LEN + CMPEXT_LEN;
+	uint8_t* seg = (uint8_t*)buf;
+
+	*crc = g_crc32_init;
+
+	for (size_t offset = 0; offset < segsz; offset += ext->chunk_sz) {
+		size_t size = segsz - offset < ext->chunk_sz ?
+				segsz - offset : ext->chunk_sz;
+
+		if (!read_cmp_chunk(fd, ext, cmp_buf, seg + offset, size,
+				&file_offset)) {
+			if (g_verbose) {
+				printf("Error while decompressing file (%lu bytes into"
+						" file).\n", file_offset);
+			}
+
+			free(cmp_buf);
+			return false;
+		}
+
+		if (g_crc32) {
+			*crc = crc32_z(*crc, seg + offset, size);
+		}
+	}
+
+	free(cmp_buf);
+
+	return true;
+}
+
+// Read the next chunk of a chunked compressed file, at *offset in the file, as
+// size bytes into out - decompressed, unless it was stored as it is. Advances
+// *offset past the chunk.
+
+static bool
+read_cmp_chunk(int fd, const as_cmp_ext_t* ext, uint8_t* cmp_buf, void* out,
+		size_t size, size_t* offset)
+{
+	uint32_t len;
+
+	if (!pread_range(fd, &len, sizeof(len), *offset)) {
+		return false;
+	}
+
+	*offset += sizeof(len);
+
+	if (len == size) {
+		if (!pread_range(fd, out, size, *offset)) {
+			return false;
+		}
+	}
+	else if (len > size || !pread_range(fd, cmp_buf, len, *offset)
+			|| !codec_decompress(ext->codec, cmp_buf, len, out, size)) {
+		return false;
+	}
+
+	*offset += len;
+
+	return true;
+}
+
+// Read exactly size bytes at offset in a file.
+
+static bool
+pread_range(int fd, void* buf, size_t size, size_t offset)
+{
+	size_t done = 0;
+
+	while (done < size) {
+		ssize_t result = pread(fd, (uint8_t*)buf + done, size - done,
+				(off_t)(offset + done));
+
+		if (result <= 0) {
+			return false;
+		}
 
-		case 'c':
-			// Compare crc32 values.
-			g_crc32 = true;
-			break;
+		done += (size_t)result;
+	}
 
-		case 'h':
-			// Provide usage information to user.
-			usage(true);
-			exit(EXIT_SUCCESS);
-			break;
+	return true;
+}
 
-		case 'i':
-			// Filter by instance number (default is 0).
-			g_inst = (uint32_t)atoi(optarg);
-			break;
+// Start reading a compressed file ahead, from its current offset, in blocks of
+// the read size.
 
-		case 'n':
-			// Filter by namespace name (default is any).
-			g_nsnm = optarg;
-			break;
+static bool
+start_readahead(as_readahead_t* ra, int fd)
+{
+	memset(ra, 0, sizeof(as_readahead_t));
 
-		case 'p':
-			// Set path directory for segment files (no default).
-			g_pathdir = optarg;
-			break;
+	ra->fd = fd;
+	ra->size = (size_t)g_read_size * 1048576;
+	ra->bufs[0] = (uint8_t*)malloc(ra->size);
+	ra->bufs[1] = (uint8_t*)malloc(ra->size);
 
-		case 'r':
-			// Perform restore operation (or advisory for analyze operation).
-			g_restore = true;
-			break;
+	if (ra->bufs[0] == NULL || ra->bufs[1] == NULL) {
+		if (g_verbose) {
+			printf("Unable to allocate memory for compression engine.\n");
+		}
 
-		case 't':
-			// Set the maximum number of threads for backup/restore I/Os.
-			// Default is number of CPUs.
-			g_max_threads = (uint32_t)atoi(optarg);
-			break;
+		free(ra->bufs[0]);
+		free(ra->bufs[1]);
+		return false;
+	}
 
-		case 'v':
-			// Request verbose output.
-			g_verbose = true;
-			break;
+	// Hint that the file will be read through, so the kernel reads ahead
+	// further, too.
 
-		case 'z':
-			// Request compressed backup.
-			g_compress = true;
-			break;
+	(void)posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
 
-		default:
-			// Unknown command line option.
-			usage(true);
-			exit(EXIT_FAILURE);
-			break;
+	pthread_mutex_init(&ra->mutex, NULL);
+	pthread_cond_init(&ra->cond, NULL);
+
+	if (pthread_create(&ra->thread, NULL, run_readahead, ra) != 0) {
+		if (g_verbose) {
+			printf("Unable to start thread to read compressed file.\n");
 		}
+
+		pthread_cond_destroy(&ra->cond);
+		pthread_mutex_destroy(&ra->mutex);
+		free(ra->bufs[0]);
+		free(ra->bufs[1]);
+		return false;
 	}
 
-	// If there are arguments past the command line options, bark.
+	return true;
+}
 
-	if (optind < argc) {
-		usage(true);
-		exit(EXIT_FAILURE);
-	}
+// Wait for the next block of a compressed file being read ahead. Returns its
+// length - zero at the end of the file, negative on error.
 
-	// Did user specify exactly one command to perform?
+static ssize_t
+next_readahead(as_readahead_t* ra, uint8_t** buf)
+{
+	pthread_mutex_lock(&ra->mutex);
 
-	if ((!g_backup && !g_restore) || (g_backup && g_restore)) {
-		printf("Must specify exactly one of backup ('-b')"
-				" or restore ('-r').\n\n");
-		usage(false);
-		exit(EXIT_FAILURE);
+	while (!ra->full[ra->next]) {
+		pthread_cond_wait(&ra->cond, &ra->mutex);
 	}
 
-	// User must specify the path of the directory containing (or to contain)
-	// Aerospike database segment files.
+	ssize_t len = ra->lens[ra->next];
 
-	if (g_pathdir == NULL) {
-		printf("Must specify pathname of file directory (use '-p').\n\n");
-		usage(false);
-		exit(EXIT_FAILURE);
-	}
+	pthread_mutex_unlock(&ra->mutex);
 
-	// Don't need to specify compress with restore.
+	*buf = ra->bufs[ra->next];
 
-	if (g_restore && g_compress) {
-		printf("Unnecessary to specify compress ('-z') with restore ('-r').\n\n");
-	}
+	return len;
+}
 
-	// Can't specify an instance number outside the valid range.
-	// Note: Instance can be 0.
+// Hand back the block of a compressed file just used, to be read into again.
 
-	if (g_inst != INV_INST && g_inst > MAX_INST) {
-		printf("Instance must be from %d..%d (use '-i').\n\n", MIN_INST,
-				MAX_INST);
-		usage(false);
-		exit(EXIT_FAILURE);
-	}
+static void
+done_readahead(as_readahead_t* ra)
+{
+	pthread_mutex_lock(&ra->mutex);
 
-	// Determine maximum number of threads--use num_cpus() if not specified.
+	ra->full[ra->next] = false;
+	ra->next ^= 1;
 
-	if (g_max_threads == INV_THREADS) {
-		g_max_threads = num_cpus();
-	}
-	else if (g_max_threads < MIN_THREADS || g_max_threads > MAX_THREADS) {
-		printf("Max threads must be in the range %d..%d (use '-t').\n\n",
-				MIN_THREADS, MAX_THREADS);
-		usage(false);
-		exit(EXIT_FAILURE);
-	}
+	pthread_cond_signal(&ra->cond);
+	pthread_mutex_unlock(&ra->mutex);
+}
 
-	// If we haven't printed usage (and verbose), print copyright info.
+// Stop reading a compressed file ahead, and clean up.
 
-	if (g_verbose) {
-		printf("%s, %s", g_fullname, g_version);
-		printf("\n");
-		printf("%s  %s\n", g_copyright, g_all_rights);
-		printf("\n");
-	}
+static void
+stop_readahead(as_readahead_t* ra)
+{
+	pthread_mutex_lock(&ra->mutex);
 
-	// Print command as issued.
+	ra->stop = true;
 
-	if (g_verbose) {
-		printf("%s", g_progname);
-		for (int i = 1; i < argc; i++) {
-			printf(" %s", argv[i]);
-		}
-		printf("\n");
-	}
+	pthread_cond_signal(&ra->cond);
+	pthread_mutex_unlock(&ra->mutex);
 
-	// Decide which operation to perform.
+	pthread_join(ra->thread, NULL);
 
-	if (g_verbose) {
-		printf("\n");
-		if (g_analyze) {
-			printf("Performing analyze operation");
-			if (g_backup) {
-				printf(" with backup option");
-			}
-			else {
-				printf(" with restore option");
-			}
-			printf(".\n");
+	pthread_cond_destroy(&ra->cond);
+	pthread_mutex_destroy(&ra->mutex);
+	free(ra->bufs[0]);
+	free(ra->bufs[1]);
+}
+
+// Read a compressed file ahead - into each buffer in turn, once it's been
+// handed back - until the end of the file, an error, or being stopped.
+
+static void*
+run_readahead(void* args)
+{
+	as_readahead_t* ra = (as_readahead_t*)args;
+	uint32_t i = 0;
+
+	while (true) {
+		pthread_mutex_lock(&ra->mutex);
+
+		while (ra->full[i] && !ra->stop) {
+			pthread_cond_wait(&ra->cond, &ra->mutex);
 		}
-		else if (g_backup) {
-			printf("Performing backup operation");
-			if (g_crc32 && !g_compress) {
-				printf(" with crc32 checking");
-			}
-			else if (g_compress && !g_crc32) {
-				printf(" with compression");
-			}
-			else if (g_compress && g_crc32) {
-				printf(" with compression and crc32 checking");
-			}
-			printf(".\n");
+
+		bool stop = ra->stop;
+
+		pthread_mutex_unlock(&ra->mutex);
+
+		if (stop) {
+			break;
 		}
-		else {
-			printf("Performing restore operation");
-			if (g_crc32) {
-				printf(" with crc32 checking");
-			}
-			printf(".\n");
+
+		// Fill the buffer, unless the file ends first.
+
+		size_t got = 0;
+		ssize_t result = 1;
+
+		while (got < ra->size && (result = read(ra->fd, ra->bufs[i] + got,
+				ra->size - got)) > 0) {
+			got += (size_t)result;
 		}
-	}
 
-	// Initialize the CRC32 initialization constant.
+		pthread_mutex_lock(&ra->mutex);
 
-	g_crc32_init = g_crc32 ? crc32(0L, Z_NULL, 0) : 0;
+		ra->lens[i] = result < 0 ? -1 : (ssize_t)got;
+		ra->full[i] = true;
 
-	// Get the list of namespace names over which to operate.
+		pthread_cond_signal(&ra->cond);
+		pthread_mutex_unlock(&ra->mutex);
 
-	int ret = init_nsnm_list();
+		// A block cut short by the end of the file is followed by an empty
+		// one, so the end is always seen.
 
-	if (ret < 0) {
-		printf("Failed to extract namespace names from list.\n");
-		exit(EXIT_FAILURE);
+		if (result < 0 || got == 0) {
+			break;
+		}
+
+		i ^= 1;
 	}
 
-	// Operate over each namespace name provided (if any).
+	return NULL;
+}
+
+#ifdef USE_ISAL
+// Inflate the gzip stream of a compressed file, from just after its header,
+// with ISA-L's igzip - several times faster than zlib, on the same stream.
+// igzip checks the stream's own crc32 as it goes. Retrieve crc32 if requested.
 
-	bool success;
+static bool
+iread_file(int fd, void* buf, size_t segsz, uLong* crc)
+{
+	as_readahead_t ra;
 
-	if (g_nsnm_count == 0) {
-		// No namespace name provided.
-		success = analyze();
+	if (!start_readahead(&ra, fd)) {
+		return false;
 	}
-	else {
-		// List of namespace names provided.
-		success = true;
-		uint32_t count = 0;
 
-		for (uint32_t i = 0; i < g_nsnm_count; i++) {
-			g_nsnm = g_nsnm_array[i];
+	struct inflate_state state;
 
-			if (strcmp(g_nsnm, "") == 0) {
-				continue;
-			}
+	isal_inflate_init(&state);
 
-			count++;
+	state.crc_flag = ISAL_GZIP;
 
-			if (!analyze()) {
-				success = false;
+	// Decompress file one block at a time, straight into the segment - igzip
+	// counts output in 32 bits, so a window of it at a time.
+
+	uint8_t* seg = (uint8_t*)buf;
+	size_t done = 0;
+
+	while (state.block_state != ISAL_BLOCK_FINISH) {
+		uint8_t* cmp_buf;
+		ssize_t bytes_read = next_readahead(&ra, &cmp_buf);
+
+		if (bytes_read <= 0) {
+			if (g_verbose) {
+				printf("%s while reading compressed file.\n",
+						bytes_read < 0 ? "Error" : "Unexpected end of file");
 			}
-		}
 
-		if (success && count != g_nsnm_count) {
-			printf("\nInvalid namespace name(s) provided.\n");
+			stop_readahead(&ra);
+			return false;
 		}
-	}
 
-	exit_nsnm_list();
+		state.next_in = cmp_buf;
+		state.avail_in = (uint32_t)bytes_read;
 
-	exit(success ? EXIT_SUCCESS : EXIT_FAILURE);
-}
+		while (state.avail_in != 0
+				&& state.block_state != ISAL_BLOCK_FINISH) {
+			size_t window = segsz - done < IOCHUNK ? segsz - done : IOCHUNK;
 
-//==========================================================
-// Local helpers.
-//
+			state.next_out = seg + done;
+			state.avail_out = (uint32_t)window;
 
-// Print usage information.
+			int ret = isal_inflate(&state);
 
-static void
-usage(bool verbose)
-{
-	printf("%s, %s", g_fullname, g_version);
-	printf("\n");
-	printf("%s  %s\n", g_copyright, g_all_rights);
-	printf("\n");
+			done += window - state.avail_out;
 
-	char first_str[MAX_BUFFER];
+			if (ret != ISAL_DECOMP_OK || (window == 0
+					&& state.block_state != ISAL_BLOCK_FINISH)) {
+				if (g_verbose) {
+					printf("Error while decompressing file (igzip error %d,"
+							" %lu bytes into segment).\n", ret, done);
+				}
 
-	sprintf(first_str, "usage: %s", g_progname);
+				stop_readahead(&ra);
+				return false;
+			}
+		}
 
-	size_t first_len = strlen(first_str);
+		done_readahead(&ra);
+	}
 
-	printf("%s", first_str);
+	stop_readahead(&ra);
 
-	printf(" [-a]");
-	printf(" [-b]");
-	printf(" [-c]");
-	printf(" [-h]");
-	printf(" [-i <instance>]");
-	printf(" [-n <name>[,<name>...]]");
+	if (done != segsz) {
+		if (g_verbose) {
+			printf("Compressed file holds %lu bytes, not %lu.\n", done,
+					segsz);
+		}
 
-	print_newline_and_blanks(first_len);
+		return false;
+	}
 
-	printf(" -p <pathdir>");
-	printf(" [-r]");
-	printf(" [-t <threads>]");
-	printf(" [-v]");
-	printf(" [-z]");
+	// Retrieve crc32, if requested.
 
-	printf("\n\n");
+	*crc = g_crc32 ? (uLong)state.crc : g_crc32_init;
 
-	printf("-a analyze (advisory - goes with '-b' or '-r')\n");
-	printf("-b backup (operation or advisory with '-a')\n");
-	printf("-c compare crc32 values of segments and segment files\n");
-	printf("-h help\n");
-	printf("-i filter by instance (default is instance 0)\n");
-	printf("-n filter by namespace name (default is all namespaces)\n");
-	printf("-p path of directory (mandatory)\n");
-	printf("-r restore (operation or advisory with '-a')\n");
-	printf("-t maximum number of threads for I/O (default is #CPUs,"
-			" in this case %u)\n", num_cpus());
-	printf("-v verbose output\n");
-	printf("-z compress files on backup\n");
+	return true;
+}
+#endif
+
+// Inflate a legacy compressed file - one gzip stream - on several threads at
+// once, straight into the segment, in rounds. In each round, this thread
+// inflates on from where the last round stopped, while helpers - threads the
+// I/O pool has to spare - each find a deflate block in a region further on and
+// inflate from there speculatively. Fails (without having moved the file's
+// offset) if no thread is spare to start with - the caller then inflates the
+// file on this thread alone, with its own (faster, read ahead) serial path.
+// Also fails if anything doesn't add up, as soon as it doesn't - but then the
+// caller inflates the file a second time, from the start. Compute crc32 if
+// requested.
+
+static bool
+sread_file(int fd, size_t filsz, void* buf, size_t segsz, uLong* crc)
+{
+	uint32_t n_helpers = claim_threads(SPEC_MAX_THREADS - 1);
+
+	if (n_helpers == 0) {
+		return false;
+	}
 
-	printf("\n");
+	// The file is mapped, so it must really be as large as the restore was
+	// planned with (e.g., from a manifest) - or the map would fault past its
+	// end.
 
-	printf("Notes:\n");
+	struct stat statbuf;
 
-	printf("\n");
+	if (fstat(fd, &statbuf) != 0 || (size_t)statbuf.st_size != filsz) {
+		release_threads(n_helpers);
+		return false;
+	}
 
-	printf("1. The '-c' option has a significant performance cost.\n");
-	printf("2. However, this is reduced when combined with the '-z' option.\n");
-	printf("3. Should be run in verbose mode ('-v') if possible.\n");
-	printf("4. A comma-separated list of namespace names may be provided.\n");
+	uint8_t* in = (uint8_t*)mmap(NULL, filsz, PROT_READ, MAP_SHARED, fd, 0);
 
-	if (!verbose) {
-		return;
+	if (in == MAP_FAILED) {
+		release_threads(n_helpers);
+		return false;
 	}
 
-	printf("\n");
+	(void)madvise(in, filsz, MADV_WILLNEED);
 
-	printf("Possible primary option combinations:\n");
+	// The gzip trailer - crc32 and size - follows the deflate stream.
 
-	printf("\n");
+	uint64_t data_end = (uint64_t)(filsz - 8) * 8;
+	size_t hdr_len = skip_gzip_header(in + CMPHDR_LEN, filsz - CMPHDR_LEN);
+	uint64_t bit = (uint64_t)(CMPHDR_LEN + hdr_len) * 8;
+	bool ok = hdr_len != 0;
+	bool final = false;
+	size_t done = 0;
+	uLong seg_crc = crc32(0L, Z_NULL, 0);
 
-	printf("-b     Perform backup operation ('-p' required).\n");
-	printf("-r     Perform restore operation ('-p' required).\n");
-	printf("-ba    Analyze backup operation ('-p' required).\n");
-	printf("-ra    Analyze restore operation ('-p' required).\n");
+	// Each round also takes on threads which have become spare since the last.
 
-	printf("\n");
+	while (ok && !final) {
+		n_helpers += claim_threads(SPEC_MAX_THREADS - 1 - n_helpers);
 
-	printf("Examples:\n");
+		// Part j > 0 searches the j-th region on from here, and stops where
+		// the region after it starts. The last region must leave a bit of the
+		// stream to search.
 
-	printf("\n");
+		uint32_t n_parts = 1;
 
-	char buffer[MAX_BUFFER];
+		while (n_parts <= n_helpers && bit + (uint64_t)n_parts * SPEC_CHUNK * 8
+				< data_end) {
+			n_parts++;
+		}
 
-	sprintf(buffer, "%s -b -p /home/aerospike/backups", g_progname);
-	printf("%s\n", buffer);
+		as_spec_part_t parts[n_parts];
 
-	printf("\n");
+		memset(parts, 0, sizeof(parts));
 
-	printf("    Backs up all Aerospike database segments with instance 0\n");
-	printf("    (all namespaces) to the directory /home/aerospike/backups.\n");
+		for (uint32_t j = 0; j < n_parts; j++) {
+			as_spec_part_t* part = &parts[j];
+			uint64_t region = (bit & ~7ul) + (uint64_t)j * SPEC_CHUNK * 8;
 
-	printf("\n");
+			part->in = in;
+			part->in_size = filsz - 8;
+			part->known = j == 0;
+			part->search_bit = j == 0 ? bit : region;
+			part->search_end = region + (uint64_t)SPEC_CHUNK * 8;
 
-	sprintf(buffer, "%s -b -p /home/aerospike/backups -zc", g_progname);
-	printf("%s\n", buffer);
+			if (part->search_end > data_end) {
+				part->search_end = data_end;
+			}
 
-	printf("\n");
+			part->stop_bit = part->search_end;
+		}
 
-	printf("    Backs up all Aerospike database segments with instance 0\n");
-	printf("    (all namespaces) to the directory /home/aerospike/backups.\n");
-	printf("    Requests that file compression be applied and crc32 checks\n");
-	printf("    be made on all backups.\n");
+		ok = spec_round(parts, n_parts, (uint8_t*)buf, segsz, &done, &bit,
+				&final, &seg_crc);
 
-	printf("\n");
+		// Helpers beyond what the next round can use are handed back now.
 
-	sprintf(buffer, "%s -ba -i2 -p /home/aerospike/backups -v", g_progname);
-	printf("%s\n", buffer);
+		uint32_t n_keep = n_parts - 1;
 
-	printf("\n");
+		release_threads(n_helpers - n_keep);
+		n_helpers = n_keep;
+	}
 
-	printf("    Analyzes whether any Aerospike database segments with\n");
-	printf("    instance 2 (all namespaces) can be backed up to the directory\n");
-	printf("    /home/aerospike/backups. Requests verbose output.\n");
+	release_threads(n_helpers);
 
-	printf("\n");
+	// The whole stream must be there, and match its trailer.
 
-	sprintf(buffer, "%s -r -i3 -n bar -p /home/aerospike/backups -cv -t 128",
-			g_progname);
-	printf("%s\n", buffer);
+	size_t trailer = (size_t)((bit + 7) / 8);
 
-	printf("\n");
+	if (ok && trailer + 8 <= filsz) {
+		uint32_t trailer_crc;
+		uint32_t trailer_size;
 
-	printf("    Restores all Aerospike database segment files with instance 3\n");
-	printf("    (namespace \'bar\') from the directory /home/aerospike/backups.\n");
-	printf("    Requests that crc32 checks be made on all restorations.\n");
-	printf("    Requests verbose output. Uses no more than 128 threads\n");
-	printf("    for file I/O. Any compressed files will be decompressed.\n");
+		memcpy(&trailer_crc, in + trailer, sizeof(trailer_crc));
+		memcpy(&trailer_size, in + trailer + 4, sizeof(trailer_size));
 
-	printf("\n");
-}
+		ok = done == segsz && trailer_crc == (uint32_t)seg_crc
+				&& trailer_size == (uint32_t)segsz;
+	}
+	else {
+		ok = false;
+	}
 
-// Print a newline followed by a number of blanks.
+	munmap(in, filsz);
 
-static void
-print_newline_and_blanks(size_t n_blanks)
-{
-	char buffer[MAX_BUFFER];
+	if (!ok) {
+		if (g_verbose) {
+			printf("Could not inflate compressed file on several threads,"
+					" inflating it on one.\n");
+		}
 
-	memset(buffer, ' ', n_blanks);
-	buffer[n_blanks] = '\0';
-	printf("\n%s", buffer);
+		return false;
+	}
+
+	// Retrieve crc32, if requested.
+
+	*crc = g_crc32 ? seg_crc : g_crc32_init;
+
+	return true;
 }
 
-static int
-init_nsnm_list(void)
+// Run a round of inflating a legacy compressed file on several threads - then
+// keep the parts that carry on from one another, in order, from the first. The
+// bit of the stream to go on from, bytes of segment done, and crc32 so far are
+// advanced past what was kept.
+
+static bool
+spec_round(as_spec_part_t parts[], uint32_t n_parts, uint8_t* seg,
+		size_t segsz, size_t* done, uint64_t* bit, bool* final, uLong* crc)
 {
-	assert(g_nsnm_base == NULL);
-	assert(g_nsnm_array == NULL);
-	assert(g_nsnm_count == 0);
+	// The first part carries on, straight into the segment, with what it has
+	// inflated so far as its window.
 
-	if (g_nsnm == NULL) {
-		return 0;
+	as_spec_part_t* first = &parts[0];
+	size_t dict_len = *done < DEFLATE_WINDOW ? *done : DEFLATE_WINDOW;
+
+	first->start_bit = *bit;
+	first->body = seg + *done;
+	first->body_cap = segsz - *done;
+	first->dict = seg + *done - dict_len;
+	first->dict_len = dict_len;
+
+	pthread_t threads[n_parts];
+	bool started[n_parts];
+
+	started[0] = false;
+
+	for (uint32_t j = 1; j < n_parts; j++) {
+		started[j] = pthread_create(&threads[j], NULL, run_spec_part,
+				&parts[j]) == 0;
 	}
 
-	char* list = strdup(g_nsnm);
+	run_spec_part(first);
 
-	if (list == NULL) {
-		return 0;
+	for (uint32_t j = 1; j < n_parts; j++) {
+		if (started[j]) {
+			pthread_join(threads[j], NULL);
+		}
+		else {
+			run_spec_part(&parts[j]);
+		}
 	}
 
-	// Save the original namespace name list.
+	bool ok = first->found;
 
-	g_nsnm_base = g_nsnm;
+	// Keep parts in order, while each starts where the one before it ended -
+	// resolving their references to the window before them as we go.
 
-	// Extract namespace names from the list.
+	uint8_t win[DEFLATE_WINDOW];
+	uint32_t n_kept = 0;
+	size_t offset = *done;
 
-	char* tmp_list = list;
+	memset(win, 0, sizeof(win));
 
-	while (tmp_list != NULL) {
+	for (uint32_t j = 0; ok && j < n_parts; j++) {
+		as_spec_part_t* part = &parts[j];
 
-		// Find next element in list.
+		bool in_stored = part->start_bit < *bit
+				&& *bit + 3 <= part->stored_bit;
 
-		char* tmp_elmt = strchr(tmp_list, ',');
+		if (!part->found || (part->start_bit != *bit && !in_stored)) {
+			break;
+		}
 
-		if (tmp_elmt != NULL) {
-			*tmp_elmt = '\0';
+		size_t size = part->n_head + part->n_body;
+
+		if (size > segsz - offset) {
+			ok = false;
+			break;
 		}
 
-		// Add element to array.
+		if (j == 0) {
+			slide_window(win, seg, offset + size);
+		}
+		else {
+			uint8_t* head = (uint8_t*)part->head;
 
-		g_nsnm_count++;
+			for (size_t i = 0; i < part->n_head; i++) {
+				uint16_t sym = part->head[i];
 
-		char** new_array = (char**)realloc(g_nsnm_array,
-				g_nsnm_count * sizeof(char*));
-		assert(new_array != NULL);
-		g_nsnm_array = new_array;
+				head[i] = sym < 256 ? (uint8_t)sym : win[sym - 256];
+			}
 
-		g_nsnm_array[g_nsnm_count - 1] = strdup(tmp_list);
+			slide_window(win, head, part->n_head);
+			slide_window(win, part->body, part->n_body);
+		}
 
-		// Go to next element (if any).
+		part->dest = seg + offset;
+		offset += size;
+		*bit = part->end_bit;
+		n_kept++;
 
-		tmp_list = tmp_elmt == NULL ? NULL : ++tmp_elmt;
+		if (part->final) {
+			*final = true;
+			break;
+		}
 	}
 
-	free(list);
-	g_nsnm = NULL;
+	// Copy kept parts into the segment, and compute their crc32s, in parallel.
 
-	return (int)g_nsnm_count;
+	for (uint32_t j = 1; j < n_kept; j++) {
+		started[j] = pthread_create(&threads[j], NULL, run_spec_copy,
+				&parts[j]) == 0;
+	}
+
+	if (n_kept != 0) {
+		run_spec_copy(first);
+	}
+
+	for (uint32_t j = 1; j < n_kept; j++) {
+		if (started[j]) {
+			pthread_join(threads[j], NULL);
+		}
+		else {
+			run_spec_copy(&parts[j]);
+		}
+	}
+
+	for (uint32_t j = 0; j < n_kept; j++) {
+		*crc = crc32_combine(*crc, parts[j].crc,
+				(z_off_t)(parts[j].n_head + parts[j].n_body));
+	}
+
+	*done = offset;
+
+	for (uint32_t j = 1; j < n_parts; j++) {
+		free(parts[j].head);
+		free(parts[j].body);
+	}
+
+	return ok;
 }
 
-static void
-exit_nsnm_list(void)
+// Inflate one part of a legacy compressed file.
+
+static void*
+run_spec_part(void* args)
 {
-	if (g_nsnm_array == NULL) {
-		return;
+	as_spec_part_t* part = (as_spec_part_t*)args;
+
+	if (part->known) {
+		part->found = spec_zlib(part, part->start_bit, part->dict,
+				part->dict_len);
+		return NULL;
 	}
 
-	for (uint32_t i = 0; i < g_nsnm_count; i++) {
-		assert(g_nsnm_array[i] != NULL);
-		free(g_nsnm_array[i]);
-		g_nsnm_array[i] = NULL;
+	as_inflater_t* inf = (as_inflater_t*)malloc(sizeof(as_inflater_t));
+
+	if (inf == NULL) {
+		return NULL;
 	}
 
-	free(g_nsnm_array);
+	inf->in = part->in;
+	inf->in_size = part->in_size;
+	part->found = spec_search(part, inf);
 
-	g_nsnm_array = NULL;
-	g_nsnm = g_nsnm_base;
-	g_nsnm_base = NULL;
+	free(inf);
+
+	return NULL;
 }
 
-// Analyze (and perform?) which operations (backup/restore) can be performed.
+// Copy a kept part of a legacy compressed file into the segment - the first
+// part is there already - and compute its crc32.
 
-static bool
-analyze(void)
+static void*
+run_spec_copy(void* args)
 {
-	return g_backup ? analyze_backup() : analyze_restore();
+	as_spec_part_t* part = (as_spec_part_t*)args;
+
+	if (!part->known && part->n_head != 0) {
+		memcpy(part->dest, part->head, part->n_head);
+	}
+
+	if (!part->known && part->n_body != 0) {
+		memcpy(part->dest + part->n_head, part->body, part->n_body);
+	}
+
+	part->crc = crc32_z(crc32(0L, Z_NULL, 0), part->dest,
+			part->n_head + part->n_body);
+
+	return NULL;
 }
 
-// Analyze whether backup operations can be performed (and perform?).
+// Find the first deflate block in a part's region - the first place a block
+// header checks out and the part inflates from there without error.
 
 static bool
-analyze_backup(void)
+spec_search(as_spec_part_t* part, as_inflater_t* inf)
 {
-	as_segment_t* segments;
-	int error;
+	for (uint64_t bit = part->search_bit; bit < part->search_end; bit++) {
+		inf->pos = bit;
 
-	// First, see if we can access the backup directory for writing.
-	// Do not create if only analyzing.
-
-	if (!check_dir(g_pathdir, true, !g_analyze)) {
-		if (g_verbose) {
-			printf("Cannot write to directory \'%s\'", g_pathdir);
-			if (g_analyze) {
-				printf(": either it does not exist,"
-						" we don't have write permission,"
-						" or we're running with \'-a\'.\n");
-			} else {
-				printf(": either it does not exist"
-						" or we don't have write permission.\n");
-			}
+		if (!spec_header(inf, true)) {
+			continue;
 		}
 
-		return false;
+		part->start_bit = bit;
+		part->stored_bit = inf->type == 0 ? inf->pos - 32 : 0;
+		part->n_head = 0;
+		part->last_marker = -1;
+		part->full = false;
+		part->n_body = 0;
+		part->final = false;
+
+		if (spec_decode(part, inf)) {
+			return true;
+		}
 	}
 
-	// Get the list of segments that passed the instance / namespace filter.
+	return false;
+}
 
-	uint32_t n_segments;
+// Inflate a speculative part from a block header just read, with markers for
+// bytes of the unknown window before the part. Once the last window's worth of
+// output has no markers, zlib carries on, with that as its window.
 
-	if (!list_segments(&segments, &n_segments, &error) || n_segments == 0) {
-		// Note: n_segments and error are valid even if list_segments() returned false.
+static bool
+spec_decode(as_spec_part_t* part, as_inflater_t* inf)
+{
+	uint64_t block_bit = part->start_bit;
+	size_t block_head = 0;
 
-		if (g_verbose) {
-			printf("\nDid not find any suitable Aerospike database segments");
-			printf(", instance %u", g_inst);
+	while (true) {
+		if (!spec_block(part, inf)) {
+			// Out of room - stop before this block.
 
-			if (g_nsnm != NULL) {
-				printf(", namespace \'%s\'", g_nsnm);
+			if (part->full) {
+				part->n_head = block_head;
+				part->end_bit = block_bit;
+				return true;
 			}
 
-			if (error != 0) {
-				char errbuff[MAX_BUFFER];
-				char *errout = strerror_r(errno, errbuff, MAX_BUFFER);
+			return false;
+		}
 
-				printf(": error was %d: %s", error, errout);
-			}
+		if (inf->final) {
+			part->final = true;
+			part->end_bit = inf->pos;
+			return true;
+		}
 
-			printf(".\n");
+		if (inf->pos >= part->stop_bit) {
+			part->end_bit = inf->pos;
+			return true;
 		}
 
-		return false;
-	}
+		if ((int64_t)part->n_head - part->last_marker > DEFLATE_WINDOW) {
+			uint8_t dict[DEFLATE_WINDOW];
+			const uint16_t* tail = part->head + part->n_head - DEFLATE_WINDOW;
 
-	// Look for segments that can be backed up:
-	//
-	// Must have one base and treex segment and and one or more primary stage
-	// segments. May have one meta segment and one or more secondary stage
-	// segments. Will handle multiple namespaces if requested and no failures.
+			for (size_t i = 0; i < DEFLATE_WINDOW; i++) {
+				dict[i] = (uint8_t)tail[i];
+			}
 
-	bool candidates = false;
+			return spec_zlib(part, inf->pos, dict, DEFLATE_WINDOW);
+		}
 
-	for (uint32_t i = 0; i < n_segments; i++) {
-		as_segment_t* segment = &segments[i];
+		block_bit = inf->pos;
+		block_head = part->n_head;
 
-		if (segment->type == TYPE_BASE) {
-			candidates = true;
+		if (!spec_header(inf, false)) {
+			return false;
+		}
+	}
+}
 
-			if (!analyze_backup_candidate(segments, n_segments, i)) {
-				for (uint32_t j = 0; j < n_segments; j++) {
-					as_segment_t* sp = &segments[j];
+// Inflate a part of a legacy compressed file with zlib, from a given bit of
+// the stream, after whatever the part has already. Stops at the first block
+// boundary at or after the part's stop bit, or at the end of the stream. A
+// speculative part which runs out of room stops at the last block boundary.
 
-					if (sp->nsnm != NULL) {
-						free(sp->nsnm);
-						sp->nsnm = NULL;
-					}
-				}
+static bool
+spec_zlib(as_spec_part_t* part, uint64_t bit, const uint8_t* dict,
+		size_t dict_len)
+{
+	z_stream strm;
 
-				free(segments);
-				segments = NULL;
+	memset(&strm, 0, sizeof(strm));
 
-				return false;
-			}
-		}
+	if (inflateInit2(&strm, -15) != Z_OK) {
+		return false;
 	}
 
-	if (!candidates) {
-		if (g_verbose) {
-			printf("\nDid not find any unattached Aerospike database segments");
-			printf(", instance %u", g_inst);
+	size_t byte = (size_t)(bit / 8);
+	int rem = (int)(bit % 8);
 
-			if (g_nsnm != NULL) {
-				printf(", namespace \'%s\'", g_nsnm);
-			}
+	if (rem != 0) {
+		(void)inflatePrime(&strm, 8 - rem, part->in[byte] >> rem);
+		byte++;
+	}
 
-			printf(".\n");
-		}
+	if (dict_len != 0) {
+		(void)inflateSetDictionary(&strm, dict, (uInt)dict_len);
 	}
 
-	for (uint32_t j = 0; j < n_segments; j++) {
-		as_segment_t* sp = &segments[j];
+	strm.next_in = (uint8_t*)part->in + byte;
+
+	uint64_t last_bit = bit;
+	size_t last_body = part->n_body;
+	bool ok = true;
+	bool full = false;
+
+	while (true) {
+		size_t in_done = (size_t)(strm.next_in - part->in);
+
+		if (strm.avail_in == 0 && in_done < part->in_size) {
+			size_t n = part->in_size - in_done;
 
-		if (sp->nsnm != NULL) {
-			free(sp->nsnm);
-			sp->nsnm = NULL;
+			strm.avail_in = n < IOCHUNK ? (uInt)n : IOCHUNK;
 		}
-	}
-	free(segments);
-	segments = NULL;
 
-	return true;
-}
+		// Room for output - a speculative part's grows, up to its limit.
 
-// Check whether a directory exists and is accessible by us.
-// Note: If create is set, we will try to create the directory.
-// Note: We check permissions based on the write parameter,
-// Note: If we create the directory, we do not unwind after failure.
+		if (part->n_body == part->body_cap && !part->known) {
+			size_t max = SPEC_MAX_OUT - part->n_head * sizeof(uint16_t);
+			size_t cap = part->body_cap == 0 ? SPEC_CHUNK : part->body_cap * 2;
 
-static bool
-check_dir(const char* pathname, bool is_write, bool create)
-{
-	struct stat statbuf;
+			cap = cap < max ? cap : max;
 
-	// Does the directory exit?
+			if (cap <= part->body_cap) {
+				full = true;
+				break;
+			}
 
-	if (stat(pathname, &statbuf) != 0) {
-		// If not and we've been asked (create is true), can we create it?
+			uint8_t* body = (uint8_t*)realloc(part->body, cap);
 
-		if (create) {
-			if (mkdir(pathname, DEFAULT_MODE_DIR) != 0) {
-				return false;
-			}
-			if (g_verbose) {
-				printf("\nCreated backup directory \'%s\'.\n", pathname);
+			if (body == NULL) {
+				ok = false;
+				break;
 			}
-		}
-		else {
-			return false;
+
+			part->body = body;
+			part->body_cap = cap;
 		}
 
-		// We created it. Try again to get status.
+		size_t room = part->body_cap - part->n_body;
 
-		if (stat(pathname, &statbuf) != 0) {
-			return false;
-		}
-	}
+		strm.next_out = part->body + part->n_body;
+		strm.avail_out = room < IOCHUNK ? (uInt)room : IOCHUNK;
 
-	// Is it a directory? (Will be if we just created it!)
+		int ret = inflate(&strm, Z_BLOCK);
 
-	if (!S_ISDIR(statbuf.st_mode)) {
-		return false;
-	}
+		part->n_body = (size_t)(strm.next_out - part->body);
 
-	// Can we access it? Standard UNIX rules.
+		uint64_t pos = (uint64_t)(strm.next_in - part->in) * 8
+				- (uint64_t)(strm.data_type & 63);
 
-	uint32_t my_uid = getuid();
-	uint32_t my_gid = getgid();
+		if (ret == Z_STREAM_END) {
+			part->final = true;
+			part->end_bit = pos;
+			break;
+		}
 
-	if (is_write) {
-		if (my_uid == 0 || my_gid == 0
-				|| (statbuf.st_uid == my_uid && (statbuf.st_mode & S_IWUSR))
-				|| (statbuf.st_gid == my_gid && (statbuf.st_mode & S_IWGRP))
-				|| (statbuf.st_mode & S_IWOTH)) {
-			return true;
+		if (ret != Z_OK) {
+			ok = false;
+			break;
 		}
-	}
-	else {
-		if (my_uid == 0 || my_gid == 0
-				|| (statbuf.st_uid == my_uid && (statbuf.st_mode & S_IRUSR))
-				|| (statbuf.st_gid == my_gid && (statbuf.st_mode & S_IRGRP))
-				|| (statbuf.st_mode & S_IROTH)) {
-			return true;
+
+		// At a block boundary - unless past the final block, whose end comes
+		// as the end of the stream.
+
+		if ((strm.data_type & 128) != 0 && (strm.data_type & 64) == 0) {
+			if (pos >= part->stop_bit) {
+				part->end_bit = pos;
+				break;
+			}
+
+			last_bit = pos;
+			last_body = part->n_body;
 		}
 	}
 
-	// Can't access.
+	(void)inflateEnd(&strm);
 
-	return false;
+	// A speculative part out of room stops at the last block boundary.
+
+	if (full) {
+		part->n_body = last_body;
+		part->end_bit = last_bit;
+	}
+
+	return ok;
 }
 
-// Get information about all Aerospike database segments.
-// Note: *n_segments and *error are valid even if list_segments() returns false.
+// Decode a block of a speculative part, after its header, into the part's
+// head - back-references to before the part become markers.
 
 static bool
-list_segments(as_segment_t** segments, uint32_t* n_segments, int* error)
+spec_block(as_spec_part_t* part, as_inflater_t* inf)
 {
-	// Start with no segments.
+	uint64_t in_bits = (uint64_t)inf->in_size * 8;
 
-	*n_segments = 0;
-	*error = 0;
+	if (inf->type == 0) {
+		size_t byte = (size_t)(inf->pos / 8);
 
-	// Get info on all shared memory segments..
+		if (!spec_push(part, inf->stored_len)) {
+			return false;
+		}
 
-	struct shmid_ds dummy; // Dummy, needed by shmctl(3).
+		for (uint32_t i = 0; i < inf->stored_len; i++) {
+			part->head[part->n_head++] = inf->in[byte + i];
+		}
 
-	int rc = shmctl(0, SHM_INFO, &dummy);
+		inf->pos += (uint64_t)inf->stored_len * 8;
 
-	if (rc < 0) {
-		*error = errno;
-		return false;
+		return true;
 	}
 
-	int max_shmid = rc; // Range of shmids: (0..max_shmid) (inclusive).
-
-	*segments = NULL; // Table is initially empty.
-
-	// Try each shmid in the range. Some may correspond to segments.
-
-	for (int ix = 0; ix <= max_shmid; ix++) {
-		as_segment_t* segment;
-
-		// Get information about segment.
+	while (inf->pos <= in_bits) {
+		int32_t sym = decode_symbol(inf, inf->lit, inf->lit_bits);
 
-		if (!stat_segment(ix, &segment, error)) {
-			continue;
+		if (sym < 0) {
+			return false;
 		}
 
-		// Check whether the segment is attached.
-
-		if (segment->natt != 0) {
-			if (segment->nsnm != NULL) {
-				free(segment->nsnm);
-				segment->nsnm = NULL;
+		if (sym < 256) {
+			if (!spec_push(part, 1)) {
+				return false;
 			}
 
-			free(segment);
-			segment = NULL;
+			part->head[part->n_head++] = (uint16_t)sym;
 			continue;
 		}
 
-		// Check whether the instance is a match (if specified).
+		if (sym == 256) {
+			return inf->pos <= in_bits;
+		}
 
-		if (g_inst != INV_INST && segment->inst != g_inst) {
-			if (segment->nsnm != NULL) {
-				free(segment->nsnm);
-				segment->nsnm = NULL;
-			}
+		uint32_t code = (uint32_t)sym - 257;
 
-			free(segment);
-			segment = NULL;
-			continue;
+		if (code >= sizeof(DEFLATE_LEN_BASE) / sizeof(DEFLATE_LEN_BASE[0])) {
+			return false;
 		}
 
-		// Check whether the namespace name is a match.
+		uint32_t len = DEFLATE_LEN_BASE[code]
+				+ get_bits(inf, DEFLATE_LEN_EXTRA[code]);
+		int32_t dsym = decode_symbol(inf, inf->dist, inf->dist_bits);
 
-		if (segment->type == TYPE_BASE && g_nsnm != NULL) {
-			if (segment->nsnm == NULL) {
-				free(segment);
-				segment = NULL;
-				continue;
-			}
-			else if (strcmp(segment->nsnm, g_nsnm) != 0) {
-				free(segment->nsnm);
-				segment->nsnm = NULL;
-				free(segment);
-				segment = NULL;
-				continue;
-			}
+		if (dsym < 0 || dsym >= (int32_t)(sizeof(DEFLATE_DIST_BASE)
+				/ sizeof(DEFLATE_DIST_BASE[0]))) {
+			return false;
 		}
 
-		// Found a valid, unattached Aerospike database segment; append it to table.
+		uint32_t dist = DEFLATE_DIST_BASE[dsym]
+				+ get_bits(inf, DEFLATE_DIST_EXTRA[dsym]);
 
-		(*n_segments)++;
+		if (dist > part->n_head + DEFLATE_WINDOW || !spec_push(part, len)) {
+			return false;
+		}
 
-		*segments = realloc(*segments,
-				(uint32_t)*n_segments * sizeof(as_segment_t));
-		assert(*segments != NULL);
+		int64_t from = (int64_t)part->n_head - dist;
 
-		memcpy(*segments + *n_segments - 1, segment, sizeof(as_segment_t));
+		for (uint32_t i = 0; i < len; i++, from++) {
+			uint16_t val = from < 0 ?
+					(uint16_t)(256 + DEFLATE_WINDOW + from) :
+					part->head[from];
 
-		free(segment);
-		segment = NULL;
-		// Do not free segment->nsnm: It is still in use!
+			if (val >= 256) {
+				part->last_marker = (int64_t)part->n_head;
+			}
+
+			part->head[part->n_head++] = val;
+		}
 	}
 
-	return true;
+	return false;
 }
 
-// Get information about a single shared memory segment by shmid.
-// Validates whether a segment is an Aerospike database segment.
+// Make room in a speculative part's head for n more symbols - unless that
+// would take the part past its limit.
 
 static bool
-stat_segment(int shmid, as_segment_t** segment, int* error)
+spec_push(as_spec_part_t* part, size_t n)
 {
-	// Get info on shared memory segment with ID of shmid.
+	if (part->n_head + n <= part->head_cap) {
+		return true;
+	}
 
-	struct shmid_ds ds;
+	if ((part->n_head + n) * sizeof(uint16_t) > SPEC_MAX_OUT) {
+		part->full = true;
+		return false;
+	}
 
-	int rc = shmctl(shmid, SHM_STAT, &ds);
+	size_t cap = part->head_cap == 0 ? CMPCHUNK : part->head_cap * 2;
 
-	if (rc == -1) {
-		*error = errno;
+	while (cap < part->n_head + n) {
+		cap *= 2;
+	}
+
+	if (cap * sizeof(uint16_t) > SPEC_MAX_OUT) {
+		cap = SPEC_MAX_OUT / sizeof(uint16_t);
+	}
+
+	uint16_t* head = (uint16_t*)realloc(part->head, cap * sizeof(uint16_t));
+
+	if (head == NULL) {
 		return false;
 	}
 
-	// Extract key from shmid_ds structure.
+	part->head = head;
+	part->head_cap = cap;
 
-	key_t key = ds.shm_perm.__key;
+	return true;
+}
 
-	// Check if this is an Aerospike primary, secondary, or data key.
+// Read a deflate block header, and build the block's codes. When searching
+// for a block, only a stored or dynamic non-final block will do, and the
+// padding before a stored block must be zero - a fixed block header is too
+// likely to turn up by chance.
 
-	bool primary = false;
-	bool secondary = false;
+static bool
+spec_header(as_inflater_t* inf, bool search)
+{
+	if (inf->pos + 3 > (uint64_t)inf->in_size * 8) {
+		return false;
+	}
 
-	switch(key & AS_XMEM_KEY_TYPE_MASK) {
-		case AS_XMEM_PRI_KEY:
-			primary = true;
-			break;
-		case AS_XMEM_SEC_KEY:
-			secondary = true;
-			break;
-		case AS_XMEM_DAT_KEY:
-			break;
-		default:
-			*error = EINVAL;
-			return false;
-			break;
+	inf->final = get_bits(inf, 1) != 0;
+	inf->type = get_bits(inf, 2);
+
+	if (search && inf->final) {
+		return false;
 	}
 
-	// Found a valid Aerospike database segment; create segment entry.
+	if (inf->type == 0) {
+		uint32_t pad = (uint32_t)((8 - inf->pos % 8) % 8);
 
-	*segment = malloc(sizeof(as_segment_t));
-	assert(*segment != NULL);
+		if (search && peek_bits(inf, pad) != 0) {
+			return false;
+		}
 
-	as_segment_t* sp = *segment;
+		inf->pos += pad;
 
-	// Populate segment info.
+		uint32_t len = get_bits(inf, 16);
+		uint32_t nlen = get_bits(inf, 16);
 
-	sp->key = key;
-	sp->shmid = rc;
-	sp->uid = ds.shm_perm.uid;
-	sp->gid = ds.shm_perm.gid;
-	sp->mode = ds.shm_perm.mode;
-	sp->natt = ds.shm_nattch;
-	sp->segsz = ds.shm_segsz;
+		inf->stored_len = len;
 
-	// Extract the key base from the key.
+		return len == (~nlen & 0xffff)
+				&& inf->pos / 8 + len <= inf->in_size;
+	}
 
-	key = key & ~AS_XMEM_KEY_TYPE_MASK;
+	uint8_t lens[288 + 32];
 
-	// Determine instance from key base.
+	if (inf->type == 1) {
+		if (search) {
+			return false;
+		}
 
-	sp->inst = (uint32_t)key >> AS_XMEM_INSTANCE_KEY_SHIFT;
+		memset(lens, 8, 144);
+		memset(lens + 144, 9, 112);
+		memset(lens + 256, 7, 24);
+		memset(lens + 280, 8, 8);
+		memset(lens + 288, 5, 32);
 
-	if (sp->inst > MAX_INST) {
-		// Note: instance can be zero.
-		free(*segment);
-		*segment = NULL;
-		*error = ENOENT;
+		return build_code(lens, 288, false, inf->lit, &inf->lit_bits)
+				&& build_code(lens + 288, 32, false, inf->dist,
+						&inf->dist_bits);
+	}
+
+	if (inf->type != 2) {
 		return false;
 	}
 
-	// Determine namespace ID from key base.
+	uint32_t n_lit = get_bits(inf, 5) + 257;
+	uint32_t n_dist = get_bits(inf, 5) + 1;
+	uint32_t n_pre = get_bits(inf, 4) + 4;
 
-	key = key & ~(0xf << AS_XMEM_INSTANCE_KEY_SHIFT);
+	if (n_lit > 286 || n_dist > 30) {
+		return false;
+	}
 
-	sp->nsid = (uint32_t)(key & (0xff << AS_XMEM_NS_KEY_SHIFT))
-			>> AS_XMEM_NS_KEY_SHIFT;
+	uint8_t pre_lens[19];
 
-	if (sp->nsid < MIN_NSID || sp->nsid > MAX_NSID) {
-		free(*segment);
-		*segment = NULL;
-		*error = ENOENT;
+	memset(pre_lens, 0, sizeof(pre_lens));
+
+	for (uint32_t i = 0; i < n_pre; i++) {
+		pre_lens[DEFLATE_PRECODE_ORDER[i]] = (uint8_t)get_bits(inf, 3);
+	}
+
+	if (!build_code(pre_lens, 19, true, inf->pre, &inf->pre_bits)) {
 		return false;
 	}
 
-	// Extract segment type from key base.
+	uint32_t n = 0;
 
-	key = key & ~(0xff << AS_XMEM_NS_KEY_SHIFT);
+	while (n < n_lit + n_dist) {
+		int32_t sym = decode_symbol(inf, inf->pre, inf->pre_bits);
 
-	if (key >= AS_XMEM_ARENA_KEY) {
-		if (primary) {
-			sp->type = TYPE_PRI_STAGE;
-		}
-		else if (secondary) {
-			sp->type = TYPE_SEC_STAGE;
+		if (sym < 0) {
+			return false;
 		}
-	}
-	else if (key == AS_XMEM_TREEX_KEY) {
-		if (primary) {
-			sp->type = TYPE_TREEX;
+
+		if (sym < 16) {
+			lens[n++] = (uint8_t)sym;
+			continue;
 		}
-	}
-	else {
-		if (primary) {
-			sp->type = TYPE_BASE ;
+
+		uint8_t len = 0;
+		uint32_t repeat;
+
+		if (sym == 16) {
+			if (n == 0) {
+				return false;
+			}
+
+			len = lens[n - 1];
+			repeat = 3 + get_bits(inf, 2);
 		}
-		else if (secondary) {
-			sp->type = TYPE_META ;
+		else if (sym == 17) {
+			repeat = 3 + get_bits(inf, 3);
 		}
 		else {
-			sp->type = TYPE_DAT_STAGE;
+			repeat = 11 + get_bits(inf, 7);
 		}
-	}
 
-	// Extract stage number from key.
-
-	if (sp->type == TYPE_PRI_STAGE ||
-		sp->type == TYPE_SEC_STAGE) {
-		if ((uint32_t)key < MIN_ARENA || (uint32_t)key > MAX_ARENA) {
-			free(*segment);
-			*segment = NULL;
-			*error = ENOENT;
+		if (n + repeat > n_lit + n_dist) {
 			return false;
 		}
 
-		sp->stage = (uint32_t)key;
+		memset(lens + n, len, repeat);
+		n += repeat;
 	}
-	else if (sp->type == TYPE_DAT_STAGE) {
-		sp->stage = (uint32_t)key;
+
+	// The end-of-block code must be there.
+
+	return lens[256] != 0
+			&& inf->pos <= (uint64_t)inf->in_size * 8
+			&& build_code(lens, n_lit, false, inf->lit, &inf->lit_bits)
+			&& build_code(lens + n_lit, n_dist, false, inf->dist,
+					&inf->dist_bits);
+}
+
+// Build a decoding table for a canonical Huffman code from its code lengths,
+// checking the code as zlib would - it may not be over-subscribed, nor
+// incomplete, except for a single code of length one (or none) in a literal
+// or distance code.
+
+static bool
+build_code(const uint8_t lens[], uint32_t n, bool precode, uint16_t table[],
+		uint32_t* bits)
+{
+	uint32_t count[16];
+
+	memset(count, 0, sizeof(count));
+
+	for (uint32_t i = 0; i < n; i++) {
+		count[lens[i]]++;
 	}
-	else {
-		sp->stage = 0;
+
+	uint32_t max = 15;
+
+	while (max != 0 && count[max] == 0) {
+		max--;
 	}
 
-	// Get namespace from base segment.
+	if (max == 0) {
+		table[0] = table[1] = 0;
+		*bits = 1;
+		return !precode;
+	}
 
-	if (sp->type == TYPE_BASE) {
-		void* memptr = shmat(sp->shmid, NULL, SHM_RDONLY);
+	int32_t left = 1;
+	uint32_t next[16];
 
-		if (memptr == (void*)-1) {
-			*error = errno;
-			free(*segment);
-			*segment = NULL;
+	count[0] = 0;
+	next[0] = 0;
+
+	for (uint32_t len = 1; len <= 15; len++) {
+		left = (left << 1) - (int32_t)count[len];
+
+		if (left < 0) {
 			return false;
 		}
 
-		char nsnm[NAMESPACE_LEN + 1];
-
-		memcpy(nsnm, memptr + NAMESPACE_OFF, NAMESPACE_LEN);
-		nsnm[NAMESPACE_LEN] = '\0';
-		shmdt(memptr);
-		sp->nsnm = strdup(nsnm);
+		next[len] = (next[len - 1] + count[len - 1]) << 1;
 	}
-	else {
-		sp->nsnm = NULL;
+
+	if (left > 0 && (precode || max != 1)) {
+		return false;
 	}
 
-	// If g_crc32 option is selected, compute crc32.
+	memset(table, 0, sizeof(uint16_t) << max);
 
-	if (g_crc32) {
-		void* memptr = shmat(sp->shmid, NULL, SHM_RDONLY);
+	for (uint32_t sym = 0; sym < n; sym++) {
+		uint32_t len = lens[sym];
 
-		if (memptr == (void*)-1) {
-			*error = errno;
+		if (len == 0) {
+			continue;
+		}
 
-			if (sp->nsnm != NULL) {
-				free(sp->nsnm);
-			
-			sp->nsnm = NULL;
-			}
+		// Codes are read from the bit stream most significant bit first.
 
-			free(*segment);
-			*segment = NULL;
-			return false;
+		uint32_t code = next[len]++;
+		uint32_t rev = 0;
+
+		for (uint32_t i = 0; i < len; i++) {
+			rev = (rev << 1) | ((code >> i) & 1);
 		}
 
-		sp->crc32 = crc32(g_crc32_init, memptr, (uInt)sp->segsz);
-		shmdt(memptr);
-	}
-	else {
-		sp->crc32 = g_crc32_init;
+		for (uint32_t k = rev; k < (1u << max); k += 1u << len) {
+			table[k] = (uint16_t)((sym << 4) | len);
+		}
 	}
 
-	*error = 0;
+	*bits = max;
+
 	return true;
 }
 
-// Determine whether a candidate base segment can be backed up.
+// Decode a symbol with a code's table - negative if there's no such code.
 
-static bool
-analyze_backup_candidate(as_segment_t* segments, uint32_t n_segments,
-		uint32_t base_ix)
+static int32_t
+decode_symbol(as_inflater_t* inf, const uint16_t table[], uint32_t bits)
 {
-	// Shortcut for primary base segment.
+	uint16_t entry = table[peek_bits(inf, bits)];
+	uint32_t len = entry & 15;
 
-	as_segment_t* pbp = &segments[base_ix];
+	if (len == 0) {
+		return -1;
+	}
 
-	assert(pbp->type == TYPE_BASE);
-	assert(pbp->nsnm != NULL);
+	inf->pos += len;
 
-	// Shortcuts for instance and namespace values.
+	return (int32_t)(entry >> 4);
+}
 
-	uint32_t inst = pbp->inst;
-	uint32_t nsid = pbp->nsid;
-	char* nsnm = pbp->nsnm;
+// Look at the next n (up to 32) bits of a deflate stream - zeros past its end.
 
-	// Find the primary treex segment.
+static uint32_t
+peek_bits(const as_inflater_t* inf, uint32_t n)
+{
+	size_t byte = (size_t)(inf->pos / 8);
+	uint64_t val = 0;
 
-	as_segment_t* ptp = NULL;
-	uint32_t n_ptps = 0;
+	if (byte + sizeof(val) <= inf->in_size) {
+		memcpy(&val, inf->in + byte, sizeof(val));
+	}
+	else if (byte < inf->in_size) {
+		memcpy(&val, inf->in + byte, inf->in_size - byte);
+	}
 
-	for (uint32_t ix = 0; ix < n_segments; ix++) {
-		as_segment_t* sp = &segments[ix];
+	return (uint32_t)((val >> (inf->pos % 8)) & ((1ul << n) - 1));
+}
 
-		if (sp->type == TYPE_TREEX && sp->nsid == nsid && sp->inst == inst) {
-			ptp = sp;
-			ptp->nsnm = strdup(nsnm);
-			n_ptps++;
-		}
-	}
+// Read the next n (up to 32) bits of a deflate stream.
 
-	if (n_ptps != 1) {
-		if (g_verbose) {
-			printf("Missing treex segment for instance %u"
-					", namespace \'%s\' (nsid %d).\n", inst, nsnm, nsid);
-		}
+static uint32_t
+get_bits(as_inflater_t* inf, uint32_t n)
+{
+	uint32_t val = peek_bits(inf, n);
 
-		// TODO: if (n_ptps > 1) will leak ptp->nsnm.
+	inf->pos += n;
 
-		return false;
-	}
+	return val;
+}
 
-	// Find the primary stage segments.
+// Find the length of a gzip header - zero if it's not one.
 
-	as_segment_t psps[MAX_PRI_STAGES] = { 0 };
-	uint32_t n_psps = 0;
+static size_t
+skip_gzip_header(const uint8_t* in, size_t in_size)
+{
+	if (in_size < 10 || in[0] != 0x1f || in[1] != 0x8b || in[2] != 8) {
+		return 0;
+	}
 
-	for (uint32_t ix = 0; ix < n_segments; ix++) {
-		as_segment_t* sp = &segments[ix];
+	uint8_t flags = in[3];
+	size_t len = 10;
 
-		if (sp->type == TYPE_PRI_STAGE && sp->nsid == nsid
-				&& sp->inst == inst) {
-			psps[n_psps] = *sp;
-			psps[n_psps].nsnm = strdup(nsnm);
-			n_psps++;
+	// FEXTRA, FNAME, FCOMMENT, then FHCRC.
+
+	if ((flags & 4) != 0) {
+		if (len + 2 > in_size) {
+			return 0;
 		}
+
+		len += 2 + (size_t)(in[len] | (in[len + 1] << 8));
 	}
 
-	if (n_psps < 1) {
-		if (g_verbose) {
-			printf("Missing primary stage segment(s) for instance %u"
-					", namespace \'%s\' (nsid %d).\n", inst, nsnm, nsid);
-		}
+	for (uint8_t flag = 8; flag <= 16; flag <<= 1) {
+		if ((flags & flag) != 0) {
+			while (len < in_size && in[len] != 0) {
+				len++;
+			}
 
-		if (ptp != NULL && ptp->nsnm != NULL) {
-			free(ptp->nsnm);
-			ptp->nsnm = NULL;
+			len++;
 		}
+	}
 
-		return false;
+	if ((flags & 2) != 0) {
+		len += 2;
 	}
 
-	// Sort the primary stage segments by key.
+	return len < in_size ? len : 0;
+}
 
-	if (n_psps > 1) {
-		qsort((void*)psps, (size_t)n_psps, sizeof(as_segment_t),
-				qsort_compare_segments);
+// Slide a deflate window along past some more output.
+
+static void
+slide_window(uint8_t* win, const uint8_t* data, size_t len)
+{
+	if (len >= DEFLATE_WINDOW) {
+		memcpy(win, data + len - DEFLATE_WINDOW, DEFLATE_WINDOW);
+		return;
 	}
 
-	// Check that all primary stages are present.
+	memmove(win, win + len, DEFLATE_WINDOW - len);
+	memcpy(win + DEFLATE_WINDOW - len, data, len);
+}
 
-	for (uint32_t ix = 0; ix < n_psps; ix++) {
-		bool found = false;
+// Claim up to max threads the I/O pool has to spare.
 
-		for (uint32_t jx = 0; jx < n_psps; jx++) {
-			as_segment_t* jp = &psps[jx];
+static uint32_t
+claim_threads(uint32_t max)
+{
+	pthread_mutex_lock(&g_io_mutex);
 
-			if (jp->stage == ix + (uint32_t)AS_XMEM_ARENA_KEY) {
-				found = true;
-				break;
-			}
-		}
+	uint32_t n = g_spare_threads < max ? g_spare_threads : max;
 
-		if (!found) {
-			if (g_verbose) {
-				printf("Missing primary stage segment %03x for instance %u"
-						", namespace \'%s\' (nsid %d).\n",
-						ix + (uint32_t)AS_XMEM_ARENA_KEY, inst, nsnm, nsid);
-			}
+	g_spare_threads -= n;
 
-			if (ptp != NULL && ptp->nsnm != NULL) {
-				free(ptp->nsnm);
-				ptp->nsnm = NULL;
-			}
+	pthread_mutex_unlock(&g_io_mutex);
 
-			for (uint32_t jx = 0; jx < n_psps; jx++) {
-				if (psps[jx].nsnm != NULL) {
-					free(psps[jx].nsnm);
-					psps[jx].nsnm = NULL;
-				}
-			}
+	return n;
+}
 
-			return false;
+// Hand back threads claimed from the I/O pool.
+
+static void
+release_threads(uint32_t n)
+{
+	pthread_mutex_lock(&g_io_mutex);
+	g_spare_threads += n;
+	pthread_mutex_unlock(&g_io_mutex);
+}
+
+// Read and sanity check the header of a compressed file - and, for a chunked
+// file, its extension, which must name a codec this build of asmt has. For a
+// gzip stream, the extension is filled in as deflate.
+
+static bool
+read_cmp_header(int fd, size_t segsz, as_cmp_t* header, as_cmp_ext_t* ext)
+{
+	if (lseek(fd, (off_t)CMPHDR_OFF, SEEK_SET) != (off_t)CMPHDR_OFF) {
+		if (g_verbose) {
+			printf("Could not seek to header in compressed file.\n");
 		}
+
+		return false;
 	}
 
-	// Find the meta segment (if any).
+	if (read(fd, (void*)header, CMPHDR_LEN) != (size_t)CMPHDR_LEN) {
+		if (g_verbose) {
+			printf("Could not read header from compressed file.\n");
+		}
 
-	as_segment_t* smp = NULL;
-	uint32_t n_smps = 0;
+		return false;
+	}
 
-	for (uint32_t ix = 0; ix < n_segments; ix++) {
-		as_segment_t* sp = &segments[ix];
+	// Sanity check header.
 
-		if (sp->type == TYPE_META && sp->nsid == nsid && sp->inst == inst) {
-			smp = sp;
-			smp->nsnm = strdup(nsnm);
-			n_smps++;
+	if (header->magic != CMPHDR_MAG1 && header->magic != CMPHDR_MAG2) {
+		if (g_verbose) {
+			printf("Compressed file header bad magic number:"
+					" expecting 0x%08x, found 0x%08x.\n", CMPHDR_MAG2,
+					header->magic);
 		}
+
+		return false;
 	}
 
-	if (n_smps > 1) {
+	if (header->version != CMPHDR_VER
+			&& header->version != CMPHDR_VER_CHUNKED) {
 		if (g_verbose) {
-			printf("Too many meta segments for instance %u"
-					", namespace \'%s\' (nsid %d).\n", inst, nsnm, nsid);
+			printf("Compressed file header bad version number:"
+					" expecting 0x%08x or 0x%08x, found 0x%08x.\n",
+					CMPHDR_VER, CMPHDR_VER_CHUNKED, header->version);
 		}
 
-		if (ptp != NULL && ptp->nsnm != NULL) {
-			free(ptp->nsnm);
-			ptp->nsnm = NULL;
+		return false;
+	}
+
+	if (segsz != header->segsz) {
+		if (g_verbose) {
+			printf("Compressed file header segment size mismatch:"
+					" expecting %lu, found %lu.\n", segsz, header->segsz);
 		}
 
-		for (uint32_t jx= 0; jx < n_psps; jx++) {
-			if (psps[jx].nsnm != NULL) {
-				free(psps[jx].nsnm);
-				psps[jx].nsnm = NULL;
-			}
+		return false;
+	}
+
+	if (header->version == CMPHDR_VER) {
+		ext->codec = CODEC_DEFLATE;
+		ext->chunk_sz = 0;
+		return true;
+	}
+
+	if (read(fd, (void*)ext, CMPEXT_LEN) != (size_t)CMPEXT_LEN) {
+		if (g_verbose) {
+			printf("Could not read header from compressed file.\n");
 		}
 
-		// TODO: If (n_smps > 1) will leak smp->nsnm.
+		return false;
+	}
+
+	if (ext->codec >= N_CODECS || !codec_available((as_codec)ext->codec)) {
+		if (g_verbose) {
+			printf("Compressed file needs codec \'%s\', which this asmt was"
+					" built without.\n", codec_name((as_codec)ext->codec));
+		}
 
 		return false;
 	}
 
-	as_segment_t ssps[MAX_SEC_STAGES] = { 0 };
-	uint32_t n_ssps = 0;
+	if (ext->chunk_sz == 0 || ext->chunk_sz > IOCHUNK) {
+		if (g_verbose) {
+			printf("Compressed file header bad chunk size %u.\n",
+					ext->chunk_sz);
+		}
 
-	// Found a meta segment?
+		return false;
+	}
 
-	if (n_smps == 1) {
+	return true;
+}
 
-		// Find the secondary stage segments.
+// Read a complete file (uncompressed). Compute crc32 if requested. A raw
+// container is read with direct I/O, in whole blocks - the segment is mapped in
+// whole pages, so the end of its last block lands beyond segsz, unchecked.
+
+static bool
+pread_file(int fd, size_t start, void* buf, size_t segsz, int shmid,
+		mode_t mode, uid_t uid, gid_t gid, uLong* crc)
+{
+	// newsize is running size, as pread(2) progresses.
+
+	ssize_t newsize = g_raw ?
+			(ssize_t)((segsz + PACK_ALIGN - 1) / PACK_ALIGN * PACK_ALIGN) :
+			(ssize_t)segsz;
+
+	// unchecked is how much of newsize lies beyond segsz.
+
+	ssize_t unchecked = newsize - (ssize_t)segsz;
+
+	// result is result of individual pread(2) operation.
+
+	ssize_t bytes_read;
+
+	// Initially, offset is start of segment (in a pack) / segment file.
+
+	off_t offset = (off_t)start;
+
+	while ((bytes_read = pread(fd, buf, (size_t)newsize, offset)) != newsize) {
+		if (bytes_read <= 0) {
+			return false;
+		}
 
-		for (uint32_t ix = 0; ix < n_segments; ix++) {
-			as_segment_t* sp = &segments[ix];
+		// Should we compute crc32? If so, apply to this chunk (up to segsz).
 
-			if (sp->type == TYPE_SEC_STAGE && sp->nsid == nsid
-					&& sp->inst == inst) {
+		ssize_t to_check = newsize - unchecked;
 
-				ssps[n_ssps] = *sp;
-				ssps[n_ssps].nsnm = strdup(nsnm);
-				n_ssps++;
-			}
+		if (g_crc32 && to_check > 0) {
+			*crc = crc32(*crc, buf,
+					(uInt)(bytes_read < to_check ? bytes_read : to_check));
 		}
 
-		if (n_ssps < 1) {
-			if (g_verbose) {
-				printf("No secondary stage segments for instance %u"
-						", namespace \'%s\' (nsid %d).\n", inst, nsnm, nsid);
-			}
+		// If only partial read, set up next chunk.
 
-			if (ptp != NULL && ptp->nsnm != NULL) {
-				free(ptp->nsnm);
-				ptp->nsnm = NULL;
-			}
+		buf += bytes_read;
+		offset += bytes_read;
+		newsize -= bytes_read;
+	}
 
-			for (uint32_t jx= 0; jx < n_psps; jx++) {
-				if (psps[jx].nsnm != NULL) {
-					free(psps[jx].nsnm);
-					psps[jx].nsnm = NULL;
-				}
-			}
+	if (bytes_read > 0) {
+		// Finish crc32 computation on last chunk, if incomplete.
 
-			if (n_ssps > 0) {
-				if (smp != NULL && smp->nsnm != NULL) {
-					free(smp->nsnm);
-					smp->nsnm = NULL;
-				}
-			}
+		if (g_crc32 && bytes_read > unchecked) {
+			*crc = crc32(*crc, buf, (uInt)(bytes_read - unchecked));
+		}
 
+		// Set segment ownership.
 
-					return false;
-		}
+		struct shmid_ds shmid_ds = { .shm_perm.uid = uid, .shm_perm.gid = gid,
+				.shm_perm.mode = (short unsigned)(mode & MODE_MASK), };
 
-		// Sort the secondary stage segments by key.
+		if (shmctl(shmid, IPC_SET, &shmid_ds) == -1) {
+			char errbuff[MAX_BUFFER];
+			char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
 
-		if (n_ssps > 1) {
-			qsort((void*)ssps, (size_t)n_ssps, sizeof(as_segment_t),
-					qsort_compare_segments);
+			if (g_verbose) {
+				printf("Unable to set uid, gid, or mode for shared memory segment"
+						": error was %d: %s\n", errno, errout);
+			}
+
+			return false;
 		}
+	}
 
-		// Check that all secondary stages are present.
+	return true;
+}
 
-		for (uint32_t ix = 0; ix < n_ssps; ix++) {
-			bool found = false;
+// Verify a complete file (compressed if requested), or an uncompressed segment
+// at an offset in a pack, without writing to shared memory. Continues to the
+// end of the file so that truncation is detected.
 
-			for (uint32_t jx = 0; jx < n_ssps; jx++) {
-				as_segment_t* jp = &ssps[jx];
+static bool
+verify_file(int fd, key_t key, size_t offset, size_t filsz, size_t segsz,
+		bool compress, uLong* crc)
+{
+	if (compress) {
+		return zverify_file(fd, key, filsz, segsz, crc);
+	}
+	else {
+		return pverify_file(fd, key, offset, segsz, crc);
+	}
+}
 
-				if (jp->stage == ix + (uint32_t)AS_XMEM_ARENA_KEY) {
-					found = true;
-				}
-			}
+// Verify a complete file (compressed). The gzip trailer is checked by the
+// compression engine, the crc32 and segment size against the file header.
 
-			if (!found) {
-				if (g_verbose) {
-					printf(
-							"Missing secondary stage segment %03x for instance %u"
-									", namespace \'%s\' (nsid %d).\n",
-							ix + (uint32_t)AS_XMEM_ARENA_KEY, inst, nsnm,
-							nsid);
-				}
+static bool
+zverify_file(int fd, key_t key, size_t filsz, size_t segsz, uLong* crc)
+{
+	(void)filsz;
 
-				if (ptp != NULL && ptp->nsnm != NULL) {
-					free(ptp->nsnm);
-					ptp->nsnm = NULL;
-				}
+	// Read and sanity check compressed file header.
 
-				for (uint32_t jx= 0; jx < n_psps; jx++) {
-					if (psps[jx].nsnm != NULL) {
-						free(psps[jx].nsnm);
-						psps[jx].nsnm = NULL;
-					}
-				}
+	as_cmp_t header;
+	as_cmp_ext_t ext;
 
-				if (smp != NULL && smp->nsnm != NULL) {
-					free(smp->nsnm);
-					smp->nsnm = NULL;
-				}
+	if (!read_cmp_header(fd, segsz, &header, &ext)) {
+		if (g_verbose) {
+			printf("Segment file %08x has a bad header.\n", key);
+		}
 
-				for (uint32_t jx= 0; jx < n_ssps; jx++) {
-					if (ssps[jx].nsnm != NULL) {
-						free(ssps[jx].nsnm);
-						ssps[jx].nsnm = NULL;
-					}
-				}
+		return false;
+	}
 
-				return false;
-			}
-		}
+	if (header.version == CMPHDR_VER_CHUNKED) {
+		return cverify_file(fd, key, &header, &ext, segsz, crc);
 	}
 
-	// Find the data segments, if any.
+	// Set up compression engine.
 
-	as_segment_t data[MAX_DATA_STAGES] = { 0 };
-	uint32_t n_data = 0;
+	z_stream infstream;
 
-	for (uint32_t ix = 0; ix < n_segments; ix++) {
-		as_segment_t* sp = &segments[ix];
+	infstream.zalloc = Z_NULL;
+	infstream.zfree = Z_NULL;
+	infstream.opaque = Z_NULL;
+	infstream.avail_in = 0;
+	infstream.next_in = Z_NULL;
 
-		if (sp->type == TYPE_DAT_STAGE && sp->nsid == nsid
-				&& sp->inst == inst) {
-			data[n_data] = *sp;
-			data[n_data].nsnm = strdup(nsnm);
-			n_data++;
+	int windowBits = 15 + 32; // Use maximum memory and zlib or gzip algorithm.
+
+	if (inflateInit2(&infstream, windowBits) != Z_OK) {
+		if (g_verbose) {
+			printf("Unable to initialize compression engine.\n");
 		}
+
+		return false;
 	}
 
-	// Sort the data segments (if any).
+	// Allocate buffers for compressed input and (discarded) output.
 
-	if (n_data > 1) {
-		qsort((void*)data, (size_t)n_data, sizeof(as_segment_t),
-				qsort_compare_segments);
-	}
+	uint8_t* cmp_buf = (uint8_t*)malloc(CMPCHUNK);
+	uint8_t* out_buf = (uint8_t*)malloc(CMPCHUNK);
 
-	// If verbose, display a list of segments to be backed up.
+	if (cmp_buf == NULL || out_buf == NULL) {
+		if (g_verbose) {
+			printf("Unable to allocate memory for compression engine.\n");
+		}
 
-	if (g_verbose) {
-		printf("\n");
-		display_segments(pbp, ptp, psps, n_psps, smp, ssps, n_ssps, data, n_data);
-		printf("\n");
+		free(cmp_buf);
+		free(out_buf);
+		(void)inflateEnd(&infstream);
+		return false;
 	}
 
-	// Sanity-check backup candidate,
+	// Decompress file one chunk at a time, discarding the output.
 
-	if (!analyze_backup_sanity(pbp, ptp, psps, n_psps, smp, ssps, n_ssps, data, n_data)) {
-		if (g_verbose) {
-			printf("Failed backup sanity check for instance %u"
-					", namespace \'%s\' (nsid %d).\n", inst, nsnm, nsid);
-		}
+	int ret = Z_OK;
+	bool success = true;
 
-		if (ptp != NULL && ptp->nsnm != NULL) {
-			free(ptp->nsnm);
-			ptp->nsnm = NULL;
-		}
+	while (success && ret != Z_STREAM_END) {
+		ssize_t bytes_read = read(fd, (void*)cmp_buf, CMPCHUNK);
 
-		for (uint32_t jx= 0; jx < n_psps; jx++) {\
-			if (psps[jx].nsnm != NULL) {
-				free(psps[jx].nsnm);
-				psps[jx].nsnm = NULL;
+		if (bytes_read < 0) {
+			if (g_verbose) {
+				printf("Error while reading segment file %08x.\n", key);
 			}
-		}
 
-		if (smp != NULL && smp->nsnm != NULL) {
-			free(smp->nsnm);
-			smp->nsnm = NULL;
+			success = false;
+			break;
 		}
 
-		for (uint32_t jx= 0; jx < n_ssps; jx++) {
-			if (ssps[jx].nsnm != NULL) {
-				free(ssps[jx].nsnm);
-				ssps[jx].nsnm = NULL;
+		if (bytes_read == 0) {
+			if (g_verbose) {
+				printf("Segment file %08x is truncated.\n", key);
 			}
-		}
 
-		for (uint32_t jx = 0; jx < n_data; jx++) {
-			if (data[jx].nsnm != NULL) {
-				free(data[jx].nsnm);
-				data[jx].nsnm = NULL;
-			}
+			success = false;
+			break;
 		}
 
-		return false;
-	}
+		infstream.avail_in = (uInt)bytes_read;
+		infstream.next_in = cmp_buf;
 
-	// Determine whether to merely analyze or actually backup.
+		do {
+			infstream.avail_out = CMPCHUNK;
+			infstream.next_out = out_buf;
 
-	if (g_analyze) {
-		if (g_verbose) {
-			// Print command to backup these segments.
+			ret = inflate(&infstream, Z_NO_FLUSH);
 
-			printf("%s -b", g_progname);
-			printf(" -i %u", inst);
-			printf(" -n %s", nsnm);
-			printf(" -p %s", g_pathdir);
-			if (g_compress) {
-				printf(" -z");
-			}
-			if (g_crc32) {
-				printf(" -c");
+			// No progress (e.g., the last output buffer was filled exactly)
+			// means more input is needed.
+
+			if (ret == Z_BUF_ERROR) {
+				ret = Z_OK;
+				break;
 			}
-			printf("\n");
-		}
 
-		if (ptp->nsnm != NULL) {
-			free(ptp->nsnm);
-			ptp->nsnm = NULL;
-		}
+			if (ret != Z_OK && ret != Z_STREAM_END) {
+				if (g_verbose) {
+					printf("Segment file %08x has invalid compressed data"
+							" (%lu bytes into file).\n", key,
+							infstream.total_in + CMPHDR_LEN);
+				}
 
-		for (uint32_t jx= 0; jx < n_psps; jx++) {
-			if (psps[jx].nsnm != NULL) {
-				free(psps[jx].nsnm);
-				psps[jx].nsnm = NULL;
+				success = false;
+				break;
 			}
-		}
+		} while (infstream.avail_out == 0 && ret != Z_STREAM_END);
 
-		if (smp != NULL && smp->nsnm != NULL) {
-			free(smp->nsnm);
-			smp->nsnm = NULL;
-		}
+		// Anything after the end of the compressed stream is garbage.
 
-		for (uint32_t jx= 0; jx < n_ssps; jx++) {
-			if (ssps[jx].nsnm != NULL) {
-				free(ssps[jx].nsnm);
-				ssps[jx].nsnm = NULL;
+		if (success && ret == Z_STREAM_END && (infstream.avail_in != 0
+				|| read(fd, (void*)cmp_buf, 1) != 0)) {
+			if (g_verbose) {
+				printf("Segment file %08x has trailing data.\n", key);
 			}
-		}
 
-		for (uint32_t jx = 0; jx < n_data; jx++) {
-			if (data[jx].nsnm != NULL) {
-				free(data[jx].nsnm);
-				data[jx].nsnm = NULL;
-			}
+			success = false;
 		}
-
-		return true;
 	}
 
-	// Actually perform backup...
-
-	bool success =  backup_candidate(pbp, ptp, psps, n_psps, smp, ssps, n_ssps,
-						data, n_data);
+	(void)inflateEnd(&infstream);
 
-	if (ptp != NULL && ptp->nsnm != NULL) {
-		free(ptp->nsnm);
-		ptp->nsnm = NULL;
-	}
+	free(cmp_buf);
+	cmp_buf = NULL;
+	free(out_buf);
+	out_buf = NULL;
 
-	for (uint32_t jx = 0; jx < n_psps; jx++) {
-		if (psps[jx].nsnm != NULL) {
-			free(psps[jx].nsnm);
-			psps[jx].nsnm = NULL;
-		}
+	if (!success) {
+		return false;
 	}
 
-	if (n_ssps > 0) {
-		if (smp != NULL && smp->nsnm != NULL) {
-			free(smp->nsnm);
-			smp->nsnm = NULL;
-		}
+	// Check the decompressed size and crc32 against the header.
 
-		for (uint32_t jx = 0; jx < n_ssps; jx++) {
-			if (ssps[jx].nsnm != NULL) {
-				free(ssps[jx].nsnm);
-				ssps[jx].nsnm = NULL;
-			}
+	if (infstream.total_out != segsz) {
+		if (g_verbose) {
+			printf("Segment file %08x decompressed to %lu bytes"
+					", expecting %lu.\n", key, infstream.total_out, segsz);
 		}
+
+		return false;
 	}
 
-	if (n_data > 0) {
-		for (uint32_t jx = 0; jx < n_data; jx++) {
-			if (data[jx].nsnm != NULL) {
-				free(data[jx].nsnm);
-				data[jx].nsnm = NULL;
-			}
+	if (infstream.adler != header.crc32) {
+		if (g_verbose) {
+			printf("Segment file %08x crc32 mismatch: header has 0x%08lx"
+					", data has 0x%08lx.\n", key, header.crc32,
+					infstream.adler);
 		}
-	}
 
-	return success;
-}
+		return false;
+	}
 
-// qsort(3) comparison routine for shared memory segments.
+	*crc = g_crc32 ? infstream.adler : g_crc32_init;
 
-static int
-qsort_compare_segments(const void* left, const void* right)
-{
-	return (int)((uint32_t)((as_segment_t*)left)->key
-			- (uint32_t)((as_segment_t*)right)->key);
+	return true;
 }
 
-// Display a table of all segments to be backed up.
+// Verify a chunked compressed file, after its header. Every chunk must
+// decompress to its full size, the crc32 must match the header's, and nothing
+// may follow the last chunk.
 
-static void
-display_segments(as_segment_t* pbp, as_segment_t* ptp,
-		as_segment_t psps[], uint32_t n_psps, as_segment_t* smp,
-		as_segment_t ssps[], uint32_t n_ssps,
-		as_segment_t data[], uint32_t n_data)
+static bool
+cverify_file(int fd, key_t key, const as_cmp_t* header,
+		const as_cmp_ext_t* ext, size_t segsz, uLong* crc)
 {
-	(void)data;
-
-	uint32_t n_rows = 1 + 2 + n_psps + (n_ssps > 0 ? (1 + n_ssps) : 0) + n_data;
-	char* table[n_rows][g_crc32 ? 13 : 12];
+	uint8_t* cmp_buf = (uint8_t*)malloc(codec_bound(ext->codec,
+			ext->chunk_sz));
+	uint8_t* out_buf = (uint8_t*)malloc(ext->chunk_sz);
 
-	// Fill in table header.
+	if (cmp_buf == NULL || out_buf == NULL) {
+		if (g_verbose) {
+			printf("Unable to allocate memory for compression engine.\n");
+		}
 
-	table[0][0] = strdup("key");
-	table[0][1] = strdup("shmid");
-	table[0][2] = strdup("user");
-	table[0][3] = strdup("group");
-	table[0][4] = strdup("mode");
-	table[0][5] = strdup("natt");
-	table[0][6] = strdup("segsz");
-	table[0][7] = strdup("inst");
-	table[0][8] = strdup("nsid");
-	table[0][9] = strdup("name");
-	table[0][10] = strdup("type");
-	table[0][11] = strdup("stage");
-	if (g_crc32) {
-		table[0][12] = strdup("crc32");
+		free(cmp_buf);
+		free(out_buf);
+		return false;
 	}
 
-	char buffer[MAX_BUFFER];
+	size_t file_offset = CMPHDR_LEN + CMPEXT_LEN;
+	uLong file_crc = crc32(0L, Z_NULL, 0);
+	bool success = true;
 
-	// Fill in table body.
+	for (size_t offset = 0; offset < segsz; offset += ext->chunk_sz) {
+		size_t size = segsz - offset < ext->chunk_sz ?
+				segsz - offset : ext->chunk_sz;
 
-	for (uint32_t i = 1; i < n_rows; i++) {
-		as_segment_t* segment;
+		if (!read_cmp_chunk(fd, ext, cmp_buf, out_buf, size, &file_offset)) {
+			if (g_verbose) {
+				printf("Segment file %08x has invalid compressed data"
+						" (%lu bytes into file).\n", key, file_offset);
+			}
 
-		if (i == 1) {
-			segment = pbp;
-		}
-		else if (i == 2) {
-			segment = ptp;
-		}
-		else if (i == 3 && smp != NULL) {
-			segment = smp;
-		}
-		else if (i <= 3 + n_psps - (uint32_t)(smp == NULL)) {
-			segment = &psps[i - (4 - (uint32_t)(smp == NULL))];
-		}
-		else if (i <= 3 + n_psps + n_ssps - (uint32_t)(smp == NULL)) {
-			segment = &ssps[i - (4 + n_psps - (uint32_t)(smp == NULL))];
-		}
-		else {
-			segment = &data[i - (4 + n_psps + n_ssps - (uint32_t)(smp == NULL))];
+			success = false;
+			break;
 		}
 
-		sprintf(buffer, "0x%08x", segment->key);
-		table[i][0] = strdup(buffer);
+		file_crc = crc32_z(file_crc, out_buf, size);
+	}
 
-		sprintf(buffer, "%d", segment->shmid);
-		table[i][1] = strdup(buffer);
+	free(cmp_buf);
+	cmp_buf = NULL;
 
-		struct passwd* pw;
+	// Anything after the last chunk is garbage.
 
-		if ((pw = getpwuid(segment->uid)) == NULL) {
-			sprintf(buffer, "%d", segment->uid);
-		}
-		else {
-			sprintf(buffer, "%s", pw->pw_name);
+	if (success && pread(fd, out_buf, 1, (off_t)file_offset) != 0) {
+		if (g_verbose) {
+			printf("Segment file %08x has trailing data.\n", key);
 		}
-		table[i][2] = strdup(buffer);
 
-		struct group* gr;
-
-		if ((gr = getgrgid(segment->gid)) == NULL) {
-			sprintf(buffer, "%d", segment->gid);
-		}
-		else {
-			sprintf(buffer, "%s", gr->gr_name);
-		}
-		table[i][3] = strdup(buffer);
+		success = false;
+	}
 
-		sprintf(buffer, "0%o", segment->mode);
-		table[i][4] = strdup(buffer);
+	free(out_buf);
+	out_buf = NULL;
 
-		// If segment is attached, print special notation.
+	if (!success) {
+		return false;
+	}
 
-		if (segment->natt == 0) {
-			sprintf(buffer, "%lu", segment->natt);
-		}
-		else {
-			sprintf(buffer, "%lu*", segment->natt);
+	if (file_crc != header->crc32) {
+		if (g_verbose) {
+			printf("Segment file %08x crc32 mismatch: header has 0x%08lx"
+					", data has 0x%08lx.\n", key, header->crc32, file_crc);
 		}
-		table[i][5] = strdup(buffer);
 
-		sprintf(buffer, "%lu", segment->segsz);
-		table[i][6] = strdup(buffer);
+		return false;
+	}
 
-		sprintf(buffer, "%u", segment->inst);
-		table[i][7] = strdup(buffer);
+	*crc = g_crc32 ? file_crc : g_crc32_init;
 
-		sprintf(buffer, "%u", segment->nsid);
-		table[i][8] = strdup(buffer);
+	return true;
+}
 
-		sprintf(buffer, "%s", segment->nsnm == NULL ? "-" : segment->nsnm);
+// Verify a complete file (uncompressed). Compute crc32 if requested. A file of
+// its own must be exactly the segment's size - a segment in a pack is followed
+// by padding, or by the next one.
 
-		table[i][9] = strdup(buffer);
+static bool
+pverify_file(int fd, key_t key, size_t start, size_t segsz, uLong* crc)
+{
+	struct stat statbuf;
 
-		switch (segment->type) {
-		case TYPE_BASE:
-			sprintf(buffer, "pi-base");
-			break;
-		case TYPE_TREEX:
-			sprintf(buffer, "pi-treex");
-			break;
-		case TYPE_META:
-			sprintf(buffer, "si-meta");
-			break;
-		case TYPE_PRI_STAGE:
-			sprintf(buffer, "pi-stage");
-			break;
-		case TYPE_SEC_STAGE:
-			sprintf(buffer, "si-stage");
-			break;
-		case TYPE_DAT_STAGE:
-			sprintf(buffer, "data-stage");
-			break;
-		default:
-			printf("unknown segment type is %d.\n", segment->type);
-			assert(false);
+	if (fd != g_pack_file.fd && (fstat(fd, &statbuf) < 0
+			|| (size_t)statbuf.st_size != segsz)) {
+		if (g_verbose) {
+			printf("Segment file %08x is not %lu bytes long.\n", key, segsz);
 		}
-		table[i][10] = strdup(buffer);
 
-		if (segment->type == TYPE_PRI_STAGE
-				|| segment->type == TYPE_SEC_STAGE
-				|| segment->type == TYPE_DAT_STAGE) {
-			sprintf(buffer, "0x%03x", segment->stage);
+		return false;
+	}
+
+	uint8_t* buf = (uint8_t*)malloc(CMPCHUNK);
+
+	if (buf == NULL) {
+		if (g_verbose) {
+			printf("Could not allocate memory to verify file.\n");
 		}
-		else {
-			sprintf(buffer, "-");
+
+		return false;
+	}
+
+	// Read the whole file, so that unreadable blocks are detected.
+
+	size_t offset = 0;
+
+	while (offset < segsz) {
+		size_t size = segsz - offset < CMPCHUNK ? segsz - offset : CMPCHUNK;
+		ssize_t bytes_read = pread(fd, (void*)buf, size,
+				(off_t)(start + offset));
+
+		if (bytes_read <= 0) {
+			if (g_verbose) {
+				printf("Could not read segment file %08x at offset %lu.\n",
+						key, offset);
+			}
+
+			free(buf);
+			buf = NULL;
+			return false;
 		}
-		table[i][11] = strdup(buffer);
 
 		if (g_crc32) {
-			sprintf(buffer, "0x%08lx", segment->crc32);
-			table[i][12] = strdup(buffer);
+			*crc = crc32(*crc, buf, (uInt)bytes_read);
 		}
+
+		offset += (size_t)bytes_read;
 	}
 
-	// Draw the table. Frees all allocated elements.
+	free(buf);
+	buf = NULL;
 
-	draw_table(&table[0][0], n_rows, g_crc32 ? 13 : 12);
+	return true;
 }
 
-// Perform a final sanity check on this backup candidate.
+// Size of a chunk of an I/O request.
 
-static bool
-analyze_backup_sanity(as_segment_t* pbp, as_segment_t* ptp,
-		as_segment_t psps[], uint32_t n_psps, as_segment_t* smp,
-		as_segment_t ssps[], uint32_t n_ssps,
-		as_segment_t data[], uint32_t n_data)
+static size_t
+io_chunk_size(const as_io_t* io, uint32_t chunk)
 {
-	(void)ptp;
-	(void)psps;
-	(void)ssps;
-	(void)data;
-	(void)n_data;
+	if (io->n_chunks == 1) {
+		return io->segsz;
+	}
 
-	// Extract primary stage count from the base segment.
+	size_t offset = (size_t)chunk * IOCHUNK;
 
-	if (pbp->segsz < N_ARENAS_PRI_OFF + N_ARENAS_LEN) {
-		if (g_verbose) {
-			printf("Base segment %08x is too small.\n", pbp->key);
-		}
+	return io->segsz - offset < IOCHUNK ? io->segsz - offset : IOCHUNK;
+}
 
-		return false;
+// Compare a chunk of a segment with its segment file. Mismatched ranges are
+// recorded in the I/O request - only an error reading the file is a failure.
+
+static bool
+compare_file(as_io_t* io, uint32_t chunk)
+{
+	if (io->cas) {
+		return compare_cas_file(io, chunk);
+	}
+	else if (io->compress) {
+		return zcompare_file(io);
+	}
+	else {
+		return pcompare_file(io, chunk);
 	}
+}
 
-	void* memptr = shmat(pbp->shmid, NULL, SHM_RDONLY);
+// Compare a segment with its segment file (compressed). Compressed files can't
+// be split, so there is only a single chunk.
 
-	if (memptr == (void*)-1) {
+static bool
+zcompare_file(as_io_t* io)
+{
+	// Read and sanity check compressed file header.
+
+	as_cmp_t header;
+	as_cmp_ext_t ext;
+
+	if (!read_cmp_header(io->fd, io->segsz, &header, &ext)) {
 		if (g_verbose) {
-			printf("Could not access base segment %08x.\n", pbp->key);
+			printf("Segment file %08x has a bad header.\n", io->key);
 		}
 
 		return false;
 	}
 
-	// Check the base segment version number.
-
-	uint32_t base_ver = *(uint32_t*)(memptr + BASEVER_OFF);
+	if (header.version == CMPHDR_VER_CHUNKED) {
+		return ccompare_file(io, &ext);
+	}
 
-	if (base_ver < BASEVER_MIN || base_ver > BASEVER_MAX) {
-		if (g_verbose) {
-			printf("Invalid version number in base segment %08x:"
-					" expecting version in range %u to %u"
-					", found version %u.\n", pbp->key, BASEVER_MIN, BASEVER_MAX,
-					base_ver);
-		}
+	// Set up compression engine.
 
-		return false;
-	}
+	z_stream infstream;
 
-	// Check the base segment shutdown status.
+	infstream.zalloc = Z_NULL;
+	infstream.zfree = Z_NULL;
+	infstream.opaque = Z_NULL;
+	infstream.avail_in = 0;
+	infstream.next_in = Z_NULL;
 
-	uint32_t base_shut = *(uint32_t*)(memptr + BASESHUT_OFF);
+	int windowBits = 15 + 32; // Use maximum memory and zlib or gzip algorithm.
 
-	if (base_shut != 1) {
+	if (inflateInit2(&infstream, windowBits) != Z_OK) {
 		if (g_verbose) {
-			printf("Shutdown status in base segment %08x:"
-					" expecting status 1"
-					", found status %u.\n", pbp->key, base_shut);
+			printf("Unable to initialize compression engine.\n");
 		}
 
 		return false;
 	}
 
-	// Actually read the number of stages from the base segment.
-
-	uint32_t n_pri_arenas = *(uint32_t*)(memptr + N_ARENAS_PRI_OFF);
-
-	shmdt(memptr);
-
-	// Check that we have the full complement of primary stages to back up.
+	uint8_t* cmp_buf = (uint8_t*)malloc(CMPCHUNK);
+	uint8_t* out_buf = (uint8_t*)malloc(CMPCHUNK);
 
-	if (n_pri_arenas != n_psps) {
+	if (cmp_buf == NULL || out_buf == NULL) {
 		if (g_verbose) {
-			printf("Wrong number of primary arena stages"
-					": expecting %u, found %u.\n", n_pri_arenas, n_psps);
+			printf("Unable to allocate memory for compression engine.\n");
 		}
 
+		free(cmp_buf);
+		free(out_buf);
+		(void)inflateEnd(&infstream);
 		return false;
 	}
 
-	// Check sanity of the meta segment (if any).
+	// Decompress file one chunk at a time, comparing as we go.
 
-	if (n_ssps > 0) {
+	as_range_t pending = { 0, 0 };
+	size_t offset = 0;
+	int ret = Z_OK;
+	bool success = true;
 
-		// Check the size of the meta segment.
+	while (success && ret != Z_STREAM_END) {
+		ssize_t bytes_read = read(io->fd, (void*)cmp_buf, CMPCHUNK);
 
-		if (smp->segsz < N_ARENAS_SEC_OFF + N_ARENAS_LEN) {
+		if (bytes_read <= 0) {
 			if (g_verbose) {
-				printf("Meta segment %08x is too small.\n", smp->key);
+				printf("Could not read segment file %08x.\n", io->key);
 			}
 
-			return false;
+			success = false;
+			break;
 		}
 
-		memptr = shmat(smp->shmid, NULL, SHM_RDONLY);
+		infstream.avail_in = (uInt)bytes_read;
+		infstream.next_in = cmp_buf;
 
-		if (memptr == (void*)-1) {
-			if (g_verbose) {
-				printf("Could not access meta segment %08x.\n", smp->key);
+		do {
+			infstream.avail_out = CMPCHUNK;
+			infstream.next_out = out_buf;
+
+			ret = inflate(&infstream, Z_NO_FLUSH);
+
+			// No progress (e.g., the last output buffer was filled exactly)
+			// means more input is needed.
+
+			if (ret == Z_BUF_ERROR) {
+				ret = Z_OK;
+				break;
 			}
 
-			return false;
-		}
+			if (ret != Z_OK && ret != Z_STREAM_END) {
+				if (g_verbose) {
+					printf("Segment file %08x has invalid compressed data"
+							" (%lu bytes into file).\n", io->key,
+							infstream.total_in + CMPHDR_LEN);
+				}
 
-		// Actually read the number of stages from the base segment.
+				success = false;
+				break;
+			}
 
-		uint32_t n_sec_arenas = *(uint32_t*)(memptr + N_ARENAS_SEC_OFF);
+			size_t have_bytes = CMPCHUNK - infstream.avail_out;
 
-		shmdt(memptr);
+			// Anything decompressed beyond the segment size is ignored -
+			// the header segment size has already been checked.
 
-		// Check that we have the full complement of secondary stages to back up.
+			if (offset < io->segsz) {
+				size_t size = io->segsz - offset < have_bytes ?
+						io->segsz - offset : have_bytes;
 
-		if (n_sec_arenas != n_ssps) {
-			if (g_verbose) {
-				printf("Wrong number of secondary arena stages"
-						": expecting %u, found %u.\n", n_sec_arenas, n_ssps);
+				if (!compare_range(io, out_buf,
+						(uint8_t*)io->memptr + offset, size, offset,
+						&pending)) {
+					success = false;
+					break;
+				}
 			}
 
-			return false;
-		}
+			offset += have_bytes;
+		} while (infstream.avail_out == 0 && ret != Z_STREAM_END);
 	}
 
-	// Check that the destination has no files for this namespace and instance.
+	(void)inflateEnd(&infstream);
 
-	DIR* dir = opendir(g_pathdir);
+	free(cmp_buf);
+	cmp_buf = NULL;
+	free(out_buf);
+	out_buf = NULL;
 
-	if (dir == NULL) {
-		return true;
+	if (!success) {
+		return false;
 	}
 
-	struct dirent* dirent;
-	as_file_t aerospike_file;
+	if (offset > io->segsz) {
+		if (g_verbose) {
+			printf("Segment file %08x decompressed to %lu bytes"
+					", expecting %lu.\n", io->key, offset, io->segsz);
+		}
 
-	bool found = false;
-	while ((dirent = readdir(dir)) != NULL) {
-		// Skip "." and ".." entries.
+		(void)flush_range(io, &pending);
+		return false;
+	}
 
-		if (strcmp(dirent->d_name, ".") == 0
-				|| strcmp(dirent->d_name, "..") == 0) {
-			continue;
-		}
+	// A short file leaves the rest of the segment unmatched.
 
-		// Validate the file name.
+	if (offset < io->segsz && !add_range(io, &pending, offset, io->segsz)) {
+		return false;
+	}
 
-		if (!validate_file_name(dirent->d_name, &aerospike_file)) {
-			continue;
+	return flush_range(io, &pending);
+}
+
+// Compare a segment with its chunked compressed file, one chunk at a time.
+
+static bool
+ccompare_file(as_io_t* io, const as_cmp_ext_t* ext)
+{
+	uint8_t* cmp_buf = (uint8_t*)malloc(codec_bound(ext->codec,
+			ext->chunk_sz));
+	uint8_t* out_buf = (uint8_t*)malloc(ext->chunk_sz);
+
+	if (cmp_buf == NULL || out_buf == NULL) {
+		if (g_verbose) {
+			printf("Unable to allocate memory for compression engine.\n");
 		}
 
-		// Check whether the file is for this namespace and instance.
+		free(cmp_buf);
+		free(out_buf);
+		return false;
+	}
+
+	as_range_t pending = { 0, 0 };
+	size_t file_offset = CMPHDR_LEN + CMPEXT_LEN;
+	bool success = true;
 
-		if (aerospike_file.inst == g_inst && aerospike_file.nsid == pbp->nsid) {
-			found = true;
+	for (size_t offset = 0; offset < io->segsz; offset += ext->chunk_sz) {
+		size_t size = io->segsz - offset < ext->chunk_sz ?
+				io->segsz - offset : ext->chunk_sz;
 
+		if (!read_cmp_chunk(io->fd, ext, cmp_buf, out_buf, size,
+				&file_offset)) {
 			if (g_verbose) {
-				printf("Found existing Aerospike file \'%s/%s\' with instance %u"
-								", namespace \'%s\' (nsid %u)"
-								": cannot back up associated segment.\n",
-						g_pathdir, dirent->d_name, g_inst, pbp->nsnm,
-						pbp->nsid);
+				printf("Segment file %08x has invalid compressed data"
+						" (%lu bytes into file).\n", io->key, file_offset);
 			}
 
-			continue;
+			success = false;
+			break;
+		}
+
+		if (!compare_range(io, out_buf, (uint8_t*)io->memptr + offset, size,
+				offset, &pending)) {
+			success = false;
+			break;
 		}
 	}
 
-	closedir(dir);
+	free(cmp_buf);
+	free(out_buf);
 
-	return !found;
+	return flush_range(io, &pending) && success;
 }
 
-// Actually back up identified segments.
+// Compare a chunk of a segment with its segment file (uncompressed).
 
 static bool
-backup_candidate(as_segment_t* pbp, as_segment_t* ptp,
-		as_segment_t psps[], uint32_t n_psps, as_segment_t* smp,
-		as_segment_t ssps[], uint32_t n_ssps,
-		as_segment_t data[], uint32_t n_data)
+pcompare_file(as_io_t* io, uint32_t chunk)
 {
-	// Create list of file I/O requests.
-	// Note: Assumes that ulimit (number of open files) is big enough.
-
-	uint32_t n_files = 1 + 1 + n_psps;
-
-	if (n_ssps > 0) {
-		n_files += 1 + n_ssps;
-	}
-
-	if (n_data > 0) {
-		n_files += n_data;
-	}
+	uint8_t* buf = (uint8_t*)malloc(CMPCHUNK);
 
-	as_io_t ios[n_files];
-	uint32_t n_ios = 0;
+	if (buf == NULL) {
+		if (g_verbose) {
+			printf("Could not allocate memory to compare file.\n");
+		}
 
-	if (!backup_candidate_file(pbp, &ios[n_ios++], ios, pbp, ptp, psps, n_psps,
-			smp, ssps, n_ssps, data, n_data)) {
 		return false;
 	}
 
-	if (!backup_candidate_file(ptp, &ios[n_ios++], ios, pbp, ptp, psps, n_psps,
-			smp, ssps, n_ssps, data, n_data)) {
-		return false;
-	}
+	size_t offset = (size_t)chunk * IOCHUNK;
+	size_t end = offset + io_chunk_size(io, chunk);
 
-	for (uint32_t i = 0; i < n_psps; i++) {
-		if (!backup_candidate_file(&psps[i], &ios[n_ios++], ios, pbp, ptp, psps,
-				n_psps, smp, ssps, n_ssps, data, n_data)) {
-			return false;
-		}
-	}
+	as_range_t pending = { 0, 0 };
 
-	if (n_ssps > 0) {
-		if (!backup_candidate_file(smp, &ios[n_ios++], ios, pbp, ptp, psps,
-				n_psps, smp, ssps, n_ssps, data, n_data)) {
-			return false;
-		}
+	while (offset < end) {
+		// A short file leaves the rest of the segment unmatched.
 
-		for (uint32_t i = 0; i < n_ssps; i++) {
-			if (!backup_candidate_file(&ssps[i], &ios[n_ios++], ios, pbp, ptp,
-					psps, n_psps, smp, ssps, n_ssps, data, n_data)) {
+		if (offset >= io->filsz) {
+			if (!add_range(io, &pending, offset, end)) {
+				free(buf);
+				buf = NULL;
 				return false;
 			}
-		}
-	}
 
-	if (n_data > 0) {
-		for (uint32_t i = 0; i < n_data; i++) {
-			if (!backup_candidate_file(&data[i], &ios[n_ios++], ios, pbp, ptp,
-					psps, n_psps, smp, ssps, n_ssps, data, n_data)) {
-				return false;
-			}
+			break;
 		}
-	}
-
-	assert(n_files == n_ios);
 
-	// Hand the file I/O requests in for processing.
+		size_t size = end - offset < CMPCHUNK ? end - offset : CMPCHUNK;
 
-	bool success = start_io(&ios[0], n_ios);
+		if (size > io->filsz - offset) {
+			size = io->filsz - offset;
+		}
 
-	// I/O requests were processed. Now post-process.
+		ssize_t bytes_read = pread(io->fd, (void*)buf, size,
+				(off_t)(io->offset + offset));
 
-	if (success && g_crc32) {
-		if (!backup_candidate_check_crc32(ios, pbp, ptp, psps, n_psps, smp,
-				ssps, n_ssps)) {
+		if (bytes_read <= 0) {
 			if (g_verbose) {
-				printf("crc32 mismatch.\n\n");
+				printf("Could not read segment file %08x at offset %lu.\n",
+						io->key, offset);
 			}
 
-			success = false;
+			free(buf);
+			buf = NULL;
+			return false;
 		}
-	}
 
-	// Notify user of success or failure.
+		if (!compare_range(io, buf, (uint8_t*)io->memptr + offset,
+				(size_t)bytes_read, offset, &pending)) {
+			free(buf);
+			buf = NULL;
+			return false;
+		}
 
-	if (g_verbose) {
-		printf("%s",
-				success ? "\nSuccessfully backed up" : "\nFailed to back up");
-		printf(" %u Aerospike database segments", n_files);
-		printf(" for instance %u, namespace \'%s\' (nsid %u).\n", pbp->inst,
-				pbp->nsnm == NULL ? "<null>" : pbp->nsnm, pbp->nsid);
+		offset += (size_t)bytes_read;
 	}
 
-	// Clean up all intermediate operations.
-
-	backup_candidate_cleanup(ios, pbp, ptp, psps, n_psps, smp, ssps, n_ssps,
-			data, n_data, !success);
+	free(buf);
+	buf = NULL;
 
-	return success;
+	return flush_range(io, &pending);
 }
 
+// Compare file contents with segment contents, accumulating mismatched
+// CMPRANGE-sized blocks into the pending range.
+
 static bool
-backup_candidate_file(as_segment_t* sp, as_io_t* io, as_io_t ios[],
-		as_segment_t* pbp, as_segment_t* ptp, as_segment_t psps[],
-		uint32_t n_psps, as_segment_t* smp, as_segment_t ssps[],
-		uint32_t n_ssps, as_segment_t data[], uint32_t n_data)
+compare_range(as_io_t* io, const uint8_t* file_buf, const uint8_t* seg_buf,
+		size_t size, size_t offset, as_range_t* pending)
 {
-	// Attach to the segment (for reading).
+	if (memcmp(file_buf, seg_buf, size) == 0) {
+		return true;
+	}
 
-	void* memptr = shmat(sp->shmid, NULL, SHM_RDONLY);
+	for (size_t i = 0; i < size; i += CMPRANGE) {
+		size_t len = size - i < CMPRANGE ? size - i : CMPRANGE;
 
-	if (memptr == (void*)-1) {
-		char errbuff[MAX_BUFFER];
-		char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
+		if (memcmp(file_buf + i, seg_buf + i, len) != 0
+				&& !add_range(io, pending, offset + i, offset + i + len)) {
+			return false;
+		}
+	}
 
-		printf("Could not attach segment %08x"
-				": error was %d: %s.\n", sp->key,
-		errno, errout);
+	return true;
+}
 
-		// Clean up all intermediate operations.
+// Add a mismatched range to the pending range, flushing the pending range to
+// the I/O request if the new range isn't adjacent.
 
-		backup_candidate_cleanup(ios, pbp, ptp, psps, n_psps, smp, ssps, n_ssps,
-		data, n_data, true);
+static bool
+add_range(as_io_t* io, as_range_t* pending, size_t start, size_t end)
+{
+	if (pending->end == start && pending->end != pending->start) {
+		pending->end = end;
+		return true;
+	}
 
+	if (!flush_range(io, pending)) {
 		return false;
 	}
 
-	// Create an I/O request for the segment.
-
-	io->key = sp->key;
-	io->write = true;
-	io->memptr = memptr;
-	io->filsz = 0;
-	io->segsz = sp->segsz;
-	io->mode = sp->mode;
-	io->uid = sp->uid;
-	io->gid = sp->gid;
-	io->crc32 = g_crc32_init;
+	pending->start = start;
+	pending->end = end;
 
-	// Construct the filename extension.
+	return true;
+}
 
-	const char* extension;
+// Record the pending mismatched range (if any) in the I/O request.
 
-	if (sp->type != TYPE_BASE && sp->type != TYPE_META && g_compress) {
-		io->compress = true;
-		extension = FILE_EXTENSION_CMP;
-	}
-	else {
-		io->compress = false;
-		extension = FILE_EXTENSION;
+static bool
+flush_range(as_io_t* io, as_range_t* pending)
+{
+	if (pending->end == pending->start) {
+		return true;
 	}
 
-	// Construct the filename for the segment file.
-
-	char pathname[PATH_MAX + 1];
-
-	sprintf(pathname, "%s/%08x%s", g_pathdir, sp->key, extension);
-
-	// Open (create) the segment file.
+	pthread_mutex_lock(&g_io_mutex);
 
-	int rc = open(pathname, O_CREAT | O_RDWR | O_EXCL, DEFAULT_MODE);
+	as_range_t* ranges = realloc(io->ranges,
+			(io->n_ranges + 1) * sizeof(as_range_t));
 
-	if (rc < 0) {
-		char errbuff[MAX_BUFFER];
-		char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
+	if (ranges == NULL) {
+		pthread_mutex_unlock(&g_io_mutex);
 
 		if (g_verbose) {
-			printf("Could not create segment file \'%s\'"
-					": error was %d: %s.\n", pathname, errno, errout);
+			printf("Could not allocate memory to record mismatches in"
+					" segment %08x.\n", io->key);
 		}
 
-		// Clean up all intermediate operations.
-
-		backup_candidate_cleanup(ios, pbp, ptp, psps, n_psps, smp, ssps, n_ssps,
-			data, n_data, true);
-
 		return false;
 	}
 
-	// Complete creation of I/O request.
-
-	io->fd = rc;
-
-	if (!io->compress) {
-		// Allocate storage space for the data to be written to the file.
-
-		rc = posix_fallocate(io->fd, 0, (off_t)sp->segsz);
-
-		if (rc < 0) {
-			char errbuff[MAX_BUFFER];
-			char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
-
-			if (g_verbose) {
-				printf("Could not allocate storage for segment file \'%s\'"
-						": error was %d: %s.\n", pathname, errno, errout);
-			}
-
-			// Clean up all intermediate operations.
-
-			backup_candidate_cleanup(ios, pbp, ptp, psps, n_psps, smp, ssps,
-					n_ssps, data, n_data, true);
-
-			return false;
-		}
-	}
+	io->ranges = ranges;
+	io->ranges[io->n_ranges++] = *pending;
+
+	pthread_mutex_unlock(&g_io_mutex);
+
+	pending->start = 0;
+	pending->end = 0;
 
 	return true;
 }
 
+// Write a segment to the chunk store - each of its chunks that isn't in the
+// store yet, then the recipe file listing all of its chunks.
+
 static bool
-backup_candidate_check_crc32(as_io_t ios[], as_segment_t* pbp,
-		as_segment_t* ptp, as_segment_t psps[], uint32_t n_psps,
-		as_segment_t* smp, as_segment_t ssps[], uint32_t n_ssps)
+write_cas_file(as_io_t* io)
 {
-	if (pbp->crc32 != ios[0].crc32) {
-		return false;
-	}
+	uint32_t n_chunks = (uint32_t)((io->segsz + DIGEST_CHUNK - 1)
+			/ DIGEST_CHUNK);
+	const uint8_t* chunk = (const uint8_t*)io->memptr;
 
-	if (ptp->crc32 != ios[1].crc32) {
-		return false;
-	}
+	for (uint32_t i = 0; i < n_chunks; i++) {
+		size_t size = io->segsz - (size_t)i * DIGEST_CHUNK;
 
-	for (uint32_t ix = 0; ix < n_psps; ix++) {
-		if (psps[ix].crc32 != ios[2 + ix].crc32) {
-			return false;
+		if (size > DIGEST_CHUNK) {
+			size = DIGEST_CHUNK;
 		}
-	}
 
-	if (n_ssps > 0) {
-		if (smp->crc32 != ios[2 + n_psps].crc32) {
+		if (!store_chunk(chunk, size, &io->chunk_digests[i], io->compress,
+				&io->stored_sz)) {
 			return false;
 		}
 
-		for (uint32_t ix = 0; ix < n_ssps; ix++) {
-			if (ssps[ix].crc32 != ios[2 + n_psps + 1 + ix].crc32) {
-				return false;
-			}
-		}
+		chunk += size;
 	}
 
-	return true;
-}
-
-// Cleanup from backup_candidate().
-// If remove is set, all files created should be removed.
-
-static void
-backup_candidate_cleanup(as_io_t ios[], as_segment_t* pbp,
-		as_segment_t* ptp, as_segment_t psps[], uint32_t n_psps,
-		as_segment_t* smp, as_segment_t ssps[], uint32_t n_ssps,
-		as_segment_t data[], uint32_t n_data,
-		bool remove_files)
-{
-	(void)data;
-	(void)n_data;
-
-	uint32_t n_objects = 2 + n_psps;
+	// Write the recipe - header, then chunk digests.
 
-	if (n_ssps > 0) {
-		n_objects += 1 + n_ssps;
-	}
+	as_cas_t header;
 
-	// Detach all (possibly) attached segments.
+	header.magic = CASHDR_MAG;
+	header.version = CASHDR_VER;
+	header.segsz = io->segsz;
+	header.chunk_size = DIGEST_CHUNK;
+	header.n_chunks = n_chunks;
+	header.compress = io->compress ? 1 : 0;
 
-	for (uint32_t ix = 0; ix < n_objects; ix++) {
-		shmdt(ios[ix].memptr);
-	}
+	size_t digests_len = n_chunks * sizeof(as_digest_t);
 
-	// Close all (possibly) opened files.
+	if (pwrite(io->fd, (void*)&header, CASHDR_LEN, (off_t)CASHDR_OFF)
+			!= (ssize_t)CASHDR_LEN
+			|| pwrite(io->fd, (void*)io->chunk_digests, digests_len,
+					(off_t)CASHDR_LEN) != (ssize_t)digests_len) {
+		if (g_verbose) {
+			printf("Could not write chunk store recipe to file.\n");
+		}
 
-	for (uint32_t ix = 0; ix < n_objects; ix++) {
-		close(ios[ix].fd);
+		return false;
 	}
 
-	// Remove all created files (only on failure case).
+	// The chunks hold exactly what's in the segment.
 
-	if (!remove_files) {
-		return;
+	if (g_crc32) {
+		io->crc32 = crc32_z(io->crc32, io->memptr, io->segsz);
 	}
 
-	char pathname[PATH_MAX + 1];
-	const char* extension;
-	as_segment_t* sp;
-
-	sp = pbp;
-	extension = FILE_EXTENSION;
-	sprintf(pathname, "%s/%08x%s", g_pathdir, sp->key, extension);
-	unlink(pathname);
+	// Set file ownership.
 
-	sp = ptp;
-	extension = g_compress ? FILE_EXTENSION_CMP : FILE_EXTENSION;
-	sprintf(pathname, "%s/%08x%s", g_pathdir, sp->key, extension);
-	unlink(pathname);
+	if (fchown(io->fd, io->uid, io->gid) == -1) {
+		char errbuff[MAX_BUFFER];
+		char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
 
-	for (uint32_t ix = 0; ix < n_psps; ix++) {
-		sp = &psps[ix];
+		if (g_verbose) {
+			printf("Unable to set uid or gid for file"
+					": error was %d: %s\n", errno, errout);
+		}
 
-		extension = g_compress ? FILE_EXTENSION_CMP : FILE_EXTENSION;
-		sprintf(pathname, "%s/%08x%s", g_pathdir, sp->key, extension);
-		unlink(pathname);
+		return false;
 	}
 
-	if (n_ssps > 0) {
-		sp = smp;
-		extension = FILE_EXTENSION;
-		sprintf(pathname, "%s/%08x%s", g_pathdir, sp->key, extension);
-		unlink(pathname);
+	// Set file mode.
 
-		for (uint32_t ix = 0; ix < n_ssps; ix++) {
-			sp = &ssps[ix];
+	if (fchmod(io->fd, io->mode) == -1) {
+		char errbuff[MAX_BUFFER];
+		char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
 
-			extension = g_compress ? FILE_EXTENSION_CMP : FILE_EXTENSION;
-			sprintf(pathname, "%s/%08x%s", g_pathdir, sp->key, extension);
-			unlink(pathname);
+		if (g_verbose) {
+			printf("Unable to set mode for file"
+					": error was %d: %s\n", errno, errout);
 		}
+
+		return false;
 	}
+
+	return true;
 }
 
-// Actually start the I/Os in the list.
+// Store a chunk in the chunk store, unless it's there already. The chunk is
+// written to a temporary file and renamed, so a chunk found in the store is
+// always complete - and concurrent writers of the same chunk don't collide.
 
 static bool
-start_io(as_io_t ios[], uint32_t n_ios)
+store_chunk(const void* buf, size_t size, const as_digest_t* digest,
+		bool compress, uint64_t* stored_sz)
 {
-	// Number of threads to start, based on g_max_threads and n_ios.
+	char pathname[PATH_MAX + 1];
 
-	uint32_t n_threads = n_ios > g_max_threads ? g_max_threads : n_ios;
+	chunk_pathname(digest, compress, pathname);
 
-	// Set global file I/O variables.
+	if (access(pathname, F_OK) == 0) {
+		return same_chunk(buf, size, digest, compress, pathname);
+	}
 
-	g_ios = ios;
-	g_n_ios = n_ios;
-	g_next_io = 0;
-	g_ios_ok = true;
+	// Compress the chunk if requested.
 
-	// How much data will be transferred (total)?
+	const void* out_buf = buf;
+	size_t out_len = size;
+	uint8_t* cmp_buf = NULL;
 
-	g_total_to_transfer = 0;
+	if (compress) {
+		uLongf cmp_len = compressBound((uLong)size);
 
-	for (uint32_t i = 0; i < g_n_ios; i++) {
-		g_total_to_transfer += (uint64_t)ios[i].segsz;
-	}
+		cmp_buf = (uint8_t*)malloc(cmp_len);
 
-	g_total_transferred = 0;
-	g_decile_transferred = 0;
+		if (cmp_buf == NULL) {
+			if (g_verbose) {
+				printf("Could not allocate memory to compress chunk.\n");
+			}
 
-	// Remember start time.
+			return false;
+		}
 
-	int rc = clock_gettime(CLOCK_MONOTONIC, &g_io_start_time);
+		if (compress2(cmp_buf, &cmp_len, (const Bytef*)buf, (uLong)size,
+				Z_BEST_SPEED) != Z_OK) {
+			if (g_verbose) {
+				printf("Could not compress chunk.\n");
+			}
 
-	if (rc != 0) {
-		if (g_verbose) {
-			printf("Could not determine I/O start time.\n");
+			free(cmp_buf);
+			cmp_buf = NULL;
+			return false;
 		}
 
-		return false;
+		out_buf = cmp_buf;
+		out_len = cmp_len;
 	}
 
-	// Initialize global mutex.
+	char temp_pathname[PATH_MAX + 64];
 
-	pthread_mutex_init(&g_io_mutex, NULL);
+	sprintf(temp_pathname, "%s.%d.%lx%s", pathname, getpid(),
+			(unsigned long)pthread_self(), TEMP_EXTENSION);
 
-	// Thread table.
+	int fd = open(temp_pathname, O_CREAT | O_WRONLY | O_TRUNC, DEFAULT_MODE);
 
-	pthread_t threads[n_threads];
+	if (fd < 0 && errno == ENOENT) {
+		// First chunk in its subdirectory - create the subdirectory.
 
-	// Actually start threads.
+		char dirname[PATH_MAX + 1];
 
-	uint32_t i;
-	for (i = 0; i < n_threads; i++) {
-		rc = pthread_create(&threads[i], NULL, run_io, NULL);
+		strcpy(dirname, pathname);
+		*strrchr(dirname, '/') = '\0';
 
-		// If creating thread failed, notify successfully created threads
-		// to end and wait.
+		// A new subdirectory must survive a crash too, as the chunks in it
+		// are renamed into place.
 
-		if (rc != 0) {
-			pthread_mutex_lock(&g_io_mutex);
-			g_ios_ok = false;
-			pthread_mutex_unlock(&g_io_mutex);
+		bool have_dir = mkdir(dirname, DEFAULT_MODE_DIR) == 0 ?
+				sync_parent_dir(dirname) : errno == EEXIST;
 
-			break;
+		if (have_dir) {
+			fd = open(temp_pathname, O_CREAT | O_WRONLY | O_TRUNC,
+					DEFAULT_MODE);
 		}
 	}
 
-	// Wait for all threads to exit.
+	if (fd < 0) {
+		char errbuff[MAX_BUFFER];
+		char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
 
-	for (uint32_t j = 0; j < i; j++) {
-		pthread_join(threads[j], NULL);
+		if (g_verbose) {
+			printf("Could not create chunk file \'%s\'"
+					": error was %d: %s.\n", temp_pathname, errno, errout);
+		}
+
+		free(cmp_buf);
+		cmp_buf = NULL;
+		return false;
 	}
 
-	struct timespec io_end_time;
+	// Write the chunk, and make sure it's durable before it's published.
 
-	rc = clock_gettime(CLOCK_MONOTONIC, &io_end_time);
+	bool success = true;
+	size_t offset = 0;
 
-	if (rc != 0) {
-		if (g_verbose) {
-			printf("Could not determine I/O end time.\n");
+	while (offset < out_len) {
+		ssize_t result = pwrite(fd, (const uint8_t*)out_buf + offset,
+				out_len - offset, (off_t)offset);
+
+		if (result <= 0) {
+			success = false;
+			break;
 		}
+
+		offset += (size_t)result;
 	}
-	else {
-		if (g_verbose && g_decile_transferred != 10) {
-			char* time_str = strtime_diff_eta(&g_io_start_time, &io_end_time,
-					g_decile_transferred);
 
-			printf("Total I/O time was %s.\n", time_str);
-			free(time_str);
-			time_str = NULL;
+	if (success && fdatasync(fd) < 0) {
+		success = false;
+	}
+
+	close(fd);
+
+	// The rename only lasts once the directory is synced.
+
+	if (success && (rename(temp_pathname, pathname) < 0
+			|| !sync_parent_dir(pathname))) {
+		success = false;
+	}
+
+	if (!success) {
+		if (g_verbose) {
+			printf("Could not write chunk file \'%s\'.\n", pathname);
 		}
+
+		unlink(temp_pathname);
+	}
+	else {
+		*stored_sz += size;
 	}
 
-	// Return success or failure.
+	free(cmp_buf);
+	cmp_buf = NULL;
 
-	return g_ios_ok;
+	return success;
 }
 
-// Process individual file I/O requests by individual threads.
+// Check that a chunk already in the chunk store is the one being stored. Its
+// digest isn't cryptographic, so a chunk with the same digest may still be
+// different - it's loaded and compared, rather than trusted. A different (or
+// damaged) chunk isn't replaced, as other backups may need it.
 
-static void*
-run_io(void* args)
+static bool
+same_chunk(const void* buf, size_t size, const as_digest_t* digest,
+		bool compress, const char* pathname)
 {
-	(void)args;
+	uint8_t* stored_buf = (uint8_t*)malloc(size);
 
-	while (true) {
-		// Get the next I/O request.
+	if (stored_buf == NULL) {
+		if (g_verbose) {
+			printf("Could not allocate memory to compare chunk.\n");
+		}
 
-		uint32_t next;
+		return false;
+	}
 
-		pthread_mutex_lock(&g_io_mutex);
+	bool same = load_chunk(digest, compress, stored_buf, size)
+			&& memcmp(stored_buf, buf, size) == 0;
 
-		// Is everything running okay?
+	free(stored_buf);
+	stored_buf = NULL;
 
-		bool ok = g_ios_ok;
+	if (!same && g_verbose) {
+		printf("Chunk file '%s' doesn't hold the chunk being stored"
+				": can't store it.\n", pathname);
+	}
 
-		// If so, get next I/O operation.
+	return same;
+}
 
-		if (ok) {
-			next = g_next_io++;
-		}
+// Restore a chunk (of size IOCHUNK) of a segment from the chunk store.
 
-		pthread_mutex_unlock(&g_io_mutex);
+static bool
+read_cas_file(as_io_t* io, uint32_t chunk)
+{
+	size_t offset = (size_t)chunk * IOCHUNK;
+	size_t end = offset + io_chunk_size(io, chunk);
 
-		// If there are no more requests or one or more failed, quit.
+	for (; offset < end; offset += DIGEST_CHUNK) {
+		size_t size = end - offset < DIGEST_CHUNK ? end - offset : DIGEST_CHUNK;
 
-		if (!ok || next >= g_n_ios) {
-			break;
+		if (!load_chunk(&io->chunk_digests[offset / DIGEST_CHUNK],
+				io->compress, (uint8_t*)io->memptr + offset, size)) {
+			return false;
 		}
+	}
 
-		// Extract this I/O request.
+	return true;
+}
 
-		as_io_t* io = &g_ios[next];
+// Verify a chunk (of size IOCHUNK) of a segment in the chunk store.
 
-		bool success;
+static bool
+verify_cas_file(as_io_t* io, uint32_t chunk)
+{
+	uint8_t* buf = (uint8_t*)malloc(DIGEST_CHUNK);
 
-		if (io->write) {
-			success = write_file(io->fd, io->memptr, io->segsz, io->mode,
-					io->uid, io->gid, io->compress, &io->crc32);
-			(void)fsync(io->fd);
-		}
-		else {
-			success = read_file(io->fd, io->memptr, io->filsz, io->segsz,
-					io->shmid, io->mode, io->uid, io->gid, io->compress,
-					&io->crc32);
+	if (buf == NULL) {
+		if (g_verbose) {
+			printf("Could not allocate memory to verify chunks.\n");
 		}
 
-		// If this request failed, stop the other threads.
+		return false;
+	}
 
-		if (!success) {
-			pthread_mutex_lock(&g_io_mutex);
-			g_ios_ok = false;
-			pthread_mutex_unlock(&g_io_mutex);
-			break;
+	bool success = true;
+	size_t offset = (size_t)chunk * IOCHUNK;
+	size_t end = offset + io_chunk_size(io, chunk);
+
+	for (; offset < end; offset += DIGEST_CHUNK) {
+		size_t size = end - offset < DIGEST_CHUNK ? end - offset : DIGEST_CHUNK;
+
+		// Carry on, so that every bad chunk gets reported.
+
+		if (!load_chunk(&io->chunk_digests[offset / DIGEST_CHUNK],
+				io->compress, buf, size)) {
+			success = false;
 		}
-		else {
-			pthread_mutex_lock(&g_io_mutex);
+	}
 
-			g_total_transferred += io->segsz;
+	free(buf);
+	buf = NULL;
 
-			// if we've reached a notable decile point, notify the user.
-			// Note: This is the only point at which output is done under
-			// a mutex, so it isn't stepped on by other threads.
+	return success;
+}
 
-			if (g_verbose) {
-				uint32_t decile_transferred = (uint32_t)((g_total_transferred
-						* 10UL) / g_total_to_transfer);
+// Compare a chunk (of size IOCHUNK) of a segment with its chunks in the chunk
+// store. Only chunks whose digests differ are loaded and compared in detail,
+// if the chunk store is available - else the whole chunk is mismatched.
 
-				if (g_decile_transferred != decile_transferred) {
-					g_decile_transferred = decile_transferred;
+static bool
+compare_cas_file(as_io_t* io, uint32_t chunk)
+{
+	uint8_t* buf = (uint8_t*)malloc(DIGEST_CHUNK);
 
-					if (g_verbose) {
-						printf("Transferred %3d%% of data",
-								g_decile_transferred * 10);
-					}
+	if (buf == NULL) {
+		if (g_verbose) {
+			printf("Could not allocate memory to compare chunks.\n");
+		}
 
-					struct timespec io_end_time;
-					int rc = clock_gettime(CLOCK_MONOTONIC, &io_end_time);
+		return false;
+	}
 
-					if (rc != 0) {
-						if (g_verbose) {
-							printf(".\n");
-						}
-					}
-					else {
-						char* time_str = strtime_diff_eta(&g_io_start_time,
-								&io_end_time, g_decile_transferred);
+	size_t offset = (size_t)chunk * IOCHUNK;
+	size_t end = offset + io_chunk_size(io, chunk);
 
-						if (g_verbose) {
-							printf(" in %s.\n", time_str);
-						}
+	as_range_t pending = { 0, 0 };
+	bool success = true;
 
-						free(time_str);
-						time_str = NULL;
-					}
-				}
-			}
+	for (; success && offset < end; offset += DIGEST_CHUNK) {
+		size_t size = end - offset < DIGEST_CHUNK ? end - offset : DIGEST_CHUNK;
+		const uint8_t* seg_buf = (const uint8_t*)io->memptr + offset;
+		const as_digest_t* digest = &io->chunk_digests[offset / DIGEST_CHUNK];
+
+		as_digest_t seg_digest;
+
+		hash_digest(seg_buf, size, DIGEST_SEED, &seg_digest);
 
-			pthread_mutex_unlock(&g_io_mutex);
+		if (hash_digest_equal(&seg_digest, digest)) {
+			continue;
 		}
-	}
 
-	return NULL;
-}
+		if (g_chunk_store != NULL && load_chunk(digest, io->compress, buf,
+				size)) {
+			success = compare_range(io, buf, seg_buf, size, offset, &pending);
+		}
+		else {
+			success = add_range(io, &pending, offset, offset + size);
+		}
+	}
 
-// Write a complete file (compressed if requested). Compute crc32 if requested.
+	free(buf);
+	buf = NULL;
 
-static bool
-write_file(int fd, const void* buf, size_t segsz, mode_t mode,
-		uid_t uid, gid_t gid, bool compress, uLong* crc)
-{
-	if (compress) {
-		return zwrite_file(fd, buf, segsz, mode, uid, gid, crc);
-	}
-	else {
-		return pwrite_file(fd, buf, segsz, mode, uid, gid, crc);
-	}
+	return success && flush_range(io, &pending);
 }
 
-// Write a complete file (compressed). Retrieve crc32 if requested.
+// Read and sanity check the header of a chunk store recipe (or pre-copy state)
+// file, and the chunk digests which follow it. The digests are to be freed by
+// the caller.
 
 static bool
-zwrite_file(int fd, const void* buf, size_t segsz, mode_t mode,
-		uid_t uid, gid_t gid, uLong* crc)
+read_cas_header(int fd, key_t key, size_t segsz, uint32_t magic,
+		as_cas_t* header, as_digest_t** digests)
 {
-	// Set up and write initial compressed file header.
+	const char* what = magic == CASHDR_MAG ?
+			"chunk store recipe" : "pre-copy state";
 
-	as_cmp_t header;
-
-	header.magic = CMPHDR_MAG2;
-	header.version = CMPHDR_VER;
-	header.crc32 = g_crc32_init;
-	header.segsz = segsz;
-
-	if (lseek(fd, (off_t)CMPHDR_OFF, SEEK_SET) != (off_t)CMPHDR_OFF) {
+	if (pread(fd, (void*)header, CASHDR_LEN, (off_t)CASHDR_OFF)
+			!= (ssize_t)CASHDR_LEN) {
 		if (g_verbose) {
-			printf("Could not write compressed file header to file.\n");
+			printf("Could not read %s header for segment %08x.\n", what, key);
 		}
 
 		return false;
 	}
 
-	if (write(fd, (void*)&header, CMPHDR_LEN) != (size_t)CMPHDR_LEN) {
+	if (header->magic != magic || header->version != CASHDR_VER
+			|| header->chunk_size != DIGEST_CHUNK) {
 		if (g_verbose) {
-			printf("Could not write compressed file header to file.\n");
+			printf("Invalid %s header for segment %08x.\n", what, key);
 		}
 
 		return false;
 	}
 
-	// Allocate buffer for compression intermediate results.
-
-	uint8_t* cmp_buf = (uint8_t*)malloc(CMPCHUNK);
-
-	if (cmp_buf == NULL) {
+	if (header->segsz != segsz || header->n_chunks
+			!= (segsz + DIGEST_CHUNK - 1) / DIGEST_CHUNK) {
 		if (g_verbose) {
-			printf("Could not allocate memory to compress file.\n");
+			printf("The %s for segment %08x has %u chunks for %lu"
+					" bytes, expecting %lu bytes.\n", what, key,
+					header->n_chunks, header->segsz, segsz);
 		}
 
 		return false;
 	}
 
-	// Set up the compression.
-
-	z_stream defstream;
+	size_t digests_len = header->n_chunks * sizeof(as_digest_t);
 
-	defstream.zalloc = Z_NULL;
-	defstream.zfree = Z_NULL;
-	defstream.opaque = Z_NULL;
+	*digests = (as_digest_t*)malloc(digests_len);
 
-	// Use gzip compression; as a side effect, get crc32 for free.
+	if (*digests == NULL) {
+		if (g_verbose) {
+			printf("Could not allocate memory for chunk digests.\n");
+		}
 
-	int windowBits = 15 + 16; // Use max memory and use gzip algorithm.
-	int memLevel = 9; // Use maximum memory level.
+		return false;
+	}
 
-	if (deflateInit2(&defstream, Z_BEST_SPEED, Z_DEFLATED, windowBits, memLevel,
-			Z_DEFAULT_STRATEGY) != Z_OK) {
+	if (pread(fd, (void*)*digests, digests_len, (off_t)CASHDR_LEN)
+			!= (ssize_t)digests_len) {
 		if (g_verbose) {
-			printf("Did not initialize compression engine while writing"
-					" segment to file.\n");
+			printf("Could not read %s chunk digests for segment %08x.\n",
+					what, key);
 		}
 
-		free(cmp_buf);
-		cmp_buf = NULL;
+		free(*digests);
+		*digests = NULL;
 		return false;
 	}
 
-	// Whole segment is available in buf.
+	return true;
+}
 
-	defstream.avail_in = (uInt)segsz;
-	defstream.next_in = (Bytef*)buf;
+// Load a chunk from the chunk store, and check it against its digest.
 
-	// Actually compress the segment.
+static bool
+load_chunk(const as_digest_t* digest, bool compress, void* buf, size_t size)
+{
+	char pathname[PATH_MAX + 1];
 
-	int ret;
+	chunk_pathname(digest, compress, pathname);
 
-	do {
-		// Compress one chunk at a time.
+	int fd = open(pathname, O_RDONLY);
+	struct stat statbuf;
 
-		defstream.avail_out = (uInt)CMPCHUNK;
-		defstream.next_out = (Bytef*)cmp_buf;
+	if (fd < 0 || fstat(fd, &statbuf) < 0) {
+		char errbuff[MAX_BUFFER];
+		char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
 
-		ret = deflate(&defstream, Z_FINISH);
-		if (ret == Z_STREAM_ERROR) {
-			if (g_verbose) {
-				printf("Could not compress file.\n");
-			}
+		if (g_verbose) {
+			printf("Could not open chunk file \'%s\'"
+					": error was %d: %s.\n", pathname, errno, errout);
+		}
 
-			free(cmp_buf);
-			cmp_buf = NULL;
-			return false;
+		if (fd >= 0) {
+			close(fd);
 		}
 
-		size_t have_bytes = CMPCHUNK - defstream.avail_out;
+		return false;
+	}
 
-		// Write this chunk to output file.
+	size_t filsz = (size_t)statbuf.st_size;
+	uint8_t* cmp_buf = NULL;
+	uint8_t* in_buf = (uint8_t*)buf;
+	bool success = true;
 
-		if (write(fd, (void*)cmp_buf, have_bytes) != (ssize_t)have_bytes) {
-			if (g_verbose) {
-				printf("Could not write to compressed file.\n");
-			}
+	if (compress) {
+		cmp_buf = (uint8_t*)malloc(filsz);
+		in_buf = cmp_buf;
+	}
+	else if (filsz != size) {
+		success = false;
+	}
 
-			(void)deflateEnd(&defstream);
-			free(cmp_buf);
-			cmp_buf = NULL;
-			return false;
-		}
-	} while (defstream.avail_out == 0);
+	size_t offset = 0;
 
-	// Finished compressing. Was it successful?
+	while (success && in_buf != NULL && offset < filsz) {
+		ssize_t bytes_read = pread(fd, in_buf + offset, filsz - offset,
+				(off_t)offset);
 
-	if (defstream.avail_in != 0) {
-		if (g_verbose) {
-			printf("Failed to compress file.\n");
+		if (bytes_read <= 0) {
+			success = false;
+			break;
 		}
 
-		(void)deflateEnd(&defstream);
-		free(cmp_buf);
-		cmp_buf = NULL;
-		return false;
+		offset += (size_t)bytes_read;
 	}
 
-	// Shut down compression engine.
+	close(fd);
 
-	deflateEnd(&defstream);
+	if (in_buf == NULL) {
+		success = false;
+	}
 
-	// Free intermediate compression buffer.
+	if (success && compress) {
+		uLongf out_len = (uLongf)size;
+
+		success = uncompress((Bytef*)buf, &out_len, cmp_buf, (uLong)filsz)
+				== Z_OK && out_len == size;
+	}
 
 	free(cmp_buf);
 	cmp_buf = NULL;
 
-	// Ensure compression engine finished happily.
+	if (success) {
+		as_digest_t chunk_digest;
 
-	if (ret != Z_STREAM_END) {
-		if (g_verbose) {
-			printf("Did not finish compressing segment to file.\n");
-		}
+		hash_digest(buf, size, DIGEST_SEED, &chunk_digest);
+		success = hash_digest_equal(&chunk_digest, digest);
+	}
 
-		return false;
+	if (!success && g_verbose) {
+		printf("Chunk file \'%s\' is damaged.\n", pathname);
 	}
 
-	// Should we retrieve crc32?
+	return success;
+}
 
-	*crc = g_crc32 ? defstream.adler : g_crc32_init;
+// Construct the pathname of a chunk in the chunk store. Chunks are spread over
+// subdirectories named after the first two hex digits of their digests.
 
-	// Go back and write compressed file header (ALWAYS).
+static void
+chunk_pathname(const as_digest_t* digest, bool compress, char* pathname)
+{
+	assert(g_chunk_store != NULL);
 
-	header.magic = CMPHDR_MAG2;
-	header.version = CMPHDR_VER;
-	header.segsz = segsz;
-	header.crc32 = defstream.adler;
+	char hex[DIGEST_HEX_LEN + 1];
 
-	if (lseek(fd, (off_t)CMPHDR_OFF, SEEK_SET) != (off_t)CMPHDR_OFF) {
-		if (g_verbose) {
-			printf("Could not write compressed file header to file.\n");
-		}
+	hash_digest_to_hex(digest, hex);
+
+	sprintf(pathname, "%s/%.2s/%s%s", g_chunk_store, hex, hex,
+			compress ? CHUNK_EXTENSION_CMP : "");
+}
+
+// Sync the directory which holds a file, so that the file's name - just
+// created, or renamed into place - survives a crash.
+
+static bool
+sync_parent_dir(const char* pathname)
+{
+	char dirname[PATH_MAX + 1];
+
+	strcpy(dirname, pathname);
+	*strrchr(dirname, '/') = '\0';
 
+	int fd = open(dirname, O_RDONLY | O_DIRECTORY);
+
+	if (fd < 0) {
 		return false;
 	}
 
-	if (write(fd, (void*)&header, CMPHDR_LEN) != (size_t)CMPHDR_LEN) {
-		if (g_verbose) {
-			printf("Could not write compressed file header to file.\n");
-		}
+	bool success = fsync(fd) == 0;
+
+	close(fd);
+
+	return success;
+}
+
+// Analyze restore operation.
+
+static bool
+analyze_restore(void)
+{
+	as_file_t* files = NULL;
+	int error;
+
+	memset(&g_plan, 0, sizeof(g_plan));
+
+	// First, see if we can access the backup directories (or raw container)
+	// for reading. Do not create.
 
+	if (g_raw && !open_raw()) {
 		return false;
 	}
 
-	// Set file ownership.
+	if (g_s3 && !open_s3()) {
+		return false;
+	}
 
-	if (fchown(fd, uid, gid) == -1) {
-		char errbuff[MAX_BUFFER];
-		char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
+	for (uint32_t t = 0; !g_raw && !g_s3 && t < g_n_pathdirs; t++) {
+		if (!check_dir(g_pathdirs[t], false, false)) {
+			if (g_verbose) {
+				printf("Cannot read from directory \'%s\'", g_pathdirs[t]);
+				printf(": either it does not exist"
+						" or we don't have read permission.\n");
+			}
+			return false;
+		}
+	}
+
+	// Likewise the chunk store (if any).
 
+	if (g_chunk_store != NULL && !check_dir(g_chunk_store, false, false)) {
 		if (g_verbose) {
-			printf("Unable to set uid or gid for file"
-					": error was %d: %s\n", errno, errout);
+			printf("Cannot read from chunk store directory \'%s\'.\n",
+					g_chunk_store);
 		}
 
 		return false;
 	}
 
-	// Set file mode.
+	// And the mirror directories (if any).
 
-	if (fchmod(fd, mode) == -1) {
-		char errbuff[MAX_BUFFER];
-		char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
+	for (uint32_t m = 0; m < g_n_mirrors; m++) {
+		if (!check_dir(g_mirrors[m], false, false)) {
+			if (g_verbose) {
+				printf("Cannot read from mirror directory \'%s\'.\n",
+						g_mirrors[m]);
+			}
 
-		if (g_verbose) {
-			printf("Unable to set mode for file"
-					": error was %d: %s\n", errno, errout);
+			return false;
 		}
+	}
 
-		return false;
+	// Load the dictionaries zstd compressed segment files may need.
+
+	if (!g_raw && !g_s3 && !g_stream && codec_available(CODEC_ZSTD)) {
+		load_dicts();
 	}
 
-	return true;
-}
+	// Get the list of Aerospike database segment files that passed the filter -
+	// from the backup's manifests if possible, else by reading the directory.
 
-// Write a complete file (uncompressed). Compute crc32 if requested.
+	uint32_t n_files;
 
-static bool
-pwrite_file(int fd, const void* buf, size_t segsz, mode_t mode,
-		uid_t uid, gid_t gid, uLong* crc)
-{
-	// newsize is running size, as pwrite(2) progresses.
+	bool listed;
 
-	ssize_t newsize = (ssize_t)segsz;
+	error = 0;
 
-	// result is result of individual pwrite(2) operation.
+	if (!g_raw && !g_s3 && plan_files(&files, &n_files)) {
+		listed = true;
 
-	ssize_t result;
+		if (g_verbose) {
+			printf("Planned from manifests in \'%s\'.\n", g_pathdir_list);
+		}
+	}
+	else {
+		listed = list_files(&files, &n_files, &error);
+	}
+
+	if (!listed || n_files == 0) {
+		// Note: n_files and error are valid even if list_files() returned false.
 
-	// Initially, offset is start of segment / segment file.
+		if (g_verbose) {
+			printf("\nDid not find any Aerospike database segment files");
 
-	off_t offset = 0;
+			print_insts();
 
-	// Write chunks of segment, as large as possible.
+			if (g_nsnm != NULL) {
+				printf(", namespace \'%s\'", g_nsnm);
+			}
 
-	while ((result = pwrite(fd, buf, (size_t)newsize, offset)) != newsize) {
-		if (result <= 0) {
-			return false;
-		}
+			if (error != 0) {
+				char errbuff[MAX_BUFFER];
+				char *errout = strerror_r(errno, errbuff, MAX_BUFFER);
 
-		// Should we compute crc32? If so, apply to this chunk.
+				printf(": error was %d: %s", error, errout);
+			}
 
-		if (g_crc32) {
-			*crc = crc32(*crc, buf, (uInt)result);
+			printf(".\n");
 		}
 
-		// If only partial write, set up next chunk.
+		if (n_files > 0) {
+			for (uint32_t j = 0; j < n_files; j++) {
+				as_file_t* fp = &files[j];
 
-		buf += result;
-		offset += result;
-		newsize -= result;
-	}
+				if (fp->type == TYPE_BASE && fp->nsnm != NULL) {
+					free(fp->nsnm);
+					fp->nsnm = NULL;
+				}
+			}
 
-	// Finish crc32 computation on last chunk, if incomplete.
+			if (files != NULL) {
+				free(files);
+				files = NULL;
+			}
+		}
 
-	if (result >= 0 && g_crc32) {
-		*crc = crc32(*crc, buf, (uInt)result);
+		return false;
 	}
 
-	// Set file ownership.
+	// Look for files that can be restored.
+	// Must have one base segment file, one treex segment file,
+	// and at least one primary stage segment file.
+	// May have one meta file and if so, at least one secondary stage segment file.
 
-	if (fchown(fd, uid, gid) == -1) {
-		char errbuff[MAX_BUFFER];
-		char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
+	bool candidates = false;
+
+	for (uint32_t ix = 0; ix < n_files; ix++) {
+		as_file_t* file = &files[ix];
 
+		if (file->type == TYPE_BASE) {
+			candidates = true;
+
+			if (!analyze_restore_candidate(files, n_files, ix)) {
+
+				for (uint32_t j = 0; j < n_files; j++) {
+					as_file_t* fp = &files[j];
+
+					if (fp->type == TYPE_BASE && fp->nsnm != NULL) {
+						free(fp->nsnm);
+						fp->nsnm = NULL;
+					}
+				}
+
+				if (files != NULL) {
+					free(files);
+					files = NULL;
+				}
+
+				return false;
+			}
+		}
+	}
+
+	if (!candidates) {
 		if (g_verbose) {
-			printf("Unable to set uid or gid for file"
-					": error was %d: %s\n", errno, errout);
+			printf("\nDid not find any Aerospike database segment files");
+			print_insts();
+
+			if (g_nsnm != NULL) {
+				printf(", namespace \'%s\'", g_nsnm);
+			}
+
+			printf(".\n");
 		}
+	}
 
-		return false;
+	// When analyzing, follow the commands with the plan.
+
+	bool success = true;
+
+	if (g_analyze && g_verbose && candidates && !g_verify) {
+		success = finish_restore_plan();
 	}
 
-	// Set file mode.
+	// Free table created by list_files().
 
-	if (fchmod(fd, mode) == -1) {
-		char errbuff[MAX_BUFFER];
-		char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
+	for (uint32_t jx = 0; jx < n_files; jx++) {
+		as_file_t* fp = &files[jx];
 
-		if (g_verbose) {
-			printf("Unable to set mode for file"
-					": error was %d: %s\n", errno, errout);
+		if (fp->type == TYPE_BASE && fp->nsnm != NULL) {
+			free(fp->nsnm);
+			fp->nsnm = NULL;
 		}
+	}
 
-		return false;
+	if (files != NULL) {
+		free(files);
+		files = NULL;
 	}
 
-	return true;
+	return success;
 }
 
-// Read a complete file (compressed if requested). Compute crc32 if requested.
+// Analyze whether to restore a candidate set of segment files.
 
 static bool
-read_file(int fd, void* buf, size_t filsz, size_t segsz, int shmid,
-		mode_t mode, uid_t uid, gid_t gid, bool compress, uLong* crc)
+analyze_restore_candidate(as_file_t* files, uint32_t n_files, uint32_t base_ix)
 {
-	if (compress) {
-		return zread_file(fd, buf, filsz, segsz, shmid, mode, uid, gid, crc);
-	}
-	else {
-		return pread_file(fd, buf, segsz, shmid, mode, uid, gid, crc);
-	}
-}
+	// Extract the base segment file.
 
-// Read a complete file (compressed). Compute crc32 if requested.
+	as_file_t* pbp = &files[base_ix];
 
-static bool
-zread_file(int fd, void* buf, size_t filsz, size_t segsz, int shmid,
-		mode_t mode, uid_t uid, gid_t gid, uLong* crc)
-{
-	(void)filsz;
+	assert(pbp->type == TYPE_BASE);
+	assert(pbp->nsnm != NULL);
 
-	// Read compressed file header.
+	uint32_t inst = pbp->inst;
+	uint32_t nsid = pbp->nsid;
+	char* nsnm = pbp->nsnm;
 
-	as_cmp_t header;
+	// A pre-copy's files are a fuzzy copy of live segments - only a finalized
+	// backup can be restored or verified.
 
-	if (lseek(fd, (off_t)CMPHDR_OFF, SEEK_SET) != (off_t)CMPHDR_OFF) {
+	if (!g_raw && !g_s3 && !g_stream && have_precopy(inst, nsid)) {
 		if (g_verbose) {
-			printf("Could not seek to header in compressed file.\n");
+			printf("Found a pre-copy of instance %u, namespace '%s' (nsid %u)"
+					" in '%s' that wasn't finalized: finish it with"
+					" '--finalize'.\n", inst, nsnm, nsid, g_pathdir);
 		}
 
 		return false;
 	}
 
-	if (read(fd, (void*)&header, CMPHDR_LEN) != (size_t)CMPHDR_LEN) {
-		if (g_verbose) {
-			printf("Could not read header from compressed file.\n");
+	// Find the corresponding treex segment file.
+
+	as_file_t* ptp = NULL;
+	uint32_t n_ptps = 0;
+
+	for (uint32_t ix = 0; ix < n_files; ix++) {
+		if (ix == base_ix) {
+			continue;
 		}
 
-		return false;
-	}
+		as_file_t* sp = &files[ix];
 
-	// Sanity check header.
+		if (sp->type == TYPE_TREEX && sp->inst == inst && sp->nsid == nsid) {
+			ptp = sp;
+			ptp->nsnm = strdup(nsnm);
+			n_ptps++;
+		}
+	}
 
-	if (header.magic != CMPHDR_MAG1 && header.magic != CMPHDR_MAG2) {
+	if (n_ptps != 1) {
 		if (g_verbose) {
-			printf("Compressed file header bad magic number:"
-					" expecting 0x%08x, found 0x%08x;", CMPHDR_MAG2, header.magic);
+			printf("Missing treex segment file.\n");
 		}
 
+		// TODO: If (n_ptps > 1) will leak ptp->nsnm;
+
 		return false;
 	}
 
-	if (header.version != CMPHDR_VER) {
-		if (g_verbose) {
-			printf("Compressed file header bad version number:"
-					" expecting 0x%08x, found 0x%08x;", CMPHDR_VER, header.version);
-		}
+	// Find the primary stage segment files.
 
-		return false;
+	as_file_t psps[MAX_PRI_STAGES] = { 0 };
+	uint32_t n_psps = 0;
+
+	for (uint32_t ix = 0; ix < n_files; ix++) {
+		as_file_t* sp = &files[ix];
+
+		if (sp->type == TYPE_PRI_STAGE && sp->nsid == nsid
+				&& sp->inst == inst) {
+			psps[n_psps] = *sp;
+			psps[n_psps].nsnm = strdup(nsnm);
+			n_psps++;
+		}
 	}
 
-	if (segsz != header.segsz) {
+	if (n_psps < 1) {
 		if (g_verbose) {
-			printf("Compressed file header segment size mismatch:"
-					" expecting %lu, found %lu.\n", segsz, header.segsz);
+			printf("Missing primary stage segment file(s) for instance %u"
+					", namespace \'%s\' (nsid %d).\n", inst, nsnm, nsid);
+		}
+
+		if (ptp != NULL && ptp->nsnm != NULL) {
+			free(ptp->nsnm);
+			ptp->nsnm = NULL;
 		}
 
 		return false;
 	}
 
-	// Set up compression engine.
+	// Sort the primary stage segment files by key.
 
-	z_stream infstream;
+	if (n_psps > 1) {
+		qsort((void*)psps, (size_t)n_psps, sizeof(as_file_t),
+				qsort_compare_files);
+	}
 
-	infstream.zalloc = Z_NULL;
-	infstream.zfree = Z_NULL;
-	infstream.opaque = Z_NULL;
-	infstream.avail_in = 0;
-	infstream.next_in = Z_NULL;
+	// Check that all primary stage files are present.
 
-	// Specify gzip only.
+	for (uint32_t ix = 0; ix < n_psps; ix++) {
+		bool found = false;
 
-	int windowBits = 15 + 32; // Use maximum memory and zlib or gzip algorithm.
-	int ret = inflateInit2(&infstream, windowBits);
+		for (uint32_t jx = 0; jx < n_psps; jx++) {
+			as_file_t* jp = &psps[jx];
 
-	if (ret != Z_OK) {
-		if (g_verbose) {
-			printf("Unable to initialize compression engine.\n");
+			if (jp->stage == ix + (uint32_t)AS_XMEM_ARENA_KEY) {
+				found = true;
+				break;
+			}
 		}
 
-		return false;
-	}
+		if (!found) {
+			if (g_verbose) {
+				printf("Missing primary stage segment file %03x for instance %u"
+						", namespace \'%s\' (nsid %d).\n",
+						ix + (uint32_t)AS_XMEM_ARENA_KEY, inst, nsnm, nsid);
+			}
 
-	// Allocate memory for compression engine buffer.
+			if (ptp != NULL && ptp->nsnm != NULL) {
+				free(ptp->nsnm);
+				ptp->nsnm = NULL;
+			}
 
-	uint8_t* cmp_buf = (uint8_t*)malloc(CMPCHUNK);
+			for (uint32_t jx = 0; jx < n_psps; jx++) {
+				if (psps[jx].nsnm != NULL) {
+					free(psps[jx].nsnm);
+					psps[jx].nsnm = NULL;
+				}
+			}
 
-	if (cmp_buf == NULL) {
-		if (g_verbose) {
-			printf("Unable to allocate memory for compression engine.\n");
+			return false;
 		}
-
-		(void)inflateEnd(&infstream);
-		return false;
 	}
 
-	// Decompress file one chunk at a time.
+	// Find the meta segment file (if any).
 
-	size_t have_bytes = 0;
-	void* my_buf = buf;
+	as_file_t* smp = NULL;
+	uint32_t n_smps = 0;
 
-	do {
+	for (uint32_t ix = 0; ix < n_files; ix++) {
+		as_file_t* sp = &files[ix];
 
-		// Read a chunk of the file into cmp_buf.
+		if (sp->type == TYPE_META && sp->nsid == nsid && sp->inst == inst) {
+			smp = sp;
+			smp->nsnm = strdup(nsnm);
+			n_smps++;
+		}
+	}
 
-		ssize_t bytes_read = read(fd, (void*)cmp_buf, CMPCHUNK);
+	if (n_smps > 1) {
+		if (g_verbose) {
+			printf("Too many meta segment files for instance %u"
+					", namespace \'%s\' (nsid %d).\n", inst, nsnm, nsid);
+		}
 
-		if (bytes_read < 0) {
-			if (g_verbose) {
-				printf("Error while reading compressed file.\n");
-			}
+		if (ptp != NULL && ptp->nsnm != NULL) {
+			free(ptp->nsnm);
+			ptp->nsnm = NULL;
+		}
 
-			(void)inflateEnd(&infstream);
-			free(cmp_buf);
-			cmp_buf = NULL;
-			return false;
+		for (uint32_t jx= 0; jx < n_psps; jx++) {
+			if (psps[jx].nsnm != NULL) {
+				free(psps[jx].nsnm);
+				psps[jx].nsnm = NULL;
+			}
 		}
 
-		// If read(2) returned no bytes, we're done.
+		// TODO: If (n_smps > 1) will leak smp->nsnm;
 
-		if (bytes_read == 0) {
-			break;
-		}
+		return false;
+	}
 
-		infstream.avail_in = (uInt)bytes_read;
-		infstream.next_in = cmp_buf;
+	as_file_t ssps[MAX_SEC_STAGES] = { 0 };
+	uint32_t n_ssps = 0;
 
-		do {
-			infstream.avail_out = CMPCHUNK;
-			my_buf += have_bytes;
-			infstream.next_out = my_buf;
+	// Found a meta segment file?
 
-			ret = inflate(&infstream, Z_SYNC_FLUSH);
+	if (n_smps == 1) {
 
-			switch (ret) {
-			case Z_ERRNO:
-			case Z_NEED_DICT:
-			case Z_DATA_ERROR:
-			case Z_MEM_ERROR:
-			case Z_STREAM_ERROR:
+		// Find the secondary stage segment files.
 
-				if (g_verbose) {
-					printf("Error while decompressing file");
-				}
+		for (uint32_t ix = 0; ix < n_files; ix++) {
+			as_file_t* sp = &files[ix];
 
-				switch (ret) {
+			if (sp->type == TYPE_SEC_STAGE && sp->nsid == nsid
+					&& sp->inst == inst) {
+				ssps[n_ssps] = *sp;
+				ssps[n_ssps].nsnm = strdup(nsnm);
+				n_ssps++;
+			}
+		}
 
-				case Z_ERRNO:
-					if (g_verbose) {
-						printf(": error reading compressed file");
-					}
+		if (n_ssps < 1) {
+			if (g_verbose) {
+				printf("No secondary stage segment files for instance %u"
+						", namespace \'%s\' (nsid %d).\n", inst, nsnm, nsid);
+			}
 
-					break;
+			if (ptp != NULL && ptp->nsnm != NULL) {
+				free(ptp->nsnm);
+				ptp->nsnm = NULL;
+			}
 
-				case Z_STREAM_ERROR:
-					if (g_verbose) {
-						printf(": invalid compression level");
-					}
+			for (uint32_t jx= 0; jx < n_psps; jx++) {
+				if (psps[jx].nsnm != NULL) {
+					free(psps[jx].nsnm);
+					psps[jx].nsnm = NULL;
+				}
+			}
+
+			if (smp != NULL && smp->nsnm != NULL) {
+				free(smp->nsnm);
+				smp->nsnm = NULL;
+			}
+
+			return false;
+		}
 
-					break;
+		// Sort the secondary stage segment files by key.
 
-				case Z_DATA_ERROR:
-					if (g_verbose) {
-						printf(": invalid or incomplete deflate data");
-					}
+		if (n_ssps > 1) {
+			qsort((void*)ssps, (size_t)n_ssps, sizeof(as_file_t),
+					qsort_compare_files);
+		}
 
-					break;
+		// Check that all secondary stage files are present.
 
-				case Z_MEM_ERROR:
-					if (g_verbose) {
-						printf(": out of memory");
-					}
+		for (uint32_t ix = 0; ix < n_ssps; ix++) {
+			bool found = false;
 
-					break;
+			for (uint32_t jx = 0; jx < n_ssps; jx++) {
+				as_file_t* jp = &ssps[jx];
 
-				case Z_VERSION_ERROR:
-					if (g_verbose) {
-						printf(": zlib version mismatch");
-					}
+				if (jp->stage == ix + (uint32_t)AS_XMEM_ARENA_KEY) {
+					found = true;
+				}
+			}
 
-					break;
+			if (!found) {
+				if (g_verbose) {
+					printf(
+							"Missing secondary stage segment file %03x for instance %u"
+									", namespace \'%s\' (nsid %d).\n",
+							ix + (uint32_t)AS_XMEM_ARENA_KEY, inst, nsnm, nsid);
+				}
 
-				default:
-					if (g_verbose) {
-						printf(": unknown error (%d)", ret);
+				if (ptp != NULL && ptp->nsnm != NULL) {
+					free(ptp->nsnm);
+					ptp->nsnm = NULL;
+				}
+
+				for (uint32_t jx= 0; jx < n_psps; jx++) {
+					if (psps[jx].nsnm != NULL) {
+						free(psps[jx].nsnm);
+						psps[jx].nsnm = NULL;
 					}
+				}
 
-					break;
+				if (smp != NULL && smp->nsnm != NULL) {
+					free(smp->nsnm);
+					smp->nsnm = NULL;
 				}
 
-				if (g_verbose) {
-					printf(" (%lu bytes into file).\n",
-							infstream.total_in + CMPHDR_LEN);
+				for (uint32_t jx = 0; jx < n_ssps; jx++) {
+					if (ssps[jx].nsnm != NULL) {
+						free(ssps[jx].nsnm);
+						ssps[jx].nsnm = NULL;
+					}
 				}
 
-				(void)inflateEnd(&infstream);
-				free(cmp_buf);
-				cmp_buf = NULL;
 				return false;
 			}
+		}
+	}
 
-			have_bytes = CMPCHUNK - infstream.avail_out;
-		} while (infstream.avail_out == 0);
-	} while (ret != Z_STREAM_END);
+	as_file_t data[MAX_DATA_STAGES] = { 0 };
+	uint32_t n_data = 0;
 
-	(void)inflateEnd(&infstream);
+	for (uint32_t ix = 0; ix < n_files; ix++) {
+		as_file_t* sp = &files[ix];
 
-	free(cmp_buf);
-	cmp_buf = NULL;
+		if (sp->type == TYPE_DAT_STAGE && sp->nsid == nsid
+				&& sp->inst == inst) {
+			data[n_data] = *sp;
+			data[n_data].nsnm = strdup(nsnm);
+			n_data++;
+		}
+	}
 
-	// Retrieve crc32, if requested.
+	// If verbose, display a list of matching segment files.
 
-	*crc = g_crc32 ? infstream.adler : g_crc32_init;
+	if (g_verbose) {
+		printf("\n");
+		display_files(pbp, ptp, psps, n_psps, smp, ssps, n_ssps,
+			data, n_data);
+		printf("\n");
+	}
 
-	// Set segment ownership
+	// Perform a final sanity check on this restore candidate.
 
-	struct shmid_ds shmid_ds = { .shm_perm.uid = uid, .shm_perm.gid = gid,
-			.shm_perm.mode = (short unsigned)(mode & MODE_MASK), };
+	if (!analyze_restore_sanity(pbp, ptp, psps, n_psps, smp, ssps, n_ssps,
+			data, n_data)) {
+		if (g_verbose) {
+			printf("Failed %s sanity check for instance %u"
+					", namespace \'%s\' (nsid %d).\n",
+					g_verify ? "verify" : "restore", files[base_ix].inst,
+					files[base_ix].nsnm, files[base_ix].nsid);
+		}
 
-	if (shmctl(shmid, IPC_SET, &shmid_ds) == -1) {
-		char errbuff[MAX_BUFFER];
-		char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
+		if (ptp != NULL && ptp->nsnm != NULL) {
+			free(ptp->nsnm);
+			ptp->nsnm = NULL;
+		}
 
-		if (g_verbose) {
-			printf("Unable to set uid, gid, or mode for shared memory segment"
-					": error was %d: %s\n", errno, errout);
+		for (uint32_t jx= 0; jx < n_psps; jx++) {
+			if (psps[jx].nsnm != NULL) {
+				free(psps[jx].nsnm);
+				psps[jx].nsnm = NULL;
+			}
+		}
+
+		if (smp != NULL && smp->nsnm != NULL) {
+			free(smp->nsnm);
+			smp->nsnm = NULL;
+		}
+
+		for (uint32_t jx = 0; jx < n_ssps; jx++) {
+			if (ssps[jx].nsnm != NULL) {
+				free(ssps[jx].nsnm);
+				ssps[jx].nsnm = NULL;
+			}
 		}
 
 		return false;
 	}
 
-	return (ret == Z_STREAM_END || ret == Z_OK) ? true : false;
-}
+	// Determine whether to analyze or actually restore.
 
-// Read a complete file (uncompressed). Compute crc32 if requested.
+	if (g_analyze) {
+		if (g_verbose && !g_verify) {
+			plan_restore_files(pbp, ptp, psps, n_psps, smp, ssps, n_ssps,
+					data, n_data);
+		}
 
-static bool
-pread_file(int fd, void* buf, size_t segsz, int shmid, mode_t mode,
-		uid_t uid, gid_t gid, uLong* crc)
-{
-	// newsize is running size, as pread(2) progresses.
+		if (g_verbose) {
+			// Print command to restore (or verify) these segment files.
 
-	ssize_t newsize = (ssize_t)segsz;
+			printf("%s %s", g_progname, g_verify ? "-V" : "-r");
+			printf(" -i %u", inst);
+			printf(" -n %s", nsnm);
+			printf(" -p %s", g_pathdir_list);
 
-	// result is result of individual pread(2) operation.
+			if (g_crc32) {
+				printf(" -c");
+			}
 
-	ssize_t bytes_read;
+			if (g_chunk_store != NULL) {
+				printf(" --chunk-store %s", g_chunk_store);
+			}
 
-	// Initially, offset is start of segment / segment file.
+			if (g_resume) {
+				printf(" --resume");
+			}
 
-	off_t offset = 0;
+			if (g_mirror_list != NULL) {
+				printf(" --mirror %s", g_mirror_list);
+			}
 
-	while ((bytes_read = pread(fd, buf, (size_t)newsize, offset)) != newsize) {
-		if (bytes_read <= 0) {
-			return false;
+			if (g_raw) {
+				printf(" --raw");
+			}
+
+			printf("\n");
+		}
+
+		if (ptp != NULL && ptp->nsnm != NULL) {
+			free(ptp->nsnm);
+			ptp->nsnm = NULL;
 		}
 
-		// Should we compute crc32? If so, apply to this chunk.
+		for (uint32_t jx= 0; jx < n_psps; jx++) {
+			if (psps[jx].nsnm != NULL) {
+				free(psps[jx].nsnm);
+				psps[jx].nsnm = NULL;
+			}
+		}
 
-		if (g_crc32) {
-			*crc = crc32(*crc, buf, (uInt)bytes_read);
+		if (smp != NULL && smp->nsnm != NULL) {
+		
+				free(smp->nsnm);
+			smp->nsnm = NULL;
 		}
 
-		// If only partial read, set up next chunk.
+		for (uint32_t jx = 0; jx < n_ssps; jx++) {
+			if (ssps[jx].nsnm != NULL) {
+				free(ssps[jx].nsnm);
+				ssps[jx].nsnm = NULL;
+			}
+		}
 
-		buf += bytes_read;
-		offset += bytes_read;
-		newsize -= bytes_read;
+		for (uint32_t jx = 0; jx < n_ssps; jx++) {
+			if (ssps[jx].nsnm != NULL) {
+				free(ssps[jx].nsnm);
+				ssps[jx].nsnm = NULL;
+			}
+		}
+		return true;
 	}
+	else {
+		// Actually perform restores (or verifies)...
 
-	if (bytes_read > 0) {
-		// Finish crc32 computation on last chunk, if incomplete.
+		bool success = g_verify ?
+				verify_candidate(pbp, ptp, psps, n_psps, smp, ssps, n_ssps,
+						data, n_data) :
+				restore_candidate(pbp, ptp, psps, n_psps, smp, ssps, n_ssps,
+						data, n_data);
 
-		if (g_crc32) {
-			*crc = crc32(*crc, buf, (uInt)bytes_read);
+		if (ptp != NULL && ptp->nsnm != NULL) {
+			free(ptp->nsnm);
+			ptp->nsnm = NULL;
 		}
 
-		// Set segment ownership.
-
-		struct shmid_ds shmid_ds = { .shm_perm.uid = uid, .shm_perm.gid = gid,
-				.shm_perm.mode = (short unsigned)(mode & MODE_MASK), };
+		for (uint32_t jx= 0; jx < n_psps; jx++) {
+			if (psps[jx].nsnm != NULL) {
+				free(psps[jx].nsnm);
+				psps[jx].nsnm = NULL;
+			}
+		}
 
-		if (shmctl(shmid, IPC_SET, &shmid_ds) == -1) {
-			char errbuff[MAX_BUFFER];
-			char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
+		if (smp != NULL && smp->nsnm != NULL) {
+			free(smp->nsnm);
+			smp->nsnm = NULL;
+		}
 
-			if (g_verbose) {
-				printf("Unable to set uid, gid, or mode for shared memory segment"
-						": error was %d: %s\n", errno, errout);
+		for (uint32_t jx = 0; jx < n_ssps; jx++) {
+			if (ssps[jx].nsnm != NULL) {
+				free(ssps[jx].nsnm);
+				ssps[jx].nsnm = NULL;
 			}
+		}
 
-			return false;
+		for (uint32_t jx = 0; jx < n_data; jx++) {
+			if (data[jx].nsnm != NULL) {
+				free(data[jx].nsnm);
+				data[jx].nsnm = NULL;
+			}
 		}
-	}
 
-	return true;
+		return success;
+	}
 }
 
-// Analyze restore operation.
+// Check the version and number of arena stages in a base segment file.
 
 static bool
-analyze_restore(void)
+analyze_restore_base_file(as_file_t* pbp, uint32_t n_psps)
 {
-	as_file_t* files = NULL;
-	int error;
+	// Check that the number of stages is valid.
+
+	char pathname[PATH_MAX + 1];
+
+	if (g_raw) {
+		strcpy(pathname, g_pathdir);
+	}
+	else if (g_s3) {
+		sprintf(pathname, "%s/%08x%s", g_pathdir, pbp->key, FILE_EXTENSION);
+	}
+	else {
+		sprintf(pathname, "%s/%08x%s", g_pathdirs[pbp->target], pbp->key,
+				pbp->pack ? PACK_EXTENSION : FILE_EXTENSION);
+	}
+
+	union {
+		uint32_t base_ver;
+		uint8_t bytes[sizeof(uint32_t)];
+	} u1;
+
+	union {
+		uint32_t n_arenas;
+		uint8_t bytes[sizeof(uint32_t)];
+	} u2;
 
-	// First, see if we can access the backup directory for reading.
-	// Do not create.
+	// An object store's base segment is read with ranged gets.
 
-	if (!check_dir(g_pathdir, false, false)) {
-		if (g_verbose) {
-			printf("Cannot read from directory \'%s\'", g_pathdir);
-			printf(": either it does not exist"
-					" or we don't have read permission.\n");
+	if (g_s3) {
+		if (!read_s3_base(pbp->key, BASEVER_OFF, u1.bytes, BASEVER_LEN)
+				|| !read_s3_base(pbp->key, N_ARENAS_PRI_OFF, u2.bytes,
+						N_ARENAS_LEN)) {
+			if (g_verbose) {
+				printf("Could not extract version number and number of arena"
+						" stages from base segment object \'%s\'.\n",
+						pathname);
+			}
+
+			return false;
 		}
+	}
+	else if (!read_base_file(pathname, (off_t)pbp->offset, u1.bytes,
+			u2.bytes)) {
 		return false;
 	}
 
-	// Get the list of Aerospike database segment files that passed the filter.
-
-	uint32_t n_files;
-
-	if (!list_files(&files, &n_files, &error) || n_files == 0) {
-		// Note: n_files and error are valid even if list_files() returned false.
+	// Check version number.
 
+	if (u1.base_ver < BASEVER_MIN || u1.base_ver > BASEVER_MAX) {
 		if (g_verbose) {
-			printf("\nDid not find any Aerospike database segment files");
-
-			if (g_inst != INV_INST) {
-				printf(", instance %u", g_inst);
-			}
-
-			if (g_nsnm != NULL) {
-				printf(", namespace \'%s\'", g_nsnm);
-			}
-
-			if (error != 0) {
-				char errbuff[MAX_BUFFER];
-				char *errout = strerror_r(errno, errbuff, MAX_BUFFER);
-
-				printf(": error was %d: %s", error, errout);
-			}
-
-			printf(".\n");
+			printf("Invalid version number in base segment file \'%s\'"
+					": expecting version in range %u to %u"
+					", found version %u.\n", pathname, BASEVER_MIN, BASEVER_MAX,
+					u1.base_ver);
 		}
 
-		if (n_files > 0) {
-			for (uint32_t j = 0; j < n_files; j++) {
-				as_file_t* fp = &files[j];
-
-				if (fp->type == TYPE_BASE && fp->nsnm != NULL) {
-					free(fp->nsnm);
-					fp->nsnm = NULL;
-				}
-			}
+		return false;
+	}
 
-			if (files != NULL) {
-				free(files);
-				files = NULL;
-			}
+	if (u2.n_arenas != n_psps) {
+		if (g_verbose) {
+			printf("Incorrect number of arena stages found"
+					": expecting %u, found %u.\n", u2.n_arenas, n_psps);
 		}
 
 		return false;
 	}
 
-	// Look for files that can be restored.
-	// Must have one base segment file, one treex segment file,
-	// and at least one primary stage segment file.
-	// May have one meta file and if so, at least one secondary stage segment file.
+	return true;
+}
 
-	bool candidates = false;
+// Read the version number and number of arena stages from a base segment file.
+// In a pack, the base segment is at an offset.
 
-	for (uint32_t ix = 0; ix < n_files; ix++) {
-		as_file_t* file = &files[ix];
+static bool
+read_base_file(const char* pathname, off_t base, uint8_t* base_ver,
+		uint8_t* n_arenas)
+{
+	// Extract arena stage count name from file.
 
-		if (file->type == TYPE_BASE) {
-			candidates = true;
+	int rc = open(pathname, O_RDONLY);
 
-			if (!analyze_restore_candidate(files, n_files, ix)) {
+	if (rc < 0) {
+		if (g_verbose) {
+			printf("Could not extract number of arena stages from base segment"
+					" file \'%s\'.\n", pathname);
+		}
 
-				for (uint32_t j = 0; j < n_files; j++) {
-					as_file_t* fp = &files[j];
+		return false;
+	}
 
-					if (fp->type == TYPE_BASE && fp->nsnm != NULL) {
-						free(fp->nsnm);
-						fp->nsnm = NULL;
-					}
-				}
+	int fd = rc;
 
-				if (files != NULL) {
-					free(files);
-					files = NULL;
-				}
+	// Read the version number from base segment file.
 
-				return false;
-			}
-		}
-	}
+	if (lseek(fd, base + BASEVER_OFF, SEEK_SET) != base + BASEVER_OFF
+			|| read(fd, (void*)base_ver, BASEVER_LEN) != BASEVER_LEN) {
+		close(fd);
 
-	if (!candidates) {
 		if (g_verbose) {
-			printf("\nDid not find any Aerospike database segment files");
-			if (g_inst != INV_INST) {
-				printf(", instance %u", g_inst);
-			}
-
-			if (g_nsnm != NULL) {
-				printf(", namespace \'%s\'", g_nsnm);
-			}
-
-			printf(".\n");
+			printf("Could not extract version number from base segment"
+					" file \'%s\'.\n", pathname);
 		}
+
+		return false;
 	}
 
-	// Free table created by list_files().
+	// Read the number of arena stages from the base segment file.
 
-	for (uint32_t jx = 0; jx < n_files; jx++) {
-		as_file_t* fp = &files[jx];
+	if (lseek(fd, base + N_ARENAS_PRI_OFF, SEEK_SET) != base + N_ARENAS_PRI_OFF
+			|| read(fd, (void*)n_arenas, N_ARENAS_LEN) != N_ARENAS_LEN) {
+		close(fd);
 
-		if (fp->type == TYPE_BASE && fp->nsnm != NULL) {
-			free(fp->nsnm);
-			fp->nsnm = NULL;
+		if (g_verbose) {
+			printf("Could not extract number of arena stages from base segment"
+					" file \'%s\'.\n", pathname);
 		}
-	}
 
-	if (files != NULL) {
-		free(files);
-		files = NULL;
+		return false;
 	}
 
+	close(fd);
+
 	return true;
 }
 
-// Analyze whether to restore a candidate set of segment files.
+// Display a list of segment files to be restored.
 
-static bool
-analyze_restore_candidate(as_file_t* files, uint32_t n_files, uint32_t base_ix)
+static void
+display_files(as_file_t* pbp, as_file_t* ptp, as_file_t psps[], uint32_t n_psps,
+		as_file_t* smp, as_file_t ssps[], uint32_t n_ssps, as_file_t data[], uint32_t n_data)
 {
-	// Extract the base segment file.
+	// The table to be displayed.
 
-	as_file_t* pbp = &files[base_ix];
+	uint32_t n_rows = 1 + 2 + n_psps + (n_ssps > 0 ? (1 + n_ssps) : 0) + n_data;
+	char* table[n_rows][11];
 
-	assert(pbp->type == TYPE_BASE);
-	assert(pbp->nsnm != NULL);
+	// Create the table header.
 
-	uint32_t inst = pbp->inst;
-	uint32_t nsid = pbp->nsid;
-	char* nsnm = pbp->nsnm;
+	table[0][0] = strdup("key");
+	table[0][1] = strdup("user");
+	table[0][2] = strdup("group");
+	table[0][3] = strdup("mode");
+	table[0][4] = strdup("filsz");
+	table[0][5] = strdup("segsz");
+	table[0][6] = strdup("inst");
+	table[0][7] = strdup("nsid");
+	table[0][8] = strdup("name");
+	table[0][9] = strdup("type");
+	table[0][10] = strdup("stage");
 
-	// Find the corresponding treex segment file.
+	// Create the table body.
 
-	as_file_t* ptp = NULL;
-	uint32_t n_ptps = 0;
+	char buffer[MAX_BUFFER];
 
-	for (uint32_t ix = 0; ix < n_files; ix++) {
-		if (ix == base_ix) {
-			continue;
+	for (uint32_t i = 1; i < n_rows; i++) {
+		as_file_t* file;
+
+		if (i == 1) {
+			file = pbp;
+		}
+		else if (i == 2) {
+			file = ptp;
+		}
+		else if (i == 3 && smp != NULL) {
+			file = smp;
+		}
+		else if (i <= 3 + n_psps - (uint32_t)(smp == NULL)) {
+			file = &psps[i - (4 - (uint32_t)(smp == NULL))];
+		}
+		else if (i <= 3 + n_psps + n_ssps - (uint32_t)(smp == NULL)) {
+			file = &ssps[i - (4 + n_psps - (uint32_t)(smp == NULL))];
+		}
+		else {
+			file = &data[i - (4 + n_psps + n_ssps - (uint32_t)(smp == NULL))];
 		}
 
-		as_file_t* sp = &files[ix];
+		sprintf(buffer, "0x%08x", file->key);
+		table[i][0] = strdup(buffer);
 
-		if (sp->type == TYPE_TREEX && sp->inst == inst && sp->nsid == nsid) {
-			ptp = sp;
-			ptp->nsnm = strdup(nsnm);
-			n_ptps++;
+		struct passwd* pw;
+
+		if ((pw = getpwuid(file->uid)) == NULL) {
+			sprintf(buffer, "%d", file->uid);
 		}
-	}
+		else {
+			sprintf(buffer, "%s", pw->pw_name);
+		}
+		table[i][1] = strdup(buffer);
 
-	if (n_ptps != 1) {
-		if (g_verbose) {
-			printf("Missing treex segment file.\n");
+		struct group* gr;
+
+		if ((gr = getgrgid(file->gid)) == NULL) {
+			sprintf(buffer, "%d", file->gid);
+		}
+		else {
+			sprintf(buffer, "%s", gr->gr_name);
 		}
 
-		// TODO: If (n_ptps > 1) will leak ptp->nsnm;
+		table[i][2] = strdup(buffer);
 
-		return false;
-	}
+		sprintf(buffer, "0%o", file->mode);
+		table[i][3] = strdup(buffer);
 
-	// Find the primary stage segment files.
+		sprintf(buffer, "%lu", file->filsz);
+		table[i][4] = strdup(buffer);
 
-	as_file_t psps[MAX_PRI_STAGES] = { 0 };
-	uint32_t n_psps = 0;
+		sprintf(buffer, "%lu", file->segsz);
+		table[i][5] = strdup(buffer);
 
-	for (uint32_t ix = 0; ix < n_files; ix++) {
-		as_file_t* sp = &files[ix];
+		sprintf(buffer, "%u", file->inst);
+		table[i][6] = strdup(buffer);
 
-		if (sp->type == TYPE_PRI_STAGE && sp->nsid == nsid
-				&& sp->inst == inst) {
-			psps[n_psps] = *sp;
-			psps[n_psps].nsnm = strdup(nsnm);
-			n_psps++;
-		}
-	}
+		sprintf(buffer, "%u", file->nsid);
+		table[i][7] = strdup(buffer);
 
-	if (n_psps < 1) {
-		if (g_verbose) {
-			printf("Missing primary stage segment file(s) for instance %u"
-					", namespace \'%s\' (nsid %d).\n", inst, nsnm, nsid);
-		}
+		sprintf(buffer, "%s", file->nsnm == NULL ? "-" : file->nsnm);
+		table[i][8] = strdup(buffer);
 
-		if (ptp != NULL && ptp->nsnm != NULL) {
-			free(ptp->nsnm);
-			ptp->nsnm = NULL;
+		switch (file->type) {
+		case TYPE_BASE:
+			sprintf(buffer, "pi-base");
+			break;
+		case TYPE_META:
+			sprintf(buffer, "si-meta");
+			break;
+		case TYPE_TREEX:
+			sprintf(buffer, "pi-treex");
+			break;
+		case TYPE_PRI_STAGE:
+			sprintf(buffer, "pi-stage");
+			break;
+		case TYPE_SEC_STAGE:
+			sprintf(buffer, "si-stage");
+			break;
+		case TYPE_DAT_STAGE:
+			sprintf(buffer, "data");
+			break;
+		default:
+			assert(false);
 		}
 
-		return false;
-	}
+		table[i][9] = strdup(buffer);
 
-	// Sort the primary stage segment files by key.
+		if (file->type == TYPE_PRI_STAGE ||
+			file->type == TYPE_SEC_STAGE ||
+			file->type == TYPE_DAT_STAGE) {
+			sprintf(buffer, "0x%03x", file->stage);
+		}
+		else {
+			sprintf(buffer, "-");
+		}
 
-	if (n_psps > 1) {
-		qsort((void*)psps, (size_t)n_psps, sizeof(as_file_t),
-				qsort_compare_files);
+		table[i][10] = strdup(buffer);
 	}
 
-	// Check that all primary stage files are present.
+	// Draw the table. All allocated entries will be freed.
 
-	for (uint32_t ix = 0; ix < n_psps; ix++) {
-		bool found = false;
+	draw_table(&table[0][0], n_rows, 11);
+}
 
-		for (uint32_t jx = 0; jx < n_psps; jx++) {
-			as_file_t* jp = &psps[jx];
+static bool
+analyze_restore_sanity(as_file_t* pbp, as_file_t* ptp, as_file_t psps[],
+		uint32_t n_psps, as_file_t* smp, as_file_t ssps[], uint32_t n_ssps,
+		as_file_t data[], uint32_t n_data)
+{
+	(void)ptp;
+	(void)psps;
+	(void)smp;
+	(void)ssps;
+	(void)n_ssps;
+	(void)data;
+	(void)n_data;
 
-			if (jp->stage == ix + (uint32_t)AS_XMEM_ARENA_KEY) {
-				found = true;
-				break;
-			}
-		}
+	// Check the base segment's version and number of arena stages - as
+	// recorded in the manifest, if planned from one, so that the base segment
+	// file needn't be opened.
 
-		if (!found) {
+	if (pbp->planned) {
+		if (pbp->base_ver < BASEVER_MIN || pbp->base_ver > BASEVER_MAX) {
 			if (g_verbose) {
-				printf("Missing primary stage segment file %03x for instance %u"
-						", namespace \'%s\' (nsid %d).\n",
-						ix + (uint32_t)AS_XMEM_ARENA_KEY, inst, nsnm, nsid);
+				printf("Invalid version number in manifest for base segment"
+						" %08x: expecting version in range %u to %u"
+						", found version %u.\n", pbp->key, BASEVER_MIN,
+						BASEVER_MAX, pbp->base_ver);
 			}
 
-			if (ptp != NULL && ptp->nsnm != NULL) {
-				free(ptp->nsnm);
-				ptp->nsnm = NULL;
-			}
+			return false;
+		}
 
-			for (uint32_t jx = 0; jx < n_psps; jx++) {
-				if (psps[jx].nsnm != NULL) {
-					free(psps[jx].nsnm);
-					psps[jx].nsnm = NULL;
-				}
+		if (pbp->n_arenas != n_psps) {
+			if (g_verbose) {
+				printf("Incorrect number of arena stages found"
+						": expecting %u, found %u.\n", pbp->n_arenas, n_psps);
 			}
 
 			return false;
 		}
 	}
+	else if (!analyze_restore_base_file(pbp, n_psps)) {
+		return false;
+	}
 
-	// Find the meta segment file (if any).
+	// Verification doesn't touch shared memory, so there's nothing to clash.
 
-	as_file_t* smp = NULL;
-	uint32_t n_smps = 0;
+	if (g_verify) {
+		return true;
+	}
 
-	for (uint32_t ix = 0; ix < n_files; ix++) {
-		as_file_t* sp = &files[ix];
+	// A resumed restore carries on with the segments it left behind.
 
-		if (sp->type == TYPE_META && sp->nsid == nsid && sp->inst == inst) {
-			smp = sp;
-			smp->nsnm = strdup(nsnm);
-			n_smps++;
-		}
+	if (g_resume && have_journal(pbp->key)) {
+		return true;
 	}
 
-	if (n_smps > 1) {
-		if (g_verbose) {
-			printf("Too many meta segment files for instance %u"
-					", namespace \'%s\' (nsid %d).\n", inst, nsnm, nsid);
-		}
+	// Check that there are no segments with the same namespace and instance.
+	// Get info on all shared memory segments.
 
-		if (ptp != NULL && ptp->nsnm != NULL) {
-			free(ptp->nsnm);
-			ptp->nsnm = NULL;
-		}
+	as_shm_t* shms;
+	uint32_t n_shms;
+	int error;
 
-		for (uint32_t jx= 0; jx < n_psps; jx++) {
-			if (psps[jx].nsnm != NULL) {
-				free(psps[jx].nsnm);
-				psps[jx].nsnm = NULL;
-			}
+	if (!list_shm(&shms, &n_shms, &error)) {
+		if (g_verbose) {
+			printf("Could not enumerate shared memory segments.\n");
 		}
 
-		// TODO: If (n_smps > 1) will leak smp->nsnm;
-
 		return false;
 	}
 
-	as_file_t ssps[MAX_SEC_STAGES] = { 0 };
-	uint32_t n_ssps = 0;
-
-	// Found a meta segment file?
-
-	if (n_smps == 1) {
-
-		// Find the secondary stage segment files.
+	// Try each segment. Some may be Aerospike database segments.
 
-		for (uint32_t ix = 0; ix < n_files; ix++) {
-			as_file_t* sp = &files[ix];
+	bool found = false;
 
-			if (sp->type == TYPE_SEC_STAGE && sp->nsid == nsid
-					&& sp->inst == inst) {
-				ssps[n_ssps] = *sp;
-				ssps[n_ssps].nsnm = strdup(nsnm);
-				n_ssps++;
-			}
-		}
+	for (uint32_t i = 0; i < n_shms; i++) {
+		// Extract key from the catalog entry.
 
-		if (n_ssps < 1) {
-			if (g_verbose) {
-				printf("No secondary stage segment files for instance %u"
-						", namespace \'%s\' (nsid %d).\n", inst, nsnm, nsid);
-			}
+		key_t key = shms[i].key;
 
-			if (ptp != NULL && ptp->nsnm != NULL) {
-				free(ptp->nsnm);
-				ptp->nsnm = NULL;
-			}
+		// Check if this is an Aerospike primary segment key.
 
-			for (uint32_t jx= 0; jx < n_psps; jx++) {
-				if (psps[jx].nsnm != NULL) {
-					free(psps[jx].nsnm);
-					psps[jx].nsnm = NULL;
-				}
-			}
+		if ((key & AS_XMEM_KEY_TYPE_MASK) == AS_XMEM_PRI_KEY) {
 
-			if (smp != NULL && smp->nsnm != NULL) {
-				free(smp->nsnm);
-				smp->nsnm = NULL;
-			}
+			// Found a valid Aerospike database primary segment.
+			// Extract the base from the key.
 
-			return false;
-		}
+			key = key & ~AS_XMEM_PRI_KEY;
 
-		// Sort the secondary stage segment files by key.
+			// Determine instance from key base.
 
-		if (n_ssps > 1) {
-			qsort((void*)ssps, (size_t)n_ssps, sizeof(as_file_t),
-					qsort_compare_files);
-		}
+			uint32_t inst = (uint32_t) key >> AS_XMEM_INSTANCE_KEY_SHIFT;
 
-		// Check that all secondary stage files are present.
+			// Determine namespace ID from key base.
 
-		for (uint32_t ix = 0; ix < n_ssps; ix++) {
-			bool found = false;
+			key = key & ~(0xf << AS_XMEM_INSTANCE_KEY_SHIFT);
 
-			for (uint32_t jx = 0; jx < n_ssps; jx++) {
-				as_file_t* jp = &ssps[jx];
+			uint32_t nsid = (uint32_t) (key & (0xff << AS_XMEM_NS_KEY_SHIFT))
+					>> AS_XMEM_NS_KEY_SHIFT;
 
-				if (jp->stage == ix + (uint32_t)AS_XMEM_ARENA_KEY) {
-					found = true;
-				}
-			}
+			// Check whether instance and namespace match.
 
-			if (!found) {
+			if (nsid == pbp->nsid && inst == pbp->inst) {
 				if (g_verbose) {
-					printf(
-							"Missing secondary stage segment file %03x for instance %u"
-									", namespace \'%s\' (nsid %d).\n",
-							ix + (uint32_t)AS_XMEM_ARENA_KEY, inst, nsnm, nsid);
-				}
-
-				if (ptp != NULL && ptp->nsnm != NULL) {
-					free(ptp->nsnm);
-					ptp->nsnm = NULL;
-				}
-
-				for (uint32_t jx= 0; jx < n_psps; jx++) {
-					if (psps[jx].nsnm != NULL) {
-						free(psps[jx].nsnm);
-						psps[jx].nsnm = NULL;
-					}
-				}
-
-				if (smp != NULL && smp->nsnm != NULL) {
-					free(smp->nsnm);
-					smp->nsnm = NULL;
-				}
-
-				for (uint32_t jx = 0; jx < n_ssps; jx++) {
-					if (ssps[jx].nsnm != NULL) {
-						free(ssps[jx].nsnm);
-						ssps[jx].nsnm = NULL;
-					}
+					printf("Found existing Aerospike primary index segment %08x with"
+							" instance %u, namespace \'%s\' (nsid %u)"
+							": cannot restore associated file.\n",
+							shms[i].key, inst, pbp->nsnm, nsid);
 				}
 
-				return false;
-			}
-		}
-	}
-
-	as_file_t data[MAX_DATA_STAGES] = { 0 };
-	uint32_t n_data = 0;
-
-	for (uint32_t ix = 0; ix < n_files; ix++) {
-		as_file_t* sp = &files[ix];
-
-		if (sp->type == TYPE_DAT_STAGE && sp->nsid == nsid
-				&& sp->inst == inst) {
-			data[n_data] = *sp;
-			data[n_data].nsnm = strdup(nsnm);
-			n_data++;
-		}
-	}
-
-	// If verbose, display a list of matching segment files.
-
-	if (g_verbose) {
-		printf("\n");
-		display_files(pbp, ptp, psps, n_psps, smp, ssps, n_ssps,
-			data, n_data);
-		printf("\n");
-	}
-
-	// Perform a final sanity check on this restore candidate.
-
-	if (!analyze_restore_sanity(pbp, ptp, psps, n_psps, smp, ssps, n_ssps,
-			data, n_data)) {
-		if (g_verbose) {
-			printf("Failed restore sanity check for instance %u"
-					", namespace \'%s\' (nsid %d).\n", files[base_ix].inst,
-					files[base_ix].nsnm, files[base_ix].nsid);
-		}
-
-		if (ptp != NULL && ptp->nsnm != NULL) {
-			free(ptp->nsnm);
-			ptp->nsnm = NULL;
-		}
-
-		for (uint32_t jx= 0; jx < n_psps; jx++) {
-			if (psps[jx].nsnm != NULL) {
-				free(psps[jx].nsnm);
-				psps[jx].nsnm = NULL;
+				found = true;
 			}
 		}
 
-		if (smp != NULL && smp->nsnm != NULL) {
-			free(smp->nsnm);
-			smp->nsnm = NULL;
-		}
+		if ((key & AS_XMEM_KEY_TYPE_MASK) == AS_XMEM_SEC_KEY) {
+			// Found a valid Aerospike database secondary segment.
+			// Extract the base from the key.
 
-		for (uint32_t jx = 0; jx < n_ssps; jx++) {
-			if (ssps[jx].nsnm != NULL) {
-				free(ssps[jx].nsnm);
-				ssps[jx].nsnm = NULL;
-			}
-		}
+			key = key & ~AS_XMEM_SEC_KEY;
 
-		return false;
-	}
+			// Determine instance from key base.
 
-	// Determine whether to analyze or actually restore.
+			uint32_t inst = (uint32_t) key >> AS_XMEM_INSTANCE_KEY_SHIFT;
 
-	if (g_analyze) {
-		if (g_verbose) {
-			// Print command to restore these segment files.
+			// Determine namespace ID from key base.
 
-			printf("%s -r", g_progname);
-			printf(" -i %u", inst);
-			printf(" -n %s", nsnm);
-			printf(" -p %s", g_pathdir);
+			key = key & ~(0xf << AS_XMEM_INSTANCE_KEY_SHIFT);
 
-			if (g_crc32) {
-				printf(" -c");
-			}
+			uint32_t nsid = (uint32_t) (key & (0xff << AS_XMEM_NS_KEY_SHIFT))
+					>> AS_XMEM_NS_KEY_SHIFT;
 
-			printf("\n");
-		}
+			// Check whether instance and namespace match.
 
-		if (ptp != NULL && ptp->nsnm != NULL) {
-			free(ptp->nsnm);
-			ptp->nsnm = NULL;
-		}
+			if (nsid == pbp->nsid && inst == pbp->inst) {
+				if (g_verbose) {
+					printf("Found existing Aerospike secondary index segment %08x with"
+							" instance %u, namespace \'%s\' (nsid %u)"
+							": cannot restore associated file.\n",
+							shms[i].key, inst, pbp->nsnm, nsid);
+				}
 
-		for (uint32_t jx= 0; jx < n_psps; jx++) {
-			if (psps[jx].nsnm != NULL) {
-				free(psps[jx].nsnm);
-				psps[jx].nsnm = NULL;
+				found = true;
 			}
 		}
 
-		if (smp != NULL && smp->nsnm != NULL) {
-		
-				free(smp->nsnm);
-			smp->nsnm = NULL;
-		}
+		if ((key & AS_XMEM_KEY_TYPE_MASK) == AS_XMEM_DAT_KEY) {
+			// Found a valid Aerospike database data segment.
+			// Extract the base from the key.
 
-		for (uint32_t jx = 0; jx < n_ssps; jx++) {
-			if (ssps[jx].nsnm != NULL) {
-				free(ssps[jx].nsnm);
-				ssps[jx].nsnm = NULL;
-			}
-		}
+			key = key & ~AS_XMEM_DAT_KEY;
 
-		for (uint32_t jx = 0; jx < n_ssps; jx++) {
-			if (ssps[jx].nsnm != NULL) {
-				free(ssps[jx].nsnm);
-				ssps[jx].nsnm = NULL;
-			}
-		}
-		return true;
-	}
-	else {
-		// Actually perform restores...
+			// Determine instance from key base.
 
-		bool success = restore_candidate(pbp, ptp, psps, n_psps, smp, ssps,
-				n_ssps, data, n_data);
+			uint32_t inst = (uint32_t) key >> AS_XMEM_INSTANCE_KEY_SHIFT;
 
-		if (ptp != NULL && ptp->nsnm != NULL) {
-			free(ptp->nsnm);
-			ptp->nsnm = NULL;
-		}
+			// Determine namespace ID from key base.
 
-		for (uint32_t jx= 0; jx < n_psps; jx++) {
-			if (psps[jx].nsnm != NULL) {
-				free(psps[jx].nsnm);
-				psps[jx].nsnm = NULL;
-			}
-		}
+			key = key & ~(0xf << AS_XMEM_INSTANCE_KEY_SHIFT);
 
-		if (smp != NULL && smp->nsnm != NULL) {
-			free(smp->nsnm);
-			smp->nsnm = NULL;
-		}
+			uint32_t nsid = (uint32_t) (key & (0xff << AS_XMEM_NS_KEY_SHIFT))
+					>> AS_XMEM_NS_KEY_SHIFT;
 
-		for (uint32_t jx = 0; jx < n_ssps; jx++) {
-			if (ssps[jx].nsnm != NULL) {
-				free(ssps[jx].nsnm);
-				ssps[jx].nsnm = NULL;
-			}
-		}
+			// Check whether instance and namespace match.
 
-		for (uint32_t jx = 0; jx < n_data; jx++) {
-			if (data[jx].nsnm != NULL) {
-				free(data[jx].nsnm);
-				data[jx].nsnm = NULL;
+			if (nsid == pbp->nsid && inst == pbp->inst) {
+				if (g_verbose) {
+					printf("Found existing Aerospike data segment %08x with"
+							" instance %u, namespace \'%s\' (nsid %u)"
+							": cannot restore associated file.\n",
+							shms[i].key, inst, pbp->nsnm, nsid);
+				}
+
+				found = true;
 			}
 		}
-
-		return success;
 	}
+
+	free(shms);
+
+	return !found;
 }
 
-// Display a list of segment files to be restored.
+// Actually restore candidate set of segment files.
 
-static void
-display_files(as_file_t* pbp, as_file_t* ptp, as_file_t psps[], uint32_t n_psps,
-		as_file_t* smp, as_file_t ssps[], uint32_t n_ssps, as_file_t data[], uint32_t n_data)
+static bool
+restore_candidate(as_file_t* pbp, as_file_t* ptp, as_file_t psps[],
+		uint32_t n_psps, as_file_t* smp, as_file_t ssps[], uint32_t n_ssps,
+		as_file_t data[], uint32_t n_data)
 {
-	// The table to be displayed.
+	// Create list of file I/O requests.
 
-	uint32_t n_rows = 1 + 2 + n_psps + (n_ssps > 0 ? (1 + n_ssps) : 0) + n_data;
-	char* table[n_rows][11];
+	uint32_t n_files = 1 + 1 + n_psps;
 
-	// Create the table header.
+	if (n_ssps > 0) {
+		n_files += 1 + n_ssps;
+	}
 
-	table[0][0] = strdup("key");
-	table[0][1] = strdup("user");
-	table[0][2] = strdup("group");
-	table[0][3] = strdup("mode");
-	table[0][4] = strdup("filsz");
-	table[0][5] = strdup("segsz");
-	table[0][6] = strdup("inst");
-	table[0][7] = strdup("nsid");
-	table[0][8] = strdup("name");
-	table[0][9] = strdup("type");
-	table[0][10] = strdup("stage");
+	if (n_data > 0) {
+		n_files += n_data;
+	}
 
-	// Create the table body.
+	// A namespace backed up to a pack is restored from its extents.
 
-	char buffer[MAX_BUFFER];
+	if (pbp->pack && !open_pack(pbp->key)) {
+		return false;
+	}
 
-	for (uint32_t i = 1; i < n_rows; i++) {
-		as_file_t* file;
+	// Journal the restore, so that it can be resumed if interrupted - only
+	// when asked to resume, so that a restore from read-only media works and
+	// a failed restore leaves nothing behind. A raw container (or object
+	// store) has nowhere to keep a journal.
 
-		if (i == 1) {
-			file = pbp;
-		}
-		else if (i == 2) {
-			file = ptp;
-		}
-		else if (i == 3 && smp != NULL) {
-			file = smp;
-		}
-		else if (i <= 3 + n_psps - (uint32_t)(smp == NULL)) {
-			file = &psps[i - (4 - (uint32_t)(smp == NULL))];
-		}
-		else if (i <= 3 + n_psps + n_ssps - (uint32_t)(smp == NULL)) {
-			file = &ssps[i - (3 + n_psps + n_ssps - (uint32_t)(smp == NULL))];
-		}
-		else {
-			file = &data[i - (4 + n_psps + n_ssps - (uint32_t)(smp == NULL))];
-		}
+	if (g_resume && !g_raw && !g_s3 && !open_journal(pbp->key, false)) {
+		close_pack();
+		return false;
+	}
 
-		sprintf(buffer, "0x%08x", file->key);
-		table[i][0] = strdup(buffer);
+	// Find out which mirrors hold the same backup, to read from as well.
 
-		struct passwd* pw;
+	check_mirrors(pbp->key);
 
-		if ((pw = getpwuid(file->uid)) == NULL) {
-			sprintf(buffer, "%d", file->uid);
-		}
-		else {
-			sprintf(buffer, "%s", pw->pw_name);
-		}
-		table[i][1] = strdup(buffer);
+	as_io_t ios[n_files];
+	uint32_t n_ios = 0;
 
-		struct group* gr;
+	if (!restore_candidate_segment(pbp, &ios[n_ios], ios, n_ios, pbp, ptp, psps, n_psps,
+			smp, ssps, n_ssps, data, n_data)) {
+		close_journal(pbp->key, false);
+		return false;
+	}
 
-		if ((gr = getgrgid(file->gid)) == NULL) {
-			sprintf(buffer, "%d", file->gid);
-		}
-		else {
-			sprintf(buffer, "%s", gr->gr_name);
-		}
+	n_ios++;
 
-		table[i][2] = strdup(buffer);
+	if (!restore_candidate_segment(ptp, &ios[n_ios], ios, n_ios, pbp, ptp, psps, n_psps,
+			smp, ssps, n_ssps, data, n_data)) {
+		close_journal(pbp->key, false);
+		return false;
+	}
 
-		sprintf(buffer, "0%o", file->mode);
-		table[i][3] = strdup(buffer);
+	n_ios++;
 
-		sprintf(buffer, "%lu", file->filsz);
-		table[i][4] = strdup(buffer);
+	for (uint32_t i = 0; i < n_psps; i++) {
+		if (!restore_candidate_segment(&psps[i], &ios[n_ios], ios, n_ios, pbp, ptp, psps,
+				n_psps, smp, ssps, n_ssps, data, n_data)) {
+			close_journal(pbp->key, false);
+			return false;
+		}
 
-		sprintf(buffer, "%lu", file->segsz);
-		table[i][5] = strdup(buffer);
+		n_ios++;
+	}
 
-		sprintf(buffer, "%u", file->inst);
-		table[i][6] = strdup(buffer);
+	if (n_ssps > 0) {
+		if (!restore_candidate_segment(smp, &ios[n_ios], ios, n_ios, pbp, ptp, psps,
+				n_psps, smp, ssps, n_ssps, data, n_data)) {
+			close_journal(pbp->key, false);
+			return false;
+		}
 
-		sprintf(buffer, "%u", file->nsid);
-		table[i][7] = strdup(buffer);
+		n_ios++;
 
-		sprintf(buffer, "%s", file->nsnm == NULL ? "-" : file->nsnm);
-		table[i][8] = strdup(buffer);
+		for (uint32_t i = 0; i < n_ssps; i++) {
+			if (!restore_candidate_segment(&ssps[i], &ios[n_ios], ios, n_ios, pbp, ptp,
+					psps, n_psps, smp, ssps, n_ssps, data, n_data)) {
+				close_journal(pbp->key, false);
+				return false;
+			}
 
-		switch (file->type) {
-		case TYPE_BASE:
-			sprintf(buffer, "pi-base");
-			break;
-		case TYPE_META:
-			sprintf(buffer, "si-meta");
-			break;
-		case TYPE_TREEX:
-			sprintf(buffer, "pi-treex");
-			break;
-		case TYPE_PRI_STAGE:
-			sprintf(buffer, "pi-stage");
-			break;
-		case TYPE_SEC_STAGE:
-			sprintf(buffer, "si-stage");
-			break;
-		case TYPE_DAT_STAGE:
-			sprintf(buffer, "data");
-			break;
-		default:
-			assert(false);
+			n_ios++;
+		}
+	}
+
+	if (n_data > 0) {
+		for (uint32_t i = 0; i < n_data; i++) {
+			if (!restore_candidate_segment(&data[i], &ios[n_ios], ios, n_ios, pbp, ptp,
+					psps, n_psps, smp, ssps, n_ssps, data, n_data)) {
+				close_journal(pbp->key, false);
+				return false;
+			}
+
+			n_ios++;
 		}
+	}
+
+	assert(n_files == n_ios);
 
-		table[i][9] = strdup(buffer);
+	// Hand the file I/O requests in for processing.
 
-		if (file->type == TYPE_PRI_STAGE ||
-			file->type == TYPE_SEC_STAGE ||
-			file->type == TYPE_DAT_STAGE) {
-			sprintf(buffer, "0x%03x", file->stage);
+	memset(g_copy_queued, 0, sizeof(g_copy_queued));
+	memset(g_copy_read, 0, sizeof(g_copy_read));
+
+	bool success = start_io(ios, n_ios);
+
+	// I/O requests were processed. Now post-process. A segment downloaded
+	// from an object store has a crc32 per part.
+
+	for (uint32_t i = 0; g_s3 && i < n_ios; i++) {
+		combine_part_crcs(&ios[i]);
+	}
+
+	if (success && g_crc32) {
+		if (!restore_candidate_check_crc32(ios, n_ios)) {
+			if (g_verbose) {
+				printf("crc32 mismatch.\n\n");
+			}
+
+			success = false;
 		}
-		else {
-			sprintf(buffer, "-");
+	}
+
+	// Notify the user of success or failure.
+
+	if (g_verbose) {
+		as_file_t* fp = pbp;
+
+		if (g_verbose) {
+			printf("%s",
+					success ?
+							"\nSuccessfully restored" : "\nFailed to restore");
+			printf(" %u Aerospike database segment files",n_files);
+			printf(" for instance %u, namespace \'%s\' (nsid %u).\n", fp->inst,
+					fp->nsnm == NULL ? "<null>" : fp->nsnm, fp->nsid);
 		}
 
-		table[i][10] = strdup(buffer);
+		if (success && g_n_mirrors != 0) {
+			for (uint32_t c = 0; c <= g_n_mirrors; c++) {
+				printf("Read %lu bytes from \'%s\'.\n", g_copy_read[c],
+						c == 0 ? g_pathdir : g_mirrors[c - 1]);
+			}
+		}
 	}
 
-	// Draw the table. All allocated entries will be freed.
+	// Clean up all intermediate operations.
+	// On failure, will destroy all created segments.
 
-	draw_table(&table[0][0], n_rows, 11);
+	restore_candidate_cleanup(ios, n_ios, !success);
+
+	close_journal(pbp->key, success);
+	free_manifest(&g_mirror_manifest);
+
+	return success;
 }
 
 static bool
-analyze_restore_sanity(as_file_t* pbp, as_file_t* ptp, as_file_t psps[],
-		uint32_t n_psps, as_file_t* smp, as_file_t ssps[], uint32_t n_ssps,
+restore_candidate_segment(as_file_t *file, as_io_t *io, as_io_t ios[],
+		uint32_t n_ios, as_file_t *pbp, as_file_t *ptp, as_file_t psps[],
+		uint32_t n_psps, as_file_t *smp, as_file_t ssps[], uint32_t n_ssps,
 		as_file_t data[], uint32_t n_data)
 {
+	(void)pbp;
 	(void)ptp;
 	(void)psps;
+	(void)n_psps;
 	(void)smp;
 	(void)ssps;
 	(void)n_ssps;
 	(void)data;
 	(void)n_data;
 
-	// Check that the number of stages is valid.
+	// Try to create the segment. When resuming, it may have been left behind
+	// by the interrupted restore - if so, it must be unattached and the right
+	// size.
 
-	char pathname[PATH_MAX + 1];
+	int shmid = shmget(file->key, file->segsz, SHMGET_FLAGS_CREATE_ONLY);
+	bool resumed = false;
 
-	sprintf(pathname, "%s/%08x%s", g_pathdir, pbp->key, FILE_EXTENSION);
+	if (shmid < 0 && errno == EEXIST && g_resume && g_journal.fd >= 0) {
+		shmid = shmget(file->key, file->segsz, 0);
 
-	// Extract arena stage count name from file.
+		struct shmid_ds ds;
 
-	int rc = open(pathname, O_RDONLY);
+		if (shmid >= 0 && (shmctl(shmid, IPC_STAT, &ds) < 0
+				|| ds.shm_segsz != file->segsz || ds.shm_nattch != 0)) {
+			shmid = -1;
+			errno = EEXIST;
+		}
+
+		resumed = shmid >= 0;
+	}
+
+	if (shmid < 0) {
+		int error = (errno == ENOENT) ? EEXIST : errno;
+		char errbuff[MAX_BUFFER];
+		char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
 
-	if (rc < 0) {
 		if (g_verbose) {
-			printf("Could not extract number of arena stages from base segment"
-					" file \'%s\'.\n", pathname);
+			printf("Could not create segment with key %08x"
+					": error was %d: %s.\n", file->key, error, errout);
 		}
 
+		// Clean up all intermediate operations.
+
+		restore_candidate_cleanup(ios, n_ios, true);
+
 		return false;
 	}
 
-	int fd = rc;
+	// Create I/O request for segment file.
+
+	io->key = file->key;
+	io->op = IO_OP_READ;
+	io->fd = -1;
+	io->memptr = (void*)-1;
+	memset(&io->digest, 0, sizeof(as_digest_t));
+	io->filsz = file->filsz;
+	io->segsz = file->segsz;
+	io->shmid = shmid;
+	io->mode = file->mode;
+	io->uid = file->uid;
+	io->gid = file->gid;
+	io->crc32 = g_crc32_init;
+	io->compress = file->compress;
+	io->cas = file->cas;
+	io->chunk_digests = NULL;
+	io->n_chunks = 1;
+	io->failed = false;
+	io->chunks_done = NULL;
+	io->n_chunks_done = 0;
+	io->atime = io->ctime = 0;
+	io->ranges = NULL;
+	io->n_ranges = 0;
+	io->offset = file->offset;
+	io->target = file->target;
+	io->upload_id = NULL;
+	io->parts = NULL;
 
-	// Check the base_ix segment version number.
+	// Construct the filename for the segment file.
 
-	if (lseek(fd, (off_t)BASEVER_OFF, SEEK_SET) != (off_t)BASEVER_OFF) {
-		close(fd);
+	char pathname[PATH_MAX + 1];
+
+	const char* extension = file_extension(file->compress, file->codec,
+			file->cas);
+
+	sprintf(pathname, "%s/%08x%s", g_pathdirs[file->target], file->key,
+			extension);
+
+	// Open the segment file (for reading) - or share the pack's. An object
+	// store has no file to open.
+
+	int rc = g_s3 ? -1 :
+			file->pack ? g_pack_file.fd : open(pathname, O_RDONLY);
+
+	// Open its copies in the mirrors too. Any one copy will do.
+
+	bool have_copy = false;
+
+	for (uint32_t m = 0; m < MAX_MIRRORS; m++) {
+		io->mirror_fds[m] = -1;
+
+		if (m < g_n_mirrors && g_mirror_ok[m] && !file->pack && !file->cas) {
+			char mirror_pathname[PATH_MAX + 1];
+
+			sprintf(mirror_pathname, "%s/%08x%s", g_mirrors[m], file->key,
+					extension);
+			io->mirror_fds[m] = open(mirror_pathname, O_RDONLY);
+			have_copy = have_copy || io->mirror_fds[m] >= 0;
+		}
+	}
+
+	if (rc < 0 && !g_s3) {
+		char errbuff[MAX_BUFFER];
+		char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
 
 		if (g_verbose) {
-			printf("Could not extract version number from base segment"
-					" file \'%s\'.\n", pathname);
+			printf("Could not open segment file \'%s\'"
+					": error was %d: %s.\n", pathname, errno, errout);
 		}
 
-		return false;
+		if (!have_copy) {
+			// Clean up all intermediate operations.
+
+			restore_candidate_cleanup(ios, n_ios + 1, true);
+
+			return false;
+		}
 	}
 
-	// Read the version number from base segment file.
+	// Complete I/O request.
 
-	union {
-		uint32_t base_ver;
-		uint8_t bytes[sizeof(uint32_t)];
-	} u1;
+	io->fd = rc;
 
-	if (read(fd, (void*)u1.bytes, BASEVER_LEN) != BASEVER_LEN) {
-		close(fd);
+	// A segment in the chunk store is reassembled in parallel chunks.
 
-		if (g_verbose) {
-			printf("Could not extract version number from base segment"
-					" file \'%s\'.\n", pathname);
-		}
+	if (io->cas && !restore_candidate_cas(io)) {
+		// Clean up all intermediate operations.
+
+		restore_candidate_cleanup(ios, n_ios + 1, true);
 
 		return false;
 	}
 
-	// Check version number.
+	// A segment in an object store is downloaded in parallel ranged gets.
 
-	if (u1.base_ver < BASEVER_MIN || u1.base_ver > BASEVER_MAX) {
-		close(fd);
+	if (g_s3 && !restore_candidate_s3(io)) {
+		// Clean up all intermediate operations.
 
-		if (g_verbose) {
-			printf("Invalid version number in base segment file \'%s\'"
-					": expecting version in range %u to %u"
-					", found version %u.\n", pathname, BASEVER_MIN, BASEVER_MAX,
-					u1.base_ver);
-		}
+		restore_candidate_cleanup(ios, n_ios + 1, true);
 
 		return false;
 	}
 
-	// Read the number of arena stages from the base segment file.
+	// When resuming, skip a segment the interrupted restore completed - it
+	// needn't even be attached.
 
-	if (lseek(fd, (off_t)N_ARENAS_PRI_OFF, SEEK_SET)
-			!= (off_t)N_ARENAS_PRI_OFF) {
-		close(fd);
+	if (resumed && resume_io(io, NULL)) {
+		return true;
+	}
+
+	// Attach to the segment (for writing).
+
+	io->memptr = shmat(shmid, NULL, 0);
+
+	// See if the segment was attached.
+	// Can not operate on segments that are in use.
+
+	if (io->memptr == (void*)-1) {
+		char errbuff[MAX_BUFFER];
+		char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
 
 		if (g_verbose) {
-			printf("Could not extract number of arena stages from base segment"
-					" file \'%s\'.\n", pathname);
+			printf("Could not attach segment %08x"
+					": error was %d: %s.\n", file->key, errno, errout);
 		}
 
+		// Clean up all intermediate operations.
+
+		restore_candidate_cleanup(ios, n_ios + 1, true);
+
 		return false;
 	}
 
-	// Read the namespace name.
+	journal_attach(io);
 
-	union {
-		uint32_t n_arenas;
-		uint8_t bytes[sizeof(uint32_t)];
-	} u2;
+	// A segment in the chunk store (or object store) has its ownership set up
+	// front, as no one chunk finishes the segment.
 
-	if (read(fd, (void*)u2.bytes, N_ARENAS_LEN) != N_ARENAS_LEN) {
-		close(fd);
+	if (io->cas || g_s3) {
 
-		if (g_verbose) {
-			printf("Could not extract number of arena stages from base segment"
-					" file \'%s\'.\n", pathname);
-		}
+		struct shmid_ds shmid_ds = { .shm_perm.uid = io->uid,
+				.shm_perm.gid = io->gid,
+				.shm_perm.mode = (short unsigned)(io->mode & MODE_MASK), };
 
-		return false;
+		if (shmctl(shmid, IPC_SET, &shmid_ds) == -1) {
+			char errbuff[MAX_BUFFER];
+			char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
+
+			if (g_verbose) {
+				printf("Unable to set uid, gid, or mode for shared memory"
+						" segment: error was %d: %s\n", errno, errout);
+			}
+
+			// Clean up all intermediate operations.
+
+			restore_candidate_cleanup(ios, n_ios + 1, true);
+
+			return false;
+		}
 	}
 
-	close(fd);
+	return true;
+}
 
-	if (u2.n_arenas != n_psps) {
+// Prepare an I/O request for a segment file in the chunk store layout - read
+// its chunk digests and split it into parallel chunks of work.
+
+static bool
+restore_candidate_cas(as_io_t* io)
+{
+	if (g_chunk_store == NULL) {
 		if (g_verbose) {
-			printf("Incorrect number of arena stages found"
-					": expecting %u, found %u.\n", u2.n_arenas, n_psps);
+			printf("Segment file %08x is in a chunk store"
+					": must specify chunk store directory"
+					" (use \'--chunk-store\').\n", io->key);
 		}
 
 		return false;
 	}
 
-	// Check that there are no segments with the same namespace and instance.
-	// Get info on all shared memory segments.
+	as_cas_t header;
 
-	struct shmid_ds dummy; // Dummy, needed by shmctl(3).
+	if (!read_cas_header(io->fd, io->key, io->segsz, CASHDR_MAG, &header,
+			&io->chunk_digests)) {
+		return false;
+	}
 
-	rc = shmctl(0, SHM_INFO, &dummy);
+	io->n_chunks = (uint32_t)((io->segsz + IOCHUNK - 1) / IOCHUNK);
 
-	if (rc < 0) {
-		if (g_verbose) {
-			printf("Could not enumerate shared memory segments.\n");
-		}
+	return true;
+}
 
-		return false;
-	}
+// Check which mirrors hold the same backup of a namespace as the backup
+// directory - the same segment files, by their manifests' digests. Only those
+// are read from. The manifest is kept, to check each copy read against.
 
-	int max_shmid = rc; // Range of shmids: 0..max_shmid (inclusive).
+static void
+check_mirrors(key_t key)
+{
+	as_manifest_t manifest;
+	bool have_manifest = g_n_mirrors != 0
+			&& read_manifest(g_pathdir, key, &manifest);
 
-	// Try each shmid in the range. Some may correspond to segments.
+	free_manifest(&g_mirror_manifest);
 
-	bool found = false;
+	for (uint32_t m = 0; m < g_n_mirrors; m++) {
+		as_manifest_t mirror_manifest;
 
-	for (int i = 0; i <= max_shmid; i++) {
-		// Get information about segment.
+		g_mirror_ok[m] = have_manifest
+				&& read_manifest(g_mirrors[m], key, &mirror_manifest);
 
-		struct shmid_ds ds;
+		bool proven = true;
 
-		if (shmctl(i, SHM_STAT, &ds) == -1) {
-			continue;
+		if (g_mirror_ok[m]) {
+			g_mirror_ok[m] = same_manifest(&manifest, &mirror_manifest,
+					&proven);
+			free_manifest(&mirror_manifest);
 		}
 
-		// Extract key from shmid_ds structure.
+		if (!proven) {
+			if (g_verbose) {
+				printf("Mirror '%s' may not hold the same backup of %08x"
+						" - no digests, crc32s, or creation stamp match"
+						": not reading from it.\n", g_mirrors[m], key);
+			}
+		}
+		else if (!g_mirror_ok[m] && g_verbose) {
+			printf("Mirror \'%s\' doesn't hold the same backup of %08x"
+					": not reading from it.\n", g_mirrors[m], key);
+		}
+	}
 
-		key_t key = ds.shm_perm.__key;
+	if (have_manifest) {
+		g_mirror_manifest = manifest;
+	}
+}
 
-		// Check if this is an Aerospike primary segment key.
+// Check whether two manifests describe the same segment files. Sizes alone
+// don't tell two backups apart - each segment must have the same digest or
+// crc32 in both, or else both manifests must have been written by the same
+// backup. If neither is so, proven is cleared.
 
-		if ((key & AS_XMEM_KEY_TYPE_MASK) == AS_XMEM_PRI_KEY) {
+static bool
+same_manifest(const as_manifest_t* left, const as_manifest_t* right,
+		bool* proven)
+{
+	if (left->n_entries != right->n_entries) {
+		return false;
+	}
 
-			// Found a valid Aerospike database primary segment.
-			// Extract the base from the key.
+	bool same_backup = left->created != 0
+			&& left->created == right->created;
 
-			key = key & ~AS_XMEM_PRI_KEY;
+	for (uint32_t i = 0; i < left->n_entries; i++) {
+		const as_manifest_entry_t* l = &left->entries[i];
+		const as_manifest_entry_t* r = find_manifest_entry(right, l->key);
 
-			// Determine instance from key base.
+		if (r == NULL || r->segsz != l->segsz || r->filsz != l->filsz
+				|| r->compress != l->compress || r->cas != l->cas
+				|| r->has_digest != l->has_digest
+				|| !hash_digest_equal(&r->digest, &l->digest)
+				|| (r->has_crc32 && l->has_crc32 && r->crc32 != l->crc32)) {
+			return false;
+		}
 
-			uint32_t inst = (uint32_t) key >> AS_XMEM_INSTANCE_KEY_SHIFT;
+		if (!same_backup && !l->has_digest
+				&& !(l->has_crc32 && r->has_crc32)) {
+			*proven = false;
+			return false;
+		}
+	}
 
-			// Determine namespace ID from key base.
+	return true;
+}
 
-			key = key & ~(0xf << AS_XMEM_INSTANCE_KEY_SHIFT);
+static bool
+restore_candidate_check_crc32(as_io_t ios[], uint32_t n_ios)
+{
+	// Check crc32 for each restored segment.
 
-			uint32_t nsid = (uint32_t) (key & (0xff << AS_XMEM_NS_KEY_SHIFT))
-					>> AS_XMEM_NS_KEY_SHIFT;
+	uint32_t i;
+	for (i = 0; i < n_ios; i++) {
+		as_io_t* io = &ios[i];
+
+		// Chunks from the chunk store were checked against their digests.
+
+		if (io->cas) {
+			continue;
+		}
+
+		// Get the shared memory ID of this segment.
+
+		int shmid = shmget(ios[i].key, ios[i].segsz, 0);
+
+		if (shmid < 0) {
+			return false;
+		}
 
-			// Check whether instance and namespace match.
+		// Attach and get the memory location for this segment.
 
-			if (nsid == pbp->nsid && inst == pbp->inst) {
-				if (g_verbose) {
-					printf("Found existing Aerospike primary index segment %08x with"
-							" instance %u, namespace \'%s\' (nsid %u)"
-							": cannot restore associated file.\n",
-							ds.shm_perm.__key, inst, pbp->nsnm, nsid);
-				}
+		void* memptr = shmat(shmid, NULL, SHM_RDONLY);
 
-				found = true;
-			}
+		if (memptr == (void*)-1) {
+			return false;
 		}
 
-		if ((key & AS_XMEM_KEY_TYPE_MASK) == AS_XMEM_SEC_KEY) {
-			// Found a valid Aerospike database secondary segment.
-			// Extract the base from the key.
+		// Actually compute the crc32 for this segment.
 
-			key = key & ~AS_XMEM_SEC_KEY;
+		uLong segment_crc32 = crc32(g_crc32_init, memptr, (uInt)ios[i].segsz);
+		shmdt(memptr);
 
-			// Determine instance from key base.
+		// Compare the crc32 value just computed with the one computed
+		// while reading the file.
 
-			uint32_t inst = (uint32_t) key >> AS_XMEM_INSTANCE_KEY_SHIFT;
+		if (segment_crc32 != io->crc32) {
+			return false;
+		}
+	}
 
-			// Determine namespace ID from key base.
+	return true;
+}
 
-			key = key & ~(0xf << AS_XMEM_INSTANCE_KEY_SHIFT);
+// Cleanup from restore_candidate().
+// If remove is set, all segments created should be removed.
 
-			uint32_t nsid = (uint32_t) (key & (0xff << AS_XMEM_NS_KEY_SHIFT))
-					>> AS_XMEM_NS_KEY_SHIFT;
+static void
+restore_candidate_cleanup(as_io_t ios[], uint32_t n_ios, bool remove_segments)
+{
+	// Close all opened files.
 
-			// Check whether instance and namespace match.
+	for (uint32_t i = 0; i < n_ios; i++) {
+		as_io_t *io = &ios[i];
 
-			if (nsid == pbp->nsid && inst == pbp->inst) {
-				if (g_verbose) {
-					printf("Found existing Aerospike secondary index segment %08x with"
-							" instance %u, namespace \'%s\' (nsid %u)"
-							": cannot restore associated file.\n",
-							ds.shm_perm.__key, inst, pbp->nsnm, nsid);
-				}
+		// Close the file - unless it's the pack's, shared by all.
 
-				found = true;
+		if (io->fd >= 0 && io->fd != g_pack_file.fd) {
+			close(io->fd);
+		}
+
+		for (uint32_t m = 0; m < g_n_mirrors; m++) {
+			if (io->mirror_fds[m] >= 0) {
+				close(io->mirror_fds[m]);
 			}
 		}
 
-		if ((key & AS_XMEM_KEY_TYPE_MASK) == AS_XMEM_DAT_KEY) {
-			// Found a valid Aerospike database data segment.
-			// Extract the base from the key.
+		free(io->chunk_digests);
+		io->chunk_digests = NULL;
 
-			key = key & ~AS_XMEM_DAT_KEY;
+		free(io->chunks_done);
+		io->chunks_done = NULL;
 
-			// Determine instance from key base.
+		free(io->parts);
+		io->parts = NULL;
+	}
 
-			uint32_t inst = (uint32_t) key >> AS_XMEM_INSTANCE_KEY_SHIFT;
+	close_pack();
 
-			// Determine namespace ID from key base.
+	// Detach all attached segments.
 
-			key = key & ~(0xf << AS_XMEM_INSTANCE_KEY_SHIFT);
+	for (uint32_t i = 0; i < n_ios; i++) {
+		as_io_t *io = &ios[i];
 
-			uint32_t nsid = (uint32_t) (key & (0xff << AS_XMEM_NS_KEY_SHIFT))
-					>> AS_XMEM_NS_KEY_SHIFT;
+		// Detach this segment.
 
-			// Check whether instance and namespace match.
+		shmdt(io->memptr);
+	}
 
-			if (nsid == pbp->nsid && inst == pbp->inst) {
+	if (!remove_segments) {
+		return;
+	}
+
+	// Destroy all created segments in case of failure - except, in a journaled
+	// ('--resume') restore, those with chunks journaled as complete, which are
+	// kept for a resume, with their final ownership and mode. The base segment
+	// is never kept, so that the server can't start from a partial restore.
+
+	bool kept = false;
+
+	for (uint32_t i = 0; i < n_ios; i++) {
+		as_io_t *io = &ios[i];
+		struct shmid_ds ds; // Dummy.
+
+		if (i != 0 && g_journal.fd >= 0 && io->n_chunks_done != 0) {
+			struct shmid_ds shmid_ds = { .shm_perm.uid = io->uid,
+					.shm_perm.gid = io->gid,
+					.shm_perm.mode = (short unsigned)(io->mode & MODE_MASK), };
+
+			if (shmctl(io->shmid, IPC_SET, &shmid_ds) == 0) {
 				if (g_verbose) {
-					printf("Found existing Aerospike data segment %08x with"
-							" instance %u, namespace \'%s\' (nsid %u)"
-							": cannot restore associated file.\n",
-							ds.shm_perm.__key, inst, pbp->nsnm, nsid);
+					printf("Kept segment %08x for '--resume'.\n", io->key);
 				}
 
-				found = true;
+				kept = true;
+				continue;
 			}
 		}
+
+		// Destroy this segment.
+
+		shmctl(io->shmid, IPC_RMID, &ds);
 	}
 
-	return !found;
+	if (kept && g_verbose) {
+		printf("Removed base segment %08x, so that the server can't start"
+				" from a partial restore.\n", ios[0].key);
+	}
 }
 
-// Actually restore candidate set of segment files.
+// Verify candidate set of segment files. Nothing is written to shared memory.
 
 static bool
-restore_candidate(as_file_t* pbp, as_file_t* ptp, as_file_t psps[],
+verify_candidate(as_file_t* pbp, as_file_t* ptp, as_file_t psps[],
 		uint32_t n_psps, as_file_t* smp, as_file_t ssps[], uint32_t n_ssps,
 		as_file_t data[], uint32_t n_data)
 {
@@ -4221,26 +18409,29 @@ restore_candidate(as_file_t* pbp, as_file_t* ptp, as_file_t psps[],
 		n_files += n_data;
 	}
 
+	// A namespace backed up to a pack is verified by its extents.
+
+	if (pbp->pack && !open_pack(pbp->key)) {
+		return false;
+	}
+
 	as_io_t ios[n_files];
 	uint32_t n_ios = 0;
 
-	if (!restore_candidate_segment(pbp, &ios[n_ios], ios, n_ios, pbp, ptp, psps, n_psps,
-			smp, ssps, n_ssps, data, n_data)) {
+	if (!verify_candidate_file(pbp, &ios[n_ios], ios, n_ios)) {
 		return false;
 	}
 
 	n_ios++;
 
-	if (!restore_candidate_segment(ptp, &ios[n_ios], ios, n_ios, pbp, ptp, psps, n_psps,
-			smp, ssps, n_ssps, data, n_data)) {
+	if (!verify_candidate_file(ptp, &ios[n_ios], ios, n_ios)) {
 		return false;
 	}
 
 	n_ios++;
 
 	for (uint32_t i = 0; i < n_psps; i++) {
-		if (!restore_candidate_segment(&psps[i], &ios[n_ios], ios, n_ios, pbp, ptp, psps,
-				n_psps, smp, ssps, n_ssps, data, n_data)) {
+		if (!verify_candidate_file(&psps[i], &ios[n_ios], ios, n_ios)) {
 			return false;
 		}
 
@@ -4248,16 +18439,14 @@ restore_candidate(as_file_t* pbp, as_file_t* ptp, as_file_t psps[],
 	}
 
 	if (n_ssps > 0) {
-		if (!restore_candidate_segment(smp, &ios[n_ios], ios, n_ios, pbp, ptp, psps,
-				n_psps, smp, ssps, n_ssps, data, n_data)) {
+		if (!verify_candidate_file(smp, &ios[n_ios], ios, n_ios)) {
 			return false;
 		}
 
 		n_ios++;
 
 		for (uint32_t i = 0; i < n_ssps; i++) {
-			if (!restore_candidate_segment(&ssps[i], &ios[n_ios], ios, n_ios, pbp, ptp,
-					psps, n_psps, smp, ssps, n_ssps, data, n_data)) {
+			if (!verify_candidate_file(&ssps[i], &ios[n_ios], ios, n_ios)) {
 				return false;
 			}
 
@@ -4265,15 +18454,12 @@ restore_candidate(as_file_t* pbp, as_file_t* ptp, as_file_t psps[],
 		}
 	}
 
-	if (n_data > 0) {
-		for (uint32_t i = 0; i < n_data; i++) {
-			if (!restore_candidate_segment(&data[i], &ios[n_ios], ios, n_ios, pbp, ptp,
-					psps, n_psps, smp, ssps, n_ssps, data, n_data)) {
-				return false;
-			}
-
-			n_ios++;
+	for (uint32_t i = 0; i < n_data; i++) {
+		if (!verify_candidate_file(&data[i], &ios[n_ios], ios, n_ios)) {
+			return false;
 		}
+
+		n_ios++;
 	}
 
 	assert(n_files == n_ios);
@@ -4282,233 +18468,206 @@ restore_candidate(as_file_t* pbp, as_file_t* ptp, as_file_t psps[],
 
 	bool success = start_io(ios, n_ios);
 
-	// I/O requests were processed. Now post-process.
-
 	if (success && g_crc32) {
-		if (!restore_candidate_check_crc32(ios, n_ios)) {
-			if (g_verbose) {
-				printf("crc32 mismatch.\n\n");
-			}
-
-			success = false;
-		}
+		success = verify_candidate_crcs(pbp, ios, n_ios);
 	}
 
 	// Notify the user of success or failure.
 
 	if (g_verbose) {
-		as_file_t* fp = pbp;
-
-		if (g_verbose) {
-			printf("%s",
-					success ?
-							"\nSuccessfully restored" : "\nFailed to restore");
-			printf(" %u Aerospike database segment files",n_files);
-			printf(" for instance %u, namespace \'%s\' (nsid %u).\n", fp->inst,
-					fp->nsnm == NULL ? "<null>" : fp->nsnm, fp->nsid);
+		if (success) {
+			printf("\nSuccessfully verified %u", n_files);
+		}
+		else if (g_n_failed_ios != 0) {
+			printf("\nFailed to verify %u of %u", g_n_failed_ios, n_files);
+		}
+		else {
+			printf("\nFailed to verify %u", n_files);
 		}
-	}
 
-	// Clean up all intermediate operations.
-	// On failure, will destroy all created segments.
+		printf(" Aerospike database segment files");
+		printf(" for instance %u, namespace \'%s\' (nsid %u).\n", pbp->inst,
+				pbp->nsnm == NULL ? "<null>" : pbp->nsnm, pbp->nsid);
+	}
 
-	restore_candidate_cleanup(ios, n_ios, !success);
+	verify_candidate_cleanup(ios, n_ios);
 
 	return success;
 }
 
 static bool
-restore_candidate_segment(as_file_t *file, as_io_t *io, as_io_t ios[],
-		uint32_t n_ios, as_file_t *pbp, as_file_t *ptp, as_file_t psps[],
-		uint32_t n_psps, as_file_t *smp, as_file_t ssps[], uint32_t n_ssps,
-		as_file_t data[], uint32_t n_data)
+verify_candidate_file(as_file_t* file, as_io_t* io, as_io_t ios[],
+		uint32_t n_ios)
 {
-	(void)pbp;
-	(void)ptp;
-	(void)psps;
-	(void)n_psps;
-	(void)smp;
-	(void)ssps;
-	(void)n_ssps;
-	(void)data;
-	(void)n_data;
-
-	// Try to create the segment.
-
-	int shmid = shmget(file->key, file->segsz, SHMGET_FLAGS_CREATE_ONLY);
-
-	if (shmid < 0) {
-		int error = (errno == ENOENT) ? EEXIST : errno;
-		char errbuff[MAX_BUFFER];
-		char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
-
-		if (g_verbose) {
-			printf("Could not create segment with key %08x"
-					": error was %d: %s.\n", file->key, error, errout);
-		}
-
-		// Clean up all intermediate operations.
+	// Construct the filename for the segment file.
 
-		restore_candidate_cleanup(ios, n_ios, true);
+	char pathname[PATH_MAX + 1];
 
-		return false;
-	}
+	const char* extension = file_extension(file->compress, file->codec,
+			file->cas);
 
-	// Attach to the segment (for writing).
+	sprintf(pathname, "%s/%08x%s", g_pathdirs[file->target], file->key,
+			extension);
 
-	void* memptr = shmat(shmid, NULL, 0);
+	// Open the segment file (for reading) - or share the pack's.
 
-	// See if the segment was attached.
-	// Can not operate on segments that are in use.
+	int rc = file->pack ? g_pack_file.fd : open(pathname, O_RDONLY);
 
-	if (memptr == (void*)-1) {
+	if (rc < 0) {
 		char errbuff[MAX_BUFFER];
 		char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
 
 		if (g_verbose) {
-			printf("Could not attach segment %08x"
-					": error was %d: %s.\n", file->key, errno, errout);
+			printf("Could not open segment file \'%s\'"
+					": error was %d: %s.\n", pathname, errno, errout);
 		}
 
 		// Clean up all intermediate operations.
 
-		restore_candidate_cleanup(ios, n_ios, true);
+		verify_candidate_cleanup(ios, n_ios);
 
 		return false;
 	}
 
-	// Create I/O request for segment file.
+	// Create I/O request for segment file. No segment is involved.
 
 	io->key = file->key;
-	io->write = false;
-	io->memptr = memptr;
+	io->fd = rc;
+	io->op = IO_OP_VERIFY;
+	io->memptr = NULL;
+	io->offset = file->offset;
+	io->target = file->target;
 	io->filsz = file->filsz;
 	io->segsz = file->segsz;
-	io->shmid = shmid;
+	io->shmid = -1;
 	io->mode = file->mode;
 	io->uid = file->uid;
 	io->gid = file->gid;
 	io->crc32 = g_crc32_init;
 	io->compress = file->compress;
-
-	// Construct the filename for the segment file.
-
-	char pathname[PATH_MAX + 1];
-
-	const char* extension =
-			file->type != TYPE_BASE && file->compress ?
-					FILE_EXTENSION_CMP : FILE_EXTENSION;
-
-	sprintf(pathname, "%s/%08x%s", g_pathdir, file->key, extension);
-
-	// Open the segment file (for reading).
-
-	int rc = open(pathname, O_RDONLY);
-
-	if (rc < 0) {
-		char errbuff[MAX_BUFFER];
-		char* errout = strerror_r(errno, errbuff, MAX_BUFFER);
-
-		if (g_verbose) {
-			printf("Could not open segment file \'%s\'"
-					": error was %d: %s.\n", pathname, errno, errout);
-		}
-
+	io->cas = file->cas;
+	io->chunk_digests = NULL;
+	io->n_chunks = 1;
+	io->failed = false;
+	io->chunks_done = NULL;
+	io->n_chunks_done = 0;
+	io->atime = io->ctime = 0;
+	io->ranges = NULL;
+	io->n_ranges = 0;
+
+	// A segment in the chunk store is verified in parallel chunks.
+
+	if (io->cas && !restore_candidate_cas(io)) {
 		// Clean up all intermediate operations.
 
-		restore_candidate_cleanup(ios, n_ios, true);
+		verify_candidate_cleanup(ios, n_ios + 1);
 
 		return false;
 	}
 
-	// Complete I/O request.
-
-	io->fd = rc;
-
 	return true;
 }
 
+// Check the crc32s of a namespace's verified segment files against those
+// recorded in its manifest by a backup with '-c'. A chunk store's files are
+// checked by their chunks' digests instead.
+
 static bool
-restore_candidate_check_crc32(as_io_t ios[], uint32_t n_ios)
+verify_candidate_crcs(const as_file_t* pbp, as_io_t ios[], uint32_t n_ios)
 {
-	// Check crc32 for each restored segment.
-
-	uint32_t i;
-	for (i = 0; i < n_ios; i++) {
-		as_io_t* io = &ios[i];
-
-		// Get the shared memory ID of this segment.
-
-		int shmid = shmget(ios[i].key, ios[i].segsz, 0);
+	as_manifest_t manifest;
 
-		if (shmid < 0) {
-			return false;
+	if (pbp->pack || !read_manifest(g_pathdir, pbp->key, &manifest)) {
+		if (g_verbose) {
+			printf("No manifest for %08x: crc32s not checked.\n", pbp->key);
 		}
 
-		// Attach and get the memory location for this segment.
-
-		void* memptr = shmat(shmid, NULL, SHM_RDONLY);
-
-		if (memptr == (void*)-1) {
-			return false;
-		}
+		return true;
+	}
 
-		// Actually compute the crc32 for this segment.
+	bool success = true;
 
-		uLong segment_crc32 = crc32(g_crc32_init, memptr, (uInt)ios[i].segsz);
-		shmdt(memptr);
+	for (uint32_t i = 0; i < n_ios; i++) {
+		as_io_t* io = &ios[i];
+		const as_manifest_entry_t* entry = find_manifest_entry(&manifest,
+				io->key);
 
-		// Compare the crc32 value just computed with the one computed
-		// while reading the file.
+		if (io->cas || entry == NULL || !entry->has_crc32
+				|| entry->crc32 == io->crc32) {
+			continue;
+		}
 
-		if (segment_crc32 != io->crc32) {
-			return false;
+		if (g_verbose) {
+			printf("Segment file %08x crc32 mismatch: manifest has 0x%08lx"
+					", data has 0x%08lx.\n", io->key, entry->crc32,
+					io->crc32);
 		}
+
+		io->failed = true;
+		g_n_failed_ios++;
+		success = false;
 	}
 
-	return true;
+	free_manifest(&manifest);
+
+	return success;
 }
 
-// Cleanup from restore_candidate().
-// If remove is set, all segments created should be removed.
+// Cleanup from verify_candidate().
 
 static void
-restore_candidate_cleanup(as_io_t ios[], uint32_t n_ios, bool remove_segments)
+verify_candidate_cleanup(as_io_t ios[], uint32_t n_ios)
 {
-	// Close all opened files.
-
 	for (uint32_t i = 0; i < n_ios; i++) {
-		as_io_t *io = &ios[i];
-
-		// Close the file.
+		if (ios[i].fd != g_pack_file.fd) {
+			close(ios[i].fd);
+		}
 
-		close(io->fd);
+		free(ios[i].chunk_digests);
+		ios[i].chunk_digests = NULL;
 	}
 
-	// Detach all attached segments.
-
-	for (uint32_t i = 0; i < n_ios; i++) {
-		as_io_t *io = &ios[i];
-
-		// Detach this segment.
+	close_pack();
+}
 
-		shmdt(io->memptr);
-	}
+// Get the name of a segment type, as displayed and as recorded in manifests.
 
-	if (!remove_segments) {
-		return;
+static const char*
+type_name(as_type type)
+{
+	switch (type) {
+	case TYPE_BASE:
+		return "pi-base";
+	case TYPE_TREEX:
+		return "pi-treex";
+	case TYPE_META:
+		return "si-meta";
+	case TYPE_PRI_STAGE:
+		return "pi-stage";
+	case TYPE_SEC_STAGE:
+		return "si-stage";
+	case TYPE_DAT_STAGE:
+		return "data-stage";
+	default:
+		return "unknown";
 	}
+}
 
-	// Destroy all created segments in case of failure.
-
-	for (uint32_t i = 0; i < n_ios; i++) {
-		as_io_t *io = &ios[i];
-		struct shmid_ds ds; // Dummy.
+// Get the file name extension of a segment file, by layout. A deflated file
+// is a gzip stream behind its header - any other codec's is chunked.
 
-		// Destroy this segment.
+static const char*
+file_extension(bool compress, as_codec codec, bool cas)
+{
+	if (cas) {
+		return FILE_EXTENSION_CAS;
+	}
 
-		shmctl(io->shmid, IPC_RMID, &ds);
+	if (!compress) {
+		return FILE_EXTENSION;
 	}
+
+	return codec == CODEC_DEFLATE ? FILE_EXTENSION_CMP : FILE_EXTENSION_CHUNKED;
 }
 
 // Validate whether this is an Aerospike database segment file.
@@ -4528,10 +18687,14 @@ validate_file_name(const char* pathname, as_file_t* file)
 		return false;
 	}
 
-	// Ensure that file extension is ".dat" or ".dat.gz".
+	// Ensure that file extension is ".dat", ".dat.gz", ".dat.cz", ".cas" or
+	// ".pack".
 
 	if ((strcmp(dot_ptr, FILE_EXTENSION) != 0)
-			&& (strcmp(dot_ptr, FILE_EXTENSION_CMP) != 0)) {
+			&& (strcmp(dot_ptr, FILE_EXTENSION_CMP) != 0)
+			&& (strcmp(dot_ptr, FILE_EXTENSION_CHUNKED) != 0)
+			&& (strcmp(dot_ptr, FILE_EXTENSION_CAS) != 0)
+			&& (strcmp(dot_ptr, PACK_EXTENSION) != 0)) {
 		free(old_ptr);
 		old_ptr = NULL;
 		return false;
@@ -4655,6 +18818,15 @@ validate_file_name(const char* pathname, as_file_t* file)
 		if (primary) {
 			file->type = TYPE_TREEX;
 		}
+		else if (data) {
+			file->type = TYPE_DAT_STAGE;
+		}
+		else {
+			// Not a valid Aerospike file type.
+			free(old_ptr);
+			old_ptr = NULL;
+			return false;
+		}
 	}
 	else if (key > 0) {
 		if (data) {
@@ -4715,7 +18887,8 @@ validate_file_name(const char* pathname, as_file_t* file)
 	return true;
 }
 
-// Generate a list of Aerospike database segment files.
+// Generate a list of Aerospike database segment files, from all the backup
+// directories.
 // Note: *n_files and *error are valid even if list_files() returns false.
 
 static bool
@@ -4724,7 +18897,44 @@ list_files(as_file_t** files, uint32_t* n_files, int* error)
 	*n_files = 0;
 	*error = 0;
 
-	DIR* dir = opendir(g_pathdir);
+	// *files is array of file structures for Aerospike database segment files.
+
+	*files = NULL; // Table is initially empty.
+
+	if (g_raw) {
+		list_raw(files, n_files);
+	}
+
+	if (g_s3 && !list_s3(files, n_files, error)) {
+		return false;
+	}
+
+	for (uint32_t target = 0; !g_raw && !g_s3 && target < g_n_pathdirs;
+			target++) {
+		if (!list_target_files(target, files, n_files, error)) {
+			return false;
+		}
+	}
+
+	// Sort table by key (important!)
+
+	if (*n_files > 0) {
+		qsort((void*)*files, (size_t)*n_files, sizeof(as_file_t),
+				qsort_compare_files);
+	}
+
+	return true;
+}
+
+// Add the Aerospike database segment files in one backup directory to the
+// list.
+
+static bool
+list_target_files(uint32_t target, as_file_t** files, uint32_t* n_files,
+		int* error)
+{
+	const char* pathdir = g_pathdirs[target];
+	DIR* dir = opendir(pathdir);
 
 	if (dir == NULL) {
 		*error = errno;
@@ -4732,16 +18942,12 @@ list_files(as_file_t** files, uint32_t* n_files, int* error)
 			char errbuff[MAX_BUFFER];
 			char *errout = strerror_r(errno, errbuff, MAX_BUFFER);
 			printf("Cannot open directory \'%s\': error was %d: %s.\n",
-					g_pathdir, *error, errout);
+					pathdir, *error, errout);
 		}
 
 		return false;
 	}
 
-	// *files is array of file structures for Aerospike database segment files.
-
-	*files = NULL; // Table is initially empty.
-
 	as_file_t valid_file;
 	struct dirent* dirent;
 
@@ -4762,7 +18968,7 @@ list_files(as_file_t** files, uint32_t* n_files, int* error)
 		char pathname[PATH_MAX + 1];
 		struct stat statbuf;
 
-		sprintf(pathname, "%s/%s", g_pathdir, dirent->d_name);
+		sprintf(pathname, "%s/%s", pathdir, dirent->d_name);
 
 		// Get status of file.
 
@@ -4781,7 +18987,14 @@ list_files(as_file_t** files, uint32_t* n_files, int* error)
 
 		// Check whether the instance number is a match.
 
-		if (g_inst != INV_INST && valid_file.inst != g_inst) {
+		if (!inst_selected(valid_file.inst)) {
+			continue;
+		}
+
+		// A pack holds all of a namespace's segments.
+
+		if (strcmp(strchr(dirent->d_name, '.'), PACK_EXTENSION) == 0) {
+			list_pack(pathname, valid_file.key, 0, target, files, n_files);
 			continue;
 		}
 
@@ -4835,13 +19048,45 @@ list_files(as_file_t** files, uint32_t* n_files, int* error)
 
 		size_t segsz;
 		bool compress;
+		as_codec codec = CODEC_STORE;
+		bool cas = false;
 
 		if (valid_file.type != TYPE_BASE && valid_file.type != TYPE_META) {
 			char* dot_ptr = strchr(dirent->d_name, '.');
 
+			// Is this a chunk store recipe file?
+
+			if (dot_ptr != NULL && strcmp(dot_ptr, FILE_EXTENSION_CAS) == 0) {
+				int fd = open(pathname, O_RDONLY);
+
+				if (fd < 0) {
+					assert(valid_file.nsnm == NULL);
+					continue;
+				}
+
+				as_cas_t header;
+				ssize_t bytes_read = pread(fd, (void*)&header, CASHDR_LEN,
+						(off_t)CASHDR_OFF);
+
+				close(fd);
+
+				if (bytes_read != (ssize_t)CASHDR_LEN
+						|| header.magic != CASHDR_MAG
+						|| header.version != CASHDR_VER) {
+					assert(valid_file.nsnm == NULL);
+					continue;
+				}
+
+				segsz = header.segsz;
+				compress = header.compress != 0;
+				cas = true;
+			}
 			// Is this a compressed file?
 
-			if (dot_ptr != NULL && strcmp(dot_ptr, FILE_EXTENSION_CMP) == 0) {
+			else if (dot_ptr != NULL
+					&& (strcmp(dot_ptr, FILE_EXTENSION_CMP) == 0
+							|| strcmp(dot_ptr, FILE_EXTENSION_CHUNKED) == 0)) {
+				bool chunked = strcmp(dot_ptr, FILE_EXTENSION_CHUNKED) == 0;
 
 				int rc = open(pathname, O_RDONLY);
 
@@ -4862,8 +19107,11 @@ list_files(as_file_t** files, uint32_t* n_files, int* error)
 				}
 
 				as_cmp_t header;
+				as_cmp_ext_t ext = { .codec = CODEC_DEFLATE };
 
-				if (read(fd, (void*)&header, CMPHDR_LEN) != CMPHDR_LEN) {
+				if (read(fd, (void*)&header, CMPHDR_LEN) != CMPHDR_LEN
+						|| (chunked && read(fd, (void*)&ext, CMPEXT_LEN)
+								!= CMPEXT_LEN)) {
 					close(fd);
 					assert(valid_file.nsnm == NULL);
 					continue;
@@ -4871,7 +19119,8 @@ list_files(as_file_t** files, uint32_t* n_files, int* error)
 
 				close(fd);
 
-				// Sanity check header.
+				// Sanity check header - a ".dat.gz" file is a gzip stream, a
+				// ".dat.cz" file is chunked.
 
 				if (header.magic != CMPHDR_MAG1
 						&& header.magic != CMPHDR_MAG2) {
@@ -4879,13 +19128,16 @@ list_files(as_file_t** files, uint32_t* n_files, int* error)
 					continue;
 				}
 
-				if (header.version != CMPHDR_VER) {
+				if (header.version != (chunked ?
+						CMPHDR_VER_CHUNKED : CMPHDR_VER)
+						|| ext.codec >= N_CODECS) {
 					assert(valid_file.nsnm == NULL);
 					continue;
 				}
 
 				segsz = header.segsz;
 				compress = true;
+				codec = (as_codec)ext.codec;
 			}
 			else {
 				segsz = (size_t)statbuf.st_size;
@@ -4916,14 +19168,173 @@ list_files(as_file_t** files, uint32_t* n_files, int* error)
 		file->filsz = (size_t)statbuf.st_size;
 		file->segsz = segsz;
 		file->compress = compress;
+		file->codec = codec;
+		file->cas = cas;
 		file->stage = valid_file.stage;
 		file->inst = valid_file.inst;
 		file->nsid = valid_file.nsid;
 		file->type = valid_file.type;
+		file->planned = false;
+		file->pack = false;
+		file->offset = 0;
+		file->target = target;
 	}
 
 	closedir(dir);
 
+	return true;
+}
+
+// Add the segments in a pack, named after its base segment key, to a list of
+// Aerospike database segment files, if the pack's namespace passes the filter.
+
+static void
+list_pack(const char* pathname, key_t key, size_t base, uint32_t target,
+		as_file_t** files, uint32_t* n_files)
+{
+	as_pack_t pack;
+
+	if (!read_pack(pathname, base, &pack)) {
+		return;
+	}
+
+	// Extract the namespace name from the base segment.
+
+	char nsnm[NAMESPACE_LEN + 1] = { 0 };
+
+	for (uint32_t i = 0; i < pack.n_extents; i++) {
+		const as_pack_extent_t* extent = &pack.extents[i];
+
+		if (extent->key == key) {
+			if (pread(pack.fd, (void*)nsnm, NAMESPACE_LEN,
+					(off_t)(extent->offset + NAMESPACE_OFF))
+					!= NAMESPACE_LEN) {
+				nsnm[0] = '\0';
+			}
+
+			nsnm[NAMESPACE_LEN] = '\0';
+			break;
+		}
+	}
+
+	// Check whether the namespace name is a match.
+
+	if (nsnm[0] == '\0' || (g_nsnm != NULL && strcmp(nsnm, g_nsnm) != 0)) {
+		close(pack.fd);
+		free(pack.extents);
+		return;
+	}
+
+	*files = realloc(*files, (size_t)(*n_files + pack.n_extents)
+			* sizeof(as_file_t));
+	assert(*files != NULL);
+
+	for (uint32_t i = 0; i < pack.n_extents; i++) {
+		const as_pack_extent_t* extent = &pack.extents[i];
+		char name[PATH_MAX + 1];
+		as_file_t valid_file;
+
+		sprintf(name, "%08x%s", extent->key, FILE_EXTENSION);
+
+		if (!validate_file_name(name, &valid_file)) {
+			continue;
+		}
+
+		as_file_t* file = *files + *n_files;
+
+		(*n_files)++;
+
+		file->key = valid_file.key;
+		file->nsnm = valid_file.type == TYPE_BASE ? strdup(nsnm) : NULL;
+		file->uid = extent->uid;
+		file->gid = extent->gid;
+		file->mode = S_IFREG | extent->mode;
+		file->filsz = extent->segsz;
+		file->segsz = extent->segsz;
+		file->compress = false;
+		file->codec = CODEC_STORE;
+		file->cas = false;
+		file->stage = valid_file.stage;
+		file->inst = valid_file.inst;
+		file->nsid = valid_file.nsid;
+		file->type = valid_file.type;
+		file->planned = false;
+		file->pack = true;
+		file->offset = extent->offset;
+		file->target = target;
+	}
+
+	close(pack.fd);
+	free(pack.extents);
+}
+
+// Generate the list of Aerospike database segment files from the packs in the
+// raw container.
+
+static void
+list_raw(as_file_t** files, uint32_t* n_files)
+{
+	const as_raw_hdr_t* header = (const as_raw_hdr_t*)g_raw_dev.super;
+	const as_raw_pack_t* packs =
+			(const as_raw_pack_t*)(g_raw_dev.super + sizeof(as_raw_hdr_t));
+
+	for (uint32_t i = 0; i < header->n_packs; i++) {
+		char name[PATH_MAX + 1];
+		as_file_t valid_file;
+
+		sprintf(name, "%08x%s", packs[i].key, PACK_EXTENSION);
+
+		// Check whether the instance number is a match.
+
+		if (!validate_file_name(name, &valid_file)
+				|| !inst_selected(valid_file.inst)) {
+			continue;
+		}
+
+		list_pack(g_pathdir, packs[i].key, packs[i].offset, 0, files, n_files);
+	}
+}
+
+// Generate the list of Aerospike database segment files from the manifests in
+// the backup directory, without reading the directory or opening any segment
+// file. Returns false if any namespace backed up there lacks a usable manifest,
+// so that the caller falls back to list_files().
+
+static bool
+plan_files(as_file_t** files, uint32_t* n_files)
+{
+	*files = NULL;
+	*n_files = 0;
+
+	bool any = false;
+
+	// Only the selected instances - and, given a namespace name, only until
+	// its manifest is found in an instance.
+
+	for (uint32_t inst = MIN_INST; (g_insts >> inst) != 0; inst++) {
+		if (!inst_selected(inst)) {
+			continue;
+		}
+
+		bool found = false;
+
+		for (uint32_t nsid = MIN_NSID; !found && nsid <= MAX_NSID; nsid++) {
+			key_t key = AS_XMEM_PRI_KEY
+					| (key_t)(inst << AS_XMEM_INSTANCE_KEY_SHIFT)
+					| (key_t)(nsid << AS_XMEM_NS_KEY_SHIFT);
+
+			if (!plan_namespace(key, files, n_files, &any, &found)) {
+				free_planned_files(files, n_files);
+				return false;
+			}
+		}
+	}
+
+	if (!any) {
+		free_planned_files(files, n_files);
+		return false;
+	}
+
 	// Sort table by key (important!)
 
 	if (*n_files > 0) {
@@ -4934,6 +19345,169 @@ list_files(as_file_t** files, uint32_t* n_files, int* error)
 	return true;
 }
 
+// Add the segment files of a namespace, identified by its base segment key, to
+// the list from the namespace's manifest. Sets any if there's a usable
+// manifest, and found if it's for the selected namespace name. Returns false
+// if the namespace was backed up, but its manifest can't be used.
+
+static bool
+plan_namespace(key_t key, as_file_t** files, uint32_t* n_files, bool* any,
+		bool* found)
+{
+	as_manifest_t manifest;
+
+	if (!read_manifest(g_pathdir, key, &manifest)) {
+		// No manifest - fine, unless the namespace was backed up without one,
+		// or to a pack.
+
+		return !have_unplanned_files(key);
+	}
+
+	// Version 1 manifests don't record what restore needs.
+
+	if (manifest.version < 2) {
+		free_manifest(&manifest);
+		return false;
+	}
+
+	// A striped backup's directories must be given as they were, in the same
+	// order, for its layout to hold - in whatever form.
+
+	if (manifest.targets != NULL && strchr(manifest.targets, ',') != NULL
+			&& !same_dir_list(manifest.targets)) {
+		if (g_verbose) {
+			printf("Backup of %08x was striped across \'%s\': give the same"
+					" directories, in the same order.\n", key,
+					manifest.targets);
+		}
+
+		free_manifest(&manifest);
+		return false;
+	}
+
+	*any = true;
+
+	if (g_nsnm != NULL && strcmp(manifest.nsnm, g_nsnm) != 0) {
+		free_manifest(&manifest);
+		return true;
+	}
+
+	*found = g_nsnm != NULL;
+
+	*files = realloc(*files, (size_t)(*n_files + manifest.n_entries)
+			* sizeof(as_file_t));
+	assert(*files != NULL);
+
+	bool success = true;
+
+	for (uint32_t i = 0; success && i < manifest.n_entries; i++) {
+		success = plan_file(&manifest, &manifest.entries[i], key,
+				*files + *n_files);
+
+		if (success) {
+			(*n_files)++;
+		}
+	}
+
+	free_manifest(&manifest);
+
+	return success;
+}
+
+// Check whether a namespace without a manifest was backed up anyway - to a
+// pack, or as segment files.
+
+static bool
+have_unplanned_files(key_t key)
+{
+	char pathname[PATH_MAX + 1];
+
+	if (have_pack(key, pathname)) {
+		return true;
+	}
+
+	for (uint32_t t = 0; t < g_n_pathdirs; t++) {
+		struct stat statbuf;
+
+		sprintf(pathname, "%s/%08x%s", g_pathdirs[t], key, FILE_EXTENSION);
+
+		if (stat(pathname, &statbuf) == 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Fill in a segment file's table entry from its manifest entry. Returns false
+// if the manifest entry is invalid.
+
+static bool
+plan_file(const as_manifest_t* manifest, const as_manifest_entry_t* entry,
+		key_t key, as_file_t* file)
+{
+	char name[PATH_MAX + 1];
+	as_file_t valid_file;
+
+	sprintf(name, "%08x%s", entry->key, FILE_EXTENSION);
+
+	if (!validate_file_name(name, &valid_file)) {
+		if (g_verbose) {
+			printf("Invalid segment key %08x in manifest for %08x.\n",
+					entry->key, key);
+		}
+
+		return false;
+	}
+
+	if (entry->target >= g_n_pathdirs) {
+		if (g_verbose) {
+			printf("Invalid target %u in manifest for %08x.\n", entry->target,
+					key);
+		}
+
+		return false;
+	}
+
+	file->key = valid_file.key;
+	file->nsnm = valid_file.type == TYPE_BASE ? strdup(manifest->nsnm) : NULL;
+	file->uid = entry->uid;
+	file->gid = entry->gid;
+	file->mode = S_IFREG | entry->mode;
+	file->filsz = entry->filsz;
+	file->segsz = entry->segsz;
+	file->compress = entry->compress;
+	file->codec = entry->codec;
+	file->cas = entry->cas;
+	file->stage = valid_file.stage;
+	file->inst = valid_file.inst;
+	file->nsid = valid_file.nsid;
+	file->type = valid_file.type;
+	file->planned = true;
+	file->pack = false;
+	file->offset = 0;
+	file->target = entry->target;
+	file->base_ver = manifest->base_ver;
+	file->n_arenas = valid_file.type == TYPE_META ?
+			manifest->n_sec_arenas : manifest->n_pri_arenas;
+
+	return true;
+}
+
+// Free a list of segment files generated from manifests.
+
+static void
+free_planned_files(as_file_t** files, uint32_t* n_files)
+{
+	for (uint32_t i = 0; i < *n_files; i++) {
+		free((*files)[i].nsnm);
+	}
+
+	free(*files);
+	*files = NULL;
+	*n_files = 0;
+}
+
 // qsort(3) comparison routine for shared memory file table.
 
 static int
@@ -5158,3 +19732,16 @@ gettime_hmst(struct timespec* time, time_t* hours, time_t* minutes,
 	*seconds = time->tv_sec;
 	*tenths = time->tv_nsec / (ONE_BILLION / 10);
 }
+
+// Get the number of microseconds elapsed since a CLOCK_MONOTONIC start time.
+
+static uint64_t
+elapsed_usec(const struct timespec* start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)((now.tv_sec - start->tv_sec) * 1000000
+			+ (now.tv_nsec - start->tv_nsec) / 1000);
+}
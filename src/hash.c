@@ -0,0 +1,473 @@
+/*
+ * hash.c
+ *
+ * Copyright (C) 2022-2023 Aerospike, Inc.
+ *
+ * Portions may be licensed to Aerospike, Inc. under one or more contributor
+ * license agreements.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/
+ */
+
+
+//==========================================================
+// Includes.
+//
+#include "hash.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "warnings.h"
+
+//==========================================================
+// Typedefs & constants.
+//
+
+static const uint64_t C1 = 0x87c37b91114253d5ULL;
+static const uint64_t C2 = 0x4cf5ad432745937fULL;
+
+// SHA-256 round constants.
+
+static const uint32_t K256[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+	0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+	0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+	0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+// Size of a SHA-256 block.
+enum {
+	SHA256_BLOCK = 64
+};
+
+// State of a SHA-256 hash in progress.
+
+typedef struct sha256_s {
+	uint32_t h[8];
+	uint8_t block[SHA256_BLOCK];
+	size_t n_block;
+	uint64_t size;
+} sha256_t;
+
+//==========================================================
+// Forward declarations.
+//
+
+static inline uint64_t rotl64(uint64_t x, int r);
+static inline uint64_t fmix64(uint64_t k);
+static inline uint64_t get_block(const uint8_t* p);
+static void sha256_init(sha256_t* ctx);
+static void sha256_update(sha256_t* ctx, const void* buf, size_t size);
+static void sha256_final(sha256_t* ctx, uint8_t* sha);
+static void sha256_transform(sha256_t* ctx, const uint8_t* block);
+static inline uint32_t rotr32(uint32_t x, int r);
+
+//==========================================================
+// Public API.
+//
+
+// Compute the 128-bit digest of a buffer. This is MurmurHash3 (x64, 128-bit
+// variant) - fast, but not cryptographic, which is fine for detecting changed
+// content.
+
+void
+hash_digest(const void* buf, size_t size, uint32_t seed, as_digest_t* digest)
+{
+	const uint8_t* data = (const uint8_t*)buf;
+	size_t n_blocks = size / 16;
+
+	uint64_t h1 = seed;
+	uint64_t h2 = seed;
+
+	// Body - 16 bytes at a time.
+
+	for (size_t i = 0; i < n_blocks; i++) {
+		uint64_t k1 = get_block(data + i * 16);
+		uint64_t k2 = get_block(data + i * 16 + 8);
+
+		k1 *= C1;
+		k1 = rotl64(k1, 31);
+		k1 *= C2;
+		h1 ^= k1;
+
+		h1 = rotl64(h1, 27);
+		h1 += h2;
+		h1 = h1 * 5 + 0x52dce729;
+
+		k2 *= C2;
+		k2 = rotl64(k2, 33);
+		k2 *= C1;
+		h2 ^= k2;
+
+		h2 = rotl64(h2, 31);
+		h2 += h1;
+		h2 = h2 * 5 + 0x38495ab5;
+	}
+
+	// Tail - the last 0..15 bytes.
+
+	const uint8_t* tail = data + n_blocks * 16;
+	uint64_t k1 = 0;
+	uint64_t k2 = 0;
+
+	switch (size & 15) {
+	case 15: k2 ^= (uint64_t)tail[14] << 48; // fall through
+	case 14: k2 ^= (uint64_t)tail[13] << 40; // fall through
+	case 13: k2 ^= (uint64_t)tail[12] << 32; // fall through
+	case 12: k2 ^= (uint64_t)tail[11] << 24; // fall through
+	case 11: k2 ^= (uint64_t)tail[10] << 16; // fall through
+	case 10: k2 ^= (uint64_t)tail[9] << 8; // fall through
+	case 9:
+		k2 ^= (uint64_t)tail[8];
+		k2 *= C2;
+		k2 = rotl64(k2, 33);
+		k2 *= C1;
+		h2 ^= k2;
+		// fall through
+	case 8: k1 ^= (uint64_t)tail[7] << 56; // fall through
+	case 7: k1 ^= (uint64_t)tail[6] << 48; // fall through
+	case 6: k1 ^= (uint64_t)tail[5] << 40; // fall through
+	case 5: k1 ^= (uint64_t)tail[4] << 32; // fall through
+	case 4: k1 ^= (uint64_t)tail[3] << 24; // fall through
+	case 3: k1 ^= (uint64_t)tail[2] << 16; // fall through
+	case 2: k1 ^= (uint64_t)tail[1] << 8; // fall through
+	case 1:
+		k1 ^= (uint64_t)tail[0];
+		k1 *= C1;
+		k1 = rotl64(k1, 31);
+		k1 *= C2;
+		h1 ^= k1;
+		break;
+	default:
+		break;
+	}
+
+	// Finalization.
+
+	h1 ^= (uint64_t)size;
+	h2 ^= (uint64_t)size;
+
+	h1 += h2;
+	h2 += h1;
+
+	h1 = fmix64(h1);
+	h2 = fmix64(h2);
+
+	h1 += h2;
+	h2 += h1;
+
+	digest->lo = h1;
+	digest->hi = h2;
+}
+
+bool
+hash_digest_equal(const as_digest_t* left, const as_digest_t* right)
+{
+	return left->lo == right->lo && left->hi == right->hi;
+}
+
+// Format a digest as DIGEST_HEX_LEN hex characters (plus null terminator).
+
+void
+hash_digest_to_hex(const as_digest_t* digest, char* hex)
+{
+	sprintf(hex, "%016lx%016lx", digest->hi, digest->lo);
+}
+
+// Parse a digest formatted by hash_digest_to_hex().
+
+bool
+hash_digest_from_hex(const char* hex, as_digest_t* digest)
+{
+	if (strlen(hex) != DIGEST_HEX_LEN) {
+		return false;
+	}
+
+	uint64_t halves[2] = { 0, 0 };
+
+	for (uint32_t i = 0; i < DIGEST_HEX_LEN; i++) {
+		char c = hex[i];
+		uint64_t nibble;
+
+		if (c >= '0' && c <= '9') {
+			nibble = (uint64_t)(c - '0');
+		}
+		else if (c >= 'a' && c <= 'f') {
+			nibble = (uint64_t)(c - 'a' + 10);
+		}
+		else if (c >= 'A' && c <= 'F') {
+			nibble = (uint64_t)(c - 'A' + 10);
+		}
+		else {
+			return false;
+		}
+
+		halves[i / 16] = (halves[i / 16] << 4) | nibble;
+	}
+
+	digest->hi = halves[0];
+	digest->lo = halves[1];
+
+	return true;
+}
+
+// Compute the SHA-256 hash of a buffer - for signing requests, where the
+// digest above won't do.
+
+void
+hash_sha256(const void* buf, size_t size, uint8_t* sha)
+{
+	sha256_t ctx;
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, buf, size);
+	sha256_final(&ctx, sha);
+}
+
+// Compute the HMAC-SHA256 of a buffer, with the given key.
+
+void
+hash_hmac_sha256(const void* key, size_t key_size, const void* buf,
+		size_t size, uint8_t* mac)
+{
+	uint8_t pad[SHA256_BLOCK] = { 0 };
+
+	// A key longer than a block is hashed first.
+
+	if (key_size > SHA256_BLOCK) {
+		hash_sha256(key, key_size, pad);
+	}
+	else {
+		memcpy(pad, key, key_size);
+	}
+
+	for (uint32_t i = 0; i < SHA256_BLOCK; i++) {
+		pad[i] ^= 0x36;
+	}
+
+	uint8_t inner[SHA256_LEN];
+	sha256_t ctx;
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, pad, SHA256_BLOCK);
+	sha256_update(&ctx, buf, size);
+	sha256_final(&ctx, inner);
+
+	// Flip the inner pad (0x36) to the outer pad (0x5c).
+
+	for (uint32_t i = 0; i < SHA256_BLOCK; i++) {
+		pad[i] ^= 0x36 ^ 0x5c;
+	}
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, pad, SHA256_BLOCK);
+	sha256_update(&ctx, inner, SHA256_LEN);
+	sha256_final(&ctx, mac);
+}
+
+// Format a SHA-256 hash as SHA256_HEX_LEN hex characters (plus null
+// terminator).
+
+void
+hash_sha256_to_hex(const uint8_t* sha, char* hex)
+{
+	for (uint32_t i = 0; i < SHA256_LEN; i++) {
+		sprintf(hex + i * 2, "%02x", sha[i]);
+	}
+}
+
+//==========================================================
+// Local helpers.
+//
+
+static inline uint64_t
+rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t
+fmix64(uint64_t k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+
+	return k;
+}
+
+// Read a (possibly unaligned) little-endian 64-bit block.
+
+static inline uint64_t
+get_block(const uint8_t* p)
+{
+	uint64_t block;
+
+	memcpy(&block, p, sizeof(block));
+
+	return block;
+}
+
+static void
+sha256_init(sha256_t* ctx)
+{
+	static const uint32_t h0[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f,
+		0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	memcpy(ctx->h, h0, sizeof(h0));
+	ctx->n_block = 0;
+	ctx->size = 0;
+}
+
+static void
+sha256_update(sha256_t* ctx, const void* buf, size_t size)
+{
+	const uint8_t* data = (const uint8_t*)buf;
+
+	ctx->size += size;
+
+	// Top up a partial block first.
+
+	if (ctx->n_block != 0) {
+		size_t n = SHA256_BLOCK - ctx->n_block;
+
+		if (n > size) {
+			n = size;
+		}
+
+		memcpy(ctx->block + ctx->n_block, data, n);
+		ctx->n_block += n;
+		data += n;
+		size -= n;
+
+		if (ctx->n_block < SHA256_BLOCK) {
+			return;
+		}
+
+		sha256_transform(ctx, ctx->block);
+		ctx->n_block = 0;
+	}
+
+	for (; size >= SHA256_BLOCK; data += SHA256_BLOCK, size -= SHA256_BLOCK) {
+		sha256_transform(ctx, data);
+	}
+
+	memcpy(ctx->block, data, size);
+	ctx->n_block = size;
+}
+
+static void
+sha256_final(sha256_t* ctx, uint8_t* sha)
+{
+	uint64_t n_bits = ctx->size * 8;
+	uint8_t pad[SHA256_BLOCK + 8] = { 0x80 };
+	size_t n_pad = ctx->n_block < 56 ?
+			56 - ctx->n_block : SHA256_BLOCK + 56 - ctx->n_block;
+
+	sha256_update(ctx, pad, n_pad);
+
+	// The length in bits, big-endian.
+
+	uint8_t len[8];
+
+	for (uint32_t i = 0; i < 8; i++) {
+		len[i] = (uint8_t)(n_bits >> (56 - i * 8));
+	}
+
+	sha256_update(ctx, len, sizeof(len));
+
+	for (uint32_t i = 0; i < 8; i++) {
+		sha[i * 4] = (uint8_t)(ctx->h[i] >> 24);
+		sha[i * 4 + 1] = (uint8_t)(ctx->h[i] >> 16);
+		sha[i * 4 + 2] = (uint8_t)(ctx->h[i] >> 8);
+		sha[i * 4 + 3] = (uint8_t)ctx->h[i];
+	}
+}
+
+static void
+sha256_transform(sha256_t* ctx, const uint8_t* block)
+{
+	uint32_t w[64];
+
+	for (uint32_t i = 0; i < 16; i++) {
+		w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16
+				| (uint32_t)block[i * 4 + 2] << 8 | (uint32_t)block[i * 4 + 3];
+	}
+
+	for (uint32_t i = 16; i < 64; i++) {
+		uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18)
+				^ (w[i - 15] >> 3);
+		uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19)
+				^ (w[i - 2] >> 10);
+
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	uint32_t a = ctx->h[0];
+	uint32_t b = ctx->h[1];
+	uint32_t c = ctx->h[2];
+	uint32_t d = ctx->h[3];
+	uint32_t e = ctx->h[4];
+	uint32_t f = ctx->h[5];
+	uint32_t g = ctx->h[6];
+	uint32_t h = ctx->h[7];
+
+	for (uint32_t i = 0; i < 64; i++) {
+		uint32_t s1 = rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25);
+		uint32_t ch = (e & f) ^ (~e & g);
+		uint32_t t1 = h + s1 + ch + K256[i] + w[i];
+		uint32_t s0 = rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22);
+		uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+		uint32_t t2 = s0 + maj;
+
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+
+	ctx->h[0] += a;
+	ctx->h[1] += b;
+	ctx->h[2] += c;
+	ctx->h[3] += d;
+	ctx->h[4] += e;
+	ctx->h[5] += f;
+	ctx->h[6] += g;
+	ctx->h[7] += h;
+}
+
+static inline uint32_t
+rotr32(uint32_t x, int r)
+{
+	return (x >> r) | (x << (32 - r));
+}
@@ -0,0 +1,69 @@
+/*
+ * hash.h
+ *
+ * Copyright (C) 2022-2023 Aerospike, Inc.
+ *
+ * Portions may be licensed to Aerospike, Inc. under one or more contributor
+ * license agreements.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/
+ */
+
+
+#pragma once
+
+//==========================================================
+// Includes.
+//
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//==========================================================
+// Typedefs & constants.
+//
+
+// A 128-bit digest.
+
+typedef struct as_digest_s {
+	uint64_t lo;
+	uint64_t hi;
+} as_digest_t;
+
+// Length of a digest formatted as hex, without terminating null.
+enum {
+	DIGEST_HEX_LEN = 32
+};
+
+// Length of a SHA-256 hash, and of one formatted as hex, without terminating
+// null.
+enum {
+	SHA256_LEN = 32,
+	SHA256_HEX_LEN = 64
+};
+
+//==========================================================
+// Public API.
+//
+
+void hash_digest(const void* buf, size_t size, uint32_t seed,
+		as_digest_t* digest);
+bool hash_digest_equal(const as_digest_t* left, const as_digest_t* right);
+void hash_digest_to_hex(const as_digest_t* digest, char* hex);
+bool hash_digest_from_hex(const char* hex, as_digest_t* digest);
+void hash_sha256(const void* buf, size_t size, uint8_t* sha);
+void hash_hmac_sha256(const void* key, size_t key_size, const void* buf,
+		size_t size, uint8_t* mac);
+void hash_sha256_to_hex(const uint8_t* sha, char* hex);